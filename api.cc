@@ -49,20 +49,30 @@ namespace
 
 void API::initialize()
 {
+  setCommand("assetstats", assetstats);
   setCommand("bind", bind);
   setCommand("bindlist", bindlist);
+  setCommand("capture", capture);
   setCommand("clear", Console::clear);
   setCommand("cmdlist", cmdlist);
   setCommand("connect", connect);
   setCommand("disconnect", disconnect);
   setCommand("echo", echo);
   setCommand("exec", exec);
+  setCommand("gfxstats", gfxstats);
+  setCommand("lerpbench", lerpbench);
+  setCommand("mediabench", mediabench);
+  setCommand("precompress", precompress);
   setCommand("print", echo);
   setCommand("quit", quit);
+  setCommand("screenshot", screenshot);
   setCommand("set", set);
   setCommand("seta", set);
   setCommand("sets", set);
   setCommand("setu", set);
+  setCommand("soundstats", soundstats);
+  setCommand("stopcapture", stopcapture);
+  setCommand("texturestats", texturestats);
   setCommand("toggle", toggle);
   setCommand("toggleconsole", Console::toggle);
   setCommand("unbind", unbind);
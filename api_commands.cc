@@ -14,20 +14,31 @@
  *                                                                         *
  ***************************************************************************/
 
+#include <algorithm>
 #include <map>
+#include <vector>
+
+#include <math.h>
 
 #include <espace/api.h>
 #include <espace/console.h>
 #include <espace/cvar.h>
+#include <espace/dxt.h>
 #include <espace/file.h>
 #include <espace/input.h>
 #include <espace/map.h>
+#include <espace/media.h>
+#include <espace/model.h>
 #include <espace/network.h>
 #include <espace/opengl.h>
 #include <espace/output.h>
+#include <espace/predicates.h>
+#include <espace/registry.h>
+#include <espace/renderer.h>
 #include <espace/sound.h>
 #include <espace/string.h>
 #include <espace/system.h>
+#include <espace/texture.h>
 
 #include "api_commands.h"
 
@@ -258,6 +269,285 @@ namespace APICommands
     esInfo << std::endl;
   }
 
+  void gfxstats()
+  {
+    uint drawn, culled;
+
+    Renderer::entityStatistics(drawn, culled);
+
+    esInfo << "Entities drawn: " << drawn << ", culled: " << culled
+           << std::endl
+           << "Texture binds: " << Renderer::textureBinds() << std::endl
+           << "Shader passes saved: " << Renderer::passesSaved() << std::endl
+           << "Scene allocations: " << Renderer::sceneAllocations()
+           << std::endl;
+  }
+
+  void texturestats()
+  {
+    uint decoding, uploading, uploadedBytes;
+
+    Texture::streamStatistics(decoding, uploading, uploadedBytes);
+
+    esInfo << "Textures waiting for decoding: " << decoding << std::endl
+           << "Textures waiting for upload: " << uploading << std::endl
+           << "Kilobytes uploaded last frame: " << uploadedBytes / 1024
+           << std::endl;
+  }
+
+  void assetstats()
+  {
+    const std::vector<RegistryBase*>& registries = RegistryBase::registries();
+
+    for(std::vector<RegistryBase*>::const_iterator i = registries.begin();
+        i != registries.end(); ++i)
+    {
+      esInfo << (*i)->type() << ": " << (*i)->count() << ", index "
+             << (*i)->indexBytes() / 1024 << " KB";
+
+      if((*i)->dataBytes())
+        esInfo << ", data " << (*i)->dataBytes() / 1024 << " KB";
+
+      esInfo << std::endl;
+    }
+  }
+
+  void soundstats()
+  {
+    const std::vector<Sound::DecodeStatistics>& statistics =
+      Sound::decodeStatistics();
+
+    double seconds = 0;
+
+    for(std::vector<Sound::DecodeStatistics>::const_iterator
+        i = statistics.begin(); i != statistics.end(); ++i)
+    {
+      esInfo << i->name << ": " << i->samples << " samples, buffer "
+             << i->bufferBytes / 1024 << " KB, grown " << i->growCount
+             << " times, " << i->seconds * 1000 << " ms" << std::endl;
+
+      seconds += i->seconds;
+    }
+
+    esInfo << statistics.size() << " sounds decoded in " << seconds * 1000
+           << " ms" << std::endl;
+
+    uint streams, underruns;
+
+    Sound::streamStatistics(streams, underruns);
+
+    esInfo << "Media streams playing: " << streams << std::endl
+           << "Stream underruns: " << underruns << std::endl;
+  }
+
+  /**
+   * Decodes all frames of a video without displaying them, then does the
+   * same with videoSkip(), and prints the frame rates.
+   */
+  void mediabench()
+  {
+    if(API::argc() != 2)
+    {
+      esInfo << "Usage: mediabench <filename>" << std::endl;
+
+      return;
+    }
+
+    Media* media = Media::acquire(API::argv(1));
+
+    if(!media)
+    {
+      esWarning << "mediabench: Failed to open \"" << API::argv(1) << "\"."
+                << std::endl;
+
+      return;
+    }
+
+    uint frames = 0;
+    double start = System::time();
+
+    while(!media->videoEOF())
+    {
+      media->videoRead();
+
+      ++frames;
+    }
+
+    double readTime = System::time() - start;
+
+    media->videoReset();
+
+    uint skipped = 0;
+
+    start = System::time();
+
+    while(!media->videoEOF())
+    {
+      media->videoSkip(1);
+
+      ++skipped;
+    }
+
+    double skipTime = System::time() - start;
+
+    Media::unacquire(media);
+
+    esInfo << "Read " << frames << " frames in " << readTime << " seconds ("
+           << ((readTime > 0) ? frames / readTime : 0) << " fps)" << std::endl
+           << "Skipped " << skipped << " frames in " << skipTime
+           << " seconds (" << ((skipTime > 0) ? skipped / skipTime : 0)
+           << " fps)" << std::endl;
+  }
+
+  void precompress()
+  {
+    if(API::argc() > 2)
+    {
+      esInfo << "Usage: precompress [prefix]" << std::endl;
+
+      return;
+    }
+
+    CVar cache = CVar::acquire("r_dxtcache", "", CVar::Archive);
+
+    if(!*cache.string)
+    {
+      esWarning << "precompress: r_dxtcache is not set." << std::endl;
+
+      return;
+    }
+
+    DXT::setCacheDirectory(cache.string);
+
+    std::vector<String> files;
+
+    const char* prefix = (API::argc() == 2) ? API::argv(1) : "";
+
+    File::find(StartsEndsWith(prefix, ".tga"), files);
+    File::find(StartsEndsWith(prefix, ".jpg"), files);
+    File::find(StartsEndsWith(prefix, ".png"), files);
+    File::find(StartsEndsWith(prefix, ".gif"), files);
+
+    uint failed = 0;
+
+    for(std::vector<String>::iterator i = files.begin(); i != files.end(); ++i)
+    {
+      if(!DXT::precompress(*i))
+        ++failed;
+    }
+
+    esInfo << "Precompressed " << (files.size() - failed) << " of "
+           << files.size() << " images" << std::endl;
+  }
+
+  void screenshot()
+  {
+    if(API::argc() > 2)
+    {
+      esInfo << "Usage: screenshot [filename]" << std::endl;
+
+      return;
+    }
+
+    String fileName = (API::argc() == 2) ? API::argv(1)
+                                         : String("screenshot.tga");
+
+    Renderer::screenshot(fileName);
+  }
+
+  void capture()
+  {
+    if(API::argc() < 2 || API::argc() > 3)
+    {
+      esInfo << "Usage: capture <basename> [interval]" << std::endl;
+
+      return;
+    }
+
+    int interval = (API::argc() == 3) ? API::argv(2).toInt() : 1;
+
+    Renderer::startCapture(API::argv(1), std::max(interval, 1));
+  }
+
+  void stopcapture()
+  {
+    Renderer::stopCapture();
+  }
+
+  /**
+   * Times vertex interpolation for a model the size of a typical player
+   * model, using a plain loop and using Model::lerpVectors().
+   */
+  void lerpbench()
+  {
+    if(API::argc() > 3)
+    {
+      esInfo << "Usage: lerpbench [vertices] [iterations]" << std::endl;
+
+      return;
+    }
+
+    int vertexCount = (API::argc() > 1) ? API::argv(1).toInt() : 2000;
+    int iterations = (API::argc() > 2) ? API::argv(2).toInt() : 10000;
+
+    if(vertexCount <= 0 || iterations <= 0)
+      return;
+
+    std::vector<Vector3> from(vertexCount);
+    std::vector<Vector3> to(vertexCount);
+    std::vector<Vector3> output(vertexCount * 2);
+
+    for(int i = 0; i < vertexCount; ++i)
+    {
+      from[i] = Vector3(i, -i, i * 0.5f);
+      to[i] = Vector3(-i, i * 0.25f, i);
+    }
+
+    double start = System::time();
+
+    for(int j = 0; j < iterations; ++j)
+    {
+      float backLerp = (j % 100) / 100.0f;
+
+      // The same positions and normals as lerpVectors() gets below
+      for(int i = 0; i < vertexCount; ++i)
+      {
+        output[i] = from[i] * backLerp + to[i] * (1 - backLerp);
+
+        Vector3 normal = from[i] * backLerp + to[i] * (1 - backLerp);
+        float square = normal.square();
+
+        if(square > 0)
+          normal *= 1 / sqrtf(square);
+
+        output[vertexCount + i] = normal;
+      }
+    }
+
+    double plainTime = System::time() - start;
+
+    start = System::time();
+
+    for(int j = 0; j < iterations; ++j)
+    {
+      float backLerp = (j % 100) / 100.0f;
+
+      Model::lerpVectors(&from[0], &to[0], backLerp, vertexCount, &output[0]);
+      Model::lerpVectors(&from[0], &to[0], backLerp, vertexCount,
+                         &output[vertexCount], true);
+    }
+
+    double kernelTime = System::time() - start;
+
+    esInfo << iterations << " frames of " << vertexCount << " vertices:"
+           << std::endl
+           << "Plain loop, positions and normals: "
+           << plainTime * 1e6 / iterations
+           << " us per frame" << std::endl
+           << "lerpVectors(), positions and normals: "
+           << kernelTime * 1e6 / iterations << " us per frame" << std::endl;
+  }
+
   void quit()
   {
     System::exit();
@@ -1,14 +1,24 @@
 namespace APICommands
 {
+  void assetstats();
   void bind();
   void bindlist();
+  void capture();
   void cmdlist();
   void connect();
   void disconnect();
   void echo();
   void exec();
+  void gfxstats();
+  void lerpbench();
+  void mediabench();
+  void precompress();
   void quit();
+  void screenshot();
   void set();
+  void soundstats();
+  void stopcapture();
+  void texturestats();
   void toggle();
   void unbindall();
   void unbind();
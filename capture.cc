@@ -0,0 +1,338 @@
+/***************************************************************************
+                       capture.cc  -  Screenshots and frame capture
+                               -------------------
+      copyright            : (C) 2003 by Morten Hustveit
+      email                : morten@debian.org
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <algorithm>
+#include <deque>
+
+#include <string.h>
+
+#include <espace/image.h>
+#include <espace/opengl.h>
+#include <espace/output.h>
+#include <espace/renderer.h>
+#include <espace/string.h>
+#include <espace/system.h>
+
+namespace
+{
+  /**
+   * A frame read back from the screen, waiting to be written.
+   *
+   * Jobs are handed over to the writing thread as a whole, so the file name
+   * must not share its data with any String used by the main thread.
+   */
+  struct Job
+  {
+    String fileName;
+    Image* image;     // Rows bottom to top, as read by glReadPixels()
+  };
+
+  // Pixel buffer objects read back into.  A buffer is mapped when the ring
+  // comes around to it again, by which time the transfer should be done.
+  enum { bufferCount = 3 };
+
+  // Frames read back but not yet written.  When the writing thread falls
+  // this far behind, the main thread waits for it instead of using more
+  // memory.
+  enum { maxQueuedJobs = 8 };
+
+  struct Slot
+  {
+    uint   buffer;
+    bool   pending;
+    uint   width;
+    uint   height;
+    String fileName;
+  };
+
+  Slot slots[bufferCount];
+  uint nextSlot = 0;
+
+  String screenshotName;
+
+  String sequenceName;
+  uint   sequenceInterval = 0;
+  uint   sequenceFrame = 0;
+  uint   sequenceNumber = 0;
+
+  void* writeThread = 0;
+  bool  writeThreadFailed = false;
+  void* jobMutex;
+  void* jobSemaphore;   // Number of queued jobs
+  void* spaceSemaphore; // Number of jobs that can be queued without waiting
+
+  std::deque<Job*> jobs;
+
+  void write(Job* job)
+  {
+    Image* image = job->image;
+    uint stride = image->width() * image->bytesPerPixel();
+    uint8_t* data = image->data();
+
+    for(uint y = 0; y < image->height() / 2; ++y)
+    {
+      std::swap_ranges(data + y * stride, data + (y + 1) * stride,
+                       data + (image->height() - y - 1) * stride);
+    }
+
+    image->saveTGA(job->fileName);
+
+    delete image;
+    delete job;
+  }
+
+  void writeLoop(void*)
+  {
+    for(;;)
+    {
+      System::waitSemaphore(jobSemaphore);
+
+      System::lockMutex(jobMutex);
+
+      Job* job = jobs.front();
+
+      jobs.pop_front();
+
+      System::unlockMutex(jobMutex);
+
+      // Queued by Renderer::finishCapture()
+      if(!job)
+        return;
+
+      write(job);
+
+      System::postSemaphore(spaceSemaphore);
+    }
+  }
+
+  /**
+   * Starts the writing thread, unless it is already running.
+   *
+   * Returns false if threads are not supported.
+   */
+  bool startWriting()
+  {
+    if(writeThread)
+      return true;
+
+    if(writeThreadFailed)
+      return false;
+
+    jobMutex = System::createMutex();
+    jobSemaphore = System::createSemaphore();
+    spaceSemaphore = System::createSemaphore(maxQueuedJobs);
+
+    writeThread = System::createThread(writeLoop, 0);
+
+    if(!writeThread)
+    {
+      esWarning << "Renderer: Failed to start capture thread.  Frames will be "
+                   "written synchronously." << std::endl;
+
+      System::destroySemaphore(spaceSemaphore);
+      System::destroySemaphore(jobSemaphore);
+      System::destroyMutex(jobMutex);
+
+      writeThreadFailed = true;
+
+      return false;
+    }
+
+    return true;
+  }
+
+  void queue(Job* job)
+  {
+    if(!startWriting())
+    {
+      write(job);
+
+      return;
+    }
+
+    System::waitSemaphore(spaceSemaphore);
+
+    System::lockMutex(jobMutex);
+
+    jobs.push_back(job);
+
+    System::unlockMutex(jobMutex);
+
+    System::postSemaphore(jobSemaphore);
+  }
+
+  /**
+   * Maps a buffer read back into earlier, and queues its contents.
+   */
+  void finishReadBack(Slot& slot)
+  {
+    slot.pending = false;
+
+    GL::bindBufferARB(GL::PIXEL_PACK_BUFFER_ARB, slot.buffer);
+
+    const void* pixels = GL::mapBufferARB(GL::PIXEL_PACK_BUFFER_ARB,
+                                          GL::READ_ONLY_ARB);
+
+    if(pixels)
+    {
+      Job* job = new Job;
+
+      job->fileName = String(static_cast<const char*>(slot.fileName));
+      job->image = new Image(slot.width, slot.height, Image::RGB);
+
+      memcpy(job->image->data(), pixels, job->image->size());
+
+      GL::unmapBufferARB(GL::PIXEL_PACK_BUFFER_ARB);
+
+      queue(job);
+    }
+    else
+    {
+      esWarning << "Renderer: Failed to map pixel buffer for \""
+                << slot.fileName << "\"." << std::endl;
+    }
+
+    GL::bindBufferARB(GL::PIXEL_PACK_BUFFER_ARB, 0);
+  }
+
+  /**
+   * Starts reading back the frame in the back buffer.
+   *
+   * Without pixel buffer objects, the pixels are read right away.
+   */
+  void startReadBack(Slot& slot, const String& fileName)
+  {
+    uint width = GL::config.width;
+    uint height = GL::config.height;
+
+    GL::pixelStorei(GL::PACK_ALIGNMENT, 1);
+    GL::readBuffer(GL::BACK);
+
+    if(!GL::config.pixelBufferObjectSupport)
+    {
+      Job* job = new Job;
+
+      job->fileName = String(static_cast<const char*>(fileName));
+      job->image = new Image(width, height, Image::RGB);
+
+      GL::readPixels(0, 0, width, height, GL::RGB, GL::UNSIGNED_BYTE,
+                     job->image->data());
+
+      GL::pixelStorei(GL::PACK_ALIGNMENT, 4);
+
+      queue(job);
+
+      return;
+    }
+
+    if(!slot.buffer)
+      GL::genBuffersARB(1, &slot.buffer);
+
+    GL::bindBufferARB(GL::PIXEL_PACK_BUFFER_ARB, slot.buffer);
+    GL::bufferDataARB(GL::PIXEL_PACK_BUFFER_ARB, width * height * 3, 0,
+                      GL::STREAM_READ_ARB);
+
+    // Returns immediately, the transfer finishes in the background
+    GL::readPixels(0, 0, width, height, GL::RGB, GL::UNSIGNED_BYTE, 0);
+
+    GL::bindBufferARB(GL::PIXEL_PACK_BUFFER_ARB, 0);
+    GL::pixelStorei(GL::PACK_ALIGNMENT, 4);
+
+    slot.pending = true;
+    slot.width = width;
+    slot.height = height;
+    slot.fileName = fileName;
+  }
+} // namespace
+
+void Renderer::screenshot(const char* fileName)
+{
+  screenshotName = String(fileName);
+}
+
+void Renderer::startCapture(const char* baseName, uint interval)
+{
+  sequenceName = String(baseName);
+  sequenceInterval = std::max(interval, 1U);
+  sequenceFrame = 0;
+  sequenceNumber = 0;
+}
+
+void Renderer::stopCapture()
+{
+  sequenceInterval = 0;
+}
+
+void Renderer::captureFrame()
+{
+  Slot& slot = slots[nextSlot];
+
+  nextSlot = (nextSlot + 1) % bufferCount;
+
+  if(slot.pending)
+    finishReadBack(slot);
+
+  String fileName;
+
+  if(!screenshotName.isEmpty())
+  {
+    fileName = screenshotName;
+    screenshotName = String::null;
+  }
+  else if(sequenceInterval && !(sequenceFrame++ % sequenceInterval))
+  {
+    fileName = String::format("%s%04u.tga",
+                              static_cast<const char*>(sequenceName),
+                              sequenceNumber++);
+  }
+  else
+    return;
+
+  startReadBack(slot, fileName);
+}
+
+void Renderer::finishCapture()
+{
+  // Oldest first, so that sequences are written in order
+  for(uint i = 0; i < bufferCount; ++i)
+  {
+    Slot& slot = slots[(nextSlot + i) % bufferCount];
+
+    if(slot.pending)
+      finishReadBack(slot);
+  }
+
+  if(!writeThread)
+    return;
+
+  // A null job tells the writing thread to return once the queue is empty
+  System::lockMutex(jobMutex);
+
+  jobs.push_back(0);
+
+  System::unlockMutex(jobMutex);
+
+  System::postSemaphore(jobSemaphore);
+  System::joinThread(writeThread);
+
+  writeThread = 0;
+
+  System::destroySemaphore(spaceSemaphore);
+  System::destroySemaphore(jobSemaphore);
+  System::destroyMutex(jobMutex);
+}
+
+// vim: ts=2 sw=2 et
@@ -0,0 +1,546 @@
+/***************************************************************************
+                          deform.cc  -  Vertex deformations
+                               -------------------
+      copyright            : (C) 2003 by Morten Hustveit
+      email                : morten@debian.org
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <espace/deform.h>
+#include <espace/shader.h>
+
+namespace
+{
+  const uint tableMask = Shader::waveTableSize - 1;
+
+  /**
+   * Samples a wave table at a position given in periods.
+   */
+  inline float lookup(const float* table, float periods)
+  {
+    return table[static_cast<int>(periods * Shader::waveTableSize)
+                 & tableMask];
+  }
+
+  inline const float* vertex(const float* array, uint index)
+  {
+    return array + index * 3;
+  }
+
+  inline float* vertex(float* array, uint index)
+  {
+    return array + index * 3;
+  }
+
+  inline float texCoordS(const Deformer::Vertices& vertices, uint index)
+  {
+    return *reinterpret_cast<const float*>(vertices.texCoords
+                                           + index * vertices.texCoordStride);
+  }
+
+#ifdef __SSE2__
+  /**
+   * Loads the vectors of four listed vertices, transposed so that each
+   * register holds one component.
+   */
+  inline void load4(const float* array, const uint* list,
+                    __m128& x, __m128& y, __m128& z)
+  {
+    const float* a = vertex(array, list[0]);
+    const float* b = vertex(array, list[1]);
+    const float* c = vertex(array, list[2]);
+    const float* d = vertex(array, list[3]);
+
+    x = _mm_set_ps(d[0], c[0], b[0], a[0]);
+    y = _mm_set_ps(d[1], c[1], b[1], a[1]);
+    z = _mm_set_ps(d[2], c[2], b[2], a[2]);
+  }
+
+  inline void store4(float* array, const uint* list,
+                     __m128 x, __m128 y, __m128 z)
+  {
+    float xs[4], ys[4], zs[4];
+
+    _mm_storeu_ps(xs, x);
+    _mm_storeu_ps(ys, y);
+    _mm_storeu_ps(zs, z);
+
+    for(uint i = 0; i < 4; ++i)
+    {
+      float* v = vertex(array, list[i]);
+
+      v[0] = xs[i];
+      v[1] = ys[i];
+      v[2] = zs[i];
+    }
+  }
+
+  /**
+   * Samples a wave table at four positions.  The indexes are computed with
+   * SSE; only the table reads are scalar.
+   */
+  inline __m128 lookup4(const float* table, __m128 periods)
+  {
+    __m128i index
+      = _mm_and_si128(_mm_cvttps_epi32(_mm_mul_ps(periods,
+                        _mm_set1_ps(Shader::waveTableSize))),
+                      _mm_set1_epi32(tableMask));
+
+    int i[4];
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(i), index);
+
+    return _mm_set_ps(table[i[3]], table[i[2]], table[i[1]], table[i[0]]);
+  }
+
+  inline __m128 madd(__m128 a, __m128 b, __m128 c)
+  {
+    return _mm_add_ps(_mm_mul_ps(a, b), c);
+  }
+#endif // __SSE2__
+
+  /**
+   * Moves vertices along their normals by a wave that travels across the
+   * surface.
+   */
+  void deformWave(const Shader::Deform& deform,
+                  Deformer::Vertices& vertices, float time)
+  {
+    const float* table = Shader::waveTable(deform.wave);
+    float phase = deform.phase + deform.frequency * time;
+
+    uint i = 0;
+
+#ifdef __SSE2__
+    const __m128 phase4 = _mm_set1_ps(phase);
+    const __m128 spread4 = _mm_set1_ps(deform.spread);
+    const __m128 base4 = _mm_set1_ps(deform.base);
+    const __m128 amplitude4 = _mm_set1_ps(deform.amplitude);
+
+    for(; i + 4 <= vertices.count; i += 4)
+    {
+      const uint* list = vertices.list + i;
+
+      __m128 x, y, z, nx, ny, nz;
+
+      load4(vertices.positions, list, x, y, z);
+      load4(vertices.normals, list, nx, ny, nz);
+
+      __m128 periods = madd(_mm_add_ps(_mm_add_ps(x, y), z), spread4, phase4);
+      __m128 offset = madd(lookup4(table, periods), amplitude4, base4);
+
+      store4(vertices.positions, list,
+             madd(nx, offset, x), madd(ny, offset, y), madd(nz, offset, z));
+    }
+#endif
+
+    for(; i < vertices.count; ++i)
+    {
+      float* p = vertex(vertices.positions, vertices.list[i]);
+      const float* n = vertex(vertices.normals, vertices.list[i]);
+
+      float offset
+        = deform.base + deform.amplitude
+        * lookup(table, phase + (p[0] + p[1] + p[2]) * deform.spread);
+
+      p[0] += n[0] * offset;
+      p[1] += n[1] * offset;
+      p[2] += n[2] * offset;
+    }
+  }
+
+  /**
+   * Moves vertices along their normals by a sine wave running along the
+   * s texture coordinate.
+   */
+  void deformBulge(const Shader::Deform& deform,
+                   Deformer::Vertices& vertices, float time)
+  {
+    const float* table = Shader::waveTable(Shader::Sin);
+    float scale = deform.bulgeWidth / (2 * M_PI);
+    float phase = deform.bulgeSpeed * time / (2 * M_PI);
+
+    uint i = 0;
+
+#ifdef __SSE2__
+    const __m128 scale4 = _mm_set1_ps(scale);
+    const __m128 phase4 = _mm_set1_ps(phase);
+    const __m128 height4 = _mm_set1_ps(deform.bulgeHeight);
+
+    for(; i + 4 <= vertices.count; i += 4)
+    {
+      const uint* list = vertices.list + i;
+
+      __m128 x, y, z, nx, ny, nz;
+
+      load4(vertices.positions, list, x, y, z);
+      load4(vertices.normals, list, nx, ny, nz);
+
+      __m128 s = _mm_set_ps(texCoordS(vertices, list[3]),
+                            texCoordS(vertices, list[2]),
+                            texCoordS(vertices, list[1]),
+                            texCoordS(vertices, list[0]));
+
+      __m128 offset = _mm_mul_ps(lookup4(table, madd(s, scale4, phase4)),
+                                 height4);
+
+      store4(vertices.positions, list,
+             madd(nx, offset, x), madd(ny, offset, y), madd(nz, offset, z));
+    }
+#endif
+
+    for(; i < vertices.count; ++i)
+    {
+      float* p = vertex(vertices.positions, vertices.list[i]);
+      const float* n = vertex(vertices.normals, vertices.list[i]);
+
+      float offset
+        = deform.bulgeHeight
+        * lookup(table, texCoordS(vertices, vertices.list[i]) * scale + phase);
+
+      p[0] += n[0] * offset;
+      p[1] += n[1] * offset;
+      p[2] += n[2] * offset;
+    }
+  }
+
+  /**
+   * Perturbs normals with sine waves that depend on the vertex position,
+   * making lighting and environment maps ripple.
+   */
+  void deformNormals(const Shader::Deform& deform,
+                     Deformer::Vertices& vertices, float time)
+  {
+    const float* table = Shader::waveTable(Shader::Sin);
+    const float spread = 0.01f;
+    float phase = deform.frequency * time;
+
+    uint i = 0;
+
+#ifdef __SSE2__
+    const __m128 spread4 = _mm_set1_ps(spread);
+    const __m128 phaseX = _mm_set1_ps(phase);
+    const __m128 phaseY = _mm_set1_ps(phase + 1.0f / 3);
+    const __m128 phaseZ = _mm_set1_ps(phase + 2.0f / 3);
+    const __m128 amplitude4 = _mm_set1_ps(deform.amplitude);
+    const __m128 epsilon = _mm_set1_ps(1e-12f);
+
+    for(; i + 4 <= vertices.count; i += 4)
+    {
+      const uint* list = vertices.list + i;
+
+      __m128 x, y, z, nx, ny, nz;
+
+      load4(vertices.positions, list, x, y, z);
+      load4(vertices.normals, list, nx, ny, nz);
+
+      nx = madd(lookup4(table, madd(_mm_add_ps(y, z), spread4, phaseX)),
+                amplitude4, nx);
+      ny = madd(lookup4(table, madd(_mm_add_ps(x, z), spread4, phaseY)),
+                amplitude4, ny);
+      nz = madd(lookup4(table, madd(_mm_add_ps(x, y), spread4, phaseZ)),
+                amplitude4, nz);
+
+      __m128 length
+        = _mm_sqrt_ps(madd(nx, nx, madd(ny, ny, madd(nz, nz, epsilon))));
+
+      store4(vertices.normals, list, _mm_div_ps(nx, length),
+             _mm_div_ps(ny, length), _mm_div_ps(nz, length));
+    }
+#endif
+
+    for(; i < vertices.count; ++i)
+    {
+      const float* p = vertex(vertices.positions, vertices.list[i]);
+      float* n = vertex(vertices.normals, vertices.list[i]);
+
+      n[0] += deform.amplitude
+            * lookup(table, (p[1] + p[2]) * spread + phase);
+      n[1] += deform.amplitude
+            * lookup(table, (p[0] + p[2]) * spread + phase + 1.0f / 3);
+      n[2] += deform.amplitude
+            * lookup(table, (p[0] + p[1]) * spread + phase + 2.0f / 3);
+
+      float length = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2] + 1e-12f);
+
+      n[0] /= length;
+      n[1] /= length;
+      n[2] /= length;
+    }
+  }
+
+  /**
+   * Moves all vertices along a fixed direction.  The offset is the same
+   * for every vertex, so there is nothing to gain from SSE here.
+   */
+  void deformMove(const Shader::Deform& deform,
+                  Deformer::Vertices& vertices, float time)
+  {
+    float offset
+      = deform.base + deform.amplitude
+      * lookup(Shader::waveTable(deform.wave),
+               deform.phase + deform.frequency * time);
+
+    float dx = deform.direction(0) * offset;
+    float dy = deform.direction(1) * offset;
+    float dz = deform.direction(2) * offset;
+
+    for(uint i = 0; i < vertices.count; ++i)
+    {
+      float* p = vertex(vertices.positions, vertices.list[i]);
+
+      p[0] += dx;
+      p[1] += dy;
+      p[2] += dz;
+    }
+  }
+
+  /**
+   * Finds the four distinct vertices of a quad drawn as two triangles.
+   *
+   * Returns false if the indexes do not form a quad.
+   */
+  bool quadVertices(const uint* indexes, uint* quad)
+  {
+    uint count = 0;
+
+    for(uint i = 0; i < 6; ++i)
+    {
+      uint j = 0;
+
+      while(j < count && quad[j] != indexes[i])
+        ++j;
+
+      if(j < count)
+        continue;
+
+      if(count == 4)
+        return false;
+
+      quad[count++] = indexes[i];
+    }
+
+    return count == 4;
+  }
+
+  /**
+   * Turns each quad to face the view plane.  Each corner keeps its texture
+   * coordinates, so its new position is chosen from where they lie
+   * relative to the center of the quad's texture coordinates.
+   */
+  void autoSprite(Deformer::Vertices& vertices, const uint* indexes,
+                  uint indexCount, const Deformer::View& view)
+  {
+    if(!vertices.texCoords)
+      return;
+
+    for(uint i = 0; i + 6 <= indexCount; i += 6)
+    {
+      uint quad[4];
+
+      if(!quadVertices(indexes + i, quad))
+        continue;
+
+      float mid[3] = { 0, 0, 0 };
+      float meanS = 0, meanT = 0;
+
+      for(uint j = 0; j < 4; ++j)
+      {
+        const float* p = vertex(vertices.positions, quad[j]);
+        const float* st = reinterpret_cast<const float*>
+          (vertices.texCoords + quad[j] * vertices.texCoordStride);
+
+        mid[0] += p[0] * 0.25f;
+        mid[1] += p[1] * 0.25f;
+        mid[2] += p[2] * 0.25f;
+        meanS += st[0] * 0.25f;
+        meanT += st[1] * 0.25f;
+      }
+
+      const float* p0 = vertex(vertices.positions, quad[0]);
+
+      // Half the side of a square with the same diagonal
+      float radius = sqrt((p0[0] - mid[0]) * (p0[0] - mid[0])
+                        + (p0[1] - mid[1]) * (p0[1] - mid[1])
+                        + (p0[2] - mid[2]) * (p0[2] - mid[2])) * 0.707f;
+
+      for(uint j = 0; j < 4; ++j)
+      {
+        float* p = vertex(vertices.positions, quad[j]);
+        const float* st = reinterpret_cast<const float*>
+          (vertices.texCoords + quad[j] * vertices.texCoordStride);
+
+        float right = (st[0] < meanS) ? -radius : radius;
+        float up = (st[1] < meanT) ? radius : -radius;
+
+        for(uint c = 0; c < 3; ++c)
+          p[c] = mid[c] + view.right(c) * right + view.up(c) * up;
+      }
+    }
+  }
+
+  inline float distance(const float* a, const float* b)
+  {
+    return sqrt((a[0] - b[0]) * (a[0] - b[0])
+              + (a[1] - b[1]) * (a[1] - b[1])
+              + (a[2] - b[2]) * (a[2] - b[2]));
+  }
+
+  /**
+   * Turns each quad around its long axis to face the viewer.
+   */
+  void autoSprite2(Deformer::Vertices& vertices, const uint* indexes,
+                   uint indexCount, const Deformer::View& view)
+  {
+    // The three ways of splitting a quad's corners into two edges
+    static const uint pairings[3][4] =
+    {
+      { 0, 1, 2, 3 },
+      { 0, 2, 1, 3 },
+      { 0, 3, 1, 2 }
+    };
+
+    for(uint i = 0; i + 6 <= indexCount; i += 6)
+    {
+      uint quad[4];
+
+      if(!quadVertices(indexes + i, quad))
+        continue;
+
+      float* p[4];
+
+      for(uint j = 0; j < 4; ++j)
+        p[j] = vertex(vertices.positions, quad[j]);
+
+      // The short edges are the pairing with the smallest total length
+      uint best = 0;
+      float bestLength = 0;
+
+      for(uint j = 0; j < 3; ++j)
+      {
+        const uint* pairing = pairings[j];
+        float length = distance(p[pairing[0]], p[pairing[1]])
+                     + distance(p[pairing[2]], p[pairing[3]]);
+
+        if(j == 0 || length < bestLength)
+        {
+          best = j;
+          bestLength = length;
+        }
+      }
+
+      float* edges[2][2] =
+      {
+        { p[pairings[best][0]], p[pairings[best][1]] },
+        { p[pairings[best][2]], p[pairings[best][3]] }
+      };
+
+      float mid[2][3];
+      float center[3], major[3], toViewer[3], minor[3];
+
+      for(uint c = 0; c < 3; ++c)
+      {
+        mid[0][c] = (edges[0][0][c] + edges[0][1][c]) * 0.5f;
+        mid[1][c] = (edges[1][0][c] + edges[1][1][c]) * 0.5f;
+        center[c] = (mid[0][c] + mid[1][c]) * 0.5f;
+        major[c] = mid[1][c] - mid[0][c];
+        toViewer[c] = view.origin(c) - center[c];
+      }
+
+      minor[0] = major[1] * toViewer[2] - major[2] * toViewer[1];
+      minor[1] = major[2] * toViewer[0] - major[0] * toViewer[2];
+      minor[2] = major[0] * toViewer[1] - major[1] * toViewer[0];
+
+      float length = sqrt(minor[0] * minor[0] + minor[1] * minor[1]
+                        + minor[2] * minor[2]);
+
+      if(length < 1e-6f)
+        continue;
+
+      float halfWidth = bestLength * 0.25f;
+
+      for(uint c = 0; c < 3; ++c)
+        minor[c] *= halfWidth / length;
+
+      for(uint e = 0; e < 2; ++e)
+      {
+        // Keep each corner on the side of the axis it was on before
+        float side = 0;
+
+        for(uint c = 0; c < 3; ++c)
+          side += (edges[e][0][c] - edges[e][1][c]) * minor[c];
+
+        float sign = (side >= 0) ? 1 : -1;
+
+        for(uint c = 0; c < 3; ++c)
+        {
+          edges[e][0][c] = mid[e][c] + minor[c] * sign;
+          edges[e][1][c] = mid[e][c] - minor[c] * sign;
+        }
+      }
+    }
+  }
+}
+
+void Deformer::apply(const Shader::Deform& deform, Vertices& vertices,
+                     const uint* indexes, uint indexCount,
+                     const View& view, float time)
+{
+  switch(deform.type)
+  {
+  case Shader::Wave:
+
+    if(vertices.normals)
+      deformWave(deform, vertices, time);
+
+    break;
+
+  case Shader::Normal:
+
+    if(vertices.normals)
+      deformNormals(deform, vertices, time);
+
+    break;
+
+  case Shader::Bulge:
+
+    if(vertices.normals && vertices.texCoords)
+      deformBulge(deform, vertices, time);
+
+    break;
+
+  case Shader::Move:
+
+    deformMove(deform, vertices, time);
+
+    break;
+
+  case Shader::AutoSprite:
+
+    autoSprite(vertices, indexes, indexCount, view);
+
+    break;
+
+  case Shader::AutoSprite2:
+
+    autoSprite2(vertices, indexes, indexCount, view);
+
+    break;
+  }
+}
+
+// vim: ts=2 sw=2 et
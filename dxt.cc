@@ -0,0 +1,514 @@
+/***************************************************************************
+                            dxt.cc  -  S3TC texture compression
+                               -------------------
+      copyright            : (C) 2003 by Morten Hustveit
+      email                : morten@debian.org
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <string.h>
+
+#include <espace/dxt.h>
+#include <espace/file.h>
+#include <espace/image.h>
+#include <espace/output.h>
+#include <espace/string.h>
+
+namespace
+{
+  String cacheDirectory = String::null;
+
+  const uint32_t cacheMagic = 0x43545844; // 'DXTC'
+  const uint32_t cacheVersion = 1;
+
+  inline uint16_t pack565(const int* color)
+  {
+    return ((color[0] >> 3) << 11) | ((color[1] >> 2) << 5) | (color[2] >> 3);
+  }
+
+  inline void unpack565(uint16_t value, int* color)
+  {
+    color[0] = (value >> 11) & 0x1F;
+    color[1] = (value >> 5) & 0x3F;
+    color[2] = value & 0x1F;
+
+    color[0] = (color[0] << 3) | (color[0] >> 2);
+    color[1] = (color[1] << 2) | (color[1] >> 4);
+    color[2] = (color[2] << 3) | (color[2] >> 2);
+  }
+
+  /**
+   * Reads a 4x4 block of RGBA pixels, repeating edge pixels of images
+   * smaller than a block.
+   */
+  void readBlock(const Image& image, uint blockX, uint blockY,
+                 uint8_t* block)
+  {
+    uint components = image.componentCount();
+    uint width = image.width();
+    uint height = image.height();
+
+    for(uint y = 0; y < 4; ++y)
+    {
+      uint imageY = blockY + y;
+
+      if(imageY >= height)
+        imageY = height - 1;
+
+      for(uint x = 0; x < 4; ++x, block += 4)
+      {
+        uint imageX = blockX + x;
+
+        if(imageX >= width)
+          imageX = width - 1;
+
+        const uint8_t* pixel
+          = image.data() + (imageY * width + imageX) * components;
+
+        switch(components)
+        {
+        case 1:
+
+          block[0] = block[1] = block[2] = pixel[0];
+          block[3] = 255;
+
+          break;
+
+        case 3:
+
+          memcpy(block, pixel, 3);
+          block[3] = 255;
+
+          break;
+
+        default:
+
+          memcpy(block, pixel, 4);
+        }
+      }
+    }
+  }
+
+  /**
+   * Encodes the colors of a block, using the bounding box of the colors as
+   * the end points.
+   */
+  void compressColors(const uint8_t* block, uint8_t* output)
+  {
+    int min[3] = { 255, 255, 255 };
+    int max[3] = { 0, 0, 0 };
+
+    for(uint i = 0; i < 16; ++i)
+    {
+      for(uint c = 0; c < 3; ++c)
+      {
+        if(block[i * 4 + c] < min[c])
+          min[c] = block[i * 4 + c];
+
+        if(block[i * 4 + c] > max[c])
+          max[c] = block[i * 4 + c];
+      }
+    }
+
+    // Move the end points slightly inwards to reduce the average error
+    for(uint c = 0; c < 3; ++c)
+    {
+      int inset = (max[c] - min[c]) >> 4;
+
+      min[c] += inset;
+      max[c] -= inset;
+    }
+
+    uint16_t color0 = pack565(max);
+    uint16_t color1 = pack565(min);
+    uint32_t indexes = 0;
+
+    if(color0 < color1)
+    {
+      uint16_t tmp = color0;
+
+      color0 = color1;
+      color1 = tmp;
+    }
+
+    if(color0 != color1)
+    {
+      int palette[4][3];
+
+      unpack565(color0, palette[0]);
+      unpack565(color1, palette[1]);
+
+      for(uint c = 0; c < 3; ++c)
+      {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+      }
+
+      for(uint i = 0; i < 16; ++i)
+      {
+        uint best = 0;
+        int bestDistance = 0x7FFFFFFF;
+
+        for(uint j = 0; j < 4; ++j)
+        {
+          int distance = 0;
+
+          for(uint c = 0; c < 3; ++c)
+          {
+            int delta = block[i * 4 + c] - palette[j][c];
+
+            distance += delta * delta;
+          }
+
+          if(distance < bestDistance)
+          {
+            best = j;
+            bestDistance = distance;
+          }
+        }
+
+        indexes |= best << (i * 2);
+      }
+    }
+
+    output[0] = color0 & 0xFF;
+    output[1] = color0 >> 8;
+    output[2] = color1 & 0xFF;
+    output[3] = color1 >> 8;
+    output[4] = indexes & 0xFF;
+    output[5] = (indexes >> 8) & 0xFF;
+    output[6] = (indexes >> 16) & 0xFF;
+    output[7] = indexes >> 24;
+  }
+
+  /**
+   * Encodes the alpha values of a block using eight interpolated values.
+   */
+  void compressAlpha(const uint8_t* block, uint8_t* output)
+  {
+    int min = 255;
+    int max = 0;
+
+    for(uint i = 0; i < 16; ++i)
+    {
+      if(block[i * 4 + 3] < min)
+        min = block[i * 4 + 3];
+
+      if(block[i * 4 + 3] > max)
+        max = block[i * 4 + 3];
+    }
+
+    output[0] = max;
+    output[1] = min;
+
+    uint64_t indexes = 0;
+
+    if(max != min)
+    {
+      // Index 0 is max, 1 is min and 2-7 are interpolated from max to min
+      static const uint remap[8] = { 1, 7, 6, 5, 4, 3, 2, 0 };
+
+      int range = max - min;
+
+      for(uint i = 0; i < 16; ++i)
+      {
+        uint step = ((block[i * 4 + 3] - min) * 7 + range / 2) / range;
+
+        indexes |= static_cast<uint64_t>(remap[step]) << (i * 3);
+      }
+    }
+
+    for(uint i = 0; i < 6; ++i)
+      output[2 + i] = (indexes >> (i * 8)) & 0xFF;
+  }
+}
+
+uint DXT::size(uint width, uint height, Format format)
+{
+  return ((width + 3) / 4) * ((height + 3) / 4)
+       * ((format == DXT1) ? 8 : 16);
+}
+
+void DXT::compress(const Image& image, Format format, uint8_t* output)
+{
+  uint8_t block[64];
+
+  for(uint y = 0; y < image.height(); y += 4)
+  {
+    for(uint x = 0; x < image.width(); x += 4)
+    {
+      readBlock(image, x, y, block);
+
+      if(format == DXT5)
+      {
+        compressAlpha(block, output);
+
+        output += 8;
+      }
+
+      compressColors(block, output);
+
+      output += 8;
+    }
+  }
+}
+
+CompressedImage* DXT::compressMipmaps(Image* image, uint maxSize)
+{
+  if(image->pixelFormat() != Image::RGB
+  && image->pixelFormat() != Image::RGBA
+  && image->pixelFormat() != Image::Gray)
+    return 0;
+
+  uint width = 1;
+  uint height = 1;
+
+  while(width < image->width() && width < maxSize)
+    width <<= 1;
+
+  while(height < image->height() && height < maxSize)
+    height <<= 1;
+
+  if(image->width() != width || image->height() != height)
+    image->resize(width, height);
+
+  Format format = (image->pixelFormat() == Image::RGBA) ? DXT5 : DXT1;
+
+  CompressedImage* result = new CompressedImage;
+
+  result->format = format;
+
+  Image mipmap(1, 1, image->pixelFormat());
+  const Image* source = image;
+
+  for(;;)
+  {
+    CompressedImage::Level level;
+
+    level.width = source->width();
+    level.height = source->height();
+    level.data.resize(size(level.width, level.height, format));
+
+    compress(*source, format, &level.data[0]);
+
+    result->levels.push_back(level);
+
+    if(level.width == 1 && level.height == 1)
+      break;
+
+    mipmap.halve(*source);
+
+    source = &mipmap;
+  }
+
+  return result;
+}
+
+void DXT::setCacheDirectory(const char* directory)
+{
+  if(!directory || !*directory)
+  {
+    cacheDirectory = String::null;
+
+    return;
+  }
+
+  cacheDirectory = directory;
+
+  // Relative names would be looked up among the game files when reading
+  if(cacheDirectory[0] != '/' && cacheDirectory[0] != '~'
+  && cacheDirectory[1] != ':' && !cacheDirectory.beginsWith("./"))
+    cacheDirectory = String("./") + cacheDirectory;
+}
+
+namespace
+{
+  /**
+   * Returns the cache file name of an image file.
+   *
+   * Path separators and '%' are percent-encoded, so different image names
+   * never share a cache file.
+   */
+  String cacheName(const String& fileName)
+  {
+    String result;
+
+    for(const char* c = fileName; *c; ++c)
+    {
+      switch(*c)
+      {
+      case '%': result += "%25"; break;
+      case '/': result += "%2F"; break;
+      case ':': result += "%3A"; break;
+      case '\\': result += "%5C"; break;
+      default: result += *c;
+      }
+    }
+
+    return cacheDirectory + "/" + result + ".dxt";
+  }
+
+  /**
+   * Returns the modification time of an image file.
+   */
+  uint sourceModified(const String& fileName)
+  {
+    File file(fileName);
+
+    return file.modified();
+  }
+}
+
+CompressedImage* DXT::readCache(const char* name)
+{
+  if(cacheDirectory.isNull())
+    return 0;
+
+  // Cache by the file actually read, so "foo.tga" finds a cached "foo.jpg"
+  String fileName = Image::locate(name);
+
+  if(fileName.isNull())
+    return 0;
+
+  uint modified = sourceModified(fileName);
+
+  if(!modified)
+    return 0;
+
+  File file(cacheName(fileName));
+
+  if(!file.isOpen())
+    return 0;
+
+  if(file.getU32() != cacheMagic
+  || file.getU32() != cacheVersion
+  || file.getU32() != modified)
+    return 0;
+
+  CompressedImage* image = new CompressedImage;
+
+  image->format = file.getU32();
+
+  uint levelCount = file.getU32();
+
+  if((image->format != DXT1 && image->format != DXT5) || levelCount > 32)
+  {
+    esWarning << "DXT: Corrupt cache file for \"" << name << "\"."
+              << std::endl;
+
+    delete image;
+
+    return 0;
+  }
+
+  image->levels.resize(levelCount);
+
+  for(uint i = 0; i < levelCount; ++i)
+  {
+    CompressedImage::Level& level = image->levels[i];
+
+    level.width = file.getU32();
+    level.height = file.getU32();
+
+    uint length = size(level.width, level.height,
+                       static_cast<Format>(image->format));
+
+    if(file.tell() + length > file.length())
+    {
+      esWarning << "DXT: Truncated cache file for \"" << name << "\"."
+                << std::endl;
+
+      delete image;
+
+      return 0;
+    }
+
+    level.data.resize(length);
+
+    file.read(&level.data[0], length);
+  }
+
+  return image;
+}
+
+bool DXT::writeCache(const char* name, const CompressedImage& image)
+{
+  if(cacheDirectory.isNull())
+    return false;
+
+  String fileName = Image::locate(name);
+
+  if(fileName.isNull())
+    return false;
+
+  uint modified = sourceModified(fileName);
+
+  if(!modified)
+    return false;
+
+  File file(cacheName(fileName), File::Write | File::Truncate);
+
+  if(!file.isOpen())
+  {
+    esWarning << "DXT: Failed to write cache file for \"" << name << "\"."
+              << std::endl;
+
+    return false;
+  }
+
+  file.put(cacheMagic);
+  file.put(cacheVersion);
+  file.put(static_cast<uint32_t>(modified));
+  file.put(static_cast<uint32_t>(image.format));
+  file.put(static_cast<uint32_t>(image.levels.size()));
+
+  for(std::vector<CompressedImage::Level>::const_iterator i
+        = image.levels.begin(); i != image.levels.end(); ++i)
+  {
+    file.put(static_cast<uint32_t>(i->width));
+    file.put(static_cast<uint32_t>(i->height));
+    file.write(&i->data[0], i->data.size());
+  }
+
+  return true;
+}
+
+bool DXT::precompress(const char* name, uint maxSize)
+{
+  CompressedImage* compressed = readCache(name);
+
+  if(compressed)
+  {
+    delete compressed;
+
+    return true;
+  }
+
+  Image* image = Image::acquire(name);
+
+  if(!image)
+    return false;
+
+  compressed = compressMipmaps(image, maxSize);
+
+  Image::unacquire(image);
+
+  if(!compressed)
+    return false;
+
+  bool result = writeCache(name, *compressed);
+
+  delete compressed;
+
+  return result;
+}
+
+// vim: ts=2 sw=2 et
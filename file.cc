@@ -528,7 +528,10 @@ void File::read(void* buffer, uint count)
       sysSeek(bufferPosition + position);
     }
 
-    sysRead(static_cast<char*>(buffer) + amount, count - amount);
+    // Don't touch the underlying file for reads ending at the end of the
+    // buffer, so that a file can be parsed by another thread after data()
+    if(count > static_cast<uint>(amount))
+      sysRead(static_cast<char*>(buffer) + amount, count - amount);
 
     position += count;
   }
@@ -1,8 +1,237 @@
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include <string.h>
+
 #include <espace/file.h>
 #include <espace/font.h>
+#include <espace/image.h>
+#include <espace/opengl.h>
 #include <espace/output.h>
 #include <espace/plugins.h>
 #include <espace/string.h>
+#include <espace/texture.h>
+
+namespace
+{
+  struct GlyphRect
+  {
+    uint   glyph;
+    Image* page;
+    uint   x, y;
+    uint   width, height;
+    uint   atlasX, atlasY;
+
+    bool operator<(const GlyphRect& r) const
+    {
+      return height > r.height;
+    }
+  };
+
+  /**
+   * Places the glyphs on shelves in an atlas of the given width.
+   *
+   * Returns the height used.
+   */
+  uint placeGlyphs(std::vector<GlyphRect>& rects, uint width)
+  {
+    uint x = 0;
+    uint y = 0;
+    uint shelfHeight = 0;
+
+    for(std::vector<GlyphRect>::iterator i = rects.begin();
+        i != rects.end(); ++i)
+    {
+      // Leave one pixel between glyphs to avoid bleeding
+      if(x + i->width + 1 > width)
+      {
+        x = 0;
+        y += shelfHeight;
+        shelfHeight = 0;
+      }
+
+      i->atlasX = x;
+      i->atlasY = y;
+
+      x += i->width + 1;
+      shelfHeight = std::max(shelfHeight, i->height + 1);
+    }
+
+    return y + shelfHeight;
+  }
+
+  /**
+   * Copies all glyphs of a font into a single texture, so that strings can
+   * be drawn without texture changes.
+   */
+  void packGlyphs(Font* font)
+  {
+    std::map<String, Image*> pages;
+    std::vector<GlyphRect> rects;
+    uint maxWidth = 0;
+    bool ok = true;
+
+    for(uint i = 0; i < 256 && ok; ++i)
+    {
+      Font::Glyph& glyph = font->glyphs[i];
+
+      if(!glyph.shaderHandle || !glyph.imageWidth || !glyph.imageHeight)
+        continue;
+
+      std::map<String, Image*>::iterator j = pages.find(glyph.shaderName);
+
+      if(j == pages.end())
+      {
+        Image* image = Image::acquire(glyph.shaderName);
+
+        if(image
+        && image->pixelFormat() != Image::RGBA
+        && image->pixelFormat() != Image::RGB
+        && image->pixelFormat() != Image::Gray)
+        {
+          Image::unacquire(image);
+
+          image = 0;
+        }
+
+        j = pages.insert(std::make_pair(String(glyph.shaderName),
+                                        image)).first;
+      }
+
+      Image* page = j->second;
+
+      if(!page)
+      {
+        ok = false;
+
+        break;
+      }
+
+      GlyphRect rect;
+
+      rect.glyph = i;
+      rect.page = page;
+      rect.x = std::min(static_cast<uint>(glyph.s1 * page->width() + 0.5f),
+                        page->width());
+      rect.y = std::min(static_cast<uint>(glyph.t1 * page->height() + 0.5f),
+                        page->height());
+      rect.width = std::min(static_cast<uint>(glyph.s2 * page->width() + 0.5f),
+                            page->width()) - rect.x;
+      rect.height = std::min(static_cast<uint>(glyph.t2 * page->height() + 0.5f),
+                             page->height()) - rect.y;
+
+      maxWidth = std::max(maxWidth, rect.width + 1);
+
+      rects.push_back(rect);
+    }
+
+    Image* atlas = 0;
+
+    if(ok && !rects.empty())
+    {
+      std::stable_sort(rects.begin(), rects.end());
+
+      uint width = 64;
+      uint height = 0;
+
+      while(width < maxWidth)
+        width <<= 1;
+
+      for(; width <= GL::config.maxTextureSize; width <<= 1)
+      {
+        uint used = placeGlyphs(rects, width);
+
+        if(used <= width)
+        {
+          height = 1;
+
+          while(height < used)
+            height <<= 1;
+
+          break;
+        }
+      }
+
+      if(height)
+      {
+        atlas = new Image(width, height, Image::RGBA);
+
+        memset(atlas->data(), 0, atlas->size());
+      }
+    }
+
+    if(atlas)
+    {
+      float width = atlas->width();
+      float height = atlas->height();
+
+      for(std::vector<GlyphRect>::iterator i = rects.begin();
+          i != rects.end(); ++i)
+      {
+        const Image* page = i->page;
+        uint bpp = page->bytesPerPixel();
+
+        for(uint y = 0; y < i->height; ++y)
+        {
+          const uint8_t* in = page->data()
+                            + ((i->y + y) * page->width() + i->x) * bpp;
+          uint8_t* out = atlas->data()
+                       + ((i->atlasY + y) * atlas->width() + i->atlasX) * 4;
+
+          for(uint x = 0; x < i->width; ++x, in += bpp, out += 4)
+          {
+            switch(page->pixelFormat())
+            {
+            case Image::RGBA:
+
+              memcpy(out, in, 4);
+
+              break;
+
+            case Image::RGB:
+
+              memcpy(out, in, 3);
+              out[3] = 255;
+
+              break;
+
+            case Image::Gray:
+
+              out[0] = out[1] = out[2] = in[0];
+              out[3] = 255;
+
+              break;
+            }
+          }
+        }
+
+        Font::Glyph& glyph = font->glyphs[i->glyph];
+
+        glyph.atlasS1 = i->atlasX / width;
+        glyph.atlasT1 = i->atlasY / height;
+        glyph.atlasS2 = (i->atlasX + i->width) / width;
+        glyph.atlasT2 = (i->atlasY + i->height) / height;
+      }
+
+      font->atlas = Texture::acquire(atlas, Texture::NoMipMaps
+                                          | Texture::NoRepeat);
+
+      esDebug(3) << "Font: Packed " << rects.size() << " glyphs from "
+                 << pages.size() << " page(s) into " << atlas->width()
+                 << "x" << atlas->height() << " atlas." << std::endl;
+
+      Image::unacquire(atlas);
+    }
+
+    for(std::map<String, Image*>::iterator i = pages.begin();
+        i != pages.end(); ++i)
+    {
+      if(i->second)
+        Image::unacquire(i->second);
+    }
+  }
+}
 
 Font* Font::acquire(const char* _fileName)
 {
@@ -28,7 +257,13 @@ Font* Font::acquire(const char* _fileName)
       font = i->second->read(file);
 
       if(font)
+      {
+        font->atlas = 0;
+
+        packGlyphs(font);
+
         return font;
+      }
     }
   }
 
@@ -14,10 +14,17 @@
  *                                                                         *
  ***************************************************************************/
 
+#include <algorithm>
 #include <map>
+#include <vector>
 
+#include <math.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <espace/file.h>
 #include <espace/image.h>
 #include <espace/opengl.h>
@@ -26,40 +33,49 @@
 #include <espace/output.h>
 #include <espace/plugins.h>
 
-Image* Image::acquire(const char* _fileName)
+String Image::locate(const char* _fileName)
 {
   String fileName(_fileName);
 
   File file(fileName);
 
-  if(!file.isOpen())
-  {
-    String base = fileName.left(fileName.length() - 3);
+  if(file.isOpen())
+    return fileName;
 
-    std::vector<String> files;
+  String base = fileName.left(fileName.length() - 3);
 
-    File::find(StartsWith(base), files);
+  std::vector<String> files;
 
-    for(std::vector<String>::iterator i = files.begin();
-        i != files.end(); ++i)
-    {
-      if(*i == fileName)
-        continue;
+  File::find(StartsWith(base), files);
+
+  for(std::vector<String>::iterator i = files.begin();
+      i != files.end(); ++i)
+  {
+    if(*i == fileName)
+      continue;
 
-      file = File(*i);
+    file = File(*i);
 
-      if(file.isOpen())
-        break;
-    }
+    if(file.isOpen())
+      return *i;
   }
 
-  if(!file.isOpen())
+  return String::null;
+}
+
+Image* Image::acquire(const char* _fileName)
+{
+  String fileName = locate(_fileName);
+
+  if(fileName.isNull())
   {
-    esWarning << "Image: Failed to open \"" << fileName << "\"." << std::endl;
+    esWarning << "Image: Failed to open \"" << _fileName << "\"." << std::endl;
 
     return 0;
   }
 
+  File file(fileName);
+
   Image* image = 0;
 
   for(PluginMap(Image)::iterator i = Plugin::image.begin();
@@ -241,43 +257,7 @@ void Image::copy(const Image& image)
     {
     case RGB:
 
-      {
-        uint8_t* RGB = data();
-        const uint8_t* Y = image.data();
-        uint width = this->width();
-        uint height = this->height();
-        const uint8_t* chroma = Y + width * height;
-
-        for(uint y = 0; y < height; ++y)
-        {
-          const uint8_t* C = chroma + y / 2 * width;
-
-          for(uint x = 0; x < width; x += 2, Y += 2, C += 2, RGB += 6)
-          {
-            int Cb = C[0] - 128;
-            int Cr = C[1] - 128;
-
-            int cRed   =  ((static_cast<int32_t>(0x10000 * 1.40200) * Cr) >> 16);
-            int cGreen = -((static_cast<int32_t>(0x10000 * 0.34414) * Cb)
-                         + (static_cast<int32_t>(0x10000 * 0.71414) * Cr) >> 16);
-            int cBlue  =  ((static_cast<int32_t>(0x10000 * 1.77200) * Cb) >> 16);
-
-            int r0 = Y[0] + cRed;
-            int g0 = Y[0] + cGreen;
-            int b0 = Y[0] + cBlue;
-            int r1 = Y[1] + cRed;
-            int g1 = Y[1] + cGreen;
-            int b1 = Y[1] + cBlue;
-
-            RGB[0] = (r0 >= 255) ? 255 : (r0 <= 0) ? 0 : r0;
-            RGB[1] = (g0 >= 255) ? 255 : (g0 <= 0) ? 0 : g0;
-            RGB[2] = (b0 >= 255) ? 255 : (b0 <= 0) ? 0 : b0;
-            RGB[3] = (r1 >= 255) ? 255 : (r1 <= 0) ? 0 : r1;
-            RGB[4] = (g1 >= 255) ? 255 : (g1 <= 0) ? 0 : g1;
-            RGB[5] = (b1 >= 255) ? 255 : (b1 <= 0) ? 0 : b1;
-          }
-        }
-      }
+      image.convertNV12(0, 0, width(), height(), data());
 
       break;
 
@@ -294,6 +274,440 @@ void Image::copy(const Image& image)
   }
 }
 
+namespace
+{
+  inline uint8_t clamp(int value)
+  {
+    return (value >= 255) ? 255 : (value <= 0) ? 0 : value;
+  }
+
+  /**
+   * Converts a pair of pixels sharing chroma values.
+   */
+  inline void convertPair(const uint8_t* Y, const uint8_t* C, uint8_t* RGB)
+  {
+    int Cb = C[0] - 128;
+    int Cr = C[1] - 128;
+
+    int cRed   =  ((static_cast<int32_t>(0x10000 * 1.40200) * Cr) >> 16);
+    int cGreen = -(((static_cast<int32_t>(0x10000 * 0.34414) * Cb)
+                  + (static_cast<int32_t>(0x10000 * 0.71414) * Cr)) >> 16);
+    int cBlue  =  ((static_cast<int32_t>(0x10000 * 1.77200) * Cb) >> 16);
+
+    RGB[0] = clamp(Y[0] + cRed);
+    RGB[1] = clamp(Y[0] + cGreen);
+    RGB[2] = clamp(Y[0] + cBlue);
+    RGB[3] = clamp(Y[1] + cRed);
+    RGB[4] = clamp(Y[1] + cGreen);
+    RGB[5] = clamp(Y[1] + cBlue);
+  }
+
+#ifdef __SSE2__
+  /**
+   * Converts a row of NV12 pixels to RGB, 16 pixels at a time.  Chroma
+   * offsets are computed with 16 bit multiplies on values scaled by 64, and
+   * the final clamping is done by saturating packs.
+   *
+   * Returns the number of pixels converted.
+   */
+  uint convertNV12Row(const uint8_t* Y, const uint8_t* C, uint8_t* RGB,
+                      uint width)
+  {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16(128);
+    const __m128i low = _mm_set1_epi32(0xFFFF);
+    const __m128i red = _mm_set1_epi16(1436);      // 1.40200 * 1024
+    const __m128i greenCb = _mm_set1_epi16(352);   // 0.34414 * 1024
+    const __m128i greenCr = _mm_set1_epi16(731);   // 0.71414 * 1024
+    const __m128i blue = _mm_set1_epi16(1815);     // 1.77200 * 1024
+
+    uint x = 0;
+
+    for(; x + 16 <= width; x += 16, Y += 16, C += 16, RGB += 48)
+    {
+      __m128i luma = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Y));
+      __m128i chroma = _mm_loadu_si128(reinterpret_cast<const __m128i*>(C));
+
+      __m128i r[2], g[2], b[2];
+
+      for(uint half = 0; half < 2; ++half)
+      {
+        __m128i y16 = half ? _mm_unpackhi_epi8(luma, zero)
+                           : _mm_unpacklo_epi8(luma, zero);
+        __m128i c16 = half ? _mm_unpackhi_epi8(chroma, zero)
+                           : _mm_unpacklo_epi8(chroma, zero);
+
+        // Each 32 bit lane holds Cb and Cr of two pixels; spread each of
+        // them over both pixels
+        __m128i cb = _mm_and_si128(c16, low);
+        __m128i cr = _mm_srli_epi32(c16, 16);
+
+        cb = _mm_or_si128(cb, _mm_slli_epi32(cb, 16));
+        cr = _mm_or_si128(cr, _mm_slli_epi32(cr, 16));
+
+        cb = _mm_slli_epi16(_mm_sub_epi16(cb, bias), 6);
+        cr = _mm_slli_epi16(_mm_sub_epi16(cr, bias), 6);
+
+        r[half] = _mm_add_epi16(y16, _mm_mulhi_epi16(cr, red));
+        g[half] = _mm_sub_epi16(y16,
+                                _mm_add_epi16(_mm_mulhi_epi16(cb, greenCb),
+                                              _mm_mulhi_epi16(cr, greenCr)));
+        b[half] = _mm_add_epi16(y16, _mm_mulhi_epi16(cb, blue));
+      }
+
+      uint8_t rs[16], gs[16], bs[16];
+
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(rs),
+                       _mm_packus_epi16(r[0], r[1]));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(gs),
+                       _mm_packus_epi16(g[0], g[1]));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(bs),
+                       _mm_packus_epi16(b[0], b[1]));
+
+      for(uint i = 0; i < 16; ++i)
+      {
+        RGB[i * 3] = rs[i];
+        RGB[i * 3 + 1] = gs[i];
+        RGB[i * 3 + 2] = bs[i];
+      }
+    }
+
+    return x;
+  }
+#endif // __SSE2__
+}
+
+void Image::convertNV12(uint left, uint top, uint width, uint height,
+                        uint8_t* RGB) const
+{
+  const uint8_t* chroma = data() + _width * _height;
+
+  for(uint y = top; y < top + height; ++y)
+  {
+    const uint8_t* Y = data() + y * _width + left;
+    const uint8_t* C = chroma + y / 2 * _width + left;
+
+    uint x = 0;
+
+#ifdef __SSE2__
+    x = convertNV12Row(Y, C, RGB, width);
+
+    Y += x;
+    C += x;
+    RGB += x * 3;
+#endif
+
+    for(; x < width; x += 2, Y += 2, C += 2, RGB += 6)
+      convertPair(Y, C, RGB);
+  }
+}
+
+namespace
+{
+  /**
+   * Weights of a separable tent filter resampling `size' samples to
+   * `newSize' samples.  When reducing, the filter widens to cover every
+   * source sample.
+   */
+  struct Filter
+  {
+    Filter(uint size, uint newSize);
+
+    uint               taps;
+    std::vector<int>   first;
+    std::vector<float> weights;
+  };
+
+  Filter::Filter(uint size, uint newSize)
+  {
+    float scale = static_cast<float>(size) / newSize;
+    float support = std::max(scale, 1.0f);
+
+    taps = static_cast<uint>(ceil(support * 2)) + 1;
+
+    first.resize(newSize);
+    weights.resize(newSize * taps);
+
+    for(uint i = 0; i < newSize; ++i)
+    {
+      float center = (i + 0.5f) * scale - 0.5f;
+      int start = static_cast<int>(floor(center - support)) + 1;
+      float* weight = &weights[i * taps];
+      float total = 0;
+
+      for(uint t = 0; t < taps; ++t)
+      {
+        weight[t] = std::max(0.0f, 1.0f - fabs(start + t - center) / support);
+
+        total += weight[t];
+      }
+
+      for(uint t = 0; t < taps; ++t)
+        weight[t] /= total;
+
+      first[i] = start;
+    }
+  }
+
+  inline uint clamp(int value, uint size)
+  {
+    return (value < 0)                        ? 0
+         : (static_cast<uint>(value) >= size) ? size - 1
+         :                                      value;
+  }
+
+  template<typename T>
+  void resample(const T* in, T* out, uint width, uint height,
+                uint newWidth, uint newHeight, uint components, float max)
+  {
+    Filter horizontal(width, newWidth);
+    Filter vertical(height, newHeight);
+
+    uint rowSize = newWidth * components;
+
+    std::vector<float> temp(rowSize * height);
+    std::vector<float> sum(rowSize);
+
+    for(uint y = 0; y < height; ++y)
+    {
+      const T* row = in + y * width * components;
+      float* result = &temp[y * rowSize];
+
+      for(uint x = 0; x < newWidth; ++x, result += components)
+      {
+        const float* weight = &horizontal.weights[x * horizontal.taps];
+
+        for(uint c = 0; c < components; ++c)
+          result[c] = 0;
+
+        for(uint t = 0; t < horizontal.taps; ++t)
+        {
+          if(!weight[t])
+            continue;
+
+          const T* pixel
+            = row + clamp(horizontal.first[x] + t, width) * components;
+
+          for(uint c = 0; c < components; ++c)
+            result[c] += pixel[c] * weight[t];
+        }
+      }
+    }
+
+    for(uint y = 0; y < newHeight; ++y)
+    {
+      const float* weight = &vertical.weights[y * vertical.taps];
+
+      std::fill(sum.begin(), sum.end(), 0.0f);
+
+      for(uint t = 0; t < vertical.taps; ++t)
+      {
+        if(!weight[t])
+          continue;
+
+        const float* row
+          = &temp[clamp(vertical.first[y] + t, height) * rowSize];
+
+        for(uint n = 0; n < rowSize; ++n)
+          sum[n] += row[n] * weight[t];
+      }
+
+      for(uint n = 0; n < rowSize; ++n, ++out)
+      {
+        float value = sum[n] + 0.5f;
+
+        *out = (value <= 0)   ? 0
+             : (value >= max) ? static_cast<T>(max)
+             :                  static_cast<T>(value);
+      }
+    }
+  }
+
+  // Gamma 2.2 conversion tables for gamma correct downsampling.  Linear
+  // values have 12 bits of precision.
+
+  uint16_t toLinear[256];
+  uint8_t  fromLinear[4096];
+
+  struct GammaTables
+  {
+    GammaTables()
+    {
+      for(uint i = 0; i < 256; ++i)
+        toLinear[i] = static_cast<uint16_t>(pow(i / 255.0, 2.2) * 4095 + 0.5);
+
+      for(uint i = 0; i < 4096; ++i)
+        fromLinear[i] = static_cast<uint8_t>(pow(i / 4095.0, 1 / 2.2) * 255
+                                             + 0.5);
+    }
+  };
+
+  // Filled before main(), since halve() runs in the texture decoding thread
+  GammaTables gammaTables;
+
+#ifdef __SSE2__
+  /**
+   * Averages 2x2 blocks of RGBA pixels, four output pixels at a time.
+   *
+   * Returns the number of output pixels written.
+   */
+  uint halveRGBA(const uint8_t* row0, const uint8_t* row1, uint8_t* out,
+                 uint width)
+  {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+
+    uint x = 0;
+
+    for(; x + 4 <= width; x += 4, row0 += 32, row1 += 32, out += 16)
+    {
+      __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0));
+      __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + 16));
+      __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1));
+      __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + 16));
+
+      // Vertical sums, two pixels per register
+      __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero),
+                                 _mm_unpacklo_epi8(b0, zero));
+      __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero),
+                                 _mm_unpackhi_epi8(b0, zero));
+      __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero),
+                                 _mm_unpacklo_epi8(b1, zero));
+      __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero),
+                                 _mm_unpackhi_epi8(b1, zero));
+
+      // Horizontal sums of neighbouring pixels
+      __m128i h0 = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1),
+                                 _mm_unpackhi_epi64(s0, s1));
+      __m128i h1 = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3),
+                                 _mm_unpackhi_epi64(s2, s3));
+
+      h0 = _mm_srli_epi16(_mm_add_epi16(h0, two), 2);
+      h1 = _mm_srli_epi16(_mm_add_epi16(h1, two), 2);
+
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+                       _mm_packus_epi16(h0, h1));
+    }
+
+    return x;
+  }
+
+  /**
+   * Averages 2x2 blocks of gray pixels, sixteen output pixels at a time.
+   *
+   * Returns the number of output pixels written.
+   */
+  uint halveGray(const uint8_t* row0, const uint8_t* row1, uint8_t* out,
+                 uint width)
+  {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i two = _mm_set1_epi16(2);
+
+    uint x = 0;
+
+    for(; x + 16 <= width; x += 16, row0 += 32, row1 += 32, out += 16)
+    {
+      __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0));
+      __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + 16));
+      __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1));
+      __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + 16));
+
+      __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero),
+                                 _mm_unpacklo_epi8(b0, zero));
+      __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero),
+                                 _mm_unpackhi_epi8(b0, zero));
+      __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero),
+                                 _mm_unpacklo_epi8(b1, zero));
+      __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero),
+                                 _mm_unpackhi_epi8(b1, zero));
+
+      // Sum neighbouring 16 bit values into 32 bit values
+      __m128i h0 = _mm_packs_epi32(_mm_madd_epi16(s0, one),
+                                   _mm_madd_epi16(s1, one));
+      __m128i h1 = _mm_packs_epi32(_mm_madd_epi16(s2, one),
+                                   _mm_madd_epi16(s3, one));
+
+      h0 = _mm_srli_epi16(_mm_add_epi16(h0, two), 2);
+      h1 = _mm_srli_epi16(_mm_add_epi16(h1, two), 2);
+
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+                       _mm_packus_epi16(h0, h1));
+    }
+
+    return x;
+  }
+#endif // __SSE2__
+
+  /**
+   * Averages pixels from two rows into one row of half the width.
+   *
+   * `next' is the offset in components to the second pixel of each pair,
+   * which is 0 when the width is not being reduced.
+   */
+  void halveRow(const uint8_t* row0, const uint8_t* row1, uint8_t* out,
+                uint width, uint components, uint next, bool gammaCorrect)
+  {
+    uint x = 0;
+
+    if(gammaCorrect)
+    {
+      for(uint n = 0; x < width; ++x, row0 += components + next,
+          row1 += components + next)
+      {
+        for(uint c = 0; c < components; ++c, ++n)
+        {
+          if(c == 3) // Alpha is linear
+          {
+            out[n] = (row0[c] + row0[c + next]
+                    + row1[c] + row1[c + next] + 2) >> 2;
+          }
+          else
+          {
+            out[n] = fromLinear[(toLinear[row0[c]] + toLinear[row0[c + next]]
+                               + toLinear[row1[c]] + toLinear[row1[c + next]]
+                               + 2) >> 2];
+          }
+        }
+      }
+
+      return;
+    }
+
+#ifdef __SSE2__
+    if(next && components == 4)
+      x = halveRGBA(row0, row1, out, width);
+    else if(next && components == 1)
+      x = halveGray(row0, row1, out, width);
+#endif
+
+    row0 += x * (components + next);
+    row1 += x * (components + next);
+    out += x * components;
+
+    for(; x < width; ++x, row0 += components + next,
+        row1 += components + next)
+    {
+      for(uint c = 0; c < components; ++c)
+        *out++ = (row0[c] + row0[c + next] + row1[c] + row1[c + next] + 2) >> 2;
+    }
+  }
+
+  void halveRow(const uint16_t* row0, const uint16_t* row1, uint16_t* out,
+                uint width, uint components, uint next)
+  {
+    for(uint x = 0; x < width; ++x, row0 += components + next,
+        row1 += components + next)
+    {
+      for(uint c = 0; c < components; ++c)
+      {
+        *out++ = (static_cast<uint32_t>(row0[c]) + row0[c + next]
+                + row1[c] + row1[c + next] + 2) >> 2;
+      }
+    }
+  }
+}
+
 void Image::resize(uint width, uint height)
 {
   uint oldWidth = _width;
@@ -301,21 +715,41 @@ void Image::resize(uint width, uint height)
   uint8_t* oldData = _data;
   uint8_t* data = new uint8_t[width * height * bytesPerPixel()];
 
-  uint stepX = (oldWidth * 0x10000) / width;
-  uint stepY = (oldHeight * 0x10000) / height;
+  switch(dataType())
+  {
+  case GL::UNSIGNED_BYTE:
 
-  uint bytesPerPixel = this->bytesPerPixel();
+    resample(oldData, data, oldWidth, oldHeight, width, height,
+             componentCount(), 255);
 
-  // The following works poorly for downsampling
+    break;
+
+  case GL::UNSIGNED_SHORT:
+
+    resample(reinterpret_cast<const uint16_t*>(oldData),
+             reinterpret_cast<uint16_t*>(data), oldWidth, oldHeight,
+             width, height, componentCount(), 65535);
+
+    break;
+
+  default:
 
-  for(uint y = 0, oldY = 0; y < height; ++y, oldY += stepY)
-  {
-    for(uint x = 0, oldX = 0; x < width; ++x, oldX += stepX)
     {
-      for(uint n = 0; n < bytesPerPixel; ++n)
+      uint stepX = (oldWidth * 0x10000) / width;
+      uint stepY = (oldHeight * 0x10000) / height;
+
+      uint bytesPerPixel = this->bytesPerPixel();
+
+      for(uint y = 0, oldY = 0; y < height; ++y, oldY += stepY)
       {
-        data[(y * width + x) * bytesPerPixel + n] =
-          oldData[((oldY >> 16) * oldWidth + (oldX >> 16)) * bytesPerPixel + n];
+        for(uint x = 0, oldX = 0; x < width; ++x, oldX += stepX)
+        {
+          for(uint n = 0; n < bytesPerPixel; ++n)
+          {
+            data[(y * width + x) * bytesPerPixel + n] =
+              oldData[((oldY >> 16) * oldWidth + (oldX >> 16)) * bytesPerPixel + n];
+          }
+        }
       }
     }
   }
@@ -328,6 +762,65 @@ void Image::resize(uint width, uint height)
   _data = data;
 }
 
+void Image::halve(const Image& source, bool gammaCorrect)
+{
+  uint components = source.componentCount();
+
+  if(!components)
+  {
+    esWarning << "Image: Unsupported pixel format for downsampling."
+              << std::endl;
+
+    return;
+  }
+
+  uint sourceWidth = source.width();
+  uint sourceHeight = source.height();
+  uint bytesPerPixel = source.bytesPerPixel();
+  uint width = (sourceWidth > 1) ? sourceWidth / 2 : 1;
+  uint height = (sourceHeight > 1) ? sourceHeight / 2 : 1;
+
+  if(&source != this)
+  {
+    if(size() < width * height * bytesPerPixel)
+    {
+      delete [] _data;
+
+      _data = new uint8_t[width * height * bytesPerPixel];
+    }
+
+    _pixelFormat = source._pixelFormat;
+  }
+
+  _width = width;
+  _height = height;
+
+  // When `source' is this image, each output row is stored at or before
+  // the input rows it is computed from.
+  uint sourceStride = sourceWidth * components;
+  uint rowStep = (sourceHeight > 1) ? 2 : 1;
+  uint nextRow = (sourceHeight > 1) ? sourceStride : 0;
+  uint next = (sourceWidth > 1) ? components : 0;
+
+  for(uint y = 0; y < height; ++y)
+  {
+    if(dataType() == GL::UNSIGNED_BYTE)
+    {
+      const uint8_t* row = source.data() + y * rowStep * sourceStride;
+
+      halveRow(row, row + nextRow, data() + y * width * components,
+               width, components, next, gammaCorrect);
+    }
+    else
+    {
+      const uint16_t* row = source.data16() + y * rowStep * sourceStride;
+
+      halveRow(row, row + nextRow, data16() + y * width * components,
+               width, components, next);
+    }
+  }
+}
+
 uint Image::size() const
 {
   if(_pixelFormat == NV12)
@@ -336,4 +829,74 @@ uint Image::size() const
   return bytesPerPixel() * _width * _height;
 }
 
+bool Image::saveTGA(const char* fileName) const
+{
+  uint components;
+
+  switch(_pixelFormat)
+  {
+  case Gray: components = 1; break;
+  case RGB: components = 3; break;
+  case RGBA: components = 4; break;
+  default:
+
+    esWarning << "Image: Only 8 bit gray, RGB and RGBA images can be saved as "
+                 "TGA." << std::endl;
+
+    return false;
+  }
+
+  File file(fileName, File::Write | File::Truncate);
+
+  if(!file.isOpen())
+  {
+    esWarning << "Image: Failed to open \"" << fileName << "\" for writing."
+              << std::endl;
+
+    return false;
+  }
+
+  file.put(static_cast<uint8_t>(0));                   // ID length
+  file.put(static_cast<uint8_t>(0));                   // No color map
+  file.put(static_cast<uint8_t>(components == 1 ? 3 : 2));
+  file.put(static_cast<uint16_t>(0));                  // Color map spec
+  file.put(static_cast<uint16_t>(0));
+  file.put(static_cast<uint8_t>(0));
+  file.put(static_cast<uint16_t>(0));                  // Origin
+  file.put(static_cast<uint16_t>(0));
+  file.put(static_cast<uint16_t>(_width));
+  file.put(static_cast<uint16_t>(_height));
+  file.put(static_cast<uint8_t>(components * 8));
+  file.put(static_cast<uint8_t>(0x20 | (components == 4 ? 8 : 0)));
+
+  // TGA stores color components as BGR(A)
+  std::vector<uint8_t> row(_width * components);
+
+  for(uint y = 0; y < _height; ++y)
+  {
+    const uint8_t* source = _data + y * _width * components;
+
+    if(components == 1)
+    {
+      file.write(source, _width);
+
+      continue;
+    }
+
+    for(uint x = 0; x < _width * components; x += components)
+    {
+      row[x] = source[x + 2];
+      row[x + 1] = source[x + 1];
+      row[x + 2] = source[x];
+
+      if(components == 4)
+        row[x + 3] = source[x + 3];
+    }
+
+    file.write(&row[0], row.size());
+  }
+
+  return true;
+}
+
 // vim: ts=2 sw=2 et
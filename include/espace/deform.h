@@ -0,0 +1,58 @@
+#ifndef DEFORM_H_
+#define DEFORM_H_ 1
+
+#ifndef SWIG
+#include "shader.h"
+#include "types.h"
+#include "vector.h"
+#endif
+
+/**
+ * CPU implementation of shader vertex deformations.
+ *
+ * \author Morten Hustveit
+ */
+struct Deformer
+{
+  /**
+   * Vertices being deformed.
+   *
+   * Positions and normals are tightly packed arrays indexed by vertex
+   * number, and are modified in place.  Only the vertices in `list' are
+   * touched by the per-vertex deformations.
+   */
+  struct Vertices
+  {
+    float*      positions;
+    float*      normals;        /**< NULL if there are no normals */
+    const char* texCoords;      /**< NULL if there are no texture coords */
+    uint        texCoordStride;
+    const uint* list;
+    uint        count;
+  };
+
+  /**
+   * The camera, in the coordinate system of the vertices.
+   */
+  struct View
+  {
+    Vector3 origin;
+    Vector3 right;
+    Vector3 up;
+  };
+
+  /**
+   * Applies a deformation.
+   *
+   * AutoSprite and AutoSprite2 rebuild the quads formed by each group of
+   * six indexes in `indexes'.  The other deformations ignore the indexes
+   * and process the vertices in the list.
+   */
+  static IMPORT void apply(const Shader::Deform& deform, Vertices& vertices,
+                           const uint* indexes, uint indexCount,
+                           const View& view, float time);
+};
+
+#endif // !DEFORM_H_
+
+// vim: ts=2 sw=2 et
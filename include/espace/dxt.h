@@ -0,0 +1,113 @@
+#ifndef DXT_H_
+#define DXT_H_ 1
+
+#ifndef SWIG
+#include <vector>
+
+#include <stdint.h>
+
+#include "string.h"
+#include "types.h"
+#endif
+
+struct Image;
+
+/**
+ * A compressed image with all of its mipmap levels.
+ */
+struct CompressedImage
+{
+  struct Level
+  {
+    uint width;
+    uint height;
+
+#ifndef SWIG
+    std::vector<uint8_t> data;
+#endif
+  };
+
+  /**
+   * DXT::DXT1 or DXT::DXT5.
+   */
+  uint format;
+
+#ifndef SWIG
+  std::vector<Level> levels;
+#endif
+};
+
+/**
+ * Namespace for S3TC (DXT1 and DXT5) texture compression.
+ *
+ * None of these functions need an OpenGL context, so they can be used by
+ * tools that precompress the textures of a game directory.
+ */
+struct DXT
+{
+  enum Format
+  {
+    DXT1 = 1, /**< Opaque images, 8 bytes per 4x4 block */
+    DXT5 = 5  /**< Images with alpha, 16 bytes per 4x4 block */
+  };
+
+  /**
+   * Returns the number of bytes of a compressed image of the given size.
+   */
+  static IMPORT uint size(uint width, uint height, Format format);
+
+  /**
+   * Compresses an 8 bit RGB, RGBA or gray image.
+   *
+   * \param output Buffer of at least size(width, height, format) bytes.
+   */
+  static IMPORT void compress(const Image& image, Format format,
+                              uint8_t* output);
+
+  /**
+   * Compresses an image and all its mipmap levels.
+   *
+   * The image is scaled to power of 2 dimensions no larger than `maxSize'.
+   * RGBA images are compressed as DXT5, all others as DXT1.
+   *
+   * Returns 0 if the pixel format is not supported.
+   */
+  static IMPORT CompressedImage* compressMipmaps(Image* image,
+                                                 uint maxSize = 2048);
+
+  /**
+   * Sets the directory used for caching compressed images.
+   *
+   * Caching is disabled until a directory is set, and by an empty name.
+   * Relative names are relative to the working directory.  The directory
+   * must exist.
+   */
+  static IMPORT void setCacheDirectory(const char* directory);
+
+  /**
+   * Reads the compressed version of an image file from the cache.
+   *
+   * The cache is keyed by the file Image::locate() finds for `name'.
+   *
+   * Returns 0 if the image is not in the cache, or if the cached copy is
+   * older than the image file.
+   */
+  static IMPORT CompressedImage* readCache(const char* name);
+
+  /**
+   * Stores the compressed version of an image file in the cache.
+   */
+  static IMPORT bool writeCache(const char* name, const CompressedImage&);
+
+  /**
+   * Compresses an image file and stores it in the cache, unless the cache
+   * is already up to date.
+   *
+   * Returns false if the image could not be read or the cache written.
+   */
+  static IMPORT bool precompress(const char* name, uint maxSize = 2048);
+};
+
+#endif // !DXT_H_
+
+// vim: ts=2 sw=2 et
@@ -20,12 +20,24 @@ struct Font
     float t2;
     int   shaderHandle;
     char  shaderName[32];
+
+    // Texture coordinates in the glyph atlas
+    float atlasS1;
+    float atlasT1;
+    float atlasS2;
+    float atlasT2;
   };
 
   Glyph glyphs[256];
   float glyphScale;
   char  name[64];
 
+  /**
+   * Texture holding all glyphs of the font, or 0 if the glyphs could not be
+   * packed.  Created by acquire().
+   */
+  uint  atlas;
+
   static IMPORT Font* acquire(const char* fileName);
 };
 
@@ -4,6 +4,7 @@
 #ifndef SWIG
 #include <stdint.h>
 
+#include "string.h"
 #include "types.h"
 #endif
 
@@ -32,6 +33,15 @@ struct Image
    */
   static IMPORT Image* acquire(const char* fileName);
 
+  /**
+   * Returns the name of the file acquire() would read for `fileName'.
+   *
+   * If `fileName' does not exist, a file with the same base name and a
+   * different extension is looked for.  Returns String::null if no file is
+   * found.
+   */
+  static IMPORT String locate(const char* fileName);
+
   /**
    * Creates an empty image.
    */
@@ -55,9 +65,22 @@ struct Image
 
   /**
    * Scales the image data to the specified resolution.
+   *
+   * A separable tent filter is used, which averages all covered pixels when
+   * reducing.
    */
   IMPORT void resize(uint width, uint height);
 
+  /**
+   * Stores `source' at half its resolution in this image, using a 2x2 box
+   * filter.  Dimensions of 1 are not reduced.
+   *
+   * `source' may be this image.  If `gammaCorrect' is true, color components
+   * of 8 bit images are averaged in linear space.  This keeps mipmaps of
+   * high contrast textures from becoming too dark.
+   */
+  IMPORT void halve(const Image& source, bool gammaCorrect = false);
+
   /**
    * Copies the contents of this image into another previously allocated image.
    *
@@ -66,6 +89,15 @@ struct Image
    */
   IMPORT void copy(const Image&);
 
+  /**
+   * Converts a rectangle of an NV12 image to 8 bit RGB.
+   *
+   * `left' and `width' must be even.  The pixels are written tightly packed
+   * to `output', which must hold width * height * 3 bytes.
+   */
+  IMPORT void convertNV12(uint left, uint top, uint width, uint height,
+                          uint8_t* output) const;
+
   /**
    * Returns the pixel format.
    */
@@ -116,6 +148,14 @@ struct Image
 
   IMPORT void brighten(float factor);
 
+  /**
+   * Writes the image to an uncompressed TGA file.
+   *
+   * Only 8 bit gray, RGB and RGBA images are supported.  Returns false on
+   * failure.
+   */
+  IMPORT bool saveTGA(const char* fileName) const;
+
 #ifndef SWIG
   uint8_t* data()
   {
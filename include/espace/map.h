@@ -167,6 +167,17 @@ struct Map
    */
   virtual bool visible(const Vector3& from, const Vector3& to) const = 0;
 
+  /**
+   * Returns whether any part of an axis aligned box is potentially visible
+   * from a point.
+   *
+   * \param from  The point from which to look.
+   * \param min   Minimum coordinate of box.
+   * \param max   Maximum coordinate of box.
+   */
+  virtual bool visible(const Vector3& from, const Vector3& min,
+                       const Vector3& max) const = 0;
+
 protected:
 
   virtual IMPORT ~Map();
@@ -6,6 +6,8 @@
 #include "types.h"
 #endif
 
+class File;
+
 /**
  * Audio and video stream interface.
  * \author Morten Hustveit
@@ -63,6 +65,17 @@ struct Media
    */
   virtual IMPORT void videoReset();
 
+  /**
+   * Returns which parts of the last frame returned by videoRead() differ
+   * from the frame before it.
+   *
+   * The returned map has one byte for each `blockSize' by `blockSize'
+   * pixel block, row by row, which is nonzero if the block changed.
+   * Returns NULL if this is not known, in which case the whole frame
+   * should be treated as changed.
+   */
+  virtual IMPORT const uint8_t* videoChangedBlocks(uint& blockSize);
+
   // AUDIO
 
   /**
@@ -104,9 +117,20 @@ struct Media
    */
   virtual IMPORT void audioReset();
 
+  /**
+   * Reads the whole file of the stream into memory.
+   *
+   * Archives can only be read by the main thread, so this must be called
+   * before the stream is decoded by any other thread.
+   */
+  IMPORT void readIntoMemory();
+
 protected:
 
+  IMPORT Media();
   virtual IMPORT ~Media();
+
+  File* _file; // The file opened by acquire()
 };
 
 #endif // !MEDIA_H_
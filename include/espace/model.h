@@ -2,6 +2,10 @@
 #define MODEL_H_
 
 #ifndef SWIG
+#include <vector>
+
+#include <stdint.h>
+
 #include "string.h"
 #include "types.h"
 #include "vector.h"
@@ -16,7 +20,8 @@ struct Model
   /**
    * Loads a 3D object and returns a handle for it.
    *
-   * Reference counting is used to avoid duplicate copies.
+   * Reference counting is used to avoid duplicate copies.  A model still
+   * being loaded by acquireAsync() is returned as is, placeholder and all.
    */
   static IMPORT uint acquire(const char* name);
 
@@ -25,6 +30,44 @@ struct Model
    */
   static IMPORT void unacquire(uint);
 
+  /**
+   * Called when a model started by acquireAsync() has been loaded.
+   *
+   * \param handle Handle returned by acquireAsync().
+   * \param success False if the file could not be read, in which case the
+   *        handle keeps referring to the placeholder.
+   * \param data The pointer passed to acquireAsync().
+   */
+  typedef void (*LoadCallback)(uint handle, bool success, void* data);
+
+  /**
+   * Starts loading a model in the background, and returns a handle for it
+   * right away.
+   *
+   * Until the model is loaded, the handle refers to a placeholder: a box
+   * with the bounds of the model.  The file is opened and its bounds read on
+   * the calling thread, the rest is parsed on a loading thread, and update()
+   * finishes the model on the main thread and calls `callback'.  If the
+   * model is already loaded, `callback' is called right away.  If threads
+   * are not supported, this is the same as acquire().
+   *
+   * Returns 0 if the file can't be opened or no plugin handles it.
+   */
+  static IMPORT uint acquireAsync(const char* name, LoadCallback callback = 0,
+                                  void* data = 0);
+
+  /**
+   * Returns true if the model is still being loaded by acquireAsync().
+   */
+  static IMPORT bool isLoading(uint handle);
+
+  /**
+   * Finishes loading the models parsed in the background since the last
+   * call, and calls their callbacks.  It is called by the renderer once per
+   * frame.
+   */
+  static IMPORT void update();
+
   /**
    * Get the model corresponding to a given handle
    *
@@ -32,6 +75,66 @@ struct Model
    */
   static IMPORT Model* modelForHandle(uint handle);
 
+  /**
+   * Interpolates between two frames of vertex data.
+   *
+   * Stores `from' * `backLerp' + `to' * (1 - `backLerp') in `output' for
+   * `count' vectors.  If `normalize' is true, the results are scaled to unit
+   * length, which is what interpolated normals need.  This function does not
+   * touch any shared state, so it may be called from any thread.
+   */
+  static IMPORT void lerpVectors(const Vector3* from, const Vector3* to,
+                                 float backLerp, uint count, Vector3* output,
+                                 bool normalize = false);
+
+  /**
+   * Vertex position and normal in the encoding used by MD3 and MDC files.
+   */
+  struct PackedVertex
+  {
+    int16_t position[3]; /**< Position in units of 1/64 */
+    uint8_t normal[2];   /**< Longitude and latitude in steps of 2 pi / 255 */
+  };
+
+  /**
+   * A frame of packed vertices.
+   *
+   * If `deltas' is not NULL, it holds four bytes per vertex, as in MDC
+   * compressed frames.  The first three, minus 127, are added to the
+   * position in units of 3/64.  The fourth is ignored.
+   */
+  struct PackedFrame
+  {
+    const PackedVertex* vertices;
+    const uint8_t*      deltas;
+  };
+
+  /**
+   * Unpacks `count' vertices of a packed frame.
+   */
+  static IMPORT void unpackVertices(const PackedFrame& frame, uint count,
+                                    Vector3* positions, Vector3* normals);
+
+  /**
+   * Unpacks and interpolates `count' vertices of two packed frames, as by
+   * lerpVectors().  Normals are renormalized.
+   */
+  static IMPORT void lerpPackedVertices(const PackedFrame& from,
+                                        const PackedFrame& to,
+                                        float backLerp, uint count,
+                                        Vector3* positions,
+                                        Vector3* normals);
+
+  /**
+   * Completes loading on the main thread.
+   *
+   * ModelPlugin::read() may be run on a loading thread, so anything that
+   * needs the renderer, like acquiring shaders, is done here.  acquire()
+   * and update() call this once, before the model is used.  The default
+   * implementation does nothing.
+   */
+  virtual IMPORT void finishLoading();
+
   /**
    * Returns the bounding box of the model.
    */
@@ -46,20 +149,104 @@ struct Model
    * \param backLerp How much to interpolate with the previous frame.
    * \param customShader Shader to use instead of the default shader or skin.
    * \param customSkin Skin to use instead of the default shader orskin.
+   * \param projectedRadius Radius of the bounding sphere on screen, relative
+   *        to half the viewport height, for choosing the level of detail.  0
+   *        means full detail.
    */
   virtual IMPORT void render(int frame, float backLerp = 0,
-                      uint customShader = 0, uint customSkin = 0) = 0;
+                      uint customShader = 0, uint customSkin = 0,
+                      float projectedRadius = 0) = 0;
 
   /**
-   * Returns the origin and axis of the specified tag.
+   * Announces that the model will be rendered with the specified frame,
+   * backLerp and projectedRadius.
    *
-   * \todo Details?
+   * The renderer calls this for every visible entity before drawing any of
+   * them, so that models can compute their vertices in the background.  The
+   * default implementation does nothing.
    */
-  virtual IMPORT int tag(const char* name, Vector3& origin, Vector3 axis[3], int startIndex);
+  virtual IMPORT void prepare(int frame, float backLerp,
+                              float projectedRadius = 0);
+
+  /**
+   * Interpolates a tag transform, stored as an origin followed by its three
+   * axes, as by lerpVectors().  The axes are renormalized.
+   */
+  static IMPORT void lerpTag(const Vector3* from, const Vector3* to,
+                             float backLerp, Vector3& origin,
+                             Vector3 axis[3]);
+
+  /**
+   * Returns the id of the first tag named `name' at or after `startIndex',
+   * or -1 if there is no such tag.
+   *
+   * Ids are small integers that stay valid for the life of the model, so
+   * callers should look tags up once and query them with tag(int, ...).
+   * The default implementation returns -1.
+   */
+  virtual IMPORT int tagId(const char* name, int startIndex = 0);
+
+  /**
+   * Returns the origin and axis of a tag at the specified frame and
+   * backLerp, interpolated the same way as render() interpolates vertices.
+   *
+   * Results are remembered for the last few poses of each tag, so querying
+   * the same pose again is cheap.  Returns false if `id' is not a valid tag
+   * id.  The default implementation always returns false.
+   */
+  virtual IMPORT bool tag(int id, int frame, float backLerp, Vector3& origin,
+                          Vector3 axis[3]);
+
+  /**
+   * Returns the origin and axis of the specified tag at the first frame.
+   *
+   * \return The id of the tag, or -1 if it was not found.
+   */
+  IMPORT int tag(const char* name, Vector3& origin, Vector3 axis[3],
+                 int startIndex);
 
 protected:
 
   virtual IMPORT ~Model();
+
+#ifndef SWIG
+  /**
+   * Tag transforms memoised by tag id, frame and backLerp.
+   *
+   * Each tag remembers the last few poses it was queried in, replacing them
+   * in turn, so attaching several models to one tag of an entity, or to
+   * entities animated in step, interpolates the tag once.
+   */
+  class IMPORT TagCache
+  {
+  public:
+
+    void resize(uint tagCount);
+
+    /**
+     * Looks up a tag transform, returning false unless it is cached.
+     */
+    bool find(uint id, int frame, float backLerp, Vector3& origin,
+              Vector3 axis[3]) const;
+
+    void add(uint id, int frame, float backLerp, const Vector3& origin,
+             const Vector3 axis[3]);
+
+  protected:
+
+    enum { ways = 4 }; // Poses remembered per tag
+
+    struct Entry
+    {
+      int     frame;
+      float   backLerp;
+      Vector3 transform[4]; // Origin and axes
+    };
+
+    std::vector<Entry> entries;     // `ways' entries per tag
+    std::vector<uint>  nextEntries; // Entry to replace next, per tag
+  };
+#endif // !SWIG
 };
 
 #endif // !MODEL_H_
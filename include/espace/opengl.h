@@ -3,6 +3,8 @@
 
 #include <set>
 
+#include <stddef.h>
+
 #include "string.h"
 #include "types.h"
 
@@ -79,6 +81,7 @@ struct GLConfig
   int   smp;
 
   int   textureFilterAnisotropicSupport;
+  int   pixelBufferObjectSupport;
 
   std::set<String> extensions;
 };
@@ -105,6 +108,7 @@ struct GL
   typedef float          GLclampf;
   typedef double         GLdouble;
   typedef double         GLclampd;
+  typedef ptrdiff_t      GLsizeiptrARB;
 
 #ifdef WIN32
 #  define APIENTRY __stdcall
@@ -744,6 +748,18 @@ struct GL
   typedef void (APIENTRY *glEndOcclusionQueryNV)(void);
   typedef void (APIENTRY *glGetOcclusionQueryivNV)(GLuint id, GLenum pname, GLint *params);
   typedef void (APIENTRY *glGetOcclusionQueryuivNV)(GLuint id, GLenum pname, GLuint *params);
+  typedef void (APIENTRY *glCompressedTexImage2DARB)(GLenum target, GLint level,
+                                            GLenum internalformat,
+                                            GLsizei width, GLsizei height,
+                                            GLint border, GLsizei imageSize,
+                                            const GLvoid *data);
+  typedef void (APIENTRY *glBindBufferARB)(GLenum target, GLuint buffer);
+  typedef void (APIENTRY *glDeleteBuffersARB)(GLsizei n, const GLuint *buffers);
+  typedef void (APIENTRY *glGenBuffersARB)(GLsizei n, GLuint *buffers);
+  typedef void (APIENTRY *glBufferDataARB)(GLenum target, GLsizeiptrARB size,
+                                           const GLvoid *data, GLenum usage);
+  typedef GLvoid* (APIENTRY *glMapBufferARB)(GLenum target, GLenum access);
+  typedef GLboolean (APIENTRY *glUnmapBufferARB)(GLenum target);
 
   static IMPORT glClearIndex                  clearIndex;
   static IMPORT glClearColor                  clearColor;
@@ -1216,6 +1232,13 @@ struct GL
   static IMPORT glEndOcclusionQueryNV         endOcclusionQueryNV;
   static IMPORT glGetOcclusionQueryivNV       getOcclusionQueryivNV;
   static IMPORT glGetOcclusionQueryuivNV      getOcclusionQueryuivNV;
+  static IMPORT glCompressedTexImage2DARB     compressedTexImage2DARB;
+  static IMPORT glBindBufferARB               bindBufferARB;
+  static IMPORT glDeleteBuffersARB            deleteBuffersARB;
+  static IMPORT glGenBuffersARB               genBuffersARB;
+  static IMPORT glBufferDataARB               bufferDataARB;
+  static IMPORT glMapBufferARB                mapBufferARB;
+  static IMPORT glUnmapBufferARB              unmapBufferARB;
 
   enum
   {
@@ -1901,6 +1924,14 @@ struct GL
     ACTIVE_TEXTURE_ARB = 0x84E0,
     CLIENT_ACTIVE_TEXTURE_ARB = 0x84E1,
     MAX_TEXTURE_UNITS_ARB = 0x84E2,
+    ARB_TEXTURE_COMPRESSION = 1,
+    TEXTURE_COMPRESSED_IMAGE_SIZE_ARB = 0x86A0,
+    TEXTURE_COMPRESSED_ARB = 0x86A1,
+    EXT_TEXTURE_COMPRESSION_S3TC = 1,
+    COMPRESSED_RGB_S3TC_DXT1_EXT = 0x83F0,
+    COMPRESSED_RGBA_S3TC_DXT1_EXT = 0x83F1,
+    COMPRESSED_RGBA_S3TC_DXT3_EXT = 0x83F2,
+    COMPRESSED_RGBA_S3TC_DXT5_EXT = 0x83F3,
     EXT_ABGR = 1,
     ABGR_EXT = 0x8000,
     EXT_BLEND_COLOR = 1,
@@ -1966,6 +1997,9 @@ struct GL
     EDGE_FLAG_ARRAY_POINTER_EXT = 0x8093,
     SGIS_TEXTURE_EDGE_CLAMP = 1,
     CLAMP_TO_EDGE_SGIS = 0x812F,
+    SGIS_GENERATE_MIPMAP = 1,
+    GENERATE_MIPMAP_SGIS = 0x8191,
+    GENERATE_MIPMAP_HINT_SGIS = 0x8192,
     EXT_BLEND_MINMAX = 1,
     FUNC_ADD_EXT = 0x8006,
     MIN_EXT = 0x8007,
@@ -2042,7 +2076,13 @@ struct GL
     PIXEL_COUNTER_BITS_NV = 0x8864,
     CURRENT_OCCLUSION_QUERY_ID_NV = 0x8865,
     PIXEL_COUNT_NV = 0x8866,
-    PIXEL_COUNT_AVAILABLE_NV = 0x8867
+    PIXEL_COUNT_AVAILABLE_NV = 0x8867,
+    STREAM_DRAW_ARB = 0x88E0,
+    STREAM_READ_ARB = 0x88E1,
+    READ_ONLY_ARB = 0x88B8,
+    WRITE_ONLY_ARB = 0x88B9,
+    PIXEL_PACK_BUFFER_ARB = 0x88EB,
+    PIXEL_UNPACK_BUFFER_ARB = 0x88EC
   };
 
 protected:
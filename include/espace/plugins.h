@@ -31,6 +31,7 @@ struct Media;
 struct Map;
 struct Shader;
 struct Font;
+struct Vector3;
 
 struct ArchivePlugin;
 struct ImagePlugin;
@@ -134,9 +135,24 @@ struct ModelPlugin : public Plugin
 
   /**
    * Open a Model file with the given name.
+   *
+   * This may be called from a loading thread, so anything that needs the
+   * renderer, like acquiring shaders, must be left for
+   * Model::finishLoading().
+   *
    * \return A pointer to the Model object on success, NULL on failure.
    */
   virtual IMPORT Model* read(File& file) = 0;
+
+  /**
+   * Reads the bounding box of a model without reading the rest of it.
+   *
+   * Used for the placeholder of a model loaded in the background.  The
+   * default implementation returns false.
+   *
+   * \return True on success.
+   */
+  virtual IMPORT bool readBounds(File& file, Vector3& mins, Vector3& maxs);
 };
 
 /**
@@ -24,6 +24,18 @@ public:
    */
   Preprocessor(const char* fileName);
 
+  /**
+   * Opens a part of a file for preprocessing.
+   *
+   * Lines are read until the end of the line containing the last byte of
+   * the range.  Symbols #define'd before the range are defined in it.
+   *
+   * \param filename The file to preprocess.
+   * \param offset   Byte offset of the first line to read.
+   * \param length   Length of the range, in bytes.
+   */
+  Preprocessor(const char* fileName, uint offset, uint length);
+
   /**
    * Destroys a preprocessor object.
    */
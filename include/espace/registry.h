@@ -0,0 +1,325 @@
+#ifndef REGISTRY_H_
+#define REGISTRY_H_
+
+#ifndef SWIG
+#include <vector>
+
+#include "string.h"
+#include "types.h"
+#endif
+
+#ifndef SWIG
+/**
+ * Type independent part of Registry.
+ *
+ * All registries add themselves to a global list, so that their statistics
+ * can be listed.
+ */
+class IMPORT RegistryBase
+{
+public:
+
+  RegistryBase(const char* type);
+  virtual ~RegistryBase();
+
+  /**
+   * Returns the name of the type of asset held, in plural.
+   */
+  const char* type() const
+  {
+    return typeName;
+  }
+
+  /**
+   * Returns the number of entries.
+   */
+  virtual uint count() const = 0;
+
+  /**
+   * Returns the number of bytes used by the handle table and name index.
+   */
+  virtual uint indexBytes() const = 0;
+
+  /**
+   * Returns the number of bytes used by the assets themselves, or 0 if
+   * unknown.
+   */
+  virtual uint dataBytes() const = 0;
+
+  /**
+   * Returns all registries created.
+   */
+  static const std::vector<RegistryBase*>& registries();
+
+protected:
+
+  static uint hash(const char* name);
+
+  const char* typeName;
+};
+
+/**
+ * Assets by handle and by name.
+ *
+ * Handles index a table directly, and names are found through a hash table
+ * chained through the entries, so acquiring, looking up and releasing an
+ * asset takes constant time.
+ *
+ * Handles are allocated by the registry and are never 0.  Names chosen by
+ * other libraries, like OpenGL texture names, are opaque and may be huge, so
+ * they belong in the value, not in the handle.  The slots of removed assets
+ * are reused, but the low bits of a handle hold the slot and the high bits
+ * hold a generation counted per slot, so a stale handle is not mistaken for
+ * a newer asset until its slot has been reused 2048 times.
+ *
+ * \author Morten Hustveit
+ */
+template<typename T>
+class Registry : public RegistryBase
+{
+public:
+
+  typedef uint (*SizeFunction)(const T&);
+
+  /**
+   * \param type Name of the type of asset held, in plural.
+   * \param sizeOf Function returning the bytes used by an asset, if known.
+   */
+  Registry(const char* type, SizeFunction sizeOf = 0)
+    : RegistryBase(type),
+      entries(1),
+      buckets(64, 0),
+      usedCount(0),
+      freeSlot(0),
+      sizeOf(sizeOf)
+  {
+  }
+
+  /**
+   * Returns the handle of the asset with the specified name, or 0 if it is
+   * not registered.
+   */
+  uint find(const char* name) const
+  {
+    uint slot = buckets[hash(name) & (buckets.size() - 1)];
+
+    while(slot && entries[slot].name != name)
+      slot = entries[slot].next;
+
+    if(!slot)
+      return 0;
+
+    return handleOf(slot);
+  }
+
+  /**
+   * Registers an asset under a new handle, and returns the handle.
+   *
+   * An asset registered earlier with the same name can no longer be found
+   * by name, but keeps its handle.
+   */
+  uint add(const String& name, const T& value)
+  {
+    uint slot = freeSlot;
+
+    if(slot)
+    {
+      freeSlot = entries[slot].next;
+
+      entries[slot].next = 0;
+    }
+    else
+    {
+      slot = entries.size();
+
+      entries.resize(slot + 1);
+    }
+
+    Entry& entry = entries[slot];
+
+    uint previous = find(name);
+
+    if(previous)
+      unlink(previous & SlotMask);
+
+    entry.name = name;
+    entry.value = value;
+    entry.used = true;
+
+    ++usedCount;
+
+    if(usedCount > buckets.size())
+      rehash(buckets.size() * 2);
+
+    link(slot);
+
+    return handleOf(slot);
+  }
+
+  /**
+   * Returns the asset with the specified handle, or 0 if the handle is
+   * invalid.
+   *
+   * The pointer is valid until the next asset is added.
+   */
+  T* get(uint handle)
+  {
+    uint slot = slotOf(handle);
+
+    if(!slot)
+      return 0;
+
+    return &entries[slot].value;
+  }
+
+  /**
+   * Unregisters the asset with the specified handle.
+   */
+  void remove(uint handle)
+  {
+    uint slot = slotOf(handle);
+
+    if(!slot)
+      return;
+
+    Entry& entry = entries[slot];
+
+    if(entry.linked)
+      unlink(slot);
+
+    entry.name = String::null;
+    entry.value = T();
+    entry.used = false;
+    entry.generation = (entry.generation + 1) & GenerationMask;
+    entry.next = freeSlot;
+
+    freeSlot = slot;
+
+    --usedCount;
+  }
+
+  uint count() const
+  {
+    return usedCount;
+  }
+
+  uint indexBytes() const
+  {
+    uint bytes = entries.capacity() * sizeof(Entry)
+               + buckets.capacity() * sizeof(uint);
+
+    for(uint i = 1; i < entries.size(); ++i)
+      bytes += entries[i].name.length();
+
+    return bytes;
+  }
+
+  uint dataBytes() const
+  {
+    if(!sizeOf)
+      return 0;
+
+    uint bytes = 0;
+
+    for(uint i = 1; i < entries.size(); ++i)
+    {
+      if(entries[i].used)
+        bytes += sizeOf(entries[i].value);
+    }
+
+    return bytes;
+  }
+
+protected:
+
+  enum
+  {
+    SlotBits = 20,
+    SlotMask = (1 << SlotBits) - 1,
+    GenerationMask = (1 << (31 - SlotBits)) - 1 // Handles fit in an int
+  };
+
+  struct Entry
+  {
+    Entry()
+      : value(),
+        next(0),
+        generation(0),
+        used(false),
+        linked(false)
+    {
+    }
+
+    String name;
+    T      value;
+    uint   next;       // Next slot in the same hash bucket or the free list
+    uint   generation; // Incremented each time the slot is freed
+    bool   used;
+    bool   linked;     // Whether the entry can be found by name
+  };
+
+  uint handleOf(uint slot) const
+  {
+    return (entries[slot].generation << SlotBits) | slot;
+  }
+
+  /**
+   * Returns the slot of a handle, or 0 if the handle is invalid or stale.
+   */
+  uint slotOf(uint handle) const
+  {
+    uint slot = handle & SlotMask;
+
+    if(!slot || slot >= entries.size() || !entries[slot].used
+    || entries[slot].generation != (handle >> SlotBits))
+      return 0;
+
+    return slot;
+  }
+
+  void link(uint slot)
+  {
+    Entry& entry = entries[slot];
+    uint& bucket = buckets[hash(entry.name) & (buckets.size() - 1)];
+
+    entry.next = bucket;
+    entry.linked = true;
+    bucket = slot;
+  }
+
+  void unlink(uint slot)
+  {
+    Entry& entry = entries[slot];
+    uint* link = &buckets[hash(entry.name) & (buckets.size() - 1)];
+
+    while(*link != slot)
+      link = &entries[*link].next;
+
+    *link = entry.next;
+
+    entry.next = 0;
+    entry.linked = false;
+  }
+
+  void rehash(uint bucketCount)
+  {
+    buckets.assign(bucketCount, 0);
+
+    for(uint i = 1; i < entries.size(); ++i)
+    {
+      if(entries[i].linked)
+        link(i);
+    }
+  }
+
+  std::vector<Entry> entries; // Indexed by slot
+  std::vector<uint>  buckets; // First slot in each bucket, or 0
+  uint               usedCount;
+  uint               freeSlot; // First free slot, or 0
+  SizeFunction       sizeOf;
+};
+#endif // !SWIG
+
+#endif // !REGISTRY_H_
+
+// vim: ts=2 sw=2 et
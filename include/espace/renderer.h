@@ -252,10 +252,20 @@ struct Renderer
     EnvMode_Modulate,
     EnvMode_Decal,
     EnvMode_Blend,
-    EnvMode_Replace
+    EnvMode_Replace,
+    EnvMode_Add      /**< Requires GL_ARB_texture_env_add */
   };
 
-  static IMPORT void setTexEnvMode(EnvMode mode);
+  /**
+   * Sets the texture environment mode of a texture unit.
+   */
+  static IMPORT void setTexEnvMode(EnvMode mode, uint level = 0);
+
+  /**
+   * Loads a column-major 4x4 texture coordinate matrix for a texture unit.
+   * Passing NULL restores the identity matrix.
+   */
+  static IMPORT void setTextureMatrix(const float* matrix, uint level = 0);
 
   /**
    * Enter 2D rendering mode.
@@ -267,9 +277,22 @@ struct Renderer
 
   /**
    * Undo a call to set2DMode().
+   *
+   * Any pending 2D quads are drawn first.
    */
   static IMPORT void set3DMode();
 
+  /**
+   * Draw all pending 2D quads.
+   *
+   * drawQuad2D() and put() collect quads sharing the same shader or texture
+   * and blend state, and draw them with a single call per shader pass.
+   * The batch is drawn when the state changes, by set3DMode(),
+   * updateScreen() and by all other drawing functions.  Call this before
+   * modifying OpenGL state directly in 2D mode.
+   */
+  static IMPORT void flush2D();
+
   // Synchronous rendering
 
   /**
@@ -360,6 +383,14 @@ struct Renderer
   static IMPORT void drawTriangles(uint triangleCount, const uint* indexes,
                                    Skin*, const char* surfaceName);
 
+  /**
+   * Draw a triangle list using the specified skin and surface index.
+   *
+   * \see Skin::surfaceIndex()
+   */
+  static IMPORT void drawTriangles(uint triangleCount, const uint* indexes,
+                                   Skin*, int surface);
+
   // Matrix functions
 
   /**
@@ -405,6 +436,16 @@ struct Renderer
 
   // Vertex arrays
 
+  /**
+   * Returns storage for `count' vectors, valid until the next call to
+   * updateScreen().
+   *
+   * Models use this for interpolated vertices, so that rendering does not
+   * modify the models themselves.  Must only be called from the rendering
+   * thread.
+   */
+  static IMPORT Vector3* frameVectors(uint count);
+
   static IMPORT void setVertexArray(const void* vertices, uint stride = 0);
 
   static IMPORT void setColorArray(const void* colors, uint stride = 0);
@@ -503,6 +544,14 @@ struct Renderer
    */
   static IMPORT void popScene();
 
+  /**
+   * Returns the number of heap allocations made for scene objects so far.
+   *
+   * Scene storage is reused between frames, so this only increases when a
+   * scene grows larger than any scene before it.
+   */
+  static IMPORT uint sceneAllocations();
+
   /**
    * Renders the current scene.
    *
@@ -511,6 +560,62 @@ struct Renderer
    *                   such model.
    */
   static IMPORT void renderScene(const RefDef& refdef, Map* worldModel = 0);
+
+  /**
+   * Returns the number of model entities drawn and culled by the last call
+   * to renderScene().
+   *
+   * Entities are culled against the view frustum and the potentially
+   * visible set of the world model, unless the cvar r_nocull is set.
+   */
+  static IMPORT void entityStatistics(uint& drawn, uint& culled);
+
+  /**
+   * Returns the number of texture binds issued through setTexture() during
+   * the last frame, i.e. between the last two calls to updateScreen().
+   */
+  static IMPORT uint textureBinds();
+
+  /**
+   * Returns the number of rendering passes saved during the last frame by
+   * shaders that draw several stages in one multitexture pass.
+   */
+  static IMPORT uint passesSaved();
+
+  // Frame capture
+
+  /**
+   * Saves the next frame to a TGA file.
+   *
+   * The frame is read back by updateScreen(), into a ring of pixel buffer
+   * objects if they are supported, and encoded and written by a background
+   * thread a few frames later.
+   */
+  static IMPORT void screenshot(const char* fileName);
+
+  /**
+   * Saves every `interval'th frame to a numbered sequence of TGA files.
+   *
+   * The files are named `baseName' followed by a four digit sequence number
+   * and ".tga".  Frames are captured as by screenshot().
+   */
+  static IMPORT void startCapture(const char* baseName, uint interval = 1);
+
+  /**
+   * Stops capturing frames.  Frames already read back are still written.
+   */
+  static IMPORT void stopCapture();
+
+protected:
+
+  friend class System;
+
+  static void captureFrame();
+
+  /**
+   * Writes all frames read back so far, and stops the capture thread.
+   */
+  static void finishCapture();
 };
 
 #endif // !RENDERER_H_
@@ -64,6 +64,7 @@ struct Shader
   virtual IMPORT Renderer::Face cullFace() const = 0;
 
   uint refCount;
+  int  handle;   // Set by acquire()
 
   enum WaveForm
   {
@@ -84,6 +85,38 @@ struct Shader
     AutoSprite2
   };
 
+  /**
+   * Parameters of a vertex deformation.
+   *
+   * Wave, Normal and Move deformations use the waveform parameters.  The
+   * spread is the phase change per unit of distance, for waves that travel
+   * across a surface.
+   */
+  struct Deform
+  {
+    VertexDeform type;
+    WaveForm     wave;
+    float        base;
+    float        amplitude;
+    float        phase;
+    float        frequency;
+    float        spread;
+    float        bulgeWidth;
+    float        bulgeHeight;
+    float        bulgeSpeed;
+    Vector3      direction;
+  };
+
+  /**
+   * Returns the number of vertex deformations applied before drawing.
+   */
+  virtual IMPORT uint deformCount() const;
+
+  /**
+   * Returns the vertex deformations, in the order they are applied.
+   */
+  virtual IMPORT const Deform* deforms() const;
+
   enum Sort
   {
     Portal =     (1 << 24),
@@ -105,12 +138,32 @@ struct Shader
 
   static IMPORT float time;
 
+  /**
+   * Number of rendering passes saved by drawing several shader stages in
+   * a single multitexture pass.  Shader plugins add to this whenever they
+   * push the state of such a pass; reset it to measure a single frame.
+   */
+  static IMPORT uint passesSaved;
+
+  /**
+   * Evaluates a waveform, clamped to [0, 1].
+   *
+   * The waveforms are sampled from precomputed tables with 1024 entries
+   * per period.
+   */
   static IMPORT float wave(WaveForm wave, float base, float amp, float phase, float freq, float time);
 
+  static const uint waveTableSize = 1024;
+
+  /**
+   * Returns one period of a waveform, sampled at waveTableSize points, in
+   * the range [-1, 1] for Sin and Square and [0, 1] for the others.
+   */
+  static IMPORT const float* waveTable(WaveForm wave);
+
   // This have to go
 
   static IMPORT bool      st_withAlpha;
-  static IMPORT bool      st_tcMod;
   static IMPORT Color     st_entityColor;
 #endif // !SWIG
 };
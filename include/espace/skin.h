@@ -2,10 +2,14 @@
 #define SKIN_H_
 
 #ifndef SWIG
+#include <vector>
+
 #include "string.h"
 #include "types.h"
 #endif // !SWIG
 
+class Shader;
+
 /**
  * Skin interface.
  *
@@ -35,6 +39,24 @@ public:
 #ifndef SWIG
   void pushState(const char* surfaceName);
 
+  /**
+   * Sets up the render state for a surface index returned by
+   * surfaceIndex().  Does nothing for -1.
+   */
+  void pushState(int surface);
+
+  /**
+   * Returns the index of the texture of the named surface, or -1 if the
+   * skin does not have one.
+   */
+  int surfaceIndex(const char* surfaceName) const;
+
+  /**
+   * Returns the shader named for a surface index returned by
+   * surfaceIndex(), if it deforms vertices, and 0 otherwise.
+   */
+  Shader* deformShader(int surface) const;
+
   String name;
 
   struct Handle
@@ -58,6 +80,46 @@ protected:
 #endif // !SWIG
 };
 
+#ifndef SWIG
+/**
+ * The skin surfaces of a model's surfaces, resolved once for each skin the
+ * model is drawn with, so that drawing needs no name lookups.
+ *
+ * \author Morten Hustveit
+ */
+class IMPORT SkinBindings
+{
+public:
+
+  /**
+   * Adds a model surface.  Must be called in the order of the surfaces,
+   * before resolve().
+   */
+  void addSurface(const char* name);
+
+  /**
+   * Returns the skin surface index of each model surface, as returned by
+   * Skin::surfaceIndex().
+   *
+   * \param handle Handle of the skin.
+   * \param skin The skin for the handle.
+   */
+  const int* resolve(uint handle, Skin* skin);
+
+protected:
+
+  struct Binding
+  {
+    uint             handle;
+    Skin*            skin;
+    std::vector<int> surfaces;
+  };
+
+  std::vector<String>  names;
+  std::vector<Binding> bindings;
+};
+#endif // !SWIG
+
 #endif // !SKIN_H_
 
 // vim: ts=2 sw=2 et
@@ -2,8 +2,11 @@
 #define SOUND_H_
 
 #ifndef SWIG
+#include <vector>
+
 #include "types.h"
 #include "media.h"
+#include "string.h"
 #include "vector.h"
 #endif
 
@@ -68,6 +71,33 @@ public:
    */
   static void unacquire(Sound* sound);
 
+#ifndef SWIG
+  /**
+   * How a sound was decoded by acquire().
+   */
+  struct DecodeStatistics
+  {
+    String name;
+    uint   samples;
+    uint   bufferBytes; /**< Size of the decoding buffer */
+    uint   growCount;   /**< Times the buffer was too small */
+    double seconds;     /**< Time spent decoding */
+  };
+
+  /**
+   * Returns the statistics of the last decode of every sound decoded since
+   * startup, in the order they were first decoded.
+   */
+  static const std::vector<DecodeStatistics>& decodeStatistics();
+#endif // !SWIG
+
+  /**
+   * Returns the number of media streams playing, and the number of times
+   * since startup that a stream ran out of decoded audio before the
+   * streaming thread refilled it.
+   */
+  static void streamStatistics(uint& streams, uint& underruns);
+
   /**
    * Sets the position of the listener.
    */
@@ -100,10 +130,16 @@ protected:
 
   static void idle();
 
+  /**
+   * Stops all media streams and the streaming thread.
+   */
+  static void shutdown();
+
   Sound();
   ~Sound();
 
-  uint handle;
+  uint handle;         // OpenAL buffer name
+  uint registryHandle; // Returned by acquireHandle()
   uint refCount;
 };
 
@@ -161,21 +197,34 @@ public:
 
   /**
    * Plays a Media stream.
+   *
+   * The stream is decoded ahead of playback by a separate thread, into a
+   * ring of s_streambuffers buffers of s_streambuffersize samples each.
+   * The media is read into memory first.  It must not be used by anything
+   * else until stop() is called.
    */
   void play(Media*, bool loop = false);
 
   /**
    * Enqueues a sound for playback.
+   *
+   * A Media stream playing on this source is stopped first.
    */
   void enqueue(const Sound*, bool loop = false);
 
   /**
    * Stops playback.
+   *
+   * If a Media stream is playing, this waits for the streaming thread to
+   * let go of it.
    */
   void stop();
 
   /**
    * Returns true if, and only if, the stream is not currently playing.
+   *
+   * A Media stream counts as playing until the streaming thread has played
+   * all of it, even while its source waits for buffers.
    */
   bool isStopped();
 
@@ -185,6 +234,10 @@ protected:
   {
     uint refCount;
     uint handle;
+    bool streaming; // Played a Media stream since the last stop()
+
+    // Set by the streaming thread when the stream has been played to the end
+    volatile bool streamPlayed;
   };
 
   DataProxy* data;
@@ -58,6 +58,71 @@ struct System
    */
   static IMPORT void dlclose(void* handle);
 
+  /**
+   * Start a new thread.
+   * \param function Function to run in the new thread.
+   * \param argument Argument passed to `function'.
+   * \return Thread handle, or NULL if threads are not supported.
+   */
+  static IMPORT void* createThread(void (*function)(void*), void* argument);
+  /**
+   * Wait for a thread to return, and release its handle.
+   * \param thread Thread handle.
+   */
+  static IMPORT void joinThread(void* thread);
+  /**
+   * Create a mutex.
+   * \return Mutex handle.
+   */
+  static IMPORT void* createMutex();
+  /**
+   * Destroy a mutex.  It must not be locked.
+   * \param mutex Mutex handle.
+   */
+  static IMPORT void destroyMutex(void* mutex);
+  /**
+   * Lock a mutex, waiting for other threads to unlock it first.
+   * \param mutex Mutex handle.
+   */
+  static IMPORT void lockMutex(void* mutex);
+  /**
+   * Unlock a mutex locked by the calling thread.
+   * \param mutex Mutex handle.
+   */
+  static IMPORT void unlockMutex(void* mutex);
+  /**
+   * Create a counting semaphore.
+   * \param value Initial value.
+   * \return Semaphore handle.
+   */
+  static IMPORT void* createSemaphore(uint value = 0);
+  /**
+   * Destroy a semaphore.  No threads may be waiting for it.
+   * \param semaphore Semaphore handle.
+   */
+  static IMPORT void destroySemaphore(void* semaphore);
+  /**
+   * Wait until the value of a semaphore is positive, then decrement it.
+   * \param semaphore Semaphore handle.
+   */
+  static IMPORT void waitSemaphore(void* semaphore);
+  /**
+   * Increment the value of a semaphore, waking a waiting thread.
+   * \param semaphore Semaphore handle.
+   */
+  static IMPORT void postSemaphore(void* semaphore);
+  /**
+   * Suspend the calling thread.
+   * \param milliseconds Time to sleep, at least.
+   */
+  static IMPORT void sleep(uint milliseconds);
+  /**
+   * Make sure memory accesses before the call are seen by other threads
+   * before those after it.  Needed for data shared between threads without
+   * a mutex.
+   */
+  static IMPORT void memoryBarrier();
+
 protected:
 
   friend class Renderer;
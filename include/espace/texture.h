@@ -2,6 +2,8 @@
 #define TEXTURE_H
 
 #ifndef SWIG
+#include <stdint.h>
+
 #include "types.h"
 #endif
 
@@ -61,6 +63,62 @@ struct Texture
    * \see acquire()
    */
   static IMPORT void unacquire(uint handle);
+
+  /**
+   * Uploads a video frame to a texture, converting NV12 frames to RGB.
+   *
+   * If `handle' is zero, a texture is created with the frame's dimensions
+   * rounded up to powers of 2, and the frame is stored in its upper left
+   * corner.  Otherwise only the blocks marked in `changedBlocks' are
+   * uploaded to the given texture.
+   *
+   * Returns the texture handle.
+   *
+   * \see Media::videoChangedBlocks()
+   */
+  static IMPORT uint uploadVideo(uint handle, const Image& frame,
+                                 const uint8_t* changedBlocks = 0,
+                                 uint blockSize = 0);
+
+  /**
+   * Uploads the planes of an NV12 video frame without converting them, for
+   * rendering paths that convert to RGB in a fragment program.
+   *
+   * `luma' receives Y as a luminance texture.  `chroma' receives Cb and Cr
+   * as the luminance and alpha of a texture of half the resolution.
+   * Textures are created and updated as by uploadVideo().
+   */
+  static IMPORT void uploadVideoPlanes(uint& luma, uint& chroma,
+                                       const Image& frame,
+                                       const uint8_t* changedBlocks = 0,
+                                       uint blockSize = 0);
+
+  /**
+   * Uploads textures decoded in the background since the last call.
+   *
+   * When r_streamtextures is set, acquire() returns a handle to a
+   * placeholder and decodes the image in a separate thread.  This function
+   * uploads the decoded images, smallest mipmap level first, until
+   * r_texturebudget kilobytes have been uploaded.  It is called by the
+   * renderer once per frame.
+   */
+  static IMPORT void update();
+
+  /**
+   * Returns the number of textures waiting to be decoded and waiting to be
+   * uploaded, and the number of bytes uploaded by the last update().
+   */
+  static IMPORT void streamStatistics(uint& decoding, uint& uploading,
+                                      uint& uploadedBytes);
+
+protected:
+
+  friend class System;
+
+  /**
+   * Stops the decoding thread, and frees the textures still being streamed.
+   */
+  static void shutdown();
 };
 
 #endif // !TEXTURE_H
@@ -49,6 +49,8 @@ Media* Media::acquire(const char* _name)
       if(!media)
         continue;
 
+      media->_file = file;
+
       return media;
     }
   }
@@ -65,10 +67,21 @@ void Media::unacquire(Media* media)
   delete media;
 }
 
+Media::Media()
+  : _file(0)
+{
+}
+
 Media::~Media()
 {
 }
 
+void Media::readIntoMemory()
+{
+  if(_file)
+    _file->data();
+}
+
 Image& Media::videoRead()
 {
   return *static_cast<Image*>(0);
@@ -92,6 +105,11 @@ void Media::videoReset()
 {
 }
 
+const uint8_t* Media::videoChangedBlocks(uint&)
+{
+  return 0;
+}
+
 uint Media::audioLength()
 {
   return 0;
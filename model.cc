@@ -14,9 +14,18 @@
  *                                                                         *
  ***************************************************************************/
 
+#include <algorithm>
+#include <deque>
 #include <map>
 #include <vector>
 
+#include <math.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <espace/color.h>
 #include <espace/file.h>
 #include <espace/map.h>
@@ -24,47 +33,134 @@
 #include <espace/output.h>
 #include <espace/plugins.h>
 #include <espace/predicates.h>
+#include <espace/registry.h>
+#include <espace/renderer.h>
+#include <espace/shader.h>
 #include <espace/string.h>
+#include <espace/system.h>
 
 namespace
 {
+  struct Load;
+
   struct ModelHandle
   {
     ModelHandle()
-      : refCount(1)
+      : refCount(1),
+        load(0)
     {
     }
 
-    String name;
     uint   refCount;
     Model* model;
+    Load*  load;     // While loaded by acquireAsync()
   };
 
-  std::map<uint, ModelHandle> handles;
-  uint                        nextHandle = 1;
-}
+  Registry<ModelHandle> handles("Models");
 
-uint Model::acquire(const char* _name)
-{
-  if(!_name)
-    return 0;
+  typedef std::vector<std::pair<Model::LoadCallback, void*> > Callbacks;
 
-  String name = String(_name).replace('\\', '/');
+  /**
+   * A model being loaded in the background.
+   *
+   * As with streamed textures, the file is read into memory by the main
+   * thread, since archives can't be accessed from several threads.  The
+   * loading thread only parses the memory.
+   */
+  struct Load
+  {
+    String       name;
+    uint         handle;
+    File*        file;
+    ModelPlugin* plugin;
+    Callbacks    callbacks;
+    bool         cancelled; // Unacquired while loading
+
+    Model*       model;     // Written by the loading thread
+  };
+
+  void* loadThread = 0;
+  bool  loadingFailed = false;
+
+  // Guards loadQueue and loadedQueue.  loadSemaphore counts the entries of
+  // loadQueue.
+  void* queueMutex;
+  void* loadSemaphore;
+
+  std::deque<Load*> loadQueue;
+  std::deque<Load*> loadedQueue;
 
-  for(std::map<uint, ModelHandle>::iterator i = handles.begin(); i != handles.end(); ++i)
+  void loadLoop(void*)
   {
-    if(i->second.name == name)
+    for(;;)
     {
-      ++i->second.refCount;
+      System::waitSemaphore(loadSemaphore);
+
+      System::lockMutex(queueMutex);
+
+      Load* load = loadQueue.front();
+
+      loadQueue.pop_front();
+
+      System::unlockMutex(queueMutex);
 
-      return i->first;
+      load->model = load->plugin->read(*load->file);
+
+      System::lockMutex(queueMutex);
+
+      loadedQueue.push_back(load);
+
+      System::unlockMutex(queueMutex);
     }
   }
 
-  File file(name);
+  /**
+   * Starts the loading thread, unless it is already running.
+   *
+   * Returns false if threads are not supported.
+   */
+  bool startLoading()
+  {
+    if(loadThread)
+      return true;
+
+    if(loadingFailed)
+      return false;
+
+    queueMutex = System::createMutex();
+    loadSemaphore = System::createSemaphore();
+
+    loadThread = System::createThread(loadLoop, 0);
+
+    if(!loadThread)
+    {
+      esWarning << "Model: Failed to start loading thread.  Models will be "
+                   "loaded synchronously." << std::endl;
 
-  if(!file.isOpen())
+      System::destroySemaphore(loadSemaphore);
+      System::destroyMutex(queueMutex);
+
+      loadingFailed = true;
+
+      return false;
+    }
+
+    return true;
+  }
+
+  /**
+   * Opens a model file, or a file with the same base name if it does not
+   * exist.  Returns NULL on failure.
+   */
+  File* openFile(const String& name)
   {
+    File* file = new File(name);
+
+    if(file->isOpen())
+      return file;
+
+    delete file;
+
     String base = name.left(name.length() - 3);
 
     std::vector<String> files;
@@ -77,78 +173,661 @@ uint Model::acquire(const char* _name)
       if(*i == name)
         continue;
 
-      file = File(*i);
+      file = new File(*i);
+
+      if(file->isOpen())
+        return file;
 
-      if(file.isOpen())
-        break;
+      delete file;
     }
+
+    esWarning << "Model: Failed to open \"" << name << "\"." << std::endl;
+
+    return 0;
   }
 
-  if(!file.isOpen())
+  Shader* placeholderShader = 0;
+
+  // Corners of the box drawn by Placeholder.  Bit 0, 1 and 2 of the index
+  // select the maximum x, y and z, respectively.
+  const uint placeholderIndexes[36] =
   {
-    esWarning << "Model: Failed to open \"" << name << "\"." << std::endl;
+    0, 4, 6, 0, 6, 2, // -x
+    1, 3, 7, 1, 7, 5, // +x
+    0, 1, 5, 0, 5, 4, // -y
+    2, 6, 7, 2, 7, 3, // +y
+    0, 2, 3, 0, 3, 1, // -z
+    4, 5, 7, 4, 7, 6  // +z
+  };
+
+  const float placeholderTexCoords[8 * 2] = { 0 };
+
+  /**
+   * Stands in for a model loaded by acquireAsync(), drawing a box with its
+   * bounds.
+   */
+  class Placeholder : public Model
+  {
+  public:
+
+    Placeholder(const Vector3& mins, const Vector3& maxs)
+      : mins(mins),
+        maxs(maxs)
+    {
+    }
+
+    ~Placeholder()
+    {
+    }
+
+    void boundBox(Vector3& _mins, Vector3& _maxs)
+    {
+      _mins = mins;
+      _maxs = maxs;
+    }
+
+    void render(int, float, uint customShader, uint, float)
+    {
+      Shader* shader = customShader ? Shader::shaderForHandle(customShader)
+                                    : 0;
+
+      if(!shader)
+      {
+        if(!placeholderShader)
+          placeholderShader = Shader::acquire("simple:*white");
+
+        shader = placeholderShader;
+      }
+
+      if(!shader)
+        return;
+
+      Vector3* vertices = Renderer::frameVectors(16);
+      Vector3* normals = vertices + 8;
+
+      for(uint i = 0; i < 8; ++i)
+      {
+        vertices[i] = Vector3((i & 1) ? maxs(0) : mins(0),
+                              (i & 2) ? maxs(1) : mins(1),
+                              (i & 4) ? maxs(2) : mins(2));
+
+        normals[i] = Vector3((i & 1) ? 1 : -1,
+                             (i & 2) ? 1 : -1,
+                             (i & 4) ? 1 : -1) * (1 / sqrtf(3));
+      }
+
+      Renderer::setVertexArray(vertices);
+      Renderer::setNormalArray(normals);
+      Renderer::setTexCoordArray(0, placeholderTexCoords);
+
+      Renderer::drawTriangles(12, placeholderIndexes, shader);
+    }
+
+  protected:
+
+    Vector3 mins;
+    Vector3 maxs;
+  };
 
+  // Sine and cosine of the 256 angles a packed normal component can have
+  float normalSin[256];
+  float normalCos[256];
+
+  struct NormalTables
+  {
+    NormalTables()
+    {
+      for(uint i = 0; i < 256; ++i)
+      {
+        float angle = i * 2 * M_PI / 255.0;
+
+        normalSin[i] = sin(angle);
+        normalCos[i] = cos(angle);
+      }
+    }
+  };
+
+  NormalTables normalTables;
+
+  // Packed vertices are unpacked this many at a time into buffers on the
+  // stack, which stay in the cache while they are interpolated
+  const uint unpackBlockSize = 64;
+
+  /**
+   * Unpacks `count' vertices starting at `first' into tightly packed float
+   * arrays.  `positions' must have room for one extra float.
+   */
+  void unpackBlock(const Model::PackedFrame& frame, uint first, uint count,
+                   float* positions, float* normals)
+  {
+    const Model::PackedVertex* vertices = frame.vertices + first;
+    const uint8_t* deltas = frame.deltas ? (frame.deltas + first * 4) : 0;
+
+    uint i = 0;
+
+#ifdef __SSE2__
+    const __m128  scale = _mm_set1_ps(1.0f / 64);
+    const __m128  deltaScale = _mm_set1_ps(3.0f / 64);
+    const __m128i deltaBias = _mm_set1_epi32(127);
+    const __m128i zero = _mm_setzero_si128();
+
+    // Two vertices per step.  The fourth lane of each result is garbage,
+    // and is overwritten by the next store or lands in the extra float.
+    for(; i + 2 <= count; i += 2)
+    {
+      __m128i packed =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(vertices + i));
+
+      __m128 position0 = _mm_cvtepi32_ps(
+        _mm_srai_epi32(_mm_unpacklo_epi16(packed, packed), 16));
+      __m128 position1 = _mm_cvtepi32_ps(
+        _mm_srai_epi32(_mm_unpackhi_epi16(packed, packed), 16));
+
+      position0 = _mm_mul_ps(position0, scale);
+      position1 = _mm_mul_ps(position1, scale);
+
+      if(deltas)
+      {
+        __m128i delta = _mm_unpacklo_epi8(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i*>(deltas + i * 4)),
+          zero);
+
+        __m128i delta0 = _mm_sub_epi32(_mm_unpacklo_epi16(delta, zero),
+                                       deltaBias);
+        __m128i delta1 = _mm_sub_epi32(_mm_unpackhi_epi16(delta, zero),
+                                       deltaBias);
+
+        position0 = _mm_add_ps(position0,
+                               _mm_mul_ps(_mm_cvtepi32_ps(delta0), deltaScale));
+        position1 = _mm_add_ps(position1,
+                               _mm_mul_ps(_mm_cvtepi32_ps(delta1), deltaScale));
+      }
+
+      _mm_storeu_ps(positions + i * 3, position0);
+      _mm_storeu_ps(positions + i * 3 + 3, position1);
+    }
+#endif
+
+    for(; i < count; ++i)
+    {
+      for(uint j = 0; j < 3; ++j)
+      {
+        float position = vertices[i].position[j] / 64.0f;
+
+        if(deltas)
+          position += (static_cast<int>(deltas[i * 4 + j]) - 127) * 3 / 64.0f;
+
+        positions[i * 3 + j] = position;
+      }
+    }
+
+    for(i = 0; i < count; ++i)
+    {
+      const uint8_t* normal = vertices[i].normal;
+
+      normals[i * 3] = normalCos[normal[1]] * normalSin[normal[0]];
+      normals[i * 3 + 1] = normalSin[normal[1]] * normalSin[normal[0]];
+      normals[i * 3 + 2] = normalCos[normal[0]];
+    }
+  }
+}
+
+uint Model::acquire(const char* _name)
+{
+  if(!_name)
     return 0;
+
+  String name = String(_name).replace('\\', '/');
+
+  uint existing = handles.find(name);
+
+  if(existing)
+  {
+    ++handles.get(existing)->refCount;
+
+    return existing;
   }
 
+  File* file = openFile(name);
+
+  if(!file)
+    return 0;
+
   std::map<uint, ModelPlugin*>::iterator i;
 
   for(i = Plugin::model.begin(); i != Plugin::model.end(); ++i)
   {
-    if(i->second->canHandle(file))
+    if(i->second->canHandle(*file))
     {
       ModelHandle handle;
 
-      handle.model = i->second->read(file);
+      handle.model = i->second->read(*file);
 
       if(!handle.model)
         continue;
 
-      handle.name = name;
+      delete file;
 
-      handles[nextHandle++] = handle;
+      handle.model->finishLoading();
 
-      return nextHandle - 1;
+      return handles.add(name, handle);
     }
   }
 
+  delete file;
+
   esWarning << "Model: No plugin found for \"" << name << "\"." << std::endl;
 
   return 0;
 }
 
-void Model::unacquire(uint handle)
+uint Model::acquireAsync(const char* _name, LoadCallback callback,
+                         void* data)
+{
+  if(!_name)
+    return 0;
+
+  String name = String(_name).replace('\\', '/');
+
+  uint existing = handles.find(name);
+
+  if(existing)
+  {
+    ModelHandle* handle = handles.get(existing);
+
+    ++handle->refCount;
+
+    if(handle->load)
+    {
+      if(callback)
+        handle->load->callbacks.push_back(std::make_pair(callback, data));
+    }
+    else if(callback)
+      callback(existing, true, data);
+
+    return existing;
+  }
+
+  if(!startLoading())
+  {
+    uint handle = acquire(name);
+
+    if(handle && callback)
+      callback(handle, true, data);
+
+    return handle;
+  }
+
+  File* file = openFile(name);
+
+  if(!file)
+    return 0;
+
+  ModelPlugin* plugin = 0;
+
+  for(std::map<uint, ModelPlugin*>::iterator i = Plugin::model.begin();
+      i != Plugin::model.end(); ++i)
+  {
+    if(i->second->canHandle(*file))
+    {
+      plugin = i->second;
+
+      break;
+    }
+  }
+
+  if(!plugin)
+  {
+    esWarning << "Model: No plugin found for \"" << name << "\"." << std::endl;
+
+    delete file;
+
+    return 0;
+  }
+
+  Vector3 mins, maxs;
+
+  if(!plugin->readBounds(*file, mins, maxs))
+  {
+    mins = Vector3(-8, -8, -8);
+    maxs = Vector3(8, 8, 8);
+  }
+
+  file->data();
+  file->seek(0);
+
+  Load* load = new Load;
+
+  load->name = name;
+  load->file = file;
+  load->plugin = plugin;
+  load->cancelled = false;
+  load->model = 0;
+
+  if(callback)
+    load->callbacks.push_back(std::make_pair(callback, data));
+
+  ModelHandle handle;
+
+  handle.model = new Placeholder(mins, maxs);
+  handle.load = load;
+
+  load->handle = handles.add(name, handle);
+
+  System::lockMutex(queueMutex);
+
+  loadQueue.push_back(load);
+
+  System::unlockMutex(queueMutex);
+
+  System::postSemaphore(loadSemaphore);
+
+  return load->handle;
+}
+
+bool Model::isLoading(uint _handle)
+{
+  ModelHandle* handle = handles.get(_handle);
+
+  return handle && handle->load;
+}
+
+void Model::update()
+{
+  if(!loadThread)
+    return;
+
+  std::deque<Load*> loaded;
+
+  System::lockMutex(queueMutex);
+
+  loaded.swap(loadedQueue);
+
+  System::unlockMutex(queueMutex);
+
+  for(std::deque<Load*>::iterator i = loaded.begin(); i != loaded.end(); ++i)
+  {
+    Load* load = *i;
+
+    delete load->file;
+
+    if(load->cancelled)
+    {
+      delete load->model;
+      delete load;
+
+      continue;
+    }
+
+    ModelHandle* handle = handles.get(load->handle);
+
+    if(load->model)
+    {
+      load->model->finishLoading();
+
+      delete handle->model;
+
+      handle->model = load->model;
+    }
+    else
+    {
+      esWarning << "Model: Failed to read \"" << load->name << "\"."
+                << std::endl;
+    }
+
+    handle->load = 0;
+
+    // Callbacks may acquire and unacquire models
+    for(Callbacks::iterator j = load->callbacks.begin();
+        j != load->callbacks.end(); ++j)
+      j->first(load->handle, load->model != 0, j->second);
+
+    delete load;
+  }
+}
+
+void Model::unacquire(uint _handle)
 {
-  std::map<uint, ModelHandle>::iterator i = handles.find(handle);
+  ModelHandle* handle = handles.get(_handle);
 
-  if(i == handles.end())
+  if(!handle)
     return;
 
-  if(--i->second.refCount)
+  if(--handle->refCount)
     return;
 
-  delete i->second.model;
+  // The loading thread still owns the load, update() frees it
+  if(handle->load)
+    handle->load->cancelled = true;
+
+  delete handle->model;
 
-  handles.erase(i);
+  handles.remove(_handle);
 }
 
-Model* Model::modelForHandle(uint handle)
+Model* Model::modelForHandle(uint _handle)
 {
-  std::map<uint, ModelHandle>::iterator i = handles.find(handle);
+  ModelHandle* handle = handles.get(_handle);
 
-  if(i == handles.end())
+  if(!handle)
     return 0;
 
-  return i->second.model;
+  return handle->model;
+}
+
+void Model::lerpVectors(const Vector3* _from, const Vector3* _to,
+                        float backLerp, uint count, Vector3* _output,
+                        bool normalize)
+{
+  // Vector3 is three tightly packed floats, so the components can be
+  // interpolated without regard to which vector they belong to
+  const float* from = reinterpret_cast<const float*>(_from);
+  const float* to = reinterpret_cast<const float*>(_to);
+  float* output = reinterpret_cast<float*>(_output);
+
+  uint componentCount = count * 3;
+  uint i = 0;
+
+#ifdef __SSE2__
+  __m128 factor = _mm_set1_ps(backLerp);
+
+  for(; i + 8 <= componentCount; i += 8)
+  {
+    __m128 to0 = _mm_loadu_ps(to + i);
+    __m128 to1 = _mm_loadu_ps(to + i + 4);
+
+    __m128 delta0 = _mm_sub_ps(_mm_loadu_ps(from + i), to0);
+    __m128 delta1 = _mm_sub_ps(_mm_loadu_ps(from + i + 4), to1);
+
+    _mm_storeu_ps(output + i, _mm_add_ps(to0, _mm_mul_ps(delta0, factor)));
+    _mm_storeu_ps(output + i + 4, _mm_add_ps(to1, _mm_mul_ps(delta1, factor)));
+  }
+#endif
+
+  for(; i < componentCount; ++i)
+    output[i] = to[i] + (from[i] - to[i]) * backLerp;
+
+  if(!normalize)
+    return;
+
+  for(i = 0; i < componentCount; i += 3)
+  {
+    float square = output[i] * output[i]
+                 + output[i + 1] * output[i + 1]
+                 + output[i + 2] * output[i + 2];
+
+    if(square > 0)
+    {
+      float scale = 1 / sqrtf(square);
+
+      output[i] *= scale;
+      output[i + 1] *= scale;
+      output[i + 2] *= scale;
+    }
+  }
+}
+
+void Model::unpackVertices(const PackedFrame& frame, uint count,
+                           Vector3* positions, Vector3* normals)
+{
+  float blockPositions[unpackBlockSize * 3 + 1];
+  float blockNormals[unpackBlockSize * 3];
+
+  for(uint first = 0; first < count; first += unpackBlockSize)
+  {
+    uint blockCount = std::min(count - first, unpackBlockSize);
+
+    unpackBlock(frame, first, blockCount, blockPositions, blockNormals);
+
+    memcpy(reinterpret_cast<float*>(positions) + first * 3, blockPositions,
+           blockCount * 3 * sizeof(float));
+    memcpy(reinterpret_cast<float*>(normals) + first * 3, blockNormals,
+           blockCount * 3 * sizeof(float));
+  }
+}
+
+void Model::lerpPackedVertices(const PackedFrame& from, const PackedFrame& to,
+                               float backLerp, uint count,
+                               Vector3* positions, Vector3* normals)
+{
+  float fromPositions[unpackBlockSize * 3 + 1];
+  float fromNormals[unpackBlockSize * 3];
+  float toPositions[unpackBlockSize * 3 + 1];
+  float toNormals[unpackBlockSize * 3];
+
+  for(uint first = 0; first < count; first += unpackBlockSize)
+  {
+    uint blockCount = std::min(count - first, unpackBlockSize);
+
+    unpackBlock(from, first, blockCount, fromPositions, fromNormals);
+    unpackBlock(to, first, blockCount, toPositions, toNormals);
+
+    lerpVectors(reinterpret_cast<Vector3*>(fromPositions),
+                reinterpret_cast<Vector3*>(toPositions),
+                backLerp, blockCount, positions + first);
+    lerpVectors(reinterpret_cast<Vector3*>(fromNormals),
+                reinterpret_cast<Vector3*>(toNormals),
+                backLerp, blockCount, normals + first, true);
+  }
 }
 
 Model::~Model()
 {
 }
 
-int Model::tag(const char*, Vector3&, Vector3[3], int)
+void Model::lerpTag(const Vector3* _from, const Vector3* _to, float backLerp,
+                    Vector3& origin, Vector3 axis[3])
+{
+  const float* from = reinterpret_cast<const float*>(_from);
+  const float* to = reinterpret_cast<const float*>(_to);
+
+  // Origin and axes, as four tightly packed groups of three floats, lerped
+  // four floats at a time
+  float output[12];
+
+#ifdef __SSE2__
+  __m128 factor = _mm_set1_ps(backLerp);
+
+  for(uint i = 0; i < 12; i += 4)
+  {
+    __m128 to0 = _mm_loadu_ps(to + i);
+    __m128 delta = _mm_sub_ps(_mm_loadu_ps(from + i), to0);
+
+    _mm_storeu_ps(output + i, _mm_add_ps(to0, _mm_mul_ps(delta, factor)));
+  }
+#else
+  for(uint i = 0; i < 12; ++i)
+    output[i] = to[i] + (from[i] - to[i]) * backLerp;
+#endif
+
+  origin = Vector3(output[0], output[1], output[2]);
+
+  for(uint i = 0; i < 3; ++i)
+  {
+    const float* v = output + 3 + i * 3;
+
+    float square = v[0] * v[0] + v[1] * v[1] + v[2] * v[2];
+    float scale = (square > 0) ? 1 / sqrtf(square) : 1;
+
+    axis[i] = Vector3(v[0] * scale, v[1] * scale, v[2] * scale);
+  }
+}
+
+int Model::tagId(const char*, int)
 {
   return -1;
 }
 
+bool Model::tag(int, int, float, Vector3&, Vector3[3])
+{
+  return false;
+}
+
+int Model::tag(const char* name, Vector3& origin, Vector3 axis[3],
+               int startIndex)
+{
+  int id = tagId(name, startIndex);
+
+  if(id < 0 || !tag(id, 0, 0, origin, axis))
+    return -1;
+
+  return id;
+}
+
+void Model::TagCache::resize(uint tagCount)
+{
+  Entry empty;
+
+  empty.frame = -1;
+  empty.backLerp = -1; // Never asked for
+
+  entries.assign(tagCount * ways, empty);
+  nextEntries.assign(tagCount, 0);
+}
+
+bool Model::TagCache::find(uint id, int frame, float backLerp,
+                           Vector3& origin, Vector3 axis[3]) const
+{
+  const Entry* entry = &entries[id * ways];
+
+  for(uint i = 0; i < ways; ++i, ++entry)
+  {
+    if(entry->frame == frame && entry->backLerp == backLerp)
+    {
+      origin = entry->transform[0];
+      axis[0] = entry->transform[1];
+      axis[1] = entry->transform[2];
+      axis[2] = entry->transform[3];
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void Model::TagCache::add(uint id, int frame, float backLerp,
+                          const Vector3& origin, const Vector3 axis[3])
+{
+  uint& next = nextEntries[id];
+  Entry& entry = entries[id * ways + next];
+
+  next = (next + 1) % ways;
+
+  entry.frame = frame;
+  entry.backLerp = backLerp;
+  entry.transform[0] = origin;
+  entry.transform[1] = axis[0];
+  entry.transform[2] = axis[1];
+  entry.transform[3] = axis[2];
+}
+
+void Model::prepare(int, float, float)
+{
+}
+
+void Model::finishLoading()
+{
+}
+
 // vim: ts=2 sw=2 et
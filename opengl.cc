@@ -539,6 +539,13 @@ void GL::initialize()
   endOcclusionQueryNV = PROC_EXT(glEndOcclusionQueryNV);
   getOcclusionQueryivNV = PROC_EXT(glGetOcclusionQueryivNV);
   getOcclusionQueryuivNV = PROC_EXT(glGetOcclusionQueryuivNV);
+  compressedTexImage2DARB = PROC_EXT(glCompressedTexImage2DARB);
+  bindBufferARB = PROC_EXT(glBindBufferARB);
+  deleteBuffersARB = PROC_EXT(glDeleteBuffersARB);
+  genBuffersARB = PROC_EXT(glGenBuffersARB);
+  bufferDataARB = PROC_EXT(glBufferDataARB);
+  mapBufferARB = PROC_EXT(glMapBufferARB);
+  unmapBufferARB = PROC_EXT(glUnmapBufferARB);
 
   strcpy(config.renderer,
          reinterpret_cast<const char*>(getString(GL::RENDERER)));
@@ -601,8 +608,13 @@ void GL::initialize()
 
   // XXX: Fill in all of the following
   config.gammaSupport = 0;
-  config.textureCompression = GLConfig::TC_NONE;
-  config.textureEnvAddSupport = 1;
+  config.textureCompression =
+    (   config.extensions.count("GL_ARB_texture_compression")
+     && config.extensions.count("GL_EXT_texture_compression_s3tc"))
+    ? GLConfig::TC_EXT_COMP_S3TC : GLConfig::TC_NONE;
+  config.textureEnvAddSupport =
+       config.extensions.count("GL_ARB_texture_env_add")
+    || config.extensions.count("GL_EXT_texture_env_add");
   config.anisotropicSupport = 1;
   config.maxAnisotropy = 2;
 
@@ -627,6 +639,12 @@ void GL::initialize()
 
   config.textureFilterAnisotropicSupport
     = config.extensions.count("GL_EXT_texture_filter_anisotropic");
+
+  config.pixelBufferObjectSupport
+    =  (   config.extensions.count("GL_ARB_pixel_buffer_object")
+        || config.extensions.count("GL_EXT_pixel_buffer_object"))
+    && bindBufferARB && genBuffersARB && bufferDataARB
+    && mapBufferARB && unmapBufferARB;
 }
 
 GL::glClearIndex                  GL::clearIndex;
@@ -1100,5 +1118,12 @@ GL::glBeginOcclusionQueryNV       GL::beginOcclusionQueryNV;
 GL::glEndOcclusionQueryNV         GL::endOcclusionQueryNV;
 GL::glGetOcclusionQueryivNV       GL::getOcclusionQueryivNV;
 GL::glGetOcclusionQueryuivNV      GL::getOcclusionQueryuivNV;
+GL::glCompressedTexImage2DARB     GL::compressedTexImage2DARB;
+GL::glBindBufferARB               GL::bindBufferARB;
+GL::glDeleteBuffersARB            GL::deleteBuffersARB;
+GL::glGenBuffersARB               GL::genBuffersARB;
+GL::glBufferDataARB               GL::bufferDataARB;
+GL::glMapBufferARB                GL::mapBufferARB;
+GL::glUnmapBufferARB              GL::unmapBufferARB;
 
 // vim: ts=2 sw=2 et
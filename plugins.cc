@@ -146,6 +146,11 @@ Plugin::Type ModelPlugin::type()
   return Plugin::ModelPluginType;
 }
 
+bool ModelPlugin::readBounds(File&, Vector3&, Vector3&)
+{
+  return false;
+}
+
 Plugin::Type MediaPlugin::type()
 {
   return Plugin::MediaPluginType;
@@ -22,8 +22,10 @@
 #include <espace/bezier.h>
 #include <espace/collision.h>
 #include <espace/color.h>
+#include <espace/cvar.h>
 #include <espace/file.h>
 #include <espace/image.h>
+#include <espace/opengl.h>
 #include <espace/output.h>
 #include <espace/renderer.h>
 #include <espace/shader.h>
@@ -51,6 +53,171 @@ bool BSP::canHandle(File& file)
   return !memcmp(magic, "IBSP", 4);
 }
 
+namespace
+{
+  const uint lightmapSize = 128;
+
+  // Each lightmap is surrounded by a copy of its edge texels, so that
+  // bilinear filtering does not pick up its neighbours in the atlas
+  const uint lightmapTileSize = lightmapSize + 2;
+
+  uint powerOfTwo(uint value)
+  {
+    uint result = 1;
+
+    while(result < value)
+      result <<= 1;
+
+    return result;
+  }
+
+  /**
+   * Copies a lightmap into an atlas page, including the border.
+   */
+  void copyLightmap(const Image& lightmap, Image& page, uint x, uint y)
+  {
+    const uint8_t* source = lightmap.data();
+    uint8_t* dest = page.data();
+    uint pitch = page.width() * 3;
+
+    for(uint row = 0; row < lightmapTileSize; ++row)
+    {
+      uint sourceRow = (row == 0) ? 0
+                     : (row > lightmapSize) ? lightmapSize - 1
+                     : row - 1;
+
+      const uint8_t* in = source + sourceRow * lightmapSize * 3;
+      uint8_t* out = dest + (y + row) * pitch + x * 3;
+
+      memcpy(out, in, 3);
+      memcpy(out + 3, in, lightmapSize * 3);
+      memcpy(out + (lightmapSize + 1) * 3, in + (lightmapSize - 1) * 3, 3);
+    }
+  }
+
+  /**
+   * Uploads the lightmaps of a map, packed into as few textures as
+   * possible, and moves the lightmap coordinates of the vertices into the
+   * space of the atlas pages.  The CPU copies of the lightmaps are freed.
+   */
+  void packLightmaps(BSPData* map)
+  {
+    CVar pack = CVar::acquire("r_packlightmaps", "1", CVar::Archive);
+
+    uint lightmapCount = map->lightmaps.size();
+    uint pageSize = 2048;
+
+    if(GL::config.maxTextureSize && GL::config.maxTextureSize < pageSize)
+      pageSize = GL::config.maxTextureSize;
+
+    uint tilesPerRow = pageSize / lightmapTileSize;
+    uint tilesPerPage = tilesPerRow * tilesPerRow;
+
+    if(!pack.integer || !tilesPerPage)
+      tilesPerPage = 1;
+
+    std::vector<float> offsetS(lightmapCount);
+    std::vector<float> offsetT(lightmapCount);
+    std::vector<float> scaleS(lightmapCount);
+    std::vector<float> scaleT(lightmapCount);
+    std::vector<Image*> pages;
+
+    map->lightmapHandles.resize(lightmapCount);
+
+    for(uint first = 0; first < lightmapCount; first += tilesPerPage)
+    {
+      uint count = std::min(tilesPerPage, lightmapCount - first);
+
+      if(tilesPerPage == 1)
+      {
+        Image* lightmap = map->lightmaps[first];
+
+        lightmap->brighten(4.0);
+
+        map->lightmapHandles[first] = Texture::acquire(lightmap);
+
+        offsetS[first] = offsetT[first] = 0.0f;
+        scaleS[first] = scaleT[first] = 1.0f;
+
+        continue;
+      }
+
+      uint columns = std::min(count, tilesPerRow);
+      uint rows = (count + columns - 1) / columns;
+
+      // Texture handles of images are keyed by address, so the pages are
+      // kept until all of them have been uploaded
+      Image* page = new Image(powerOfTwo(columns * lightmapTileSize),
+                              powerOfTwo(rows * lightmapTileSize), Image::RGB);
+
+      pages.push_back(page);
+
+      memset(page->data(), 0, page->width() * page->height() * 3);
+
+      for(uint i = 0; i < count; ++i)
+      {
+        Image* lightmap = map->lightmaps[first + i];
+        uint x = (i % columns) * lightmapTileSize;
+        uint y = (i / columns) * lightmapTileSize;
+
+        lightmap->brighten(4.0);
+
+        copyLightmap(*lightmap, *page, x, y);
+
+        offsetS[first + i] = float(x + 1) / page->width();
+        offsetT[first + i] = float(y + 1) / page->height();
+        scaleS[first + i] = float(lightmapSize) / page->width();
+        scaleT[first + i] = float(lightmapSize) / page->height();
+      }
+
+      uint handle = Texture::acquire(page, Texture::NoMipMaps
+                                         | Texture::NoRepeat);
+
+      for(uint i = 0; i < count; ++i)
+        map->lightmapHandles[first + i] = handle;
+    }
+
+    uint textureCount = (tilesPerPage == 1) ? lightmapCount : pages.size();
+
+    for(uint i = 0; i < pages.size(); ++i)
+      delete pages[i];
+
+    for(uint i = 0; i < lightmapCount; ++i)
+      delete map->lightmaps[i];
+
+    map->lightmaps.clear();
+
+    std::vector<bool> moved(map->vertices.size(), false);
+
+    for(uint i = 0; i < map->faces.size(); ++i)
+    {
+      const BSPData::Face& face = map->faces[i];
+      int lightmap = map->rfaces[i].lightmap;
+
+      if(lightmap < 0 || uint(lightmap) >= lightmapCount)
+        continue;
+
+      for(uint j = 0; j < face.vertexCount; ++j)
+      {
+        if(moved[face.vertex + j])
+          continue;
+
+        moved[face.vertex + j] = true;
+
+        Vector2& coord = map->vertices[face.vertex + j].lightmapCoord;
+
+        coord(0) = offsetS[lightmap] + coord(0) * scaleS[lightmap];
+        coord(1) = offsetT[lightmap] + coord(1) * scaleT[lightmap];
+      }
+    }
+
+    esInfo << "BSP: Uploaded " << lightmapCount << " lightmaps in "
+           << textureCount << " textures, saving up to "
+           << (lightmapCount - textureCount) << " texture binds per frame."
+           << std::endl;
+  }
+}
+
 Map* BSP::read(File& file)
 {
   BSPData* map = new BSPData;
@@ -98,18 +265,7 @@ Map* BSP::read(File& file)
          << map->vertices.size() << " vertices and "
          << map->nodes.size() << " nodes." << std::endl;
 
-  esInfo << "BSP: Uploading " << map->lightmaps.size() << " lightmaps... " << std::endl;
-
-  map->lightmapHandles.resize(map->lightmaps.size());
-
-  for(uint i = 0; i < map->lightmaps.size(); ++i)
-  {
-    Image* lightmap = map->lightmaps[i];
-
-    lightmap->brighten(4.0);
-
-    map->lightmapHandles[i] = Texture::acquire(lightmap);
-  }
+  packLightmaps(map);
 
   esInfo << "BSP: Acquiring " << map->textures.size() << " shaders..." << std::endl;
 
@@ -313,6 +469,13 @@ BSPData::~BSPData()
     }
   }
 
+  // Several lightmaps share each atlas page
+  for(uint i = 0; i < lightmapHandles.size(); ++i)
+  {
+    if(i == 0 || lightmapHandles[i] != lightmapHandles[i - 1])
+      ::Texture::unacquire(lightmapHandles[i]);
+  }
+
   // XXX: Unacquire shaders
 }
 
@@ -551,6 +714,54 @@ bool BSPData::visible(const Vector3& from, const Vector3& to) const
   return testVisibility(cluster0, cluster1);
 }
 
+bool BSPData::visible(const Vector3& from, const Vector3& min,
+                      const Vector3& max) const
+{
+  int cluster = rleaves[findLeaf(from)].cluster;
+
+  if(cluster == -1)
+    return true;
+
+  bool clusterFound = false;
+
+  if(visible(0, cluster, min, max, clusterFound))
+    return true;
+
+  // Like a point outside the map, a box touching no cluster is not culled
+  return !clusterFound;
+}
+
+/**
+ * Tests the clusters of all leaves below `nodeIndex' touched by the box.
+ */
+bool BSPData::visible(int nodeIndex, int cluster, const Vector3& min,
+                      const Vector3& max, bool& clusterFound) const
+{
+  if(nodeIndex < 0)
+  {
+    int leafCluster = rleaves[-(nodeIndex + 1)].cluster;
+
+    if(leafCluster == -1)
+      return false;
+
+    clusterFound = true;
+
+    return testVisibility(cluster, leafCluster);
+  }
+
+  const Node& node = nodes[nodeIndex];
+  const Plane& plane = planes[node.plane];
+
+  if(Collision::back(plane, plane.distance, min, max))
+    return visible(node.children[0], cluster, min, max, clusterFound);
+
+  if(Collision::front(plane, plane.distance, min, max))
+    return visible(node.children[1], cluster, min, max, clusterFound);
+
+  return visible(node.children[0], cluster, min, max, clusterFound)
+      || visible(node.children[1], cluster, min, max, clusterFound);
+}
+
 void BSPData::InlineModel::boundBox(Vector3& min, Vector3& max)
 {
   min = this->min;
@@ -558,7 +769,8 @@ void BSPData::InlineModel::boundBox(Vector3& min, Vector3& max)
 }
 
 void BSPData::InlineModel::render(int frame, float backLerp,
-                                  uint customShader, uint customSkin)
+                                  uint customShader, uint customSkin,
+                                  float)
 {
   // XXX
 }
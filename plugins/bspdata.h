@@ -44,6 +44,8 @@ public:
   void contents(const Vector3& min, const Vector3& max,
                 Trace& trace, int contentMask) const;
   bool visible(const Vector3& from, const Vector3& to) const;
+  bool visible(const Vector3& from, const Vector3& min,
+               const Vector3& max) const;
 
   enum Lump
   {
@@ -159,7 +161,8 @@ public:
   public:
 
     void boundBox(Vector3& min, Vector3& max);
-    void render(int frame, float backLerp, uint customShader, uint customSkin);
+    void render(int frame, float backLerp, uint customShader, uint customSkin,
+                float projectedRadius);
 
   protected:
 
@@ -354,6 +357,8 @@ public:
                     Trace& trace, float t1 = 0, float t2 = 1) const;
   void contents(int nodeIndex, const Vector3& min, const Vector3& max,
                 Trace& trace) const;
+  bool visible(int nodeIndex, int cluster, const Vector3& min,
+               const Vector3& max, bool& clusterFound) const;
 
   // *** Run time functions and data
 
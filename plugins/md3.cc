@@ -14,6 +14,12 @@
  *                                                                         *
  ***************************************************************************/
 
+#include <algorithm>
+#include <vector>
+
+#include <math.h>
+#include <string.h>
+
 #include <espace/file.h>
 #include <espace/model.h>
 #include <espace/output.h>
@@ -28,8 +34,12 @@ class MD3Data : public Model
 public:
 
   void boundBox(Vector3& mins, Vector3& maxs);
-  int  tag(const char* name, Vector3& origin, Vector3 axis[3], int startIndex);
-  void render(int frame, float backLerp, uint customShader, uint customSkin);
+  void finishLoading();
+  int  tagId(const char* name, int startIndex);
+  bool tag(int id, int frame, float backLerp, Vector3& origin,
+           Vector3 axis[3]);
+  void render(int frame, float backLerp, uint customShader, uint customSkin,
+              float projectedRadius);
 
 protected:
 
@@ -48,11 +58,13 @@ protected:
     float    radius;
   };
 
+  typedef char TagName[64];
+
+  // Laid out as expected by Model::lerpTag()
   class Tag
   {
   public:
 
-    char    name[64];
     Vector3 origin;
     Vector3 axis[3];
   };
@@ -66,18 +78,19 @@ protected:
       delete [] textureCoords;
       delete [] indexes;
       delete [] frames;
-      delete [] lerpVertices;
     }
 
     char      name[64];
     uint      flags;
     uint      frameCount;
     Shader*   shader;
+    std::vector<String> shaderNames; // Tried in turn by finishLoading()
     Vector2*  textureCoords;
     uint      vertexCount;
     uint*     indexes;
     uint      triangleCount;
 
+    // Vertices are kept as stored in the file, and unpacked when drawn
     class Frame
     {
     public:
@@ -85,25 +98,26 @@ protected:
       ~Frame()
       {
         delete [] vertices;
-        delete [] normals;
       }
 
-      Vector3* vertices;
-      Vector3* normals;
+      Model::PackedVertex* vertices;
     };
 
     Frame*    frames;
-    Vector3*  lerpVertices;
   };
 
   Frame*   frames;
   uint     frameCount;
 
-  Tag*     tags;
+  TagName* tagNames;
+  Tag*     tags;     // tagCount tags per frame
   uint     tagCount;
+  TagCache tagCache;
 
   Surface* surfaces;
   uint     surfaceCount;
+
+  SkinBindings skinBindings;
 };
 
 uint32_t MD3::id()
@@ -165,15 +179,20 @@ Model* MD3::read(File& file)
   {
     file.seek(tagOffset);
 
+    model->tagNames = new MD3Data::TagName[model->tagCount];
+    model->tags = new MD3Data::Tag[model->frameCount * model->tagCount];
+
     for(uint j = 0; j < model->frameCount; ++j)
     {
-      model->tags = new MD3Data::Tag[model->tagCount];
-
       for(uint i = 0; i < model->tagCount; ++i)
       {
-        MD3Data::Tag& tag = model->tags[i];
+        MD3Data::Tag& tag = model->tags[j * model->tagCount + i];
 
-        file.read(tag.name, 64);
+        // Every frame repeats the names
+        if(j)
+          file.skip(64);
+        else
+          file.read(model->tagNames[i], 64);
 
         tag.origin = file.getVector3();
         tag.axis[0] = file.getVector3();
@@ -181,6 +200,8 @@ Model* MD3::read(File& file)
         tag.axis[2] = file.getVector3();
       }
     }
+
+    model->tagCache.resize(model->tagCount);
   }
 
   if(model->surfaceCount)
@@ -197,6 +218,8 @@ Model* MD3::read(File& file)
 
       file.read(surface.name, 64);
 
+      model->skinBindings.addSurface(surface.name);
+
       file.getU32(); // Skip flags
 
       surface.frameCount = file.getU32();
@@ -204,8 +227,6 @@ Model* MD3::read(File& file)
       surface.vertexCount = file.getU32();
       surface.triangleCount = file.getU32();
 
-      surface.lerpVertices = new Vector3[surface.vertexCount];
-
       uint triangleOffset = surfaceOffset + file.getU32();
       uint shaderOffset = surfaceOffset + file.getU32();
       uint texCoordOffset = surfaceOffset + file.getU32();
@@ -217,24 +238,16 @@ Model* MD3::read(File& file)
 
       surface.shader = 0;
 
-      for(uint i = 0; i < shaderCount && !surface.shader; ++i)
+      for(uint i = 0; i < shaderCount; ++i)
       {
         char name[64];
 
         file.read(name, 64);
-
-        String shaderName = String(name).replace('\\', '/');
         file.getU32(); // Skip useless integer
 
-        surface.shader = Shader::acquire(shaderName);
-
-        if(!surface.shader)
-          surface.shader = Shader::acquire(String("simple:") + shaderName);
+        surface.shaderNames.push_back(String(name).replace('\\', '/'));
       }
 
-      if(surface.shader)
-        esWarning << "Failed to load shader for surface." << std::endl;
-
       file.seek(triangleOffset);
 
       surface.indexes = new uint[surface.triangleCount * 3];
@@ -261,21 +274,18 @@ Model* MD3::read(File& file)
       {
         MD3Data::Surface::Frame& frame = surface.frames[j];
 
-        frame.vertices = new Vector3[surface.vertexCount];
-        frame.normals = new Vector3[surface.vertexCount];
+        frame.vertices = new Model::PackedVertex[surface.vertexCount];
 
         for(uint i = 0; i < surface.vertexCount; ++i)
         {
-          frame.vertices[i](0) = file.getS16() / 64.0;
-          frame.vertices[i](1) = file.getS16() / 64.0;
-          frame.vertices[i](2) = file.getS16() / 64.0;
+          Model::PackedVertex& vertex = frame.vertices[i];
 
-          float lng = file.getU8() * 2 * M_PI / 255.0;
-          float lat = file.getU8() * 2 * M_PI / 255.0;
+          vertex.position[0] = file.getS16();
+          vertex.position[1] = file.getS16();
+          vertex.position[2] = file.getS16();
 
-          frame.normals[i](0) = cos(lat) * sin(lng);
-          frame.normals[i](1) = sin(lat) * sin(lng);
-          frame.normals[i](2) = cos(lng);
+          vertex.normal[0] = file.getU8(); // Longitude
+          vertex.normal[1] = file.getU8(); // Latitude
         }
       }
     }
@@ -284,13 +294,49 @@ Model* MD3::read(File& file)
   return model;
 }
 
+bool MD3::readBounds(File& file, Vector3& mins, Vector3& maxs)
+{
+  file.seek(4 + 4 + 64 + 4); // Skip magic, version, model name and flags
+
+  uint frameCount = file.getU32();
+
+  file.seek(4 + 4 + 64 + 4 + 4 * 4);
+
+  uint frameOffset = file.getU32();
+
+  if(!frameCount)
+    return false;
+
+  for(uint i = 0; i < frameCount; ++i)
+  {
+    file.seek(frameOffset + i * 56);
+
+    Vector3 min = file.getVector3();
+    Vector3 max = file.getVector3();
+
+    for(uint j = 0; j < 3; ++j)
+    {
+      if(!i || min(j) < mins(j))
+        mins(j) = min(j);
+
+      if(!i || max(j) > maxs(j))
+        maxs(j) = max(j);
+    }
+  }
+
+  return true;
+}
+
 MD3Data::~MD3Data()
 {
   if(frameCount)
     delete [] frames;
 
   if(tagCount)
+  {
+    delete [] tagNames;
     delete [] tags;
+  }
 
   if(surfaceCount)
     delete [] surfaces;
@@ -321,26 +367,73 @@ void MD3Data::boundBox(Vector3& mins, Vector3& maxs)
   }
 }
 
-int MD3Data::tag(const char* name, Vector3& origin, Vector3 axis[3], int startIndex)
+void MD3Data::finishLoading()
 {
-  for(uint i = startIndex; i < tagCount; ++i)
+  for(uint i = 0; i < surfaceCount; ++i)
   {
-    if(!strcmp(tags[i].name, name))
+    Surface& surface = surfaces[i];
+
+    for(uint j = 0; j < surface.shaderNames.size() && !surface.shader; ++j)
     {
-      origin = tags[i].origin;
-      axis[0] = tags[i].axis[0];
-      axis[1] = tags[i].axis[1];
-      axis[2] = tags[i].axis[2];
+      surface.shader = Shader::acquire(surface.shaderNames[j]);
 
-      return i;
+      if(!surface.shader)
+        surface.shader = Shader::acquire(String("simple:")
+                                         + surface.shaderNames[j]);
     }
+
+    if(!surface.shader)
+      esWarning << "MD3: Failed to load shader for surface \""
+                << surface.name << "\"." << std::endl;
+  }
+}
+
+int MD3Data::tagId(const char* name, int startIndex)
+{
+  for(uint i = std::max(startIndex, 0); i < tagCount; ++i)
+  {
+    if(!strcmp(tagNames[i], name))
+      return i;
   }
 
   return -1;
 }
 
+bool MD3Data::tag(int id, int frameIndex, float backLerp, Vector3& origin,
+                  Vector3 axis[3])
+{
+  if(id < 0 || static_cast<uint>(id) >= tagCount || !frameCount)
+    return false;
+
+  if(tagCache.find(id, frameIndex, backLerp, origin, axis))
+    return true;
+
+  uint frame = (frameIndex % static_cast<int>(frameCount) + frameCount)
+             % frameCount;
+  uint lastFrame = frame ? (frame - 1) : (frameCount - 1);
+
+  const Tag& to = tags[frame * tagCount + id];
+  const Tag& from = tags[lastFrame * tagCount + id];
+
+  if(backLerp > 0)
+  {
+    Model::lerpTag(&from.origin, &to.origin, backLerp, origin, axis);
+  }
+  else
+  {
+    origin = to.origin;
+    axis[0] = to.axis[0];
+    axis[1] = to.axis[1];
+    axis[2] = to.axis[2];
+  }
+
+  tagCache.add(id, frameIndex, backLerp, origin, axis);
+
+  return true;
+}
+
 void MD3Data::render(int frameIndex, float backLerp,
-                     uint _customShader, uint customSkin)
+                     uint _customShader, uint customSkin, float)
 {
   frameIndex %= frameCount;
 
@@ -353,6 +446,8 @@ void MD3Data::render(int frameIndex, float backLerp,
   Skin* skin = customSkin ? Skin::skinForHandle(customSkin)
                           : 0;
 
+  const int* skinSurfaces = skin ? skinBindings.resolve(customSkin, skin) : 0;
+
   Shader* customShader = skin          ? 0
                        : _customShader ? Shader::shaderForHandle(_customShader)
                                        : 0;
@@ -369,24 +464,29 @@ void MD3Data::render(int frameIndex, float backLerp,
     if(!skin && !shader)
       continue;
 
+    Vector3* vertices = Renderer::frameVectors(surface.vertexCount * 2);
+    Vector3* normals = vertices + surface.vertexCount;
+
+    Model::PackedFrame packed = { frame.vertices, 0 };
+
     if(backLerp > 0)
     {
       const Surface::Frame& lastFrame = surface.frames[frameIndex ? (frameIndex - 1) : (frameCount - 1)];
 
-      for(uint i = 0; i < surface.vertexCount; ++i)
-        surface.lerpVertices[i] = lastFrame.vertices[i] * backLerp
-                                + frame.vertices[i] * (1 - backLerp);
-
+      Model::PackedFrame lastPacked = { lastFrame.vertices, 0 };
 
-      Renderer::setVertexArray(surface.lerpVertices);
+      Model::lerpPackedVertices(lastPacked, packed, backLerp,
+                                surface.vertexCount, vertices, normals);
     }
     else // backLerp == 0
     {
-      Renderer::setVertexArray(frame.vertices);
+      Model::unpackVertices(packed, surface.vertexCount, vertices, normals);
     }
 
+    Renderer::setVertexArray(vertices);
+    Renderer::setNormalArray(normals);
+
     Renderer::setTexCoordArray(0, surface.textureCoords);
-    Renderer::setNormalArray(frame.normals);
 
     if(shader)
     {
@@ -396,7 +496,7 @@ void MD3Data::render(int frameIndex, float backLerp,
     else // skin
     {
       Renderer::drawTriangles(surface.triangleCount, surface.indexes,
-                              skin, surface.name);
+                              skin, skinSurfaces[i]);
     }
   }
 }
@@ -8,6 +8,7 @@ struct MD3 : public ModelPlugin
   uint32_t id();
   bool canHandle(File& file);
   Model* read(File& file);
+  bool readBounds(File& file, Vector3& mins, Vector3& maxs);
 };
 
 #endif // !PLUGINS_MD3_H_
@@ -14,6 +14,12 @@
  *                                                                         *
  ***************************************************************************/
 
+#include <algorithm>
+#include <vector>
+
+#include <math.h>
+#include <string.h>
+
 #include <espace/file.h>
 #include <espace/model.h>
 #include <espace/output.h>
@@ -28,8 +34,12 @@ class MDCData : public Model
 public:
 
   void boundBox(Vector3& mins, Vector3& maxs);
-  int  tag(const char* name, Vector3& origin, Vector3 axis[3], int startIndex);
-  void render(int frame, float backLerp, uint customShader, uint customSkin);
+  void finishLoading();
+  int  tagId(const char* name, int startIndex);
+  bool tag(int id, int frame, float backLerp, Vector3& origin,
+           Vector3 axis[3]);
+  void render(int frame, float backLerp, uint customShader, uint customSkin,
+              float projectedRadius);
 
 protected:
 
@@ -48,12 +58,13 @@ protected:
     char    name[16];
   };
 
+  // Laid out as expected by Model::lerpTag()
   class Tag
   {
   public:
 
     Vector3 origin;
-    Vector3 angle;
+    Vector3 axis[3];
   };
 
   class Surface
@@ -64,29 +75,27 @@ protected:
     {
       delete [] textureCoords;
       delete [] indexes;
+      delete [] baseVertices;
+      delete [] deltas;
       delete [] frames;
-      delete [] lerpVertices;
     }
 
     char      name[64];
     uint      flags;
     uint      frameCount;
     Shader*   shader;
+    std::vector<String> shaderNames; // Tried in turn by finishLoading()
     Vector2*  textureCoords;
     uint      vertexCount;
     uint*     indexes;
     uint      triangleCount;
 
-    class Frame
-    {
-    public:
-
-      Vector3*  vertices;
-      Vector3*  normals;
-    };
-
-    Frame*    frames;
-    Vector3*  lerpVertices;
+    // Vertices are kept as stored in the file, and unpacked when drawn.
+    // Each frame refers to a base frame, and optionally to a compressed
+    // frame holding deltas from it.
+    Model::PackedVertex* baseVertices;
+    uint8_t*             deltas;
+    Model::PackedFrame*  frames;
   };
 
   typedef char TagName[64];
@@ -94,11 +103,14 @@ protected:
   Frame*   frames;
   uint     frameCount;
   TagName* tagNames;
-  Tag*     tags;
+  Tag*     tags;     // tagCount tags per frame
   uint     tagCount;
+  TagCache tagCache;
   Surface* surfaces;
   uint     surfaceCount;
   uint     skinCount;
+
+  SkinBindings skinBindings;
 };
 
 uint32_t MDC::id()
@@ -168,9 +180,9 @@ Model* MDC::read(File& file)
 
     file.seek(tagFrameOffset);
 
-    model->tags = new MDCData::Tag[model->tagCount];
+    model->tags = new MDCData::Tag[model->frameCount * model->tagCount];
 
-    for(uint i = 0; i < model->tagCount; ++i)
+    for(uint i = 0; i < model->frameCount * model->tagCount; ++i)
     {
       MDCData::Tag& tag = model->tags[i];
 
@@ -178,10 +190,25 @@ Model* MDC::read(File& file)
       tag.origin(1) = file.getS16() / 64.0;
       tag.origin(2) = file.getS16() / 64.0;
 
-      tag.angle(0) = file.getS16() * 360.0 / 32767.0;
-      tag.angle(1) = file.getS16() * 360.0 / 32767.0;
-      tag.angle(2) = file.getS16() * 360.0 / 32767.0;
+      // Pitch, yaw and roll, converted to axes once so that tags can be
+      // interpolated like MD3 tags
+      float angles[3];
+
+      for(uint j = 0; j < 3; ++j)
+        angles[j] = file.getS16() * 2 * M_PI / 32767.0;
+
+      float sp = sin(angles[0]), cp = cos(angles[0]);
+      float sy = sin(angles[1]), cy = cos(angles[1]);
+      float sr = sin(angles[2]), cr = cos(angles[2]);
+
+      tag.axis[0] = Vector3(cp * cy, cp * sy, -sp);
+      tag.axis[1] = Vector3(sr * sp * cy - cr * sy, sr * sp * sy + cr * cy,
+                            sr * cp);
+      tag.axis[2] = Vector3(cr * sp * cy + sr * sy, cr * sp * sy - sr * cy,
+                            cr * cp);
     }
+
+    model->tagCache.resize(model->tagCount);
   }
 
   if(model->surfaceCount)
@@ -198,6 +225,8 @@ Model* MDC::read(File& file)
 
       file.read(surface.name, 64);
 
+      model->skinBindings.addSurface(surface.name);
+
       file.getU32(); // Skip flags
 
       uint compFrameCount = file.getU32();
@@ -232,19 +261,14 @@ Model* MDC::read(File& file)
 
       surface.shader = 0;
 
-      for(uint i = 0; i < shaderCount && !surface.shader; ++i)
+      for(uint i = 0; i < shaderCount; ++i)
       {
         char name[64];
 
         file.read(name, 64);
-
-        String shaderName = String(name).replace('\\', '/');
         file.getU32(); // Skip useless integer
 
-        surface.shader = Shader::acquire(shaderName);
-
-        if(!surface.shader)
-          surface.shader = Shader::acquire(String("simple:") + shaderName);
+        surface.shaderNames.push_back(String(name).replace('\\', '/'));
       }
 
       file.seek(texCoordOffset);
@@ -254,95 +278,62 @@ Model* MDC::read(File& file)
       for(uint i = 0; i < surface.vertexCount; ++i)
         surface.textureCoords[i] = file.getVector2();
 
-      surface.lerpVertices = new Vector3[surface.vertexCount];
-
       file.seek(baseVertexOffset);
 
-      Vector3* baseVertices = new Vector3[surface.vertexCount * baseFrameCount];
-      Vector3* baseNormals = new Vector3[surface.vertexCount * baseFrameCount];
+      surface.baseVertices =
+        new Model::PackedVertex[surface.vertexCount * baseFrameCount];
 
-      for(uint i = 0, j = 0; i < baseFrameCount; ++i)
+      for(uint j = 0; j < surface.vertexCount * baseFrameCount; ++j)
       {
-        for(uint k = 0; k < surface.vertexCount; ++k, ++j)
-        {
-          baseVertices[j](0) = file.getS16() / 64.0;
-          baseVertices[j](1) = file.getS16() / 64.0;
-          baseVertices[j](2) = file.getS16() / 64.0;
-
-          float lng = file.getU8() * 2 * M_PI / 255.0;
-          float lat = file.getU8() * 2 * M_PI / 255.0;
-
-          baseNormals[j](0) = cos(lat) * sin(lng);
-          baseNormals[j](1) = sin(lat) * sin(lng);
-          baseNormals[j](2) = cos(lng);
-        }
+        Model::PackedVertex& vertex = surface.baseVertices[j];
+
+        vertex.position[0] = file.getS16();
+        vertex.position[1] = file.getS16();
+        vertex.position[2] = file.getS16();
+
+        vertex.normal[0] = file.getU8(); // Longitude
+        vertex.normal[1] = file.getU8(); // Latitude
       }
 
-      Vector3* compVertices = 0;
-      Vector3* compNormals = 0;
+      // The fourth byte of each delta is a delta normal, which is not
+      // handled
+      surface.deltas = new uint8_t[surface.vertexCount * compFrameCount * 4];
 
       if(compFrameCount)
       {
         file.seek(compVertexOffset);
-
-        compVertices = new Vector3[surface.vertexCount * compFrameCount];
-        compNormals = new Vector3[surface.vertexCount * compFrameCount];
-
-        for(uint i = 0, j = 0; i < compFrameCount; ++i)
-        {
-          for(uint k = 0; k < surface.vertexCount; ++k, ++j)
-          {
-            compVertices[j](0) = (static_cast<int>(file.getU8()) - 127) * 3.0 / 64.0;
-            compVertices[j](1) = (static_cast<int>(file.getU8()) - 127) * 3.0 / 64.0;
-            compVertices[j](2) = (static_cast<int>(file.getU8()) - 127) * 3.0 / 64.0;
-
-            file.getU8(); // XXX: Don't know how to process delta normal
-
-            compNormals[j] = Vector3(0, 0, 0);
-          }
-        }
+        file.read(surface.deltas, surface.vertexCount * compFrameCount * 4);
       }
 
-      surface.frames = new MDCData::Surface::Frame[model->frameCount];
+      surface.frames = new Model::PackedFrame[model->frameCount];
 
       file.seek(baseFrameOffset);
 
       for(uint i = 0; i < model->frameCount; ++i)
       {
-        MDCData::Surface::Frame& frame = surface.frames[i];
-
-        frame.vertices = new Vector3[surface.vertexCount];
-        frame.normals = new Vector3[surface.vertexCount];
+        Model::PackedFrame& frame = surface.frames[i];
 
         uint frameIndex = file.getU16();
 
         if(frameIndex >= baseFrameCount)
-          continue;
+          frameIndex = 0;
 
-        for(uint j = 0; j < surface.vertexCount; ++j)
-        {
-          frame.vertices[j] = baseVertices[frameIndex * surface.vertexCount + j];
-          frame.normals[j] = baseNormals[frameIndex * surface.vertexCount + j];
-        }
+        frame.vertices = baseFrameCount
+                       ? &surface.baseVertices[frameIndex * surface.vertexCount]
+                       : 0;
       }
 
       file.seek(compFrameOffset);
 
       for(uint i = 0; i < model->frameCount; ++i)
       {
-        MDCData::Surface::Frame& frame = surface.frames[i];
+        Model::PackedFrame& frame = surface.frames[i];
 
         uint frameIndex = file.getU16();
 
-        if(frameIndex >= compFrameCount)
-          continue;
-
-        for(uint j = 0; j < surface.vertexCount; ++j)
-        {
-          frame.vertices[j] += compVertices[frameIndex * surface.vertexCount + j];
-          frame.normals[j] += compNormals[frameIndex * surface.vertexCount + j];
-          frame.normals[j].normalize();
-        }
+        frame.deltas = (frameIndex < compFrameCount)
+                     ? &surface.deltas[frameIndex * surface.vertexCount * 4]
+                     : 0;
       }
     }
   }
@@ -350,6 +341,39 @@ Model* MDC::read(File& file)
   return model;
 }
 
+bool MDC::readBounds(File& file, Vector3& mins, Vector3& maxs)
+{
+  file.seek(4 + 4 + 64 + 4); // Magic, version, model name and flags
+
+  uint frameCount = file.getU32();
+
+  file.seek(4 + 4 + 64 + 4 + 4 * 4);
+
+  uint frameOffset = file.getU32();
+
+  if(!frameCount)
+    return false;
+
+  for(uint i = 0; i < frameCount; ++i)
+  {
+    file.seek(frameOffset + i * 56);
+
+    Vector3 min = file.getVector3();
+    Vector3 max = file.getVector3();
+
+    for(uint j = 0; j < 3; ++j)
+    {
+      if(!i || min(j) < mins(j))
+        mins(j) = min(j);
+
+      if(!i || max(j) > maxs(j))
+        maxs(j) = max(j);
+    }
+  }
+
+  return true;
+}
+
 MDCData::~MDCData()
 {
   if(frameCount)
@@ -390,28 +414,73 @@ void MDCData::boundBox(Vector3& mins, Vector3& maxs)
   }
 }
 
-int MDCData::tag(const char* name, Vector3& origin, Vector3 axis[3], int startIndex)
+void MDCData::finishLoading()
 {
-  for(uint i = startIndex; i < tagCount; ++i)
+  for(uint i = 0; i < surfaceCount; ++i)
   {
-    if(!strcmp(tagNames[i], name))
+    Surface& surface = surfaces[i];
+
+    for(uint j = 0; j < surface.shaderNames.size() && !surface.shader; ++j)
     {
-      origin = tags[i].origin;
+      surface.shader = Shader::acquire(surface.shaderNames[j]);
+
+      if(!surface.shader)
+        surface.shader = Shader::acquire(String("simple:")
+                                         + surface.shaderNames[j]);
+    }
 
-      // XXX: Derive from tags[i].axis
-      axis[0] = Vector3(1, 0, 0);
-      axis[1] = Vector3(0, 1, 0);
-      axis[2] = Vector3(0, 0, 1);
+    if(!surface.shader)
+      esWarning << "MDC: Failed to load shader for surface \""
+                << surface.name << "\"." << std::endl;
+  }
+}
 
+int MDCData::tagId(const char* name, int startIndex)
+{
+  for(uint i = std::max(startIndex, 0); i < tagCount; ++i)
+  {
+    if(!strcmp(tagNames[i], name))
       return i;
-    }
   }
 
   return -1;
 }
 
+bool MDCData::tag(int id, int frameIndex, float backLerp, Vector3& origin,
+                  Vector3 axis[3])
+{
+  if(id < 0 || static_cast<uint>(id) >= tagCount || !frameCount)
+    return false;
+
+  if(tagCache.find(id, frameIndex, backLerp, origin, axis))
+    return true;
+
+  uint frame = (frameIndex % static_cast<int>(frameCount) + frameCount)
+             % frameCount;
+  uint lastFrame = frame ? (frame - 1) : (frameCount - 1);
+
+  const Tag& to = tags[frame * tagCount + id];
+  const Tag& from = tags[lastFrame * tagCount + id];
+
+  if(backLerp > 0)
+  {
+    Model::lerpTag(&from.origin, &to.origin, backLerp, origin, axis);
+  }
+  else
+  {
+    origin = to.origin;
+    axis[0] = to.axis[0];
+    axis[1] = to.axis[1];
+    axis[2] = to.axis[2];
+  }
+
+  tagCache.add(id, frameIndex, backLerp, origin, axis);
+
+  return true;
+}
+
 void MDCData::render(int frameIndex, float backLerp,
-                     uint _customShader, uint customSkin)
+                     uint _customShader, uint customSkin, float)
 {
   frameIndex %= frameCount;
 
@@ -424,6 +493,8 @@ void MDCData::render(int frameIndex, float backLerp,
   Skin* skin = customSkin ? Skin::skinForHandle(customSkin)
                           : 0;
 
+  const int* skinSurfaces = skin ? skinBindings.resolve(customSkin, skin) : 0;
+
   Shader* customShader = skin          ? 0
                        : _customShader ? Shader::shaderForHandle(_customShader)
                                        : 0;
@@ -431,32 +502,33 @@ void MDCData::render(int frameIndex, float backLerp,
   for(uint j = 0; j < surfaceCount; ++j)
   {
     const Surface& surface = surfaces[j];
-    const Surface::Frame& frame = surface.frames[frameIndex];
+    const Model::PackedFrame& frame = surface.frames[frameIndex];
 
     Shader* shader = skin                ? 0
                    : customShader        ? customShader
                                          : surface.shader;
 
-    if(!skin && !shader)
+    if(!frame.vertices || (!skin && !shader))
       continue;
 
+    Vector3* vertices = Renderer::frameVectors(surface.vertexCount * 2);
+    Vector3* normals = vertices + surface.vertexCount;
+
     if(backLerp > 0)
     {
-      const Surface::Frame& lastFrame = surface.frames[frameIndex ? (frameIndex - 1) : (frameCount - 1)];
+      const Model::PackedFrame& lastFrame = surface.frames[frameIndex ? (frameIndex - 1) : (frameCount - 1)];
 
-      for(uint i = 0; i < surface.vertexCount; ++i)
-        surface.lerpVertices[i] = lastFrame.vertices[i] * backLerp
-                                + frame.vertices[i] * (1 - backLerp);
-
-
-      Renderer::setVertexArray(surface.lerpVertices);
+      Model::lerpPackedVertices(lastFrame, frame, backLerp,
+                                surface.vertexCount, vertices, normals);
     }
     else // backLerp == 0
     {
-      Renderer::setVertexArray(frame.vertices);
+      Model::unpackVertices(frame, surface.vertexCount, vertices, normals);
     }
 
-    Renderer::setNormalArray(frame.normals);
+    Renderer::setVertexArray(vertices);
+    Renderer::setNormalArray(normals);
+
     Renderer::setTexCoordArray(0, surface.textureCoords);
 
     if(shader)
@@ -467,7 +539,7 @@ void MDCData::render(int frameIndex, float backLerp,
     else // skin
     {
       Renderer::drawTriangles(surface.triangleCount, surface.indexes,
-                              skin, surface.name);
+                              skin, skinSurfaces[j]);
     }
   }
 }
@@ -14,12 +14,22 @@
  *                                                                         *
  ***************************************************************************/
 
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <espace/cvar.h>
 #include <espace/file.h>
 #include <espace/model.h>
 #include <espace/output.h>
 #include <espace/renderer.h>
 #include <espace/shader.h>
 #include <espace/skin.h>
+#include <espace/system.h>
 #include <espace/vector.h>
 #include <espace/quat.h>
 
@@ -30,15 +40,24 @@ class MDSData : public Model
 public:
 
   void boundBox(Vector3& mins, Vector3& maxs);
-  int  tag(const char* name, Vector3& origin, Vector3 axis[3], int startIndex);
-  void render(int frame, float backLerp, uint customShader, uint customSkin);
+  void finishLoading();
+  int  tagId(const char* name, int startIndex);
+  bool tag(int id, int frame, float backLerp, Vector3& origin,
+           Vector3 axis[3]);
+  void render(int frame, float backLerp, uint customShader, uint customSkin,
+              float projectedRadius);
+  void prepare(int frame, float backLerp, float projectedRadius);
 
 protected:
 
   friend class MDS;
 
+  MDSData();
   ~MDSData();
 
+  // Number of levels of detail below the full model
+  enum { lodSteps = 16 };
+
   class Frame
   {
   public:
@@ -105,7 +124,6 @@ protected:
     {
       if(vertexCount)
       {
-        delete [] vertices;
         delete [] normals;
         delete [] textureCoords;
         delete [] collapseMap;
@@ -116,32 +134,63 @@ protected:
         delete [] boneRefs;
     }
 
-    class Vertex
+    enum { noVertex = ~0U };
+
+    // Vertices are skinned four at a time, in batches of vertices with the
+    // same number of weights.  The weights of a batch are stored as one
+    // structure of arrays per weight.
+    class SkinBatch
     {
     public:
 
-      class Weight
-      {
-      public:
+      uint weightCount;
+      uint firstWeight;
+      uint vertices[4]; // noVertex for padding, otherwise increasing
+    };
+
+    static bool firstVertexBefore(const SkinBatch& lhs, const SkinBatch& rhs)
+    {
+      return lhs.vertices[0] < rhs.vertices[0];
+    }
+
+    class SkinWeights
+    {
+    public:
 
-        uint    bone;
-        float   weight;
-        Vector3 position;
-      };
+      uint  bones[4];
+      float weights[4];
+      float x[4];
+      float y[4];
+      float z[4];
+    };
 
-      Weight* weights;
-      uint    weightCount;
+    // Vertices are ordered by importance, so a level of detail keeps the
+    // first vertexCount vertices, with the others replaced through the
+    // collapse map.  Index lists are built the first time a level is drawn.
+    class Lod
+    {
+    public:
 
-      uint  fixedParent;
-      float fixedDist;
+      uint              vertexCount;
+      uint              batchCount; // Skin batches covering the vertices
+      bool              built;
+      const uint*       indexes;
+      uint              triangleCount;
+      std::vector<uint> collapsedIndexes;
     };
 
     char     name[64];
+    char     shaderName[64]; // Acquired by finishLoading()
     Shader*  shader;
 
     int      minLod;
 
-    Vertex*  vertices;
+    std::vector<SkinBatch>   skinBatches; // Sorted by first vertex
+    std::vector<SkinWeights> skinWeights;
+    uint                     firstVertex; // Offset in Instance::vertices
+
+    Lod      lods[lodSteps + 1];
+
     Vector3* normals;
     Vector2* textureCoords;
     uint*    collapseMap;
@@ -151,7 +200,6 @@ protected:
     uint*    boneRefs;
     uint     boneRefCount;
 
-    Vector3* lerpVertices;
     Color*   colors;
   };
 
@@ -161,10 +209,69 @@ protected:
 
     Vector3   offset;
     Quat      orientation;
-    Matrix4x4 inverse;
     float     frame;
   };
 
+  /**
+   * Bones posed at one animation time, and their palette for skinning.
+   *
+   * Poses are computed on the main thread by pose(), and shared by the
+   * instances and tag lookups with the same animation time.  A pose is only
+   * recomputed for a new time when it has not been used in the current
+   * round.
+   */
+  class Pose
+  {
+  public:
+
+    float                 time;
+    uint                  round;   // Last round the pose was used in
+    std::vector<LerpBone> bones;
+    std::vector<float>    palette; // See pose()
+  };
+
+  std::vector<Pose*> poses;
+
+  /**
+   * Skinned vertices for one animation time.
+   *
+   * prepare() queues an instance for the skinning threads, and render()
+   * waits for it.  Entities drawn with the same frame and backLerp share an
+   * instance.  Only the skinning thread touches the vertices while the
+   * instance is queued, and its pose must not change until then.
+   */
+  class Instance
+  {
+  public:
+
+    enum State
+    {
+      Idle,
+      Queued,
+      Ready
+    };
+
+    MDSData* model;
+    float    time;
+    uint     lodStep; // Vertices of lower levels of detail are skinned too
+    State    state;
+    uint     round;  // Prepare round the instance belongs to
+    void*    done;   // Posted by the skinning thread
+
+    const Pose*           pose;
+    std::vector<Vector3>  vertices; // All surfaces
+  };
+
+  std::vector<Instance*> instances;
+  Instance               immediate; // For render() without prepare()
+
+  // prepare() starts a new round after render() has been called, after
+  // which the instances of older rounds may be reused
+  uint      round;
+  bool      rendering;
+
+  uint      totalVertexCount;
+
   float     lodScale;
   float     lodBias;
 
@@ -172,7 +279,6 @@ protected:
   uint      frameCount;
 
   Bone*     bones;
-  LerpBone* lerpBones;
   uint      boneCount;
 
   uint      torsoParent;
@@ -180,12 +286,46 @@ protected:
   Surface*  surfaces;
   uint      surfaceCount;
 
+  SkinBindings skinBindings;
+
   Tag*      tags;
   uint      tagCount;
-
-  void      updateBone(uint bone, float frame = 0);
+  TagCache  tagCache;
+
+  float     animationTime(int frame, float backLerp);
+  uint      lodStep(float projectedRadius);
+  const Surface::Lod& surfaceLod(Surface& surface, uint step);
+  void      updateBone(LerpBone* pose, uint bone, float time);
+  const Pose* pose(float time);
+  void      skin(Instance& instance);
+
+  static void skinSurface(const Surface& surface, uint batchCount,
+                          const float* palette, uint boneCount,
+                          Vector3* output);
+
+  static std::deque<Instance*> skinQueue;
+  static void*                 skinMutex;
+  static void*                 skinSemaphore;
+  static uint                  skinThreadCount;
+  static bool                  skinThreadsDisabled;
+
+  static bool startSkinning();
+  static void skinLoop(void*);
 };
 
+std::deque<MDSData::Instance*> MDSData::skinQueue;
+void*                          MDSData::skinMutex;
+void*                          MDSData::skinSemaphore;
+uint                           MDSData::skinThreadCount = 0;
+bool                           MDSData::skinThreadsDisabled = false;
+
+namespace
+{
+  CVar lodBiasCVar;
+  CVar lodScaleCVar;
+  bool lodCVarsAcquired = false;
+}
+
 uint32_t MDS::id()
 {
   return 0x4D445358; // "MDSW"
@@ -279,7 +419,6 @@ Model* MDS::read(File& file)
     file.seek(boneOffset);
 
     model->bones = new MDSData::Bone[model->boneCount];
-    model->lerpBones = new MDSData::LerpBone[model->boneCount];
 
     for(uint i = 0; i < model->boneCount; ++i)
     {
@@ -291,8 +430,6 @@ Model* MDS::read(File& file)
       bone.torsoWeight = file.getFloat();
       bone.parentDistance = file.getFloat();
       bone.flags = file.getU32();
-
-      model->lerpBones[i].frame = -1;
     }
   }
 
@@ -310,22 +447,13 @@ Model* MDS::read(File& file)
 
       file.read(surface.name, 64);
 
-      char shaderName[64];
-      file.read(shaderName, 64);
+      model->skinBindings.addSurface(surface.name);
 
-      file.skip(4); // Space reserved in file for shader handle
+      file.read(surface.shaderName, 64);
 
-      if(strlen(shaderName))
-      {
-        surface.shader = Shader::acquire(String(shaderName).replace('\\', '/'));
+      file.skip(4); // Space reserved in file for shader handle
 
-        if(!surface.shader)
-          esWarning << "MDS: Failed to acquire shader \"" << shaderName << "\"." << std::endl;
-      }
-      else
-      {
-        surface.shader = 0;
-      }
+      surface.shader = 0;
 
       surface.minLod = file.getS32();
 
@@ -344,46 +472,120 @@ Model* MDS::read(File& file)
 
       surfaceOffset += file.getU32();
 
+      surface.firstVertex = model->totalVertexCount;
+      model->totalVertexCount += surface.vertexCount;
+
       if(surface.vertexCount)
       {
         file.seek(vertexOffset);
 
-        surface.vertices = new MDSData::Surface::Vertex[surface.vertexCount];
         surface.normals = new Vector3[surface.vertexCount];
         surface.textureCoords = new Vector2[surface.vertexCount];
-        surface.lerpVertices = new Vector3[surface.vertexCount];
         surface.colors = new Color[surface.vertexCount];
 
+        std::vector<uint>    weightCounts(surface.vertexCount);
+        std::vector<uint>    firstWeights(surface.vertexCount);
+        std::vector<uint>    weightBones;
+        std::vector<float>   weightValues;
+        std::vector<Vector3> weightPositions;
+        uint                 maxWeightCount = 0;
+
         for(uint j = 0; j < surface.vertexCount; ++j)
         {
-          MDSData::Surface::Vertex& vertex = surface.vertices[j];
-
           surface.normals[j] = file.getVector3();
           surface.textureCoords[j] = file.getVector2();
 
-          vertex.weightCount = file.getU32();
-          vertex.fixedParent = file.getU32();
-          vertex.fixedDist = file.getFloat();
+          weightCounts[j] = file.getU32();
+          firstWeights[j] = weightBones.size();
+
+          file.skip(8); // Fixed parent and distance
+
+          maxWeightCount = std::max(maxWeightCount, weightCounts[j]);
+
+          for(uint k = 0; k < weightCounts[j]; ++k)
+          {
+            uint bone = file.getU32();
+
+            weightBones.push_back((bone < model->boneCount) ? bone : 0);
+            weightValues.push_back(file.getFloat());
+            weightPositions.push_back(file.getVector3());
+          }
+        }
+
+        // Group vertices with the same number of weights four by four, so
+        // that they can be skinned together
+        for(uint weightCount = 0; weightCount <= maxWeightCount; ++weightCount)
+        {
+          std::vector<uint> group;
 
-          if(vertex.weightCount)
-            vertex.weights = new MDSData::Surface::Vertex::Weight[vertex.weightCount];
+          for(uint j = 0; j < surface.vertexCount; ++j)
+          {
+            if(weightCounts[j] == weightCount)
+              group.push_back(j);
+          }
 
-          for(uint k = 0; k < vertex.weightCount; ++k)
+          for(uint j = 0; j < group.size(); j += 4)
           {
-            MDSData::Surface::Vertex::Weight& weight = vertex.weights[k];
+            MDSData::Surface::SkinBatch batch;
+
+            batch.weightCount = weightCount;
+            batch.firstWeight = surface.skinWeights.size();
+
+            for(uint lane = 0; lane < 4; ++lane)
+            {
+              batch.vertices[lane] = (j + lane < group.size())
+                                   ? group[j + lane]
+                                   : MDSData::Surface::noVertex;
+            }
+
+            for(uint k = 0; k < weightCount; ++k)
+            {
+              MDSData::Surface::SkinWeights weights;
+
+              for(uint lane = 0; lane < 4; ++lane)
+              {
+                uint vertex = batch.vertices[lane];
+
+                if(vertex == MDSData::Surface::noVertex)
+                {
+                  weights.bones[lane] = 0;
+                  weights.weights[lane] = 0;
+                  weights.x[lane] = weights.y[lane] = weights.z[lane] = 0;
 
-            weight.bone = file.getU32();
-            weight.weight = file.getFloat();
-            weight.position = file.getVector3();
+                  continue;
+                }
+
+                uint weight = firstWeights[vertex] + k;
+
+                weights.bones[lane] = weightBones[weight];
+                weights.weights[lane] = weightValues[weight];
+                weights.x[lane] = weightPositions[weight](0);
+                weights.y[lane] = weightPositions[weight](1);
+                weights.z[lane] = weightPositions[weight](2);
+              }
+
+              surface.skinWeights.push_back(weights);
+            }
+
+            surface.skinBatches.push_back(batch);
           }
         }
 
+        std::sort(surface.skinBatches.begin(), surface.skinBatches.end(),
+                  MDSData::Surface::firstVertexBefore);
+
         file.seek(collapseMapOffset);
 
         surface.collapseMap = new uint[surface.vertexCount];
 
         for(uint j = 0; j < surface.vertexCount; ++j)
+        {
           surface.collapseMap[j] = file.getU32();
+
+          // Vertices can only collapse into more important ones
+          if(surface.collapseMap[j] >= j)
+            surface.collapseMap[j] = 0;
+        }
       }
 
       if(surface.triangleCount)
@@ -409,6 +611,30 @@ Model* MDS::read(File& file)
         for(uint j = 0; j < surface.boneRefCount; ++j)
           surface.boneRefs[j] = file.getU32();
       }
+
+      for(uint step = 0; step <= MDSData::lodSteps; ++step)
+      {
+        MDSData::Surface::Lod& lod = surface.lods[step];
+
+        uint count = surface.vertexCount * step / MDSData::lodSteps;
+
+        if(static_cast<int>(count) < surface.minLod)
+        {
+          count = std::min(static_cast<uint>(surface.minLod),
+                           surface.vertexCount);
+        }
+
+        MDSData::Surface::SkinBatch end;
+
+        end.vertices[0] = count;
+
+        lod.vertexCount = count;
+        lod.batchCount = std::lower_bound(surface.skinBatches.begin(),
+                                          surface.skinBatches.end(), end,
+                                          MDSData::Surface::firstVertexBefore)
+                       - surface.skinBatches.begin();
+        lod.built = false;
+      }
     }
   }
 
@@ -427,21 +653,80 @@ Model* MDS::read(File& file)
       tag.torsoWeight = file.getFloat();
       tag.boneIndex = file.getU32();
     }
+
+    model->tagCache.resize(model->tagCount);
   }
 
   return model;
 }
 
+MDSData::MDSData()
+  : round(0),
+    rendering(false),
+    totalVertexCount(0)
+{
+  immediate.model = this;
+  immediate.state = Instance::Idle;
+  immediate.round = 0;
+  immediate.lodStep = lodSteps;
+  immediate.pose = 0;
+  immediate.done = 0;
+}
+
+bool MDS::readBounds(File& file, Vector3& mins, Vector3& maxs)
+{
+  file.seek(4 + 4 + 64 + 4 + 4); // Magic, version, model name and LOD
+
+  uint frameCount = file.getU32();
+  uint boneCount = file.getU32();
+
+  file.seek(4 + 4 + 64 + 4 + 4 + 4 + 4);
+
+  uint frameOffset = file.getU32();
+
+  if(!frameCount)
+    return false;
+
+  for(uint i = 0; i < frameCount; ++i)
+  {
+    file.seek(frameOffset + i * (13 * 4 + boneCount * 12));
+
+    Vector3 min = file.getVector3();
+    Vector3 max = file.getVector3();
+
+    for(uint j = 0; j < 3; ++j)
+    {
+      if(!i || min(j) < mins(j))
+        mins(j) = min(j);
+
+      if(!i || max(j) > maxs(j))
+        maxs(j) = max(j);
+    }
+  }
+
+  return true;
+}
+
 MDSData::~MDSData()
 {
+  for(uint i = 0; i < instances.size(); ++i)
+  {
+    if(instances[i]->state == Instance::Queued)
+      System::waitSemaphore(instances[i]->done);
+
+    System::destroySemaphore(instances[i]->done);
+
+    delete instances[i];
+  }
+
+  for(uint i = 0; i < poses.size(); ++i)
+    delete poses[i];
+
   if(frameCount)
     delete [] frames;
 
   if(boneCount)
-  {
     delete [] bones;
-    delete [] lerpBones;
-  }
 
   if(tagCount)
     delete [] tags;
@@ -472,44 +757,268 @@ void MDSData::boundBox(Vector3& mins, Vector3& maxs)
   }
 }
 
-int MDSData::tag(const char* name, Vector3& origin, Vector3 axis[3], int startIndex)
+void MDSData::finishLoading()
+{
+  for(uint i = 0; i < surfaceCount; ++i)
+  {
+    Surface& surface = surfaces[i];
+
+    if(!strlen(surface.shaderName))
+      continue;
+
+    surface.shader =
+      Shader::acquire(String(surface.shaderName).replace('\\', '/'));
+
+    if(!surface.shader)
+      esWarning << "MDS: Failed to acquire shader \"" << surface.shaderName
+                << "\"." << std::endl;
+  }
+}
+
+int MDSData::tagId(const char* name, int startIndex)
 {
-  for(uint i = startIndex; i < tagCount; ++i)
+  for(uint i = std::max(startIndex, 0); i < tagCount; ++i)
   {
     if(!strcmp(tags[i].name, name))
+      return i;
+  }
+
+  return -1;
+}
+
+bool MDSData::tag(int id, int frameIndex, float backLerp, Vector3& origin,
+                  Vector3 axis[3])
+{
+  if(id < 0 || static_cast<uint>(id) >= tagCount
+  || !frameCount || !boneCount)
+    return false;
+
+  if(tagCache.find(id, frameIndex, backLerp, origin, axis))
+    return true;
+
+  const Tag& tag = tags[id];
+  const LerpBone* posed = &pose(animationTime(frameIndex, backLerp))->bones[0];
+
+  origin = posed[tag.boneIndex].offset * (1 - tag.torsoWeight)
+         + posed[torsoParent].offset   * tag.torsoWeight;
+
+  Quat orientation = posed[tag.boneIndex].orientation
+                   .slerp(posed[torsoParent].orientation, tag.torsoWeight);
+
+  orientation.matrix(*(new(axis) Matrix3x3));
+
+  tagCache.add(id, frameIndex, backLerp, origin, axis);
+
+  return true;
+}
+
+float MDSData::animationTime(int frameIndex, float backLerp)
+{
+  frameIndex %= frameCount;
+
+  if(frameIndex < 0)
+    frameIndex += frameCount;
+
+  float time = frameIndex - backLerp;
+
+  if(time < 0)
+    time += frameCount;
+
+  return time;
+}
+
+/**
+ * Chooses a level of detail, 0 being the coarsest and lodSteps the full
+ * model.
+ */
+uint MDSData::lodStep(float projectedRadius)
+{
+  if(projectedRadius <= 0)
+    return lodSteps;
+
+  if(!lodCVarsAcquired)
+  {
+    lodBiasCVar = CVar::acquire("r_lodbias", "0", CVar::Archive);
+    lodScaleCVar = CVar::acquire("r_lodscale", "5", CVar::Archive);
+
+    lodCVarsAcquired = true;
+  }
+  else
+  {
+    lodBiasCVar.update();
+    lodScaleCVar.update();
+  }
+
+  float lod = projectedRadius * lodScaleCVar.value * lodScale
+            - (0.25 * lodBiasCVar.value + lodBias);
+
+  if(lod <= 0)
+    return 0;
+
+  if(lod >= 1)
+    return lodSteps;
+
+  return static_cast<uint>(ceil(lod * lodSteps));
+}
+
+const MDSData::Surface::Lod& MDSData::surfaceLod(Surface& surface, uint step)
+{
+  Surface::Lod& lod = surface.lods[step];
+
+  if(lod.built)
+    return lod;
+
+  lod.built = true;
+
+  if(lod.vertexCount == surface.vertexCount)
+  {
+    lod.indexes = surface.indexes;
+    lod.triangleCount = surface.triangleCount;
+
+    return lod;
+  }
+
+  if(lod.vertexCount)
+  {
+    for(uint i = 0; i < surface.triangleCount * 3; i += 3)
     {
-      updateBone(tags[i].boneIndex);
-      updateBone(torsoParent);
+      uint triangle[3];
 
-      origin = lerpBones[tags[i].boneIndex].offset * (1 - tags[i].torsoWeight)
-             + lerpBones[torsoParent].offset       * tags[i].torsoWeight;
+      for(uint j = 0; j < 3; ++j)
+      {
+        uint index = surface.indexes[i + j];
 
-      Quat orientation = lerpBones[tags[i].boneIndex].orientation
-                       .slerp(lerpBones[torsoParent].orientation,
-                              tags[i].torsoWeight);
+        while(index >= lod.vertexCount)
+          index = surface.collapseMap[index];
 
-      orientation.matrix(*(new(axis) Matrix3x3));
+        triangle[j] = index;
+      }
 
-      return i;
+      // Skip triangles that collapsed into lines or points
+      if(triangle[0] == triangle[1] || triangle[1] == triangle[2]
+      || triangle[2] == triangle[0])
+        continue;
+
+      lod.collapsedIndexes.insert(lod.collapsedIndexes.end(),
+                                  triangle, triangle + 3);
     }
   }
 
-  return -1;
+  lod.triangleCount = lod.collapsedIndexes.size() / 3;
+  lod.indexes = lod.triangleCount ? &lod.collapsedIndexes[0] : 0;
+
+  return lod;
+}
+
+void MDSData::prepare(int frameIndex, float backLerp, float projectedRadius)
+{
+  if(!frameCount || !totalVertexCount || !startSkinning())
+    return;
+
+  if(rendering)
+  {
+    ++round;
+    rendering = false;
+  }
+
+  float time = animationTime(frameIndex, backLerp);
+  uint step = lodStep(projectedRadius);
+
+  Instance* instance = 0;
+
+  for(uint i = 0; i < instances.size(); ++i)
+  {
+    if(instances[i]->round == round)
+    {
+      if(instances[i]->time == time && instances[i]->lodStep >= step)
+        return;
+
+      continue;
+    }
+
+    if(!instance)
+      instance = instances[i];
+  }
+
+  if(instance)
+  {
+    if(instance->state == Instance::Queued)
+    {
+      System::waitSemaphore(instance->done);
+
+      instance->state = Instance::Ready;
+    }
+  }
+  else
+  {
+    instance = new Instance;
+    instance->model = this;
+    instance->done = System::createSemaphore();
+
+    instances.push_back(instance);
+  }
+
+  instance->time = time;
+  instance->lodStep = step;
+  instance->pose = pose(time);
+  instance->state = Instance::Queued;
+  instance->round = round;
+
+  System::lockMutex(skinMutex);
+
+  skinQueue.push_back(instance);
+
+  System::unlockMutex(skinMutex);
+
+  System::postSemaphore(skinSemaphore);
 }
 
 void MDSData::render(int frameIndex, float backLerp,
-                     uint _customShader, uint customSkin)
+                     uint _customShader, uint customSkin,
+                     float projectedRadius)
 {
-  frameIndex %= frameCount;
+  if(!frameCount)
+    return;
+
+  rendering = true;
+
+  float time = animationTime(frameIndex, backLerp);
+  uint step = lodStep(projectedRadius);
+
+  Instance* instance = 0;
+
+  for(uint i = 0; i < instances.size(); ++i)
+  {
+    if(instances[i]->round == round && instances[i]->time == time
+    && instances[i]->lodStep >= step)
+    {
+      instance = instances[i];
+
+      if(instance->state == Instance::Queued)
+      {
+        System::waitSemaphore(instance->done);
+
+        instance->state = Instance::Ready;
+      }
 
-  if(backLerp == 1)
+      break;
+    }
+  }
+
+  if(!instance)
   {
-    frameIndex = frameIndex ? (frameIndex - 1) : (frameCount - 1);
-    backLerp = 0;
+    instance = &immediate;
+    instance->time = time;
+    instance->lodStep = step;
+    instance->pose = pose(time);
+
+    skin(*instance);
   }
 
   Skin* skin = customSkin ? Skin::skinForHandle(customSkin) : 0;
 
+  const int* skinSurfaces = skin ? skinBindings.resolve(customSkin, skin) : 0;
+
   Shader* customShader = skin          ? 0
                        : _customShader ? Shader::shaderForHandle(_customShader)
                                        : 0;
@@ -525,62 +1034,46 @@ void MDSData::render(int frameIndex, float backLerp,
     if(!skin && !shader)
       continue;
 
-    Renderer::setVertexArray(surface.lerpVertices);
-    Renderer::setColorArray(surface.colors);
-    Renderer::setTexCoordArray(0, surface.textureCoords);
-
-    for(uint i = 0; i < surface.boneRefCount; ++i)
-      updateBone(surface.boneRefs[i]);
-
-    // Set all lerpVertices to (0, 0, 0)
-    memset(surface.lerpVertices, 0, sizeof(Vector3) * surface.vertexCount);
-
-    for(uint i = 0; i < surface.vertexCount; ++i)
-    {
-      Surface::Vertex& vertex = surface.vertices[i];
+    const Surface::Lod& lod = surfaceLod(surface, step);
 
-      for(uint j = 0; j < vertex.weightCount; ++j)
-      {
-        Surface::Vertex::Weight& weight = vertex.weights[j];
+    if(!lod.triangleCount)
+      continue;
 
-        surface.lerpVertices[i]
-          += weight.weight * (weight.position * lerpBones[weight.bone].inverse);
-      }
-    }
+    Renderer::setVertexArray(&instance->vertices[surface.firstVertex]);
+    Renderer::setColorArray(surface.colors);
+    Renderer::setTexCoordArray(0, surface.textureCoords);
 
     if(shader)
     {
-      Renderer::drawTriangles(surface.triangleCount, surface.indexes,
-                              shader);
+      Renderer::drawTriangles(lod.triangleCount, lod.indexes, shader);
     }
     else // skin
     {
-      Renderer::drawTriangles(surface.triangleCount, surface.indexes,
-                              skin, surface.name);
+      Renderer::drawTriangles(lod.triangleCount, lod.indexes,
+                              skin, skinSurfaces[i]);
     }
   }
 }
 
-void MDSData::updateBone(uint bone, float frame)
+void MDSData::updateBone(LerpBone* pose, uint bone, float time)
 {
-  LerpBone& lerpBone = lerpBones[bone];
+  LerpBone& lerpBone = pose[bone];
 
-  if(lerpBone.frame == frame)
+  if(lerpBone.frame == time)
     return;
 
-  lerpBone.frame = frame;
+  lerpBone.frame = time;
 
   if(bone == 0)
   {
     lerpBone.orientation.identity();
     lerpBone.offset = Vector3(0, 0, 0);
-    lerpBone.inverse.identity();
 
     return;
   }
 
   double _intFrame;
-  float fraction = modf(frame, &_intFrame);
+  float fraction = modf(time, &_intFrame);
 
   int intFrame = static_cast<int>(_intFrame) % frameCount;
 
@@ -603,23 +1096,274 @@ void MDSData::updateBone(uint bone, float frame)
   }
   else
   {
-    updateBone(baseBone.parent, frame);
+    updateBone(pose, baseBone.parent, time);
+
+    lerpBone.offset += pose[baseBone.parent].offset;
+  }
+}
+
+/**
+ * Returns the skeleton posed at the specified time, computing it unless it
+ * is cached.
+ *
+ * The palette holds the bone transforms as a structure of arrays: the
+ * coefficient of input component k in output component j for bone b is
+ * palette[(j * 4 + k) * boneCount + b], with k = 3 being the offset.
+ */
+const MDSData::Pose* MDSData::pose(float time)
+{
+  Pose* pose = 0;
+
+  for(uint i = 0; i < poses.size(); ++i)
+  {
+    if(poses[i]->time == time)
+    {
+      poses[i]->round = round;
+
+      return poses[i];
+    }
 
-    lerpBone.offset += lerpBones[baseBone.parent].offset;
+    // Reuse the pose that has gone unused the longest
+    if(poses[i]->round != round
+    && (!pose || round - poses[i]->round > round - pose->round))
+      pose = poses[i];
   }
 
-  Matrix3x3 tmp = lerpBones[bone].orientation.matrix();
+  if(pose)
+  {
+    // Queued instances of older rounds may still be reading the palette
+    for(uint i = 0; i < instances.size(); ++i)
+    {
+      if(instances[i]->pose == pose && instances[i]->state == Instance::Queued)
+      {
+        System::waitSemaphore(instances[i]->done);
 
-  for(uint i = 0; i < 3; ++i)
+        instances[i]->state = Instance::Ready;
+      }
+    }
+  }
+  else
   {
+    pose = new Pose;
+    pose->bones.resize(boneCount);
+    pose->palette.resize(boneCount * 12);
+
+    poses.push_back(pose);
+  }
+
+  pose->time = time;
+  pose->round = round;
+
+  for(uint i = 0; i < boneCount; ++i)
+    pose->bones[i].frame = -1;
+
+  for(uint i = 0; i < boneCount; ++i)
+  {
+    LerpBone& bone = pose->bones[i];
+
+    updateBone(&pose->bones[0], i, time);
+
+    Matrix3x3 rotation = bone.orientation.matrix();
+
     for(uint j = 0; j < 3; ++j)
-      lerpBone.inverse(i, j) = tmp(j, i);
+    {
+      for(uint k = 0; k < 3; ++k)
+        pose->palette[(j * 4 + k) * boneCount + i] = rotation(j, k);
+
+      pose->palette[(j * 4 + 3) * boneCount + i] = bone.offset(j);
+    }
+  }
+
+  return pose;
+}
 
-    lerpBone.inverse(3, i) = lerpBone.offset(i);
-    lerpBone.inverse(i, 3) = 0;
+/**
+ * Skins the vertices of the instance's level of detail.
+ */
+void MDSData::skin(Instance& instance)
+{
+  instance.vertices.resize(totalVertexCount);
+
+  if(!boneCount)
+    return;
+
+  // Only the vertices used by the level of detail are skinned
+  for(uint i = 0; i < surfaceCount; ++i)
+  {
+    Surface& surface = surfaces[i];
+
+    if(!surface.vertexCount)
+      continue;
+
+    skinSurface(surface, surface.lods[instance.lodStep].batchCount,
+                &instance.pose->palette[0], boneCount,
+                &instance.vertices[surface.firstVertex]);
   }
+}
 
-  lerpBone.inverse(3, 3) = 1;
+void MDSData::skinSurface(const Surface& surface, uint batchCount,
+                          const float* palette, uint boneCount,
+                          Vector3* output)
+{
+  for(uint i = 0; i < batchCount; ++i)
+  {
+    const Surface::SkinBatch& batch = surface.skinBatches[i];
+    const Surface::SkinWeights* weights = &surface.skinWeights[batch.firstWeight];
+
+    float x[4], y[4], z[4];
+
+#ifdef __SSE2__
+    __m128 sumX = _mm_setzero_ps();
+    __m128 sumY = _mm_setzero_ps();
+    __m128 sumZ = _mm_setzero_ps();
+
+    for(uint j = 0; j < batch.weightCount; ++j)
+    {
+      const Surface::SkinWeights& w = weights[j];
+
+      __m128 px = _mm_loadu_ps(w.x);
+      __m128 py = _mm_loadu_ps(w.y);
+      __m128 pz = _mm_loadu_ps(w.z);
+      __m128 weight = _mm_loadu_ps(w.weights);
+
+      __m128 result[3];
+
+      for(uint k = 0; k < 3; ++k)
+      {
+        const float* row = palette + k * 4 * boneCount;
+
+        __m128 m0 = _mm_setr_ps(row[w.bones[0]], row[w.bones[1]],
+                                row[w.bones[2]], row[w.bones[3]]);
+        row += boneCount;
+        __m128 m1 = _mm_setr_ps(row[w.bones[0]], row[w.bones[1]],
+                                row[w.bones[2]], row[w.bones[3]]);
+        row += boneCount;
+        __m128 m2 = _mm_setr_ps(row[w.bones[0]], row[w.bones[1]],
+                                row[w.bones[2]], row[w.bones[3]]);
+        row += boneCount;
+        __m128 m3 = _mm_setr_ps(row[w.bones[0]], row[w.bones[1]],
+                                row[w.bones[2]], row[w.bones[3]]);
+
+        result[k] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, px),
+                                          _mm_mul_ps(m1, py)),
+                               _mm_add_ps(_mm_mul_ps(m2, pz), m3));
+      }
+
+      sumX = _mm_add_ps(sumX, _mm_mul_ps(result[0], weight));
+      sumY = _mm_add_ps(sumY, _mm_mul_ps(result[1], weight));
+      sumZ = _mm_add_ps(sumZ, _mm_mul_ps(result[2], weight));
+    }
+
+    _mm_storeu_ps(x, sumX);
+    _mm_storeu_ps(y, sumY);
+    _mm_storeu_ps(z, sumZ);
+#else
+    for(uint lane = 0; lane < 4; ++lane)
+      x[lane] = y[lane] = z[lane] = 0;
+
+    for(uint j = 0; j < batch.weightCount; ++j)
+    {
+      const Surface::SkinWeights& w = weights[j];
+
+      for(uint lane = 0; lane < 4; ++lane)
+      {
+        uint bone = w.bones[lane];
+        float result[3];
+
+        for(uint k = 0; k < 3; ++k)
+        {
+          const float* row = palette + k * 4 * boneCount + bone;
+
+          result[k] = row[0] * w.x[lane]
+                    + row[boneCount] * w.y[lane]
+                    + row[2 * boneCount] * w.z[lane]
+                    + row[3 * boneCount];
+        }
+
+        x[lane] += result[0] * w.weights[lane];
+        y[lane] += result[1] * w.weights[lane];
+        z[lane] += result[2] * w.weights[lane];
+      }
+    }
+#endif
+
+    for(uint lane = 0; lane < 4; ++lane)
+    {
+      if(batch.vertices[lane] == Surface::noVertex)
+        break;
+
+      output[batch.vertices[lane]] = Vector3(x[lane], y[lane], z[lane]);
+    }
+  }
+}
+
+/**
+ * Starts the skinning threads, unless they are already running.
+ *
+ * Returns false if skinning should be done by render() instead.
+ */
+bool MDSData::startSkinning()
+{
+  if(skinThreadCount)
+    return true;
+
+  if(skinThreadsDisabled)
+    return false;
+
+  CVar threads = CVar::acquire("r_skinthreads", "2", CVar::Archive);
+
+  if(threads.integer <= 0)
+  {
+    skinThreadsDisabled = true;
+
+    return false;
+  }
+
+  skinMutex = System::createMutex();
+  skinSemaphore = System::createSemaphore();
+
+  for(int i = 0; i < threads.integer; ++i)
+  {
+    if(!System::createThread(skinLoop, 0))
+      break;
+
+    ++skinThreadCount;
+  }
+
+  if(!skinThreadCount)
+  {
+    esWarning << "MDS: Failed to start skinning threads.  Models will be "
+                 "skinned while drawn." << std::endl;
+
+    System::destroySemaphore(skinSemaphore);
+    System::destroyMutex(skinMutex);
+
+    skinThreadsDisabled = true;
+
+    return false;
+  }
+
+  return true;
+}
+
+void MDSData::skinLoop(void*)
+{
+  for(;;)
+  {
+    System::waitSemaphore(skinSemaphore);
+
+    System::lockMutex(skinMutex);
+
+    Instance* instance = skinQueue.front();
+
+    skinQueue.pop_front();
+
+    System::unlockMutex(skinMutex);
+
+    instance->model->skin(*instance);
+
+    System::postSemaphore(instance->done);
+  }
 }
 
 // vim: ts=2 sw=2 et
@@ -17,7 +17,11 @@
 #include <map>
 #include <vector>
 
+#include <ctype.h>
+#include <math.h>
+
 #include <espace/color.h>
+#include <espace/cvar.h>
 #include <espace/file.h>
 #include <espace/texture.h>
 #include <espace/opengl.h>
@@ -46,6 +50,9 @@ public:
   uint sort() const;
   Renderer::Face cullFace() const;
 
+  uint deformCount() const;
+  const Deform* deforms() const;
+
   class Map
   {
   public:
@@ -128,16 +135,44 @@ public:
 
   std::vector<Map> maps;
 
+  /**
+   * Time-dependent parameters of a stage, evaluated once per value of
+   * Shader::time.
+   */
+  class StageState
+  {
+  public:
+
+    float rgbWave;
+    uint  texture;
+    bool  hasTextureMatrix;
+    float textureMatrix[16];
+  };
+
+  std::vector<StageState> states;
+  float stateTime;
+
+  void updateStates();
+
+  /**
+   * A rendering pass, drawing one stage or two stages combined with
+   * multitexturing.
+   */
+  class Pass
+  {
+  public:
+
+    uint stage;
+    uint stageCount;
+    Renderer::EnvMode combine;
+  };
+
+  std::vector<Pass> passes;
+
+  void compilePasses();
+
   Renderer::Face _cullFace;
-  WaveForm deformVertsWave;
-  float    deformVertsBase;
-  float    deformVertsAmp;
-  float    deformVertsPhase;
-  float    deformVertsFreq;
-  float    deformVertsBulgeWidth;
-  float    deformVertsBulgeHeight;
-  float    deformVertsBulgeSpeed;
-  Vector3  deformVertsDir;
+  std::vector<Deform> deformList;
   bool     fog;
   Color    fogColor;
   float    fogDistance; // distance until fogs becomes totally opaque
@@ -170,10 +205,42 @@ public:
 
   static bool tcGen;
   static bool lighting;
+  static bool multitexture;
 };
 
 namespace
 {
+  /**
+   * Position of a shader definition, from its name to its closing brace.
+   */
+  class Location
+  {
+  public:
+
+    uint file;
+    uint offset;
+    uint length;
+  };
+
+  /**
+   * A shader file and the shaders it defines, as stored in the index cache.
+   */
+  class ShaderFile
+  {
+  public:
+
+    String name;
+    uint   size;
+    uint   modified;
+
+    std::vector<String>   shaderNames;
+    std::vector<Location> locations;
+  };
+
+  std::vector<ShaderFile> shaderFiles;
+  std::map<String, Location> locations;
+
+  // Shaders are only parsed when first acquired
   std::map<String, Q3ShaderData*> shaders;
 
   void fileHook(const char* name);
@@ -181,6 +248,7 @@ namespace
 
 bool Q3ShaderData::tcGen = false;
 bool Q3ShaderData::lighting = false;
+bool Q3ShaderData::multitexture = false;
 
 Q3Shader::Q3Shader()
 {
@@ -189,389 +257,770 @@ Q3Shader::Q3Shader()
 
 namespace
 {
-  void fileHook(const char* name)
+  Shader::WaveForm parseWaveForm(const String& token)
   {
-    if(!EndsWith(".shader")(name))
-      return;
+    return (token == "inversesawtooth") ? Shader::InverseSawtooth
+         : (token == "triangle") ?        Shader::Triangle
+         : (token == "square") ?          Shader::Square
+         : (token == "sawtooth") ?        Shader::Sawtooth
+         : /* token == "sin" */           Shader::Sin;
+  }
 
-    esDebug(3) << "Found shader file \"" << name << "\"." << std::endl;
+  /**
+   * Parses the arguments of a deformVertexes directive.
+   *
+   * Returns false if the deformation is not supported.
+   */
+  bool parseDeform(Preprocessor& input, Shader::Deform& deform)
+  {
+    String token = input.nextToken().toLower();
+
+    deform.base = 0;
+    deform.amplitude = 0;
+    deform.phase = 0;
+    deform.frequency = 0;
+    deform.spread = 0;
+    deform.bulgeWidth = 0;
+    deform.bulgeHeight = 0;
+    deform.bulgeSpeed = 0;
+    deform.wave = Shader::Sin;
+
+    if(token == "wave")
+    {
+      float divisor = input.nextToken().toFloat();
+
+      deform.type = Shader::Wave;
+      deform.spread = (divisor != 0) ? 1.0f / divisor : 100.0f;
+      deform.wave = parseWaveForm(input.nextToken().toLower());
+      deform.base = input.nextToken().toFloat();
+      deform.amplitude = input.nextToken().toFloat();
+      deform.phase = input.nextToken().toFloat();
+      deform.frequency = input.nextToken().toFloat();
+    }
+    else if(token == "normal")
+    {
+      deform.type = Shader::Normal;
+      deform.amplitude = input.nextToken().toFloat();
+      deform.frequency = input.nextToken().toFloat();
+    }
+    else if(token == "bulge")
+    {
+      deform.type = Shader::Bulge;
+      deform.bulgeWidth = input.nextToken().toFloat();
+      deform.bulgeHeight = input.nextToken().toFloat();
+      deform.bulgeSpeed = input.nextToken().toFloat();
+    }
+    else if(token == "move")
+    {
+      float x = input.nextToken().toFloat();
+      float y = input.nextToken().toFloat();
+      float z = input.nextToken().toFloat();
+
+      deform.type = Shader::Move;
+      deform.direction = Vector3(x, y, z);
+      deform.wave = parseWaveForm(input.nextToken().toLower());
+      deform.base = input.nextToken().toFloat();
+      deform.amplitude = input.nextToken().toFloat();
+      deform.phase = input.nextToken().toFloat();
+      deform.frequency = input.nextToken().toFloat();
+    }
+    else if(token == "autosprite")
+    {
+      deform.type = Shader::AutoSprite;
+    }
+    else if(token == "autosprite2")
+    {
+      deform.type = Shader::AutoSprite2;
+    }
+    else
+    {
+      esWarning << "Shader: Unsupported vertex deformation \"" << token
+                << "\"." << std::endl;
 
-    Preprocessor input(name);
+      return false;
+    }
 
+    return true;
+  }
+
+  /**
+   * Parses the body of a shader, up to and including its closing brace.
+   *
+   * Returns false if the input ends before the closing brace.
+   */
+  bool parseBody(Preprocessor& input, Q3ShaderData* shader)
+  {
     String token;
-    String shaderName;
-    Q3ShaderData* shader = 0;
+    bool hasSort = false;
 
-    while(!(token = input.nextToken()).isNull())
+    while(!(token = input.nextToken()).isNull() && *token != '}')
     {
-      bool hasSort = false;
-
       if(*token == '\n')
         continue;
 
-      if(*token == '{')
+      if(token.beginsWith("q3map_"))
       {
-        while('}' != *(token = input.nextToken()))
+        while(!(token = input.nextToken()).isNull() && *token != '\n')
+          ;
+
+        continue;
+      }
+
+      if(token == "cull")
+      {
+        token = input.nextToken().toLower();
+
+        shader->_cullFace = (token == "back")  ? Renderer::Face_Back
+                          : (token == "front") ? Renderer::Face_Front
+                                               : Renderer::Face_None;
+      }
+      else if(token == "sort")
+      {
+        token = input.nextToken().toLower();
+
+        bool ok = true;
+
+        shader->_sort = (token == "portal")     ? Shader::Portal
+                      : (token == "sky")        ? Shader::Sky
+                      : (token == "opaque")     ? Shader::Opaque
+                      : (token == "banner")     ? Shader::Banner
+                      : (token == "underwater") ? Shader::Underwater
+                      : (token == "additive")   ? Shader::Additive
+                      : (token == "nearest")    ? Shader::Nearest
+                      : (token.toInt(&ok) << 24);
+
+        hasSort = true;
+
+        if(!ok)
+        {
+          esWarning << "Shader: Invalid sort value: " << token << std::endl;
+
+          shader->_sort = Shader::Opaque;
+        }
+      }
+      else if(token == "nomipmaps" || token == "nomipmap")
+      {
+        shader->nomipmaps = true;
+      }
+      else if(token == "skyparms")
+      {
+        shader->farbox = input.nextToken().toLower();
+        shader->cloudHeight = input.nextToken().toUInt();
+        shader->nearbox = input.nextToken().toLower();
+      }
+      else if(token == "surfaceparm")
+      {
+        token = input.nextToken().toLower();
+
+        if(token == "sky") shader->sky = true;
+        else if(token == "flesh") shader->flesh = true;
+        else if(token == "lava") shader->lava = true;
+        else if(token == "metalsteps") shader->metalsteps = true;
+        else if(token == "nodamage") shader->nodamage = true;
+        else if(token == "nodlight") shader->nodlight = true;
+        else if(token == "nodraw") shader->nodraw = true;
+        else if(token == "noimpact") shader->noimpact = true;
+        else if(token == "nomarks") shader->nomarks = true;
+        else if(token == "nolightmap") shader->nolightmap = true;
+        else if(token == "nosteps") shader->nosteps = true;
+        else if(token == "origin") shader->origin = true;
+        else if(token == "playerclip") shader->playerclip = true;
+        else if(token == "slick") shader->slick = true;
+        else if(token == "slime") shader->slime = true;
+        else if(token == "water") shader->water = true;
+      }
+      else if(token == "polygonOffset")
+      {
+        shader->polygonOffset = true;
+      }
+      else if(String(token).toLower() == "deformvertexes")
+      {
+        Shader::Deform deform;
+
+        // Quake 3 ignores deformations beyond the third
+        if(parseDeform(input, deform) && shader->deformList.size() < 3)
+          shader->deformList.push_back(deform);
+      }
+      else if(*token == '{')
+      {
+        Q3ShaderData::Map& map = *shader->maps.insert(shader->maps.end(),
+                                                      Q3ShaderData::Map());
+
+        bool hasDepthWrite = false;
+
+        while(!(token = input.nextToken()).isNull()
+           && *token.toLower() != '}')
         {
           if(*token == '\n')
             continue;
 
-          if(token.beginsWith("q3map_"))
+          if((1 /* XXX: Compression? */ && token == "mapcomp")
+          || (0 /* XXX: Compression? */ && token == "mapnocomp")
+          || (token == "map"))
           {
-            while('\n' != *(input.nextToken()));
-
-            continue;
+            map.textureNames.clear();
+            map.textureNames.push_back(input.nextToken().replace('\\', '/'));
           }
-
-          if(token == "cull")
+          else if(token == "clampmap")
           {
-            token = input.nextToken().toLower();
+            // XXX: clamp this!
+            map.textureNames.clear();
+            map.textureNames.push_back(input.nextToken().replace('\\', '/'));
+          }
+          else if((1 /* XXX: Compression? */ && token == "animmapcomp")
+               || (0 /* XXX: Compression? */ && token == "animmapnocomp")
+               || (token == "animmap"))
+          {
+            map.frequency = input.nextToken().toUInt();
 
-            shader->_cullFace = (token == "back")  ? Renderer::Face_Back
-                              : (token == "front") ? Renderer::Face_Front
-                                                   : Renderer::Face_None;
+            while(!(token = input.nextToken()).isNull() && token != "\n")
+              map.textureNames.insert(map.textureNames.begin(), token.replace('\\', '/'));
           }
-          else if(token == "sort")
+          else if(token == "rgbgen")
           {
             token = input.nextToken().toLower();
 
-            bool ok = true;
-
-            shader->_sort = (token == "portal")     ? Shader::Portal
-                          : (token == "sky")        ? Shader::Sky
-                          : (token == "opaque")     ? Shader::Opaque
-                          : (token == "banner")     ? Shader::Banner
-                          : (token == "underwater") ? Shader::Underwater
-                          : (token == "additive")   ? Shader::Additive
-                          : (token == "nearest")    ? Shader::Nearest
-                          : (token.toInt(&ok) << 24);
-
-            hasSort = true;
+            map.rgbGen
+              = (token == "wave")             ? Q3ShaderData::Map::Wave
+              : (token == "identitylighting") ? Q3ShaderData::Map::IdentityLighting
+              : (token == "entity")           ? Q3ShaderData::Map::Entity
+              : (token == "oneminusentity")   ? Q3ShaderData::Map::OneMinusEntity
+              : (token == "vertex")           ? Q3ShaderData::Map::Vertex
+              : (token == "exactvertex")      ? Q3ShaderData::Map::ExactVertex
+              : (token == "lightingdiffuse")  ? Q3ShaderData::Map::LightingDiffuse
+              : (token == "const")            ? Q3ShaderData::Map::Constant
+              : /* token == "identity" */       Q3ShaderData::Map::Identity;
+
+            if(map.rgbGen == Q3ShaderData::Map::Wave)
+            {
+              map.rgbGenWaveForm
+                = parseWaveForm(input.nextToken().toLower());
 
-            if(!ok)
+              map.rgbGenWaveBase = input.nextToken().toFloat();
+              map.rgbGenWaveAmp = input.nextToken().toFloat();
+              map.rgbGenWavePhase = input.nextToken().toFloat();
+              map.rgbGenWaveFreq = input.nextToken().toFloat();
+            }
+            else if(map.rgbGen == Q3ShaderData::Map::Constant)
             {
-              esWarning << "Shader: Invalid sort value: " << token << std::endl;
+              token = input.nextToken(); // Skip '('
+
+              map.rgbGenColor.setRed(input.nextToken().toFloat());
+              map.rgbGenColor.setGreen(input.nextToken().toFloat());
+              map.rgbGenColor.setBlue(input.nextToken().toFloat());
 
-              shader->_sort = Shader::Opaque;
+              token = input.nextToken(); // Skip ')'
             }
           }
-          else if(token == "nomipmaps" || token == "nomipmap")
+          else if(token == "alphagen")
           {
-            shader->nomipmaps = true;
+            token = input.nextToken().toLower();
+
+            map.alphaGen
+              = (token == "wave")             ? Q3ShaderData::Map::Wave
+              : (token == "identitylighting") ? Q3ShaderData::Map::IdentityLighting
+              : (token == "entity")           ? Q3ShaderData::Map::Entity
+              : (token == "oneminusentity")   ? Q3ShaderData::Map::OneMinusEntity
+              : (token == "vertex")           ? Q3ShaderData::Map::Vertex
+              : (token == "exactvertex")      ? Q3ShaderData::Map::ExactVertex
+              : (token == "lightingdiffuse")  ? Q3ShaderData::Map::LightingDiffuse
+              : /* token == "identity" */       Q3ShaderData::Map::Identity;
+
+            if(map.alphaGen == Q3ShaderData::Map::Wave)
+            {
+              map.alphaGenWaveForm
+                = parseWaveForm(input.nextToken().toLower());
+
+              map.alphaGenWaveBase = input.nextToken().toFloat();
+              map.alphaGenWaveAmp = input.nextToken().toFloat();
+              map.alphaGenWavePhase = input.nextToken().toFloat();
+              map.alphaGenWaveFreq = input.nextToken().toFloat();
+            }
           }
-          else if(token == "skyparms")
+          else if(token == "tcgen")
           {
-            shader->farbox = input.nextToken().toLower();
-            shader->cloudHeight = input.nextToken().toUInt();
-            shader->nearbox = input.nextToken().toLower();
+            token = input.nextToken().toLower();
+
+            map.tcGen
+              = (token == "environment") ? Q3ShaderData::Map::Environment
+              : (token == "lightmap")    ? Q3ShaderData::Map::Lightmap
+              : /* token == "base" */      Q3ShaderData::Map::Base;
           }
-          else if(token == "surfaceparm")
+          else if(token == "tcmod")
           {
             token = input.nextToken().toLower();
 
-            if(token == "sky") shader->sky = true;
-            else if(token == "flesh") shader->flesh = true;
-            else if(token == "lava") shader->lava = true;
-            else if(token == "metalsteps") shader->metalsteps = true;
-            else if(token == "nodamage") shader->nodamage = true;
-            else if(token == "nodlight") shader->nodlight = true;
-            else if(token == "nodraw") shader->nodraw = true;
-            else if(token == "noimpact") shader->noimpact = true;
-            else if(token == "nomarks") shader->nomarks = true;
-            else if(token == "nolightmap") shader->nolightmap = true;
-            else if(token == "nosteps") shader->nosteps = true;
-            else if(token == "origin") shader->origin = true;
-            else if(token == "playerclip") shader->playerclip = true;
-            else if(token == "slick") shader->slick = true;
-            else if(token == "slime") shader->slime = true;
-            else if(token == "water") shader->water = true;
+            Q3ShaderData::Map::TCMod& tcMod = map.tcMods[map.tcModCount++];
+
+            tcMod.type
+              = (token == "rotate") ?    Q3ShaderData::Map::TCMod::Rotate
+              : (token == "scale") ?     Q3ShaderData::Map::TCMod::Scale
+              : (token == "scroll") ?    Q3ShaderData::Map::TCMod::Scroll
+              : (token == "stretch") ?   Q3ShaderData::Map::TCMod::Stretch
+              : (token == "transform") ? Q3ShaderData::Map::TCMod::Transform
+              : /* token == "turb" */    Q3ShaderData::Map::TCMod::Turbulence;
+
+            switch(tcMod.type)
+            {
+            case Q3ShaderData::Map::TCMod::Rotate:
+
+              tcMod.freq = input.nextToken().toFloat();
+
+              break;
+
+            case Q3ShaderData::Map::TCMod::Scale:
+            case Q3ShaderData::Map::TCMod::Scroll:
+
+              tcMod.s = input.nextToken().toFloat();
+              tcMod.t = input.nextToken().toFloat();
+
+              break;
+
+            case Q3ShaderData::Map::TCMod::Stretch:
+
+              // XXX
+
+              break;
+
+            case Q3ShaderData::Map::TCMod::Transform:
+
+              // XXX
+
+              break;
+
+            case Q3ShaderData::Map::TCMod::Turbulence:
+
+              // XXX
+
+              break;
+            }
           }
-          else if(token == "polygonOffset")
+          else if(token == "depthwrite")
           {
-            shader->polygonOffset = true;
+            map.depthWrite = true;
+            hasDepthWrite = true;
           }
-          else if(*token == '{')
+          else if(token == "blendfunc")
           {
-            Q3ShaderData::Map& map = *shader->maps.insert(shader->maps.end(),
-                                                          Q3ShaderData::Map());
+            String sourceBlend = input.nextToken().toUpper();
+            String destBlend = input.nextToken().toUpper();
 
-            bool hasDepthWrite = false;
-
-            while('}' != *(token = input.nextToken().toLower()))
+            if(sourceBlend == "ADD" || sourceBlend == "GL_ADD")
             {
-              if(*token == '\n')
-                continue;
-
-              if((1 /* XXX: Compression? */ && token == "mapcomp")
-              || (0 /* XXX: Compression? */ && token == "mapnocomp")
-              || (token == "map"))
-              {
-                map.textureNames.clear();
-                map.textureNames.push_back(input.nextToken().replace('\\', '/'));
-              }
-              else if(token == "clampmap")
+              map.sourceBlend = Renderer::Factor_One;
+              map.destBlend = Renderer::Factor_One;
+            }
+            else if(sourceBlend == "FILTER")
+            {
+              map.sourceBlend = Renderer::Factor_DstColor;
+              map.destBlend = Renderer::Factor_Zero;
+            }
+            else if(sourceBlend == "BLEND")
+            {
+              map.sourceBlend = Renderer::Factor_SrcAlpha;
+              map.destBlend = Renderer::Factor_OneMinusSrcAlpha;
+            }
+            else
+            {
+              if(sourceBlend == "GL_ZERO")
+                map.sourceBlend = Renderer::Factor_Zero;
+              else if(sourceBlend == "GL_ONE")
+                map.sourceBlend = Renderer::Factor_One;
+              else if(sourceBlend == "GL_DST_COLOR")
+                map.sourceBlend = Renderer::Factor_DstColor;
+              else if(sourceBlend == "GL_ONE_MINUS_DST_COLOR")
+                map.sourceBlend = Renderer::Factor_OneMinusDstColor;
+              else if(sourceBlend == "GL_SRC_ALPHA")
+                map.sourceBlend = Renderer::Factor_SrcAlpha;
+              else if(sourceBlend == "GL_ONE_MINUS_SRC_ALPHA")
+                map.sourceBlend = Renderer::Factor_OneMinusSrcAlpha;
+              else if(sourceBlend == "GL_DST_ALPHA")
+                map.sourceBlend = Renderer::Factor_DstAlpha;
+              else if(sourceBlend == "GL_ONE_MINUS_DST_ALPHA")
+                map.sourceBlend = Renderer::Factor_OneMinusDstAlpha;
+              else if(sourceBlend == "GL_SRC_ALPHA_SATURATE")
+                map.sourceBlend = Renderer::Factor_SrcAlphaSaturate;
+              else
               {
-                // XXX: clamp this!
-                map.textureNames.clear();
-                map.textureNames.push_back(input.nextToken().replace('\\', '/'));
+                esWarning << "Invalid source blend value \"" << sourceBlend
+                          << "\"." << std::endl;
               }
-              else if((1 /* XXX: Compression? */ && token == "animmapcomp")
-                   || (0 /* XXX: Compression? */ && token == "animmapnocomp")
-                   || (token == "animmap"))
-              {
-                map.frequency = input.nextToken().toUInt();
 
-                while("\n" != (token = input.nextToken()))
-                  map.textureNames.insert(map.textureNames.begin(), token.replace('\\', '/'));
-              }
-              else if(token == "rgbgen")
+              if(destBlend == "GL_ZERO")
+                map.destBlend = Renderer::Factor_Zero;
+              else if(destBlend == "GL_ONE")
+                map.destBlend = Renderer::Factor_One;
+              else if(destBlend == "GL_SRC_COLOR")
+                map.destBlend = Renderer::Factor_SrcColor;
+              else if(destBlend == "GL_ONE_MINUS_SRC_COLOR")
+                map.destBlend = Renderer::Factor_OneMinusSrcColor;
+              else if(destBlend == "GL_SRC_ALPHA")
+                map.destBlend = Renderer::Factor_SrcAlpha;
+              else if(destBlend == "GL_ONE_MINUS_SRC_ALPHA")
+                map.destBlend = Renderer::Factor_OneMinusSrcAlpha;
+              else if(destBlend == "GL_DST_ALPHA")
+                map.destBlend = Renderer::Factor_DstAlpha;
+              else if(destBlend == "GL_ONE_MINUS_DST_ALPHA")
+                map.destBlend = Renderer::Factor_OneMinusDstAlpha;
+              else
               {
-                token = input.nextToken().toLower();
-
-                map.rgbGen
-                  = (token == "wave")             ? Q3ShaderData::Map::Wave
-                  : (token == "identitylighting") ? Q3ShaderData::Map::IdentityLighting
-                  : (token == "entity")           ? Q3ShaderData::Map::Entity
-                  : (token == "oneminusentity")   ? Q3ShaderData::Map::OneMinusEntity
-                  : (token == "vertex")           ? Q3ShaderData::Map::Vertex
-                  : (token == "exactvertex")      ? Q3ShaderData::Map::ExactVertex
-                  : (token == "lightingdiffuse")  ? Q3ShaderData::Map::LightingDiffuse
-                  : (token == "const")            ? Q3ShaderData::Map::Constant
-                  : /* token == "identity" */       Q3ShaderData::Map::Identity;
-
-                if(map.rgbGen == Q3ShaderData::Map::Wave)
-                {
-                  token = input.nextToken().toLower();
-
-                  map.rgbGenWaveForm
-                    = (token == "inversesawtooth") ? Shader::InverseSawtooth
-                    : (token == "triangle") ?        Shader::Triangle
-                    : (token == "square") ?          Shader::Square
-                    : (token == "sawtooth") ?        Shader::Sawtooth
-                    : /* token == "sin" */           Shader::Sin;
-
-                  map.rgbGenWaveBase = input.nextToken().toFloat();
-                  map.rgbGenWaveAmp = input.nextToken().toFloat();
-                  map.rgbGenWavePhase = input.nextToken().toFloat();
-                  map.rgbGenWaveFreq = input.nextToken().toFloat();
-                }
-                else if(map.rgbGen == Q3ShaderData::Map::Constant)
-                {
-                  token = input.nextToken(); // Skip '('
-
-                  map.rgbGenColor.setRed(input.nextToken().toFloat());
-                  map.rgbGenColor.setGreen(input.nextToken().toFloat());
-                  map.rgbGenColor.setBlue(input.nextToken().toFloat());
-
-                  token = input.nextToken(); // Skip ')'
-                }
+                esWarning << "Invalid destination blend value \""
+                          << destBlend << "\"." << std::endl;
               }
-              else if(token == "alphagen")
-              {
-                token = input.nextToken().toLower();
-
-                map.alphaGen
-                  = (token == "wave")             ? Q3ShaderData::Map::Wave
-                  : (token == "identitylighting") ? Q3ShaderData::Map::IdentityLighting
-                  : (token == "entity")           ? Q3ShaderData::Map::Entity
-                  : (token == "oneminusentity")   ? Q3ShaderData::Map::OneMinusEntity
-                  : (token == "vertex")           ? Q3ShaderData::Map::Vertex
-                  : (token == "exactvertex")      ? Q3ShaderData::Map::ExactVertex
-                  : (token == "lightingdiffuse")  ? Q3ShaderData::Map::LightingDiffuse
-                  : /* token == "identity" */       Q3ShaderData::Map::Identity;
-
-                if(map.alphaGen == Q3ShaderData::Map::Wave)
-                {
-                  token = input.nextToken().toLower();
-
-                  map.alphaGenWaveForm
-                    = (token == "inversesawtooth") ? Shader::InverseSawtooth
-                    : (token == "triangle") ?        Shader::Triangle
-                    : (token == "square") ?          Shader::Square
-                    : (token == "sawtooth") ?        Shader::Sawtooth
-                    : /* token == "sin" */           Shader::Sin;
-
-                  map.alphaGenWaveBase = input.nextToken().toFloat();
-                  map.alphaGenWaveAmp = input.nextToken().toFloat();
-                  map.alphaGenWavePhase = input.nextToken().toFloat();
-                  map.alphaGenWaveFreq = input.nextToken().toFloat();
-                }
-              }
-              else if(token == "tcgen")
+            }
+
+            if(shader->maps.size() == 1) // This is the first map
+            {
+              if(map.destBlend != Renderer::Factor_Zero
+              || map.sourceBlend == Renderer::Factor_DstColor
+              || map.sourceBlend == Renderer::Factor_OneMinusDstColor
+              || map.sourceBlend == Renderer::Factor_OneMinusDstAlpha)
               {
-                token = input.nextToken().toLower();
+                if(!hasSort)
+                  shader->_sort = Shader::Additive;
 
-                map.tcGen
-                  = (token == "environment") ? Q3ShaderData::Map::Environment
-                  : (token == "lightmap")    ? Q3ShaderData::Map::Lightmap
-                  : /* token == "base" */      Q3ShaderData::Map::Base;
+                if(!hasDepthWrite)
+                  map.depthWrite = false;
               }
-              else if(token == "tcmod")
-              {
-                token = input.nextToken().toLower();
+            }
+          }
+          else if(token == "alphafunc")
+          {
+            token = input.nextToken().toUpper();
+
+            if(token == "GT0")
+              map.alphaFunc = Renderer::Alpha_GT0;
+            else if(token == "LT128")
+              map.alphaFunc = Renderer::Alpha_LT128;
+            else if(token == "GE128")
+              map.alphaFunc = Renderer::Alpha_GE128;
+            else
+            {
+              esWarning << "Invalid alpha function \"" << token
+                        << "\"." << std::endl;
+            }
+          }
+        }
 
-                Q3ShaderData::Map::TCMod& tcMod = map.tcMods[map.tcModCount++];
+        if(token.isNull())
+          return false;
+      }
+    }
 
-                tcMod.type
-                  = (token == "rotate") ?    Q3ShaderData::Map::TCMod::Rotate
-                  : (token == "scale") ?     Q3ShaderData::Map::TCMod::Scale
-                  : (token == "scroll") ?    Q3ShaderData::Map::TCMod::Scroll
-                  : (token == "stretch") ?   Q3ShaderData::Map::TCMod::Stretch
-                  : (token == "transform") ? Q3ShaderData::Map::TCMod::Transform
-                  : /* token == "turb" */    Q3ShaderData::Map::TCMod::Turbulence;
+    return !token.isNull();
+  }
+}
 
-                switch(tcMod.type)
-                {
-                case Q3ShaderData::Map::TCMod::Rotate:
+namespace
+{
+  const uint32_t indexMagic = 0x49533351; // 'Q3SI'
+  const uint32_t indexVersion = 1;
 
-                  tcMod.freq = input.nextToken().toFloat();
+  std::map<String, ShaderFile> cachedFiles;
+  bool cacheRead = false;
+  bool cacheDirty = false;
 
-                  break;
+  String getString(File& file)
+  {
+    uint length = file.getU32();
 
-                case Q3ShaderData::Map::TCMod::Scale:
-                case Q3ShaderData::Map::TCMod::Scroll:
+    if(length > file.length() - file.tell())
+      return String::null;
 
-                  tcMod.s = input.nextToken().toFloat();
-                  tcMod.t = input.nextToken().toFloat();
+    std::vector<char> buffer(length + 1);
 
-                  break;
+    file.read(&buffer[0], length);
+    buffer[length] = 0;
 
-                case Q3ShaderData::Map::TCMod::Stretch:
+    return String(&buffer[0]);
+  }
 
-                  // XXX
+  void putString(File& file, const String& string)
+  {
+    file.put(static_cast<uint32_t>(string.length()));
+    file.write(static_cast<const char*>(string), string.length());
+  }
 
-                  break;
+  /**
+   * Reads the shader index cache named by r_shadercache, if any.
+   */
+  void readIndexCache()
+  {
+    cacheRead = true;
 
-                case Q3ShaderData::Map::TCMod::Transform:
+    CVar cacheName = CVar::acquire("r_shadercache", "", CVar::Archive);
 
-                  // XXX
+    if(!*cacheName.string)
+      return;
 
-                  break;
+    File file(cacheName.string);
 
-                case Q3ShaderData::Map::TCMod::Turbulence:
+    if(!file.isOpen()
+    || file.length() < 12
+    || file.getU32() != indexMagic
+    || file.getU32() != indexVersion)
+      return;
 
-                  // XXX
+    uint fileCount = file.getU32();
 
-                  break;
-                }
-              }
-              else if(token == "depthwrite")
-              {
-                map.depthWrite = true;
-                hasDepthWrite = true;
-              }
-              else if(token == "blendfunc")
-              {
-                String sourceBlend = input.nextToken().toUpper();
-                String destBlend = input.nextToken().toUpper();
-
-                if(sourceBlend == "ADD" || sourceBlend == "GL_ADD")
-                {
-                  map.sourceBlend = Renderer::Factor_One;
-                  map.destBlend = Renderer::Factor_One;
-                }
-                else if(sourceBlend == "FILTER")
-                {
-                  map.sourceBlend = Renderer::Factor_DstColor;
-                  map.destBlend = Renderer::Factor_Zero;
-                }
-                else if(sourceBlend == "BLEND")
-                {
-                  map.sourceBlend = Renderer::Factor_SrcAlpha;
-                  map.destBlend = Renderer::Factor_OneMinusSrcAlpha;
-                }
-                else
-                {
-                  if(sourceBlend == "GL_ZERO")
-                    map.sourceBlend = Renderer::Factor_Zero;
-                  else if(sourceBlend == "GL_ONE")
-                    map.sourceBlend = Renderer::Factor_One;
-                  else if(sourceBlend == "GL_DST_COLOR")
-                    map.sourceBlend = Renderer::Factor_DstColor;
-                  else if(sourceBlend == "GL_ONE_MINUS_DST_COLOR")
-                    map.sourceBlend = Renderer::Factor_OneMinusDstColor;
-                  else if(sourceBlend == "GL_SRC_ALPHA")
-                    map.sourceBlend = Renderer::Factor_SrcAlpha;
-                  else if(sourceBlend == "GL_ONE_MINUS_SRC_ALPHA")
-                    map.sourceBlend = Renderer::Factor_OneMinusSrcAlpha;
-                  else if(sourceBlend == "GL_DST_ALPHA")
-                    map.sourceBlend = Renderer::Factor_DstAlpha;
-                  else if(sourceBlend == "GL_ONE_MINUS_DST_ALPHA")
-                    map.sourceBlend = Renderer::Factor_OneMinusDstAlpha;
-                  else if(sourceBlend == "GL_SRC_ALPHA_SATURATE")
-                    map.sourceBlend = Renderer::Factor_SrcAlphaSaturate;
-                  else
-                  {
-                    esWarning << "Invalid source blend value \"" << sourceBlend
-                              << "\"." << std::endl;
-                  }
-
-                  if(destBlend == "GL_ZERO")
-                    map.destBlend = Renderer::Factor_Zero;
-                  else if(destBlend == "GL_ONE")
-                    map.destBlend = Renderer::Factor_One;
-                  else if(destBlend == "GL_SRC_COLOR")
-                    map.destBlend = Renderer::Factor_SrcColor;
-                  else if(destBlend == "GL_ONE_MINUS_SRC_COLOR")
-                    map.destBlend = Renderer::Factor_OneMinusSrcColor;
-                  else if(destBlend == "GL_SRC_ALPHA")
-                    map.destBlend = Renderer::Factor_SrcAlpha;
-                  else if(destBlend == "GL_ONE_MINUS_SRC_ALPHA")
-                    map.destBlend = Renderer::Factor_OneMinusSrcAlpha;
-                  else if(destBlend == "GL_DST_ALPHA")
-                    map.destBlend = Renderer::Factor_DstAlpha;
-                  else if(destBlend == "GL_ONE_MINUS_DST_ALPHA")
-                    map.destBlend = Renderer::Factor_OneMinusDstAlpha;
-                  else
-                  {
-                    esWarning << "Invalid destination blend value \""
-                              << destBlend << "\"." << std::endl;
-                  }
-                }
-
-                if(shader->maps.size() == 1) // This is the first map
-                {
-                  if(map.destBlend != Renderer::Factor_Zero
-                  || map.sourceBlend == Renderer::Factor_DstColor
-                  || map.sourceBlend == Renderer::Factor_OneMinusDstColor
-                  || map.sourceBlend == Renderer::Factor_OneMinusDstAlpha)
-                  {
-                    if(!hasSort)
-                      shader->_sort = Shader::Additive;
-
-                    if(!hasDepthWrite)
-                      map.depthWrite = false;
-                  }
-                }
-              }
-              else if(token == "alphafunc")
-              {
-                token = input.nextToken().toUpper();
-
-                if(token == "GT0")
-                  map.alphaFunc = Renderer::Alpha_GT0;
-                else if(token == "LT128")
-                  map.alphaFunc = Renderer::Alpha_LT128;
-                else if(token == "GE128")
-                  map.alphaFunc = Renderer::Alpha_GE128;
-                else
-                {
-                  esWarning << "Invalid alpha function \"" << token
-                            << "\"." << std::endl;
-                }
-              }
-            }
-          }
+    for(uint i = 0; i < fileCount && file.tell() < file.length(); ++i)
+    {
+      ShaderFile shaderFile;
+
+      shaderFile.name = getString(file);
+      shaderFile.size = file.getU32();
+      shaderFile.modified = file.getU32();
+
+      uint shaderCount = file.getU32();
+
+      if(shaderFile.name.isNull() || shaderCount > file.length())
+        break;
+
+      for(uint j = 0; j < shaderCount; ++j)
+      {
+        Location location;
+
+        shaderFile.shaderNames.push_back(getString(file));
+        location.file = 0;
+        location.offset = file.getU32();
+        location.length = file.getU32();
+        shaderFile.locations.push_back(location);
+      }
+
+      cachedFiles[shaderFile.name] = shaderFile;
+    }
+  }
+
+  /**
+   * Writes the shader index to the file named by r_shadercache.
+   */
+  void writeIndexCache()
+  {
+    cacheDirty = false;
+
+    CVar cacheName = CVar::acquire("r_shadercache", "", CVar::Archive);
+
+    if(!*cacheName.string)
+      return;
+
+    File file(cacheName.string, File::Write | File::Truncate);
+
+    if(!file.isOpen())
+    {
+      esWarning << "Shader: Failed to write index cache \""
+                << cacheName.string << "\"." << std::endl;
+
+      return;
+    }
+
+    file.put(indexMagic);
+    file.put(indexVersion);
+    file.put(static_cast<uint32_t>(shaderFiles.size()));
+
+    for(std::vector<ShaderFile>::const_iterator i = shaderFiles.begin();
+        i != shaderFiles.end(); ++i)
+    {
+      putString(file, i->name);
+      file.put(static_cast<uint32_t>(i->size));
+      file.put(static_cast<uint32_t>(i->modified));
+      file.put(static_cast<uint32_t>(i->shaderNames.size()));
+
+      for(uint j = 0; j < i->shaderNames.size(); ++j)
+      {
+        putString(file, i->shaderNames[j]);
+        file.put(static_cast<uint32_t>(i->locations[j].offset));
+        file.put(static_cast<uint32_t>(i->locations[j].length));
+      }
+    }
+  }
+
+  /**
+   * Finds the name and extent of each shader in a file, without parsing the
+   * shader bodies.
+   */
+  void scanFile(File& file, ShaderFile& shaderFile)
+  {
+    const char* data = reinterpret_cast<const char*>(file.data());
+    uint length = file.length();
+
+    uint depth = 0;
+    uint nameBegin = 0;
+    uint nameEnd = 0;
+    bool haveName = false;
+
+    for(uint i = 0; i < length; )
+    {
+      char c = data[i];
+
+      if(c == '/' && i + 1 < length && data[i + 1] == '/')
+      {
+        while(i < length && data[i] != '\n')
+          ++i;
+      }
+      else if(c == '/' && i + 1 < length && data[i + 1] == '*')
+      {
+        for(i += 2; i < length; ++i)
+        {
+          if(data[i - 1] == '*' && data[i] == '/')
+            break;
         }
+
+        ++i;
+      }
+      else if(c == '"')
+      {
+        for(++i; i < length && data[i] != '"' && data[i] != '\n'; ++i)
+          ;
+
+        ++i;
+      }
+      else if(c == '{')
+      {
+        ++depth;
+        ++i;
+      }
+      else if(c == '}')
+      {
+        if(depth && !--depth && haveName)
+        {
+          std::vector<char> name(data + nameBegin, data + nameEnd);
+
+          name.push_back(0);
+
+          Location location;
+
+          location.file = 0;
+          location.offset = nameBegin;
+          location.length = i + 1 - nameBegin;
+
+          shaderFile.shaderNames.push_back(
+            String(&name[0]).replace('\\', '/').toLower());
+          shaderFile.locations.push_back(location);
+
+          haveName = false;
+        }
+
+        ++i;
+      }
+      else if(isspace(c))
+      {
+        ++i;
       }
       else
       {
-        shaderName = token.replace('\\', '/').toLower();
-        shader = new Q3ShaderData;
-        shaders[shaderName] = shader;
+        uint begin = i;
+
+        while(i < length && !isspace(data[i])
+           && data[i] != '{' && data[i] != '}' && data[i] != '"')
+          ++i;
+
+        if(!depth)
+        {
+          nameBegin = begin;
+          nameEnd = i;
+          haveName = true;
+        }
       }
     }
   }
+
+  void fileHook(const char* name)
+  {
+    if(!EndsWith(".shader")(name))
+      return;
+
+    esDebug(3) << "Found shader file \"" << name << "\"." << std::endl;
+
+    if(!cacheRead)
+      readIndexCache();
+
+    File file(name);
+
+    if(!file.isOpen())
+      return;
+
+    ShaderFile shaderFile;
+
+    shaderFile.name = name;
+    shaderFile.size = file.length();
+    shaderFile.modified = file.modified();
+
+    std::map<String, ShaderFile>::const_iterator cached
+      = cachedFiles.find(name);
+
+    if(cached != cachedFiles.end()
+    && cached->second.size == shaderFile.size
+    && cached->second.modified == shaderFile.modified)
+    {
+      shaderFile.shaderNames = cached->second.shaderNames;
+      shaderFile.locations = cached->second.locations;
+    }
+    else
+    {
+      scanFile(file, shaderFile);
+
+      cacheDirty = true;
+    }
+
+    uint fileIndex = shaderFiles.size();
+
+    for(uint i = 0; i < shaderFile.shaderNames.size(); ++i)
+    {
+      Location& location = locations[shaderFile.shaderNames[i]];
+
+      location = shaderFile.locations[i];
+      location.file = fileIndex;
+    }
+
+    shaderFiles.push_back(shaderFile);
+  }
+
+  /**
+   * Parses the definition of a shader.
+   *
+   * Returns 0 if the shader is not defined.
+   */
+  Q3ShaderData* parseShader(const String& name)
+  {
+    std::map<String, Location>::const_iterator location
+      = locations.find(name);
+
+    if(location == locations.end())
+      return 0;
+
+    const String& fileName = shaderFiles[location->second.file].name;
+
+    Preprocessor input(fileName, location->second.offset,
+                       location->second.length);
+
+    String token;
+
+    while(!(token = input.nextToken()).isNull() && *token != '{')
+      ;
+
+    if(token.isNull())
+    {
+      esWarning << "Shader: Definition of \"" << name << "\" in \""
+                << fileName << "\" has no body." << std::endl;
+
+      return 0;
+    }
+
+    Q3ShaderData* shader = new Q3ShaderData;
+
+    if(!parseBody(input, shader))
+    {
+      esWarning << "Shader: Definition of \"" << name << "\" in \""
+                << fileName << "\" ends before its closing brace."
+                << std::endl;
+
+      delete shader;
+
+      return 0;
+    }
+
+    return shader;
+  }
 }
 
 uint32_t Q3Shader::id()
@@ -584,13 +1033,27 @@ bool Q3Shader::canHandle(File&)
   return false;
 }
 
-Shader* Q3Shader::acquire(const char* name, bool mipmaps)
+Shader* Q3Shader::acquire(const char* _name, bool mipmaps)
 {
-  std::map<String, Q3ShaderData*>::iterator shader
-    = shaders.find(String(name).toLower());
+  // All shader files have been seen once the first shader is acquired
+  if(cacheDirty)
+    writeIndexCache();
+
+  cachedFiles.clear();
+
+  String name = String(_name).toLower();
+
+  std::map<String, Q3ShaderData*>::iterator shader = shaders.find(name);
 
   if(shader == shaders.end())
-    return 0;
+  {
+    Q3ShaderData* data = parseShader(name);
+
+    if(!data)
+      return 0;
+
+    shader = shaders.insert(std::make_pair(name, data)).first;
+  }
 
   if(!mipmaps)
     shader->second->nomipmaps = true;
@@ -606,6 +1069,9 @@ void Q3ShaderData::acquire()
 {
   std::vector<Map>::iterator map;
 
+  states.resize(maps.size());
+  stateTime = -1;
+
   for(map = maps.begin(); map != maps.end(); ++map)
   {
     if(map->textureNames.size() && !map->textureHandles)
@@ -640,6 +1106,73 @@ void Q3ShaderData::acquire()
       }
     }
   }
+
+  compilePasses();
+}
+
+void Q3ShaderData::compilePasses()
+{
+  CVar collapse = CVar::acquire("r_collapsestages", "1", CVar::Archive);
+
+  passes.clear();
+
+  for(uint i = 0; i < maps.size(); ++i)
+  {
+    Pass pass;
+
+    pass.stage = i;
+    pass.stageCount = 1;
+    pass.combine = Renderer::EnvMode_Modulate;
+
+    if(collapse.integer
+    && GL::config.maxActiveTextures >= 2
+    && i + 1 < maps.size())
+    {
+      const Map& first = maps[i];
+      const Map& second = maps[i + 1];
+
+      // The first stage must write its color unblended, so that blending
+      // the second stage with the frame buffer is equivalent to combining
+      // the two in the texture units.  Texture matrices and texture
+      // coordinate generation only apply to the first unit.
+      bool combinable
+        =  first.sourceBlend == Renderer::Factor_One
+        && first.destBlend == Renderer::Factor_Zero
+        && first.tcGen != Map::Environment
+        && !first.tcModCount
+        && first.rgbGen != Map::LightingDiffuse
+        && second.tcGen != Map::Environment
+        && !second.tcModCount
+        && second.alphaFunc == Renderer::Alpha_All
+        && (second.rgbGen == Map::Identity
+         || second.rgbGen == Map::IdentityLighting)
+        && second.frameCount
+        && second.textureHandles[0];
+
+      if(combinable)
+      {
+        if((second.sourceBlend == Renderer::Factor_DstColor
+         && second.destBlend == Renderer::Factor_Zero)
+        || (second.sourceBlend == Renderer::Factor_Zero
+         && second.destBlend == Renderer::Factor_SrcColor))
+        {
+          pass.stageCount = 2;
+          pass.combine = Renderer::EnvMode_Modulate;
+        }
+        else if(second.sourceBlend == Renderer::Factor_One
+             && second.destBlend == Renderer::Factor_One
+             && GL::config.textureEnvAddSupport)
+        {
+          pass.stageCount = 2;
+          pass.combine = Renderer::EnvMode_Add;
+        }
+      }
+    }
+
+    passes.push_back(pass);
+
+    i += pass.stageCount - 1;
+  }
 }
 
 void Q3ShaderData::unacquire()
@@ -662,7 +1195,8 @@ void Q3ShaderData::unacquire()
 }
 
 Q3ShaderData::Q3ShaderData()
-  : _cullFace(Renderer::Face_Front),
+  : stateTime(-1),
+    _cullFace(Renderer::Face_Front),
     nopicmip(false),
     nomipmaps(false),
     polygonOffset(false),
@@ -703,159 +1237,278 @@ Q3ShaderData::Map::Map()
 
 uint Q3ShaderData::passCount() const
 {
-  return maps.size();
+  return passes.size();
 }
 
-void Q3ShaderData::pushState(uint pass)
+namespace
 {
-  Renderer::setCullFace(_cullFace);
-  Renderer::setPolygonOffset(polygonOffset);
-
-  if(maps.empty())
+  /**
+   * Multiplies the 2x3 affine texture coordinate transform `m' by `n' from
+   * the right, like glMultMatrix would.
+   */
+  void multiply(float m[2][3], const float n[2][3])
   {
-    Renderer::setTexture(0);
+    for(uint row = 0; row < 2; ++row)
+    {
+      float a = m[row][0];
+      float b = m[row][1];
+
+      m[row][0] = a * n[0][0] + b * n[1][0];
+      m[row][1] = a * n[0][1] + b * n[1][1];
+      m[row][2] = a * n[0][2] + b * n[1][2] + m[row][2];
+    }
   }
-  else // maps.size() >= 1
+}
+
+void Q3ShaderData::updateStates()
+{
+  stateTime = time;
+
+  for(uint pass = 0; pass < maps.size(); ++pass)
   {
     const Map& map = maps[pass];
+    StageState& state = states[pass];
 
-    if(map.rgbGen == Map::Identity
-    || map.rgbGen == Map::IdentityLighting)
+    if(map.rgbGen == Map::Wave)
     {
-      Renderer::setTexEnvMode(Renderer::EnvMode_Replace);
+      state.rgbWave = wave(map.rgbGenWaveForm, map.rgbGenWaveBase,
+                           map.rgbGenWaveAmp, map.rgbGenWavePhase,
+                           map.rgbGenWaveFreq, time);
     }
-    else // map.rgbGen != Map::Identity
+
+    if(map.frameCount)
     {
-      Renderer::setTexEnvMode(Renderer::EnvMode_Modulate);
-    }
+      uint frame = (map.frameCount > 1)
+                 ? (static_cast<uint>(time * map.frequency) % map.frameCount)
+                 : 0;
 
-    if(map.rgbGen == Map::Vertex)
+      state.texture = map.textureHandles[frame];
+    }
+    else
     {
-      Renderer::setColors(Renderer::Source_Array0,
-                          map.alphaGen == Map::Vertex);
+      state.texture = 0;
     }
-    else // map.rgbGen != Map::Vertex
+
+    state.hasTextureMatrix = false;
+
+    if(!map.tcModCount)
+      continue;
+
+    float matrix[2][3] = { { 1, 0, 0 }, { 0, 1, 0 } };
+
+    for(uint i = 0; i < map.tcModCount; ++i)
     {
-      Renderer::setColors(Renderer::Source_Constant);
+      const Map::TCMod& tcMod = map.tcMods[i];
 
-      if(map.rgbGen == Map::Constant)
+      switch(tcMod.type)
       {
-        GL::color3ubv(map.rgbGenColor.data());
-      }
-      else if(map.rgbGen == Map::Entity)
-      {
-        if(map.alphaGen == Map::Entity)
+      case Map::TCMod::Rotate:
+
         {
-          GL::color4ubv(Shader::st_entityColor.data());
+          // Rotates `freq' degrees per second around the texture center
+          float angle = -tcMod.freq * time / 180.0 * M_PI;
+          float c = cos(angle);
+          float s = sin(angle);
+
+          const float rotate[2][3] =
+          {
+            { c, -s, 0.5f - 0.5f * c + 0.5f * s },
+            { s,  c, 0.5f - 0.5f * s - 0.5f * c }
+          };
+
+          multiply(matrix, rotate);
         }
-        else // map.alphaGen != Map::Entity
+
+        break;
+
+      case Map::TCMod::Scale:
+
         {
-          GL::color3ubv(Shader::st_entityColor.data());
+          const float scale[2][3] =
+          {
+            { tcMod.s, 0, 0 },
+            { 0, tcMod.t, 0 }
+          };
+
+          multiply(matrix, scale);
         }
-      }
-      else if(map.rgbGen == Map::Wave)
-      {
-        float value = wave(map.rgbGenWaveForm, map.rgbGenWaveBase,
-                           map.rgbGenWaveAmp, map.rgbGenWavePhase,
-                           map.rgbGenWaveFreq, time);
 
-        GL::color3f(value, value, value);
-      }
-      else if(map.rgbGen == Map::LightingDiffuse)
-      {
-        GL::enableClientState(GL::NORMAL_ARRAY);
-        GL::enable(GL::LIGHTING);
-        GL::enable(GL::COLOR_MATERIAL);
-        GL::enable(GL::NORMALIZE);
+        break;
 
-        lighting = true;
+      case Map::TCMod::Scroll:
 
-        GL::color3f(1, 1, 1);
-      }
-    }
+        {
+          // Only the fractional part matters, and keeping the offset small
+          // avoids losing texture coordinate precision over time
+          float s = tcMod.s * time;
+          float t = tcMod.t * time;
 
-    Renderer::setAlphaFunc(map.alphaFunc);
-    Renderer::setBlendFunc(map.sourceBlend, map.destBlend);
+          const float scroll[2][3] =
+          {
+            { 1, 0, s - floor(s) },
+            { 0, 1, t - floor(t) }
+          };
 
-    if(map.textureHandles[0] == Texture::lightmap)
-    {
-      Renderer::setTexCoords(Renderer::Source_Array1);
-    }
-    else // map.textureHandles[0] != Texture::lightmap
-    {
-      Renderer::setTexCoords(Renderer::Source_Array0);
+          multiply(matrix, scroll);
+        }
 
-      uint frame = (map.frameCount > 1)
-                 ? (static_cast<uint>(time * map.frequency) % map.frameCount)
-                 : 0;
+        break;
 
-      Renderer::setTexture(map.textureHandles[frame]);
+      case Map::TCMod::Stretch:
+      case Map::TCMod::Transform:
+      case Map::TCMod::Turbulence:
+
+        break;
+      }
     }
 
-    if(map.tcModCount)
-    {
-      st_tcMod = true;
+    float* m = state.textureMatrix;
 
-      GL::matrixMode(GL::TEXTURE);
-      GL::pushMatrix();
+    m[0] = matrix[0][0]; m[4] = matrix[0][1]; m[8] = 0;  m[12] = matrix[0][2];
+    m[1] = matrix[1][0]; m[5] = matrix[1][1]; m[9] = 0;  m[13] = matrix[1][2];
+    m[2] = 0;            m[6] = 0;            m[10] = 1; m[14] = 0;
+    m[3] = 0;            m[7] = 0;            m[11] = 0; m[15] = 1;
 
-      for(uint i = 0; i < map.tcModCount; ++i)
-      {
-        switch(map.tcMods[i].type)
-        {
-        case Map::TCMod::Rotate:
+    state.hasTextureMatrix = true;
+  }
+}
+
+void Q3ShaderData::pushState(uint pass)
+{
+  Renderer::setCullFace(_cullFace);
+  Renderer::setPolygonOffset(polygonOffset);
+
+  if(maps.empty())
+  {
+    Renderer::setTexture(0);
+
+    return;
+  }
 
-          GL::translatef(0.5, 0.5, 0);
-          GL::rotatef(map.tcMods[i].freq / 180.0 * M_PI * time, 0, 0, 1);
-          GL::translatef(-0.5, -0.5, 0);
+  if(time != stateTime)
+    updateStates();
 
-          break;
+  const Pass& p = passes[pass];
+  const Map& map = maps[p.stage];
+  const StageState& state = states[p.stage];
 
-        case Map::TCMod::Scale:
+  if(map.rgbGen == Map::Identity
+  || map.rgbGen == Map::IdentityLighting)
+  {
+    Renderer::setTexEnvMode(Renderer::EnvMode_Replace);
+  }
+  else // map.rgbGen != Map::Identity
+  {
+    Renderer::setTexEnvMode(Renderer::EnvMode_Modulate);
+  }
 
-          GL::scalef(map.tcMods[i].s, map.tcMods[i].t, 1.0);
+  if(map.rgbGen == Map::Vertex)
+  {
+    Renderer::setColors(Renderer::Source_Array0,
+                        map.alphaGen == Map::Vertex);
+  }
+  else // map.rgbGen != Map::Vertex
+  {
+    Renderer::setColors(Renderer::Source_Constant);
 
-          break;
+    if(map.rgbGen == Map::Constant)
+    {
+      GL::color3ubv(map.rgbGenColor.data());
+    }
+    else if(map.rgbGen == Map::Entity)
+    {
+      if(map.alphaGen == Map::Entity)
+      {
+        GL::color4ubv(Shader::st_entityColor.data());
+      }
+      else // map.alphaGen != Map::Entity
+      {
+        GL::color3ubv(Shader::st_entityColor.data());
+      }
+    }
+    else if(map.rgbGen == Map::Wave)
+    {
+      GL::color3f(state.rgbWave, state.rgbWave, state.rgbWave);
+    }
+    else if(map.rgbGen == Map::LightingDiffuse)
+    {
+      if(!lighting)
+      {
+        GL::enableClientState(GL::NORMAL_ARRAY);
+        GL::enable(GL::LIGHTING);
+        GL::enable(GL::COLOR_MATERIAL);
+        GL::enable(GL::NORMALIZE);
 
-        case Map::TCMod::Scroll:
+        lighting = true;
+      }
 
-          GL::translatef(map.tcMods[i].s * time, map.tcMods[i].t * time, 0);
+      GL::color3f(1, 1, 1);
+    }
+  }
 
-          break;
+  Renderer::setAlphaFunc(map.alphaFunc);
+  Renderer::setBlendFunc(map.sourceBlend, map.destBlend);
 
-        case Map::TCMod::Stretch:
+  if(state.texture == Texture::lightmap)
+  {
+    Renderer::setTexCoords(Renderer::Source_Array1);
+  }
+  else // state.texture != Texture::lightmap
+  {
+    Renderer::setTexCoords(Renderer::Source_Array0);
+    Renderer::setTexture(state.texture);
+  }
 
-          break;
+  if(state.hasTextureMatrix)
+    Renderer::setTextureMatrix(state.textureMatrix);
 
-        case Map::TCMod::Transform:
+  Renderer::setDepthMask(map.depthWrite);
 
-          break;
+  if(map.tcGen == Map::Environment && !tcGen)
+  {
+    GL::enable(GL::TEXTURE_GEN_S);
+    GL::enable(GL::TEXTURE_GEN_T);
+    GL::texGeni(GL::S, GL::TEXTURE_GEN_MODE, GL::SPHERE_MAP);
+    GL::texGeni(GL::T, GL::TEXTURE_GEN_MODE, GL::SPHERE_MAP);
+    Renderer::setNormals(Renderer::Source_Array0);
+    GL::enableClientState(GL::NORMAL_ARRAY);
+
+    tcGen = true;
+  }
 
-        case Map::TCMod::Turbulence:
+  if(p.stageCount > 1)
+  {
+    const StageState& second = states[p.stage + 1];
 
-          break;
-        }
-      }
+    if(second.texture == Texture::lightmap)
+    {
+      Renderer::setTexCoords(Renderer::Source_Array1, 1);
+    }
+    else // second.texture != Texture::lightmap
+    {
+      Renderer::setTexCoords(Renderer::Source_Array0, 1);
+      Renderer::setTexture(second.texture, 1);
     }
 
-    Renderer::setDepthMask(map.depthWrite);
+    Renderer::setTexEnvMode(p.combine, 1);
 
-    if(map.tcGen == Map::Environment)
-    {
-      GL::enable(GL::TEXTURE_GEN_S);
-      GL::enable(GL::TEXTURE_GEN_T);
-      GL::texGeni(GL::S, GL::TEXTURE_GEN_MODE, GL::SPHERE_MAP);
-      GL::texGeni(GL::T, GL::TEXTURE_GEN_MODE, GL::SPHERE_MAP);
-      Renderer::setNormals(Renderer::Source_Array0);
-      GL::enableClientState(GL::NORMAL_ARRAY);
+    multitexture = true;
 
-      tcGen = true;
-    }
+    passesSaved += p.stageCount - 1;
   }
 }
 
 void Q3ShaderData::popState()
 {
+  if(multitexture)
+  {
+    Renderer::setTexCoords(Renderer::Source_Constant, 1);
+    Renderer::setTexture(0, 1);
+    Renderer::setTexEnvMode(Renderer::EnvMode_Modulate, 1);
+
+    multitexture = false;
+  }
+
   if(lighting)
   {
     Renderer::setNormals(Renderer::Source_Constant);
@@ -875,12 +1528,7 @@ void Q3ShaderData::popState()
     tcGen = false;
   }
 
-  if(st_tcMod)
-  {
-    GL::popMatrix();
-
-    st_tcMod = false;
-  }
+  Renderer::setTextureMatrix(0);
 }
 
 bool Q3ShaderData::isSky() const
@@ -898,4 +1546,14 @@ Renderer::Face Q3ShaderData::cullFace() const
   return _cullFace;
 }
 
+uint Q3ShaderData::deformCount() const
+{
+  return deformList.size();
+}
+
+const Shader::Deform* Q3ShaderData::deforms() const
+{
+  return deformList.empty() ? 0 : &deformList[0];
+}
+
 // vim: ts=2 sw=2 et
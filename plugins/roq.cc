@@ -14,11 +14,16 @@
  *                                                                         *
  ***************************************************************************/
 
+#include <algorithm>
+#include <vector>
+
 #include <stdint.h>
 
+#include <espace/cvar.h>
 #include <espace/file.h>
 #include <espace/image.h>
 #include <espace/media.h>
+#include <espace/system.h>
 
 #include "roq.h"
 
@@ -32,6 +37,8 @@ public:
   bool    videoEOF();
   void    videoReset();
 
+  const uint8_t* videoChangedBlocks(uint& blockSize);
+
   uint    audioLength();
   uint    audioRead(void* buffer, uint size);
   uint    audioFormat();
@@ -41,6 +48,7 @@ public:
 
 protected:
 
+  RoQData(File* file);
   ~RoQData();
 
   friend class RoQ;
@@ -95,6 +103,122 @@ protected:
   uint videoNextChunk;
   uint frame;
 
+  // The current video chunk, including its two argument bytes.  Video
+  // decoding reads from this copy so that only videoReadChunk() touches
+  // the file.
+  std::vector<uint8_t> chunk;
+  const uint8_t* input;
+  const uint8_t* inputEnd;
+
+  uint8_t getU8()
+  {
+    return (input != inputEnd) ? *input++ : 0;
+  }
+
+  uint16_t getU16()
+  {
+    uint16_t result = getU8();
+
+    return result | (getU8() << 8);
+  }
+
+  // A QuadVQ chunk is decoded in two passes.  The bitstream is parsed
+  // serially into a list of block operations, grouped by macroblock row.
+  // The operations of a row only write to that row of the back buffer,
+  // and only read the codebook and the front buffer, so the rows can be
+  // executed by several threads at once.
+  enum OperationType
+  {
+    Copy2,
+    Copy4,
+    Move4,
+    Move8
+  };
+
+  struct Operation
+  {
+    uint16_t x;
+    uint16_t y;
+    int8_t   deviationX;
+    int8_t   deviationY;
+    uint8_t  type;
+    uint8_t  index;
+  };
+
+  std::vector<Operation> operations;
+  std::vector<uint>      rowStarts; // First operation of each row, and end
+
+  void decodeRows(uint first, uint last);
+  void decodeSlice(uint slice);
+  void executeOperations();
+
+  // Threads helping with executeOperations(), each handling a fixed slice
+  // of the macroblock rows.  Slice 0 is handled by the decoding thread.
+  struct Helper
+  {
+    RoQData* media;
+    uint     slice;
+    void*    thread;
+    void*    start;
+  };
+
+  std::vector<Helper> helpers;
+  void* helpersDone;
+
+  static void helperLoop(void* argument);
+
+  // Thread decoding one frame ahead of videoRead().  Only the calling
+  // thread posts requests, and it touches the decoder state only while no
+  // request is pending.
+  void* aheadThread;
+  void* aheadRequest;
+  void* aheadReady;
+  bool  aheadPending; // A frame has been requested and not waited for
+  bool  aheadDone;    // A frame has been decoded into the back buffer
+  bool  aheadDecoded; // Whether that frame was found
+  bool  stopping;
+
+  void* fileMutex;
+
+  static void aheadLoop(void* argument);
+
+  void startThreads(uint count);
+  void requestFrame();
+  void waitFrame();
+
+  void lockFile()
+  {
+    if(fileMutex)
+      System::lockMutex(fileMutex);
+  }
+
+  void unlockFile()
+  {
+    if(fileMutex)
+      System::unlockMutex(fileMutex);
+  }
+
+  bool fastSkip;
+
+  // Change tracking, one entry per 8x8 block.  A block differs from the
+  // previous frame only if it was written, or if it differed in the
+  // previous frame, since skipped blocks keep the contents of the frame
+  // before the previous one.
+  enum { changeBlockSize = 8 };
+
+  uint blocksPerRow;
+  std::vector<uint8_t> writtenBlocks;  // Written by the current frame
+  std::vector<uint8_t> changedBlocks;  // Differs from the previous frame
+  std::vector<uint8_t> pendingBlocks;  // Changed since videoRead()
+  std::vector<uint8_t> reportedBlocks; // Returned by videoChangedBlocks()
+
+  bool blockDiffers(uint blockX, uint blockY);
+  void updateChangedBlocks();
+  bool atEnd();
+  bool decodeFrame();
+  bool nextFrame();
+  void skipFrame();
+
   uint audioNextChunk;
   uint audioChunkRemaining;
   uint audioPosition;
@@ -106,7 +230,7 @@ protected:
 
   uint audioDecode(uint8_t* sampleBuffer, uint sampleCount);
 
-  ChunkType videoReadChunk();
+  ChunkType videoReadChunk(bool skipPicture);
   BlockType getBlockType();
   template<int blockSize> void handleBlock(uint x, uint y);
   template<int blockSize> void copyFromCodeBook(uint x, uint y, uint8_t index);
@@ -134,18 +258,11 @@ bool RoQ::canHandle(File& file)
 
 Media* RoQ::open(File* file)
 {
-  RoQData* media = new RoQData;
-
-  media->file = file;
+  RoQData* media = new RoQData(file);
 
   media->videoReset();
   media->audioReset();
 
-  media->front = 0;
-  media->back = 0;
-
-  media->frequency = 0;
-
   file->seek(8 /* First chunk */);
 
   for(uint tested = 0; tested < 10 && !media->frequency; ++tested)
@@ -167,11 +284,74 @@ Media* RoQ::open(File* file)
     }
   }
 
+  CVar threads = CVar::acquire("roq_threads", "2", CVar::Archive);
+  CVar fastSkip = CVar::acquire("roq_fastskip", "0", CVar::Archive);
+
+  media->fastSkip = (fastSkip.integer != 0);
+
+  // Audio may be read by the sound streaming thread while video is decoded,
+  // so the file is locked even without decoding threads
+  media->fileMutex = System::createMutex();
+
+  if(threads.integer > 0)
+    media->startThreads(threads.integer);
+
   return media;
 }
 
+RoQData::RoQData(File* _file)
+  : file(_file),
+    front(0),
+    back(0),
+    frontData(0),
+    backData(0),
+    width(0),
+    height(0),
+    input(0),
+    inputEnd(0),
+    helpersDone(0),
+    aheadThread(0),
+    aheadRequest(0),
+    aheadReady(0),
+    aheadPending(false),
+    aheadDone(false),
+    aheadDecoded(false),
+    stopping(false),
+    fileMutex(0),
+    fastSkip(false),
+    blocksPerRow(0),
+    frequency(0)
+{
+}
+
 RoQData::~RoQData()
 {
+  waitFrame();
+
+  stopping = true;
+
+  if(aheadThread)
+  {
+    System::postSemaphore(aheadRequest);
+    System::joinThread(aheadThread);
+
+    System::destroySemaphore(aheadRequest);
+    System::destroySemaphore(aheadReady);
+  }
+
+  for(uint i = 0; i < helpers.size(); ++i)
+  {
+    System::postSemaphore(helpers[i].start);
+    System::joinThread(helpers[i].thread);
+    System::destroySemaphore(helpers[i].start);
+  }
+
+  if(helpersDone)
+    System::destroySemaphore(helpersDone);
+
+  if(fileMutex)
+    System::destroyMutex(fileMutex);
+
   delete file;
 
   if(front)
@@ -181,11 +361,127 @@ RoQData::~RoQData()
   }
 }
 
+/**
+ * Starts the thread decoding ahead, and `count' - 1 threads helping it.
+ *
+ * Does nothing if the system does not support threads.
+ */
+void RoQData::startThreads(uint count)
+{
+  // The archive readers are not thread safe, so load the whole file while
+  // on the main thread.  Reads after this never leave memory.
+  file->data();
+
+  aheadRequest = System::createSemaphore();
+  aheadReady = System::createSemaphore();
+
+  aheadThread = System::createThread(aheadLoop, this);
+
+  if(!aheadThread)
+  {
+    System::destroySemaphore(aheadRequest);
+    System::destroySemaphore(aheadReady);
+
+    aheadRequest = 0;
+    aheadReady = 0;
+
+    return;
+  }
+
+  if(count < 2)
+    return;
+
+  helpersDone = System::createSemaphore();
+
+  // The threads keep pointers to the elements, so never grow the vector
+  // after this.
+  helpers.resize(count - 1);
+
+  for(uint i = 0; i < helpers.size(); ++i)
+  {
+    helpers[i].media = this;
+    helpers[i].slice = i + 1;
+    helpers[i].start = System::createSemaphore();
+    helpers[i].thread = System::createThread(helperLoop, &helpers[i]);
+
+    if(!helpers[i].thread)
+    {
+      System::destroySemaphore(helpers[i].start);
+      helpers.resize(i);
+
+      break;
+    }
+  }
+}
+
+void RoQData::aheadLoop(void* argument)
+{
+  RoQData* media = reinterpret_cast<RoQData*>(argument);
+
+  for(;;)
+  {
+    System::waitSemaphore(media->aheadRequest);
+
+    if(media->stopping)
+      break;
+
+    media->aheadDecoded = media->decodeFrame();
+
+    System::postSemaphore(media->aheadReady);
+  }
+}
+
+void RoQData::helperLoop(void* argument)
+{
+  Helper* helper = reinterpret_cast<Helper*>(argument);
+  RoQData* media = helper->media;
+
+  for(;;)
+  {
+    System::waitSemaphore(helper->start);
+
+    if(media->stopping)
+      break;
+
+    media->decodeSlice(helper->slice);
+
+    System::postSemaphore(media->helpersDone);
+  }
+}
+
+/**
+ * Asks the decoding thread for the next frame, unless it is already
+ * decoding one or has one ready.
+ */
+void RoQData::requestFrame()
+{
+  if(!aheadThread || aheadPending || aheadDone)
+    return;
+
+  aheadPending = true;
+
+  System::postSemaphore(aheadRequest);
+}
+
+/**
+ * Waits for the decoding thread to finish the requested frame, if any.
+ */
+void RoQData::waitFrame()
+{
+  if(!aheadPending)
+    return;
+
+  System::waitSemaphore(aheadReady);
+
+  aheadPending = false;
+  aheadDone = true;
+}
+
 RoQData::BlockType RoQData::getBlockType()
 {
   if(!blockTypeCount)
   {
-    blockTypes = file->getU16();
+    blockTypes = getU16();
     blockTypeCount = 8;
   }
 
@@ -204,7 +500,20 @@ void RoQData::handleBlock<16>(uint x, uint y)
 template<int blockSize>
 void RoQData::handleBlock(uint x, uint y)
 {
-  switch(getBlockType())
+  BlockType blockType = getBlockType();
+
+  if(blockType != Skip)
+  {
+    writtenBlocks[(y / changeBlockSize) * blocksPerRow
+                  + x / changeBlockSize] = 1;
+  }
+
+  Operation operation;
+
+  operation.x = x;
+  operation.y = y;
+
+  switch(blockType)
   {
   case Skip:
 
@@ -213,12 +522,13 @@ void RoQData::handleBlock(uint x, uint y)
   case Motion:
 
     {
-      int arg = file->getU8();
+      int arg = getU8();
 
-      int deviationX = 8 - (arg >> 4) - meanX;
-      int deviationY = 8 - (arg & 0xF) - meanY;
+      operation.type = (blockSize == 8) ? Move8 : Move4;
+      operation.deviationX = 8 - (arg >> 4) - meanX;
+      operation.deviationY = 8 - (arg & 0xF) - meanY;
 
-      move<blockSize>(x, y, x + deviationX, y + deviationY);
+      operations.push_back(operation);
     }
 
     break;
@@ -226,14 +536,17 @@ void RoQData::handleBlock(uint x, uint y)
   case CodeBookIndex:
 
     {
-      int i = file->getU8() * 4;
+      int i = getU8() * 4;
+
+      operation.type = (blockSize == 8) ? Copy4 : Copy2;
 
       for(int j = 0; j < 4; ++j)
       {
-        copyFromCodeBook<blockSize / 2>(
-          x + (j % 2) * blockSize / 2,
-          y + (j / 2) * blockSize / 2,
-          codeBookIndices[i + j]);
+        operation.x = x + (j % 2) * blockSize / 2;
+        operation.y = y + (j / 2) * blockSize / 2;
+        operation.index = codeBookIndices[i + j];
+
+        operations.push_back(operation);
       }
     }
 
@@ -252,12 +565,15 @@ void RoQData::handleBlock(uint x, uint y)
     }
     else // blockSize == 4
     {
+      operation.type = Copy2;
+
       for(int i = 0; i < 4; ++i)
       {
-        copyFromCodeBook<2>(
-          x + (i % 2) * 2,
-          y + (i / 2) * 2,
-          file->getU8());
+        operation.x = x + (i % 2) * 2;
+        operation.y = y + (i / 2) * 2;
+        operation.index = getU8();
+
+        operations.push_back(operation);
       }
     }
   }
@@ -311,8 +627,77 @@ void RoQData::move(uint backX, uint backY, uint frontX, uint frontY)
   }
 }
 
-RoQData::ChunkType RoQData::videoReadChunk()
+/**
+ * Executes the operations of macroblock rows `first' up to `last'.
+ */
+void RoQData::decodeRows(uint first, uint last)
+{
+  for(uint i = rowStarts[first]; i < rowStarts[last]; ++i)
+  {
+    const Operation& operation = operations[i];
+
+    switch(operation.type)
+    {
+    case Copy2:
+
+      copyFromCodeBook<2>(operation.x, operation.y, operation.index);
+
+      break;
+
+    case Copy4:
+
+      copyFromCodeBook<4>(operation.x, operation.y, operation.index);
+
+      break;
+
+    case Move4:
+
+      move<4>(operation.x, operation.y,
+              operation.x + operation.deviationX,
+              operation.y + operation.deviationY);
+
+      break;
+
+    case Move8:
+
+      move<8>(operation.x, operation.y,
+              operation.x + operation.deviationX,
+              operation.y + operation.deviationY);
+
+      break;
+    }
+  }
+}
+
+void RoQData::decodeSlice(uint slice)
+{
+  uint rows = rowStarts.size() - 1;
+  uint sliceCount = helpers.size() + 1;
+
+  decodeRows(slice * rows / sliceCount, (slice + 1) * rows / sliceCount);
+}
+
+void RoQData::executeOperations()
+{
+  for(uint i = 0; i < helpers.size(); ++i)
+    System::postSemaphore(helpers[i].start);
+
+  decodeSlice(0);
+
+  for(uint i = 0; i < helpers.size(); ++i)
+    System::waitSemaphore(helpersDone);
+}
+
+/**
+ * Reads and handles the next video chunk.
+ *
+ * If `skipPicture' is true, QuadVQ chunks are passed over without touching
+ * the image buffers.
+ */
+RoQData::ChunkType RoQData::videoReadChunk(bool skipPicture)
 {
+  lockFile();
+
   file->seek(videoNextChunk);
 
   ChunkType chunkType = static_cast<ChunkType>(file->getU16());
@@ -320,23 +705,52 @@ RoQData::ChunkType RoQData::videoReadChunk()
   uint chunkSize = file->getU32();
   videoNextChunk = file->tell() + chunkSize + 2;
 
+  bool wanted = (chunkType == Info || chunkType == QuadCodeBook
+                 || (chunkType == QuadVQ && !skipPicture));
+
+  if(wanted)
+  {
+    uint size = std::min(chunkSize + 2, file->length() - file->tell());
+
+    chunk.resize(size + 1);
+    file->read(&chunk[0], size);
+
+    input = &chunk[0];
+    inputEnd = input + size;
+  }
+
+  unlockFile();
+
   switch(chunkType)
   {
   case Info:
 
     {
-      file->skip(2); // Unused argument
+      getU16(); // Unused argument
 
       if(!front)
       {
-        width = file->getU16();
-        height = file->getU16();
+        width = getU16();
+        height = getU16();
 
         front = new Image(width, height, Image::NV12);
         frontData = front->data();
 
         back = new Image(width, height, Image::NV12);
         backData = back->data();
+
+        blocksPerRow = (width + changeBlockSize - 1) / changeBlockSize;
+
+        uint blockCount = blocksPerRow
+                        * ((height + changeBlockSize - 1) / changeBlockSize);
+
+        writtenBlocks.resize(blockCount);
+        changedBlocks.resize(blockCount);
+        pendingBlocks.resize(blockCount);
+        reportedBlocks.resize(blockCount);
+
+        std::fill(changedBlocks.begin(), changedBlocks.end(), 1);
+        std::fill(pendingBlocks.begin(), pendingBlocks.end(), 1);
       }
     }
 
@@ -345,8 +759,8 @@ RoQData::ChunkType RoQData::videoReadChunk()
   case QuadCodeBook:
 
     {
-      uint indexCount = file->getU8();
-      uint pixel2x2Count = file->getU8();
+      uint indexCount = getU8();
+      uint pixel2x2Count = getU8();
 
       if(pixel2x2Count == 0)
         pixel2x2Count = 256;
@@ -357,19 +771,30 @@ RoQData::ChunkType RoQData::videoReadChunk()
       for(uint i = 0; i < pixel2x2Count; ++i)
       {
         for(uint j = 0; j < 4; ++j)
-          codeBook[i].Y[j] = file->getU8();
+          codeBook[i].Y[j] = getU8();
 
-        codeBook[i].Cb = file->getU8();
-        codeBook[i].Cr = file->getU8();
+        codeBook[i].Cb = getU8();
+        codeBook[i].Cr = getU8();
       }
 
-      file->read(codeBookIndices, indexCount * 4);
+      uint size = std::min(indexCount * 4,
+                           static_cast<uint>(inputEnd - input));
+
+      memcpy(codeBookIndices, input, size);
+      input += size;
     }
 
     break;
 
   case QuadVQ:
 
+    if(skipPicture)
+    {
+      ++frame;
+
+      break;
+    }
+
     {
       blockTypeCount = 0;
 
@@ -382,14 +807,29 @@ RoQData::ChunkType RoQData::videoReadChunk()
          width * height + (height / 2) * width);
       }
 
-      meanY = file->getS8();
-      meanX = file->getS8();
+      meanY = static_cast<int8_t>(getU8());
+      meanX = static_cast<int8_t>(getU8());
+
+      std::fill(writtenBlocks.begin(), writtenBlocks.end(), 0);
 
       const int blockSize = 16;
 
+      operations.clear();
+      rowStarts.clear();
+
       for(uint y = 0; y < height; y += blockSize)
+      {
+        rowStarts.push_back(operations.size());
+
         for(uint x = 0; x < width; x += blockSize)
           handleBlock<blockSize>(x, y);
+      }
+
+      rowStarts.push_back(operations.size());
+
+      executeOperations();
+
+      updateChangedBlocks();
 
       ++frame;
     }
@@ -408,11 +848,81 @@ RoQData::ChunkType RoQData::videoReadChunk()
   return chunkType;
 }
 
-Image& RoQData::videoRead()
+bool RoQData::blockDiffers(uint blockX, uint blockY)
 {
-  while(!videoEOF())
-    if(QuadVQ == videoReadChunk())
-      break;
+  uint x = blockX * changeBlockSize;
+  uint y = blockY * changeBlockSize;
+  uint size = std::min(width - x, static_cast<uint>(changeBlockSize));
+  uint end = std::min(height, y + changeBlockSize);
+
+  for(uint i = y; i < end; ++i)
+  {
+    if(memcmp(&backData[i * width + x], &frontData[i * width + x], size))
+      return true;
+  }
+
+  for(uint i = y / 2; i < (end + 1) / 2; ++i)
+  {
+    if(memcmp(&backData[(height + i) * width + x],
+              &frontData[(height + i) * width + x], size))
+      return true;
+  }
+
+  return false;
+}
+
+void RoQData::updateChangedBlocks()
+{
+  for(uint i = 0; i < changedBlocks.size(); ++i)
+  {
+    if(writtenBlocks[i] || changedBlocks[i])
+    {
+      changedBlocks[i] = blockDiffers(i % blocksPerRow, i / blocksPerRow);
+      pendingBlocks[i] |= changedBlocks[i];
+    }
+  }
+}
+
+bool RoQData::atEnd()
+{
+  return !file->isOpen() || videoNextChunk == file->length();
+}
+
+/**
+ * Decodes the next frame into the back buffer.
+ *
+ * Returns false if there were no more frames.
+ */
+bool RoQData::decodeFrame()
+{
+  while(!atEnd())
+  {
+    if(QuadVQ == videoReadChunk(false))
+      return true;
+  }
+
+  return false;
+}
+
+/**
+ * Gets the next frame into the back buffer, and swaps buffers.
+ *
+ * Returns false if there were no more frames.
+ */
+bool RoQData::nextFrame()
+{
+  bool decoded;
+
+  if(aheadThread)
+  {
+    requestFrame();
+    waitFrame();
+
+    aheadDone = false;
+    decoded = aheadDecoded;
+  }
+  else
+    decoded = decodeFrame();
 
   Image* tmp = back;
   back = front;
@@ -421,24 +931,83 @@ Image& RoQData::videoRead()
   backData = back->data();
   frontData = front->data();
 
+  if(!decoded)
+    std::fill(pendingBlocks.begin(), pendingBlocks.end(), 1);
+
+  return decoded;
+}
+
+/**
+ * Passes over the next frame.
+ *
+ * With roq_fastskip, only the codebooks are parsed.  RoQ has no key
+ * frames, so the blocks the skipped frames would have written stay stale
+ * until a later frame writes them again.  It is off by default for that
+ * reason.
+ */
+void RoQData::skipFrame()
+{
+  // The first two frames initialize both buffers
+  if(!fastSkip || frame < 2)
+  {
+    nextFrame();
+
+    return;
+  }
+
+  while(!atEnd())
+  {
+    if(QuadVQ == videoReadChunk(true))
+      break;
+  }
+
+  std::fill(changedBlocks.begin(), changedBlocks.end(), 1);
+  std::fill(pendingBlocks.begin(), pendingBlocks.end(), 1);
+}
+
+Image& RoQData::videoRead()
+{
+  nextFrame();
+
+  reportedBlocks.swap(pendingBlocks);
+
+  std::fill(pendingBlocks.begin(), pendingBlocks.end(), 0);
+
+  if(!atEnd())
+    requestFrame();
+
   return *front;
 }
 
 void RoQData::videoSkip(uint count)
 {
-  while(count--)
-  {
-    while(!videoEOF())
-      if(QuadVQ == videoReadChunk())
-        break;
+  if(!count)
+    return;
 
-    Image* tmp = back;
-    back = front;
-    front = tmp;
+  // A frame decoded ahead is as good as skipped
+  waitFrame();
 
-    backData = back->data();
-    frontData = front->data();
+  if(aheadDone)
+  {
+    nextFrame();
+    --count;
   }
+
+  while(count--)
+    skipFrame();
+
+  if(!atEnd())
+    requestFrame();
+}
+
+const uint8_t* RoQData::videoChangedBlocks(uint& blockSize)
+{
+  if(reportedBlocks.empty())
+    return 0;
+
+  blockSize = changeBlockSize;
+
+  return &reportedBlocks[0];
 }
 
 uint RoQData::videoFrameRate()
@@ -448,13 +1017,26 @@ uint RoQData::videoFrameRate()
 
 bool RoQData::videoEOF()
 {
-  return !file->isOpen() || videoNextChunk == file->length();
+  waitFrame();
+
+  if(aheadDone)
+    return !aheadDecoded;
+
+  return atEnd();
 }
 
 void RoQData::videoReset()
 {
+  // Discard any frame decoded ahead
+  waitFrame();
+
+  aheadDone = false;
+
   frame = 0;
   videoNextChunk = 8;
+
+  std::fill(changedBlocks.begin(), changedBlocks.end(), 1);
+  std::fill(pendingBlocks.begin(), pendingBlocks.end(), 1);
 }
 
 uint RoQData::audioLength()
@@ -494,6 +1076,9 @@ uint RoQData::audioRead(void* buf, uint size)
 
   uint read = 0;
 
+  // The decoding thread reads video chunks from the same file
+  lockFile();
+
   if(audioChunkRemaining)
   {
     file->seek(audioPosition);
@@ -549,6 +1134,8 @@ uint RoQData::audioRead(void* buf, uint size)
 
   audioPosition = file->tell();
 
+  unlockFile();
+
   return read;
 }
 
@@ -26,6 +26,7 @@ class VorbisData : public Media
 {
 public:
 
+  uint    audioLength();
   uint    audioRead(void* buffer, uint size);
   uint    audioFormat();
   uint    audioFrequency();
@@ -173,6 +174,14 @@ VorbisData::~VorbisData()
   ov_clear(&vorbisFile);
 }
 
+uint VorbisData::audioLength()
+{
+  // Read from the last page when the stream was opened
+  ogg_int64_t length = ov_pcm_total(&vorbisFile, -1);
+
+  return (length > 0) ? length : 0;
+}
+
 uint VorbisData::audioRead(void* buff, uint bufferSize)
 {
   char* buffer = reinterpret_cast<char*>(buff);
@@ -17,6 +17,7 @@
 #include <map>
 #include <vector>
 #include <ctype.h>
+#include <string.h>
 
 #include <espace/file.h>
 #include <espace/output.h>
@@ -31,12 +32,17 @@ public:
   Internal()
     : token(0),
       eof(false),
-      stack(0)
+      stack(0),
+      end(~0U)
   {
   }
 
   String nextToken();
 
+  void tokenize();
+
+  void readDefines(uint offset);
+
   File*                        input;
   std::vector<const char*>     tokens;
   uint                         token;
@@ -44,27 +50,82 @@ public:
   bool                         eof;
   std::map<String, StringList> symbols;
   char*                        stack;
+  uint                         end;
 };
 
-Preprocessor::Preprocessor(const char* fileName)
-  : m(new Internal)
+void Preprocessor::Internal::tokenize()
 {
-  m->input = new File(fileName);
-
-  if(m->input->isOpen())
+  if(input->isOpen())
   {
     for(;;)
     {
-      String string = m->nextToken();
+      String string = nextToken();
 
       if(string.isNull())
         break;
 
-      m->tokens.push_back(strdup(string));
+      tokens.push_back(strdup(string));
     }
   }
 
-  delete m->input;
+  delete input;
+}
+
+/**
+ * Reads the #define's found before `offset'.
+ */
+void Preprocessor::Internal::readDefines(uint offset)
+{
+  const char* data = reinterpret_cast<const char*>(input->data());
+
+  for(uint i = 0; i + 7 <= offset; ++i)
+  {
+    if(data[i] != '#' || memcmp(data + i, "#define", 7))
+      continue;
+
+    uint lineStart = i;
+
+    while(lineStart && data[lineStart - 1] != '\n'
+       && isspace(data[lineStart - 1]))
+      --lineStart;
+
+    if(lineStart && data[lineStart - 1] != '\n')
+      continue;
+
+    // Let nextToken() read just this line
+    input->seek(lineStart);
+    end = lineStart + 1;
+
+    nextToken();
+
+    eof = false;
+  }
+
+  currentLine.clear();
+}
+
+Preprocessor::Preprocessor(const char* fileName)
+  : m(new Internal)
+{
+  m->input = new File(fileName);
+
+  m->tokenize();
+}
+
+Preprocessor::Preprocessor(const char* fileName, uint offset, uint length)
+  : m(new Internal)
+{
+  m->input = new File(fileName);
+
+  if(m->input->isOpen())
+  {
+    m->readDefines(offset);
+
+    m->input->seek(offset);
+    m->end = offset + length;
+  }
+
+  m->tokenize();
 }
 
 Preprocessor::~Preprocessor()
@@ -142,7 +203,7 @@ String Preprocessor::Internal::nextToken()
       currentLine.clear();
     }
 
-    String line = input->readLine();
+    String line = (input->tell() < end) ? input->readLine() : String::null;
 
     if(line.isNull())
     {
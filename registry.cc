@@ -0,0 +1,66 @@
+/***************************************************************************
+                       registry.cc  -  Asset registries
+                               -------------------
+      copyright            : (C) 2003 by Morten Hustveit
+      email                : morten@debian.org
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <algorithm>
+#include <vector>
+
+#include <espace/registry.h>
+
+namespace
+{
+  // Created on first use, as registries are created during static
+  // initialization
+  std::vector<RegistryBase*>& registryList()
+  {
+    static std::vector<RegistryBase*> list;
+
+    return list;
+  }
+}
+
+RegistryBase::RegistryBase(const char* type)
+  : typeName(type)
+{
+  registryList().push_back(this);
+}
+
+RegistryBase::~RegistryBase()
+{
+  std::vector<RegistryBase*>& list = registryList();
+
+  list.erase(std::remove(list.begin(), list.end(), this), list.end());
+}
+
+const std::vector<RegistryBase*>& RegistryBase::registries()
+{
+  return registryList();
+}
+
+uint RegistryBase::hash(const char* name)
+{
+  // FNV-1a
+  uint hash = 2166136261U;
+
+  for(; *name; ++name)
+  {
+    hash ^= static_cast<unsigned char>(*name);
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+// vim: ts=2 sw=2 et
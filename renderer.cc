@@ -15,12 +15,15 @@
  ***************************************************************************/
 
 #include <algorithm>
-#include <list>
+#include <vector>
 
 #include <math.h>
+#include <string.h>
 
+#include <espace/collision.h>
 #include <espace/color.h>
 #include <espace/cvar.h>
+#include <espace/deform.h>
 #include <espace/file.h>
 #include <espace/font.h>
 #include <espace/map.h>
@@ -37,6 +40,10 @@ namespace
 {
   struct Light
   {
+    Light()
+    {
+    }
+
     Light(const Vector3& origin, float intensity, const Color& color)
       : origin(origin),
         intensity(intensity),
@@ -51,6 +58,10 @@ namespace
 
   struct Corona
   {
+    Corona()
+    {
+    }
+
     Corona(const Vector3& direction, const Color& color)
       : direction(direction),
         color(color)
@@ -61,17 +72,120 @@ namespace
     Color   color;
   };
 
+  uint sceneAllocations = 0;
+
+  // The OpenGL modelview matrix and its stack, tracked so that the matrix
+  // never has to be read back.  Only this file changes it.
+  Matrix4x4              modelView;
+  std::vector<Matrix4x4> modelViewStack;
+
+  // Storage returned by Renderer::frameVectors()
+  Vector3*              arena = 0;
+  uint                  arenaSize = 0;
+  uint                  arenaUsed = 0;
+  uint                  arenaRequested = 0;
+  std::vector<Vector3*> arenaOverflow;
+
+  /**
+   * Array whose storage is kept when cleared, so that scene data does not
+   * cause heap allocations once it has reached its peak size.
+   */
+  template<typename T>
+  class FrameArray
+  {
+  public:
+
+    FrameArray()
+      : size(0),
+        capacity(0),
+        data(0)
+    {
+    }
+
+    void push_back(const T& value)
+    {
+      if(size == capacity)
+        grow();
+
+      data[size++] = value;
+    }
+
+    T& operator[](uint index)
+    {
+      return data[index];
+    }
+
+    uint size;
+
+  protected:
+
+    void grow()
+    {
+      uint newCapacity = capacity ? capacity * 2 : 64;
+      T* newData = new T[newCapacity];
+
+      std::copy(data, data + size, newData);
+
+      delete [] data;
+
+      data = newData;
+      capacity = newCapacity;
+
+      ++sceneAllocations;
+    }
+
+    uint capacity;
+    T*   data;
+  };
+
+  struct Range
+  {
+    Range()
+      : begin(0),
+        end(0)
+    {
+    }
+
+    uint begin;
+    uint end;
+  };
+
+  // Objects of the current scene and of all pushed scenes.  The current
+  // scene always ends at the end of the arrays.
+  FrameArray<RefEntity> entities;
+  FrameArray<RefEntity> prependedEntities; // Stored in reverse order
+  FrameArray<Light>     lights;
+  FrameArray<Corona>    coronas;
+
   struct Scene
   {
-    std::list<RefEntity> entities;
-    std::list<Corona>    coronas;
-    std::list<Light>     lights;
+    Range entities;
+    Range prependedEntities;
+    Range lights;
+    Range coronas;
   };
 
   std::vector<Scene> scenes;
 
   Scene scene;
 
+  // Whether each entity of the scene being rendered passed culling, and the
+  // projected radius passed to its model
+  FrameArray<bool>  entityVisible;
+  FrameArray<float> entityProjectedRadius;
+
+  /**
+   * Returns entity `index' of the current scene, counting the prepended
+   * entities first.
+   */
+  RefEntity* sceneEntity(uint index, uint prependedCount)
+  {
+    // Prepended entities are stored in reverse order
+    return (index < prependedCount)
+           ? &prependedEntities[scene.prependedEntities.end - 1 - index]
+           : &entities[scene.entities.begin + index - prependedCount];
+  }
+
   uint lightmap;
 
   uint maxLights = 8; // XXX
@@ -79,6 +193,18 @@ namespace
 
   bool mode2D = false;
 
+  // Entity culling statistics for the last rendered scene
+  uint entitiesDrawn = 0;
+  uint entitiesCulled = 0;
+
+  // Texture binds issued in the current and the last completed frame
+  uint frameTextureBinds = 0;
+  uint lastFrameTextureBinds = 0;
+
+  // Shader::passesSaved at the end of the last two frames
+  uint passesSavedBefore = 0;
+  uint passesSavedAfter = 0;
+
   // Render state
 
   uint activeTexture[16]; // Init in initialize()
@@ -90,7 +216,8 @@ namespace
   Renderer::Factor sourceBlend = Renderer::Factor_One;
   Renderer::Factor destBlend = Renderer::Factor_Zero;
   bool polygonOffset = false;
-  Renderer::EnvMode texEnvMode = Renderer::EnvMode_Modulate;
+  Renderer::EnvMode texEnvModes[16]; // Init in initialize()
+  bool textureMatrices[16]; // Init in initialize()
 
   uint        vertexStride;
   const char* vertexPointer = 0;
@@ -115,6 +242,132 @@ struct PixmapPrivate
   bool nvRect;
 };
 
+// Batched 2D rendering
+
+namespace
+{
+  struct Batch2D
+  {
+    Shader*             shader;
+    uint                texture;
+    Color               color;
+    Renderer::EnvMode   texEnvMode;
+    Renderer::Factor    sourceBlend;
+    Renderer::Factor    destBlend;
+    Renderer::AlphaFunc alphaFunc;
+
+    bool operator==(const Batch2D& b) const
+    {
+      if(shader != b.shader || texture != b.texture
+      || memcmp(color.data(), b.color.data(), 4))
+        return false;
+
+      // Shaders set up their own blend state
+      if(shader)
+        return true;
+
+      return texEnvMode == b.texEnvMode
+          && sourceBlend == b.sourceBlend
+          && destBlend == b.destBlend
+          && alphaFunc == b.alphaFunc;
+    }
+  };
+
+  const uint maxBatchQuads = 1024;
+
+  // Quads are stored counter-clockwise, starting at the upper left corner
+  float   batchVertices[maxBatchQuads * 4 * 3];
+  float   batchTexCoords[maxBatchQuads * 4 * 2];
+  uint    batchQuadCount = 0;
+  Batch2D batch;
+
+  /**
+   * Add a quad to the current batch, flushing it first if the state differs.
+   *
+   * `vertices' and `texCoords' both contain four (x, y) pairs.
+   */
+  void batchQuad2D(const Batch2D& state, const float* vertices,
+                   const float* texCoords)
+  {
+    if(batchQuadCount == maxBatchQuads
+    || (batchQuadCount && !(state == batch)))
+      Renderer::flush2D();
+
+    if(!batchQuadCount)
+      batch = state;
+
+    float* v = &batchVertices[batchQuadCount * 12];
+    float* t = &batchTexCoords[batchQuadCount * 8];
+
+    for(uint i = 0; i < 4; ++i)
+    {
+      *v++ = vertices[i * 2];
+      *v++ = vertices[i * 2 + 1];
+      *v++ = 0;
+      *t++ = texCoords[i * 2];
+      *t++ = texCoords[i * 2 + 1];
+    }
+
+    ++batchQuadCount;
+  }
+
+  /**
+   * Draws the pending quads with the state set up by the caller.
+   *
+   * Only the first texture unit reads from the batch.  All other vertex
+   * attributes are constant, as they would be in immediate mode.
+   */
+  void drawBatch2D(uint quadCount)
+  {
+    Renderer::setTexCoords(Renderer::Source_Array0, 0);
+
+    for(uint level = 1; level < GL::config.maxActiveTextures && level < 16;
+        ++level)
+      Renderer::setTexCoords(Renderer::Source_Constant, level);
+
+    Renderer::setColors(Renderer::Source_Constant);
+    Renderer::setNormals(Renderer::Source_Constant);
+
+    // Quads are wound for back face culling
+    if(cullFace == Renderer::Face_Front)
+      GL::frontFace(GL::CW);
+
+    GL::drawArrays(GL::QUADS, 0, quadCount * 4);
+
+    if(cullFace == Renderer::Face_Front)
+      GL::frontFace(GL::CCW);
+  }
+
+  Batch2D textureBatch(uint texture, Renderer::EnvMode texEnvMode,
+                       Renderer::Factor sourceBlend,
+                       Renderer::Factor destBlend,
+                       Renderer::AlphaFunc alphaFunc)
+  {
+    Batch2D state;
+
+    state.shader = 0;
+    state.texture = texture;
+    state.color = Shader::st_entityColor;
+    state.texEnvMode = texEnvMode;
+    state.sourceBlend = sourceBlend;
+    state.destBlend = destBlend;
+    state.alphaFunc = alphaFunc;
+
+    return state;
+  }
+
+  Batch2D shaderBatch(Shader* shader)
+  {
+    Batch2D state;
+
+    state.shader = shader;
+    state.texture = 0;
+    state.color = Shader::st_entityColor;
+
+    return state;
+  }
+}
+
 void RefDef::setViewport(int x, int y, int width, int height)
 {
   this->x = x;
@@ -138,7 +391,58 @@ void Renderer::clearScreen()
 
 void Renderer::updateScreen()
 {
+  flush2D();
+
+  captureFrame();
+
   System::updateScreen();
+
+  // Replace any extra blocks needed this frame with one large enough for
+  // all of them
+  for(uint i = 0; i < arenaOverflow.size(); ++i)
+    delete [] arenaOverflow[i];
+
+  arenaOverflow.clear();
+
+  if(arenaRequested > arenaSize)
+  {
+    delete [] arena;
+
+    arenaSize = arenaRequested;
+    arena = new Vector3[arenaSize];
+  }
+
+  arenaUsed = 0;
+  arenaRequested = 0;
+
+  Texture::update();
+  Model::update();
+
+  lastFrameTextureBinds = frameTextureBinds;
+  frameTextureBinds = 0;
+
+  passesSavedBefore = passesSavedAfter;
+  passesSavedAfter = Shader::passesSaved;
+}
+
+Vector3* Renderer::frameVectors(uint count)
+{
+  arenaRequested += count;
+
+  if(arenaUsed + count <= arenaSize)
+  {
+    Vector3* result = arena + arenaUsed;
+
+    arenaUsed += count;
+
+    return result;
+  }
+
+  Vector3* block = new Vector3[count];
+
+  arenaOverflow.push_back(block);
+
+  return block;
 }
 
 void Renderer::setColor(const Color& color)
@@ -186,6 +490,8 @@ void Renderer::setTexture(uint texture, uint level)
     }
 
     GL::bindTexture(GL::TEXTURE_2D, texture);
+
+    ++frameTextureBinds;
   }
 
   activeTexture[level] = texture;
@@ -285,11 +591,18 @@ void Renderer::setPolygonOffset(bool offset)
   polygonOffset = offset;
 }
 
-void Renderer::setTexEnvMode(EnvMode mode)
+void Renderer::setTexEnvMode(EnvMode mode, uint level)
 {
-  if(mode == texEnvMode)
+  if(mode == texEnvModes[level])
     return;
 
+  if(level != textureLevel)
+  {
+    GL::activeTextureARB(GL::TEXTURE0_ARB + level);
+
+    textureLevel = level;
+  }
+
   switch(mode)
   {
   case EnvMode_Modulate:
@@ -316,6 +629,12 @@ void Renderer::setTexEnvMode(EnvMode mode)
 
     break;
 
+  case EnvMode_Add:
+
+    GL::texEnvi(GL::TEXTURE_ENV, GL::TEXTURE_ENV_MODE, GL::ADD);
+
+    break;
+
   default:
 
     esWarning << "Invalid texture environment mode \"" << mode
@@ -324,7 +643,31 @@ void Renderer::setTexEnvMode(EnvMode mode)
     return;
   }
 
-  texEnvMode = mode;
+  texEnvModes[level] = mode;
+}
+
+void Renderer::setTextureMatrix(const float* matrix, uint level)
+{
+  if(!matrix && !textureMatrices[level])
+    return;
+
+  if(level != textureLevel)
+  {
+    GL::activeTextureARB(GL::TEXTURE0_ARB + level);
+
+    textureLevel = level;
+  }
+
+  GL::matrixMode(GL::TEXTURE);
+
+  if(matrix)
+    GL::loadMatrixf(matrix);
+  else
+    GL::loadIdentity();
+
+  GL::matrixMode(GL::MODELVIEW);
+
+  textureMatrices[level] = (matrix != 0);
 }
 
 void Renderer::set2DMode()
@@ -347,11 +690,16 @@ void Renderer::set2DMode()
   GL::pushMatrix();
   GL::loadIdentity();
 
+  modelViewStack.push_back(modelView);
+  modelView.identity();
+
   mode2D = true;
 }
 
 void Renderer::set3DMode()
 {
+  flush2D();
+
   if(!mode2D)
     return;
 
@@ -360,15 +708,76 @@ void Renderer::set3DMode()
   GL::matrixMode(GL::PROJECTION);
   GL::popMatrix();
 
+  modelView = modelViewStack.back();
+  modelViewStack.pop_back();
+
   GL::depthMask(GL::TRUE);
   GL::depthFunc(GL::LEQUAL);
 
   mode2D = false;
 }
 
+void Renderer::flush2D()
+{
+  if(!batchQuadCount)
+    return;
+
+  uint quadCount = batchQuadCount;
+
+  batchQuadCount = 0;
+
+  // Callers may have set up arrays for their own drawing already
+  const char* oldVertexPointer = vertexPointer;
+  uint        oldVertexStride = vertexStride;
+  const char* oldTexCoordPointer = texCoordPointer[0];
+  uint        oldTexCoordStride = texCoordStride[0];
+
+  setVertexArray(batchVertices);
+  setTexCoordArray(0, batchTexCoords);
+
+  if(batch.shader)
+  {
+    Color entityColor = Shader::st_entityColor;
+
+    Shader::st_entityColor = batch.color;
+
+    for(uint pass = 0; pass < batch.shader->passCount(); ++pass)
+    {
+      batch.shader->pushState(pass);
+
+      drawBatch2D(quadCount);
+
+      batch.shader->popState();
+    }
+
+    Shader::st_entityColor = entityColor;
+  }
+  else
+  {
+    GL::color4ubv(batch.color.data());
+
+    setTexture(batch.texture);
+    setTexEnvMode(batch.texEnvMode);
+    setCullFace(Face_Back);
+    setAlphaFunc(batch.alphaFunc);
+    setBlendFunc(batch.sourceBlend, batch.destBlend);
+    setPolygonOffset(false);
+
+    drawBatch2D(quadCount);
+  }
+
+  if(oldVertexPointer)
+    setVertexArray(oldVertexPointer, oldVertexStride);
+
+  if(oldTexCoordPointer)
+    setTexCoordArray(0, oldTexCoordPointer, oldTexCoordStride);
+}
+
 void Renderer::drawLine3D(const Vector3& start, const Vector3& end,
                           Shader* shader)
 {
+  flush2D();
+
   for(uint pass = 0; pass < shader->passCount(); ++pass)
   {
     shader->pushState(pass);
@@ -384,11 +793,13 @@ void Renderer::drawLine3D(const Vector3& start, const Vector3& end,
 
 void Renderer::drawQuad2D(float __x, float _y, const Pixmap* pixmap)
 {
-  setCullFace(Face_Back);
-  setTexEnvMode(EnvMode_Replace);
-
   if(pixmap->d->nvRect)
   {
+    flush2D();
+
+    setCullFace(Face_Back);
+    setTexEnvMode(EnvMode_Replace);
+
     // XXX: Respect and update texture state
 
     GL::enable(GL::TEXTURE_RECTANGLE_NV);
@@ -409,6 +820,8 @@ void Renderer::drawQuad2D(float __x, float _y, const Pixmap* pixmap)
   }
   else
   {
+    static const float texCoords[8] = { 0, 0, 0, 1, 1, 1, 1, 0 };
+
     for(uint y = 0; y < pixmap->d->heights.size(); ++y)
     {
       float _x = __x;
@@ -417,18 +830,14 @@ void Renderer::drawQuad2D(float __x, float _y, const Pixmap* pixmap)
       {
         uint glHandle = pixmap->d->glHandles[y * pixmap->d->widths.size() + x];
 
-        setTexture(glHandle);
-
-        GL::begin(GL::QUADS);
-        GL::texCoord2f(0, 0);
-        GL::vertex2f(_x, _y);
-        GL::texCoord2f(0, 1);
-        GL::vertex2f(_x, _y + pixmap->d->heights[y]);
-        GL::texCoord2f(1, 1);
-        GL::vertex2f(_x + pixmap->d->widths[x], _y + pixmap->d->heights[y]);
-        GL::texCoord2f(1, 0);
-        GL::vertex2f(_x + pixmap->d->widths[x], _y);
-        GL::end();
+        float x2 = _x + pixmap->d->widths[x];
+        float y2 = _y + pixmap->d->heights[y];
+
+        float vertices[8] = { _x, _y, _x, y2, x2, y2, x2, _y };
+
+        batchQuad2D(textureBatch(glHandle, EnvMode_Replace, sourceBlend,
+                                 destBlend, alphaFunc),
+                    vertices, texCoords);
 
         _x += pixmap->d->widths[x];
       }
@@ -442,31 +851,14 @@ void Renderer::drawQuad2D(float x, float y, float width, float height,
                           float s1, float t1, float s2, float t2,
                           Shader* shader)
 {
-  for(uint pass = 0; pass < shader->passCount(); ++pass)
+  float vertices[8] =
   {
-    shader->pushState(pass);
-
-    GL::begin(GL::QUADS);
-
-    if(cullFace == Face_Back)
-    {
-      GL::texCoord2f(s1, t1); GL::vertex2f(x, y);
-      GL::texCoord2f(s1, t2); GL::vertex2f(x, y + height);
-      GL::texCoord2f(s2, t2); GL::vertex2f(x + width, y + height);
-      GL::texCoord2f(s2, t1); GL::vertex2f(x + width, y);
-    }
-    else
-    {
-      GL::texCoord2f(s1, t1); GL::vertex2f(x, y);
-      GL::texCoord2f(s2, t1); GL::vertex2f(x + width, y);
-      GL::texCoord2f(s2, t2); GL::vertex2f(x + width, y + height);
-      GL::texCoord2f(s1, t2); GL::vertex2f(x, y + height);
-    }
+    x, y, x, y + height, x + width, y + height, x + width, y
+  };
 
-    GL::end();
+  float texCoords[8] = { s1, t1, s1, t2, s2, t2, s2, t1 };
 
-    shader->popState();
-  }
+  batchQuad2D(shaderBatch(shader), vertices, texCoords);
 }
 
 void Renderer::drawQuad2D(float x, float y, float width, float height,
@@ -488,19 +880,17 @@ void Renderer::drawQuad2D(float x, float y, float width, float height,
   Vector3 lowerLeft =  (Vector3(-width,  height, 0) * matrix) + center;
   Vector3 lowerRight = (Vector3( width,  height, 0) * matrix) + center;
 
-  for(uint pass = 0; pass < shader->passCount(); ++pass)
+  float vertices[8] =
   {
-    shader->pushState(pass);
+    upperLeft(0), upperLeft(1),
+    lowerLeft(0), lowerLeft(1),
+    lowerRight(0), lowerRight(1),
+    upperRight(0), upperRight(1)
+  };
 
-    GL::begin(GL::QUADS);
-    GL::texCoord2f(s1, t1); GL::vertex2fv(upperLeft.data());
-    GL::texCoord2f(s1, t2); GL::vertex2fv(lowerLeft.data());
-    GL::texCoord2f(s2, t2); GL::vertex2fv(lowerRight.data());
-    GL::texCoord2f(s2, t1); GL::vertex2fv(upperRight.data());
-    GL::end();
+  float texCoords[8] = { s1, t1, s1, t2, s2, t2, s2, t1 };
 
-    shader->popState();
-  }
+  batchQuad2D(shaderBatch(shader), vertices, texCoords);
 }
 
 void Renderer::drawQuad3D(const Vector3& v1, const Vector3& v2,
@@ -509,6 +899,8 @@ void Renderer::drawQuad3D(const Vector3& v1, const Vector3& v2,
                           const Vector2& t3, const Vector2& t4,
                           Shader* shader)
 {
+  flush2D();
+
   for(uint pass = 0; pass < shader->passCount(); ++pass)
   {
     shader->pushState(pass);
@@ -524,8 +916,143 @@ void Renderer::drawQuad3D(const Vector3& v1, const Vector3& v2,
   }
 }
 
+// Vertex deformation
+
+namespace
+{
+  // Scratch copies of the deformed vertices, indexed like the source arrays
+  std::vector<float> deformPositions;
+  std::vector<float> deformNormals;
+
+  // Vertices and indexes referenced by the current batch
+  std::vector<uint>  deformStamps;
+  uint               deformStamp = 0;
+  std::vector<uint>  deformList;
+  std::vector<uint>  deformIndexes;
+
+  const char* undeformedVertexPointer;
+  uint        undeformedVertexStride;
+  const char* undeformedNormalPointer;
+  uint        undeformedNormalStride;
+
+  void beginDeform()
+  {
+    if(!++deformStamp)
+    {
+      std::fill(deformStamps.begin(), deformStamps.end(), 0);
+
+      deformStamp = 1;
+    }
+
+    deformList.clear();
+    deformIndexes.clear();
+  }
+
+  /**
+   * Adds the vertices of a primitive to the batch being deformed.
+   */
+  void collectDeform(const uint* indexes, uint indexCount)
+  {
+    for(uint i = 0; i < indexCount; ++i)
+    {
+      uint index = indexes[i];
+
+      if(index >= deformStamps.size())
+        deformStamps.resize(index + 1, 0);
+
+      if(deformStamps[index] != deformStamp)
+      {
+        deformStamps[index] = deformStamp;
+        deformList.push_back(index);
+      }
+    }
+
+    deformIndexes.insert(deformIndexes.end(), indexes, indexes + indexCount);
+  }
+
+  /**
+   * Deforms the collected vertices and points the vertex and normal arrays
+   * at the result.  Must be followed by a call to endDeform().
+   */
+  void applyDeform(const Shader* shader)
+  {
+    undeformedVertexPointer = vertexPointer;
+    undeformedVertexStride = vertexStride;
+    undeformedNormalPointer = normalPointer;
+    undeformedNormalStride = normalStride;
+
+    uint size = deformStamps.size() * 3;
+
+    if(deformPositions.size() < size)
+    {
+      deformPositions.resize(size);
+      deformNormals.resize(size);
+    }
+
+    uint stride = vertexStride ? vertexStride : 3 * sizeof(float);
+    uint nStride = normalStride ? normalStride : 3 * sizeof(float);
+
+    for(std::vector<uint>::const_iterator i = deformList.begin();
+        i != deformList.end(); ++i)
+    {
+      memcpy(&deformPositions[*i * 3], vertexPointer + *i * stride,
+             3 * sizeof(float));
+
+      if(normalPointer)
+        memcpy(&deformNormals[*i * 3], normalPointer + *i * nStride,
+               3 * sizeof(float));
+    }
+
+    Deformer::Vertices vertices;
+
+    vertices.positions = &deformPositions[0];
+    vertices.normals = normalPointer ? &deformNormals[0] : 0;
+    vertices.texCoords = texCoordPointer[0];
+    vertices.texCoordStride = texCoordStride[0] ? texCoordStride[0]
+                                                : 2 * sizeof(float);
+    vertices.list = &deformList[0];
+    vertices.count = deformList.size();
+
+    // The camera in object space, from the transpose of the modelview
+    // rotation
+    const float* m = modelView.data();
+
+    Deformer::View view;
+
+    view.right = Vector3(m[0], m[4], m[8]);
+    view.right.normalize();
+    view.up = Vector3(m[1], m[5], m[9]);
+    view.up.normalize();
+    view.origin = Vector3(-(m[0] * m[12] + m[1] * m[13] + m[2] * m[14]),
+                          -(m[4] * m[12] + m[5] * m[13] + m[6] * m[14]),
+                          -(m[8] * m[12] + m[9] * m[13] + m[10] * m[14]));
+
+    const Shader::Deform* deforms = shader->deforms();
+
+    for(uint i = 0; i < shader->deformCount(); ++i)
+      Deformer::apply(deforms[i], vertices, &deformIndexes[0],
+                      deformIndexes.size(), view, Shader::time);
+
+    Renderer::setVertexArray(&deformPositions[0]);
+
+    if(normalPointer)
+      Renderer::setNormalArray(&deformNormals[0]);
+  }
+
+  void endDeform()
+  {
+    Renderer::setVertexArray(undeformedVertexPointer, undeformedVertexStride);
+
+    if(undeformedNormalPointer)
+      Renderer::setNormalArray(undeformedNormalPointer,
+                               undeformedNormalStride);
+  }
+}
+
 void Renderer::drawTriangles(uint triangleCount, const uint* indexes)
 {
+  flush2D();
+
   GL::drawElements(GL::TRIANGLES, triangleCount * 3, GL::UNSIGNED_INT,
                    indexes);
 }
@@ -533,6 +1060,17 @@ void Renderer::drawTriangles(uint triangleCount, const uint* indexes)
 void Renderer::drawTriangles(uint triangleCount, const uint* indexes,
                              Shader* shader)
 {
+  flush2D();
+
+  bool deform = shader->deformCount() && vertexPointer;
+
+  if(deform)
+  {
+    beginDeform();
+    collectDeform(indexes, triangleCount * 3);
+    applyDeform(shader);
+  }
+
   for(uint pass = 0; pass < shader->passCount(); ++pass)
   {
     shader->pushState(pass);
@@ -542,14 +1080,57 @@ void Renderer::drawTriangles(uint triangleCount, const uint* indexes,
 
     shader->popState();
   }
+
+  if(deform)
+    endDeform();
 }
 
 void Renderer::drawTriangles(uint triangleCount, const uint* indexes,
                              Skin* skin, const char* surfaceName)
 {
+  flush2D();
+
+  Shader* shader = skin->deformShader(skin->surfaceIndex(surfaceName));
+
+  bool deform = shader && vertexPointer;
+
+  if(deform)
+  {
+    beginDeform();
+    collectDeform(indexes, triangleCount * 3);
+    applyDeform(shader);
+  }
+
   skin->pushState(surfaceName);
 
   GL::drawElements(GL::TRIANGLES, triangleCount * 3, GL::UNSIGNED_INT, indexes);
+
+  if(deform)
+    endDeform();
+}
+
+void Renderer::drawTriangles(uint triangleCount, const uint* indexes,
+                             Skin* skin, int surface)
+{
+  flush2D();
+
+  Shader* shader = skin->deformShader(surface);
+
+  bool deform = shader && vertexPointer;
+
+  if(deform)
+  {
+    beginDeform();
+    collectDeform(indexes, triangleCount * 3);
+    applyDeform(shader);
+  }
+
+  skin->pushState(surface);
+
+  GL::drawElements(GL::TRIANGLES, triangleCount * 3, GL::UNSIGNED_INT, indexes);
+
+  if(deform)
+    endDeform();
 }
 
 // Matrix functions
@@ -566,6 +1147,8 @@ void Renderer::setViewMatrix(const Matrix4x4& matrix)
   GL::matrixMode(GL::MODELVIEW);
 
   GL::loadMatrixf(matrix.data());
+
+  modelView = matrix;
 }
 
 Matrix4x4 Renderer::projectionMatrix()
@@ -579,11 +1162,7 @@ Matrix4x4 Renderer::projectionMatrix()
 
 Matrix4x4 Renderer::viewMatrix()
 {
-  float temp[16];
-
-  GL::getFloatv(GL::MODELVIEW_MATRIX, temp);
-
-  return Matrix4x4(temp);
+  return modelView;
 }
 
 // Font functions
@@ -599,7 +1178,7 @@ void Renderer::put(float x, float y, const Font* font, const char* text,
   if(align != Left)
   {
     for(const char* ch = text; *ch; ++ch)
-      width += font->glyphs[static_cast<int>(*ch)].xSkip;
+      width += font->glyphs[static_cast<unsigned char>(*ch)].xSkip;
 
     if(align == Center)
       x -= width / 2;
@@ -607,13 +1186,48 @@ void Renderer::put(float x, float y, const Font* font, const char* text,
       x -= width;
   }
 
+  if(font->atlas)
+  {
+    Batch2D state = textureBatch(font->atlas, EnvMode_Modulate,
+                                 Factor_SrcAlpha, Factor_OneMinusSrcAlpha,
+                                 Alpha_All);
+
+    for(; *text; ++text)
+    {
+      const Font::Glyph& glyph
+        = font->glyphs[static_cast<unsigned char>(*text)];
+
+      if(glyph.shaderHandle && glyph.imageWidth && glyph.imageHeight)
+      {
+        float x1 = x;
+        float y1 = y - glyph.top;
+        float x2 = x1 + glyph.imageWidth;
+        float y2 = y1 + glyph.imageHeight;
+
+        float vertices[8] = { x1, y1, x1, y2, x2, y2, x2, y1 };
+        float texCoords[8] =
+        {
+          glyph.atlasS1, glyph.atlasT1, glyph.atlasS1, glyph.atlasT2,
+          glyph.atlasS2, glyph.atlasT2, glyph.atlasS2, glyph.atlasT1
+        };
+
+        batchQuad2D(state, vertices, texCoords);
+      }
+
+      x += glyph.xSkip;
+    }
+
+    return;
+  }
+
   // Used for caching the results from Shader::shaderForHandle()
   int lastHandle = 0;
   Shader* shader = 0;
 
   while(*text)
   {
-    const Font::Glyph& glyph = font->glyphs[static_cast<int>(*text)];
+    const Font::Glyph& glyph
+      = font->glyphs[static_cast<unsigned char>(*text)];
 
     if(glyph.shaderHandle != lastHandle)
     {
@@ -889,6 +1503,8 @@ void Renderer::addTriangles(uint triangleCount, const uint* indexes,
 
 void Renderer::flush()
 {
+  flush2D();
+
   std::stable_sort(simplePrimitives,
                    simplePrimitives + simplePrimitiveCount);
   std::stable_sort(shaderPrimitives,
@@ -948,15 +1564,32 @@ void Renderer::flush()
       count++;
     }
 
+    bool deform = primitive->shader->deformCount() && vertexPointer;
+
+    if(deform)
+    {
+      beginDeform();
+
+      for(uint i = 0; i < count; ++i)
+        collectDeform(primitive[i].indexes, primitive[i].indexCount);
+
+      applyDeform(primitive->shader);
+    }
+
     for(uint pass = 0; pass < primitive->shader->passCount(); ++pass)
     {
       primitive->shader->pushState(pass);
 
       for(uint i = 0; i < count; ++i)
       {
+        // Lightmap stages may be on the first or, when a shader draws two
+        // stages in one pass, on the second texture unit
         if(texCoordSource[0] == Source_Array1)
           setTexture(primitive[i].lightmap);
 
+        if(texCoordSource[1] == Source_Array1)
+          setTexture(primitive[i].lightmap, 1);
+
         GL::drawElements(primitive[i].type, primitive[i].indexCount,
                          GL::UNSIGNED_INT, primitive[i].indexes);
       }
@@ -964,15 +1597,15 @@ void Renderer::flush()
       primitive->shader->popState();
     }
 
+    if(deform)
+      endDeform();
+
     primitive += count;
   }
 
   CVar dynamicLights = CVar::acquire("r_dynamiclight", "1", CVar::Archive);
 
-  if(!dynamicLights.integer)
-    scene.lights.clear();
-
-  if(!scene.lights.empty())
+  if(dynamicLights.integer && scene.lights.begin != scene.lights.end)
   {
     setDepthMask(false);
     setPolygonOffset(false);
@@ -983,9 +1616,10 @@ void Renderer::flush()
     setTexCoords(Source_Constant);
     setColors(Source_Constant);
 
-    for(std::list<Light>::iterator light = scene.lights.begin();
-        light != scene.lights.end(); ++light)
+    for(uint index = scene.lights.begin; index != scene.lights.end; ++index)
     {
+      const Light* light = &lights[index];
+
       Vector3 origin = light->origin;
 
       GL::disable(GL::CULL_FACE);
@@ -1098,35 +1732,59 @@ void Renderer::flush()
 
 void Renderer::clearScene()
 {
-  scene.entities.clear();
-  scene.lights.clear();
-  scene.coronas.clear();
+  if(scenes.empty())
+  {
+    entities.size = 0;
+    prependedEntities.size = 0;
+    lights.size = 0;
+    coronas.size = 0;
+  }
+
+  scene.entities.begin = scene.entities.end = entities.size;
+  scene.prependedEntities.begin = scene.prependedEntities.end
+    = prependedEntities.size;
+  scene.lights.begin = scene.lights.end = lights.size;
+  scene.coronas.begin = scene.coronas.end = coronas.size;
 
   // XXX: clear polys
 }
 
 void Renderer::addLight(const Vector3& origin, float intensity, const Color& color)
 {
-  scene.lights.push_back(Light(origin, intensity, color));
+  lights.push_back(Light(origin, intensity, color));
+
+  scene.lights.end = lights.size;
 }
 
 void Renderer::addCorona(const Vector3& direction, const Color& color)
 {
-  scene.coronas.push_back(Corona(direction, color));
+  coronas.push_back(Corona(direction, color));
+
+  scene.coronas.end = coronas.size;
 }
 
 void Renderer::prependRefEntity(const RefEntity& refEntity)
 {
-  scene.entities.push_front(refEntity);
+  prependedEntities.push_back(refEntity);
+
+  scene.prependedEntities.end = prependedEntities.size;
 }
 
 void Renderer::appendRefEntity(const RefEntity& refEntity)
 {
-  scene.entities.push_back(refEntity);
+  entities.push_back(refEntity);
+
+  scene.entities.end = entities.size;
+}
+
+uint Renderer::sceneAllocations()
+{
+  return ::sceneAllocations;
 }
 
 void Renderer::renderScene(const RefDef& refDef, Map* map)
 {
+  flush2D();
 
   if(refDef.fovX == 0 || refDef.fovY == 0)
     return;
@@ -1208,8 +1866,45 @@ void Renderer::renderScene(const RefDef& refDef, Map* map)
 
   GL::loadMatrixf(viewMatrix.data());
 
+  modelViewStack.push_back(modelView);
+  modelView = viewMatrix;
+
   Matrix3x3 orientation = refDef.axis;
 
+  // Planes of the view frustum, pointing inwards.  The far plane is at
+  // infinity.
+  Matrix4x4 clip = viewMatrix * projMatrix;
+  Vector3 frustum[5];
+  float frustumDistance[5];
+
+  for(uint i = 0; i < 5; ++i)
+  {
+    uint column = i / 2;
+    float sign = (i & 1) ? -1 : 1;
+
+    for(uint j = 0; j < 4; ++j)
+    {
+      float value = clip(j, 3) + sign * clip(j, column);
+
+      if(j < 3)
+        frustum[i](j) = value;
+      else
+        frustumDistance[i] = value;
+    }
+
+    float m = frustum[i].magnitude();
+
+    frustum[i] /= m;
+    frustumDistance[i] /= -m;
+  }
+
+  CVar noCull = CVar::acquire("r_nocull", "0", CVar::Cheat);
+
+  bool pvsCull = map && !(refDef.rdflags & RefDef::NoWorldModel);
+
+  entitiesDrawn = 0;
+  entitiesCulled = 0;
+
   uint light = 0;
 
   float specular[] =
@@ -1229,9 +1924,11 @@ void Renderer::renderScene(const RefDef& refDef, Map* map)
   GL::colorMaterial(GL::FRONT_AND_BACK, GL::AMBIENT_AND_DIFFUSE);
   GL::enable(GL::COLOR_MATERIAL);
 */
-  for(std::list<Corona>::iterator i = scene.coronas.begin();
-      i != scene.coronas.end() && light < maxLights; ++i)
+  for(uint index = scene.coronas.begin;
+      index != scene.coronas.end && light < maxLights; ++index)
   {
+    const Corona* i = &coronas[index];
+
     GL::enable(GL::LIGHT0 + light);
 
     float position[4] =
@@ -1268,27 +1965,139 @@ void Renderer::renderScene(const RefDef& refDef, Map* map)
 
   activeLights = light;
 
+  uint prependedCount = scene.prependedEntities.end
+                      - scene.prependedEntities.begin;
+  uint entityCount = prependedCount
+                   + scene.entities.end - scene.entities.begin;
+
+  // Cull the models before drawing anything, so that they can prepare their
+  // vertices in other threads while the world is drawn
+  entityVisible.size = 0;
+  entityProjectedRadius.size = 0;
+
+  for(uint index = 0; index < entityCount; ++index)
+  {
+    RefEntity* i = sceneEntity(index, prependedCount);
+
+    entityVisible.push_back(false);
+    entityProjectedRadius.push_back(0);
+
+    if(i->type != RefEntity::Model || !i->modelHandle
+    || (i->renderfx & RefEntity::ThirdPerson))
+      continue;
+
+    Model* model = Model::modelForHandle(i->modelHandle);
+
+    if(!model)
+      continue;
+
+    Matrix4x4 modelMatrix;
+
+    modelMatrix.identity();
+    modelMatrix.translate(i->origin(0), i->origin(1), i->origin(2));
+    modelMatrix *= i->axis;
+
+    Vector3 boxMin, boxMax;
+
+    model->boundBox(boxMin, boxMax);
+
+    if(!noCull.integer)
+    {
+      // World space box enclosing the transformed bounding box
+      Vector3 min, max;
+
+      for(uint corner = 0; corner < 8; ++corner)
+      {
+        Vector3 point((corner & 1) ? boxMax(0) : boxMin(0),
+                      (corner & 2) ? boxMax(1) : boxMin(1),
+                      (corner & 4) ? boxMax(2) : boxMin(2));
+
+        point *= modelMatrix;
+
+        for(uint j = 0; j < 3; ++j)
+        {
+          if(!corner || point(j) < min(j))
+            min(j) = point(j);
+
+          if(!corner || point(j) > max(j))
+            max(j) = point(j);
+        }
+      }
+
+      bool culled = false;
+
+      for(uint j = 0; j < 5 && !culled; ++j)
+        culled = Collision::front(frustum[j], frustumDistance[j], min, max);
+
+      if(!culled && pvsCull)
+        culled = !map->visible(refDef.origin, min, max);
+
+      if(culled)
+      {
+        ++entitiesCulled;
+
+        continue;
+      }
+    }
+
+    entityVisible[index] = true;
+
+    // Models seen through the eyes, like the view weapon, are always drawn
+    // in full detail
+    if(!(i->renderfx & (RefEntity::FirstPerson | RefEntity::DepthHack)))
+    {
+      Vector3 center = (boxMin + boxMax) * 0.5;
+
+      center *= modelMatrix;
+
+      // Measured after the transform, since entity axes may be scaled
+      float radius = 0;
+
+      for(uint corner = 0; corner < 8; ++corner)
+      {
+        Vector3 point((corner & 1) ? boxMax(0) : boxMin(0),
+                      (corner & 2) ? boxMax(1) : boxMin(1),
+                      (corner & 4) ? boxMax(2) : boxMin(2));
+
+        point *= modelMatrix;
+
+        radius = std::max(radius, (point - center).magnitude());
+      }
+
+      float depth = 0;
+
+      for(uint j = 0; j < 3; ++j)
+        depth += (center(j) - refDef.origin(j)) * refDef.axis(0, j);
+
+      if(depth > 0)
+      {
+        entityProjectedRadius[index]
+          = std::min(radius * projMatrix(1, 1) / depth, 1.0f);
+      }
+    }
+
+    model->prepare(i->frame, i->backlerp, entityProjectedRadius[index]);
+  }
+
   if(map && !(refDef.rdflags & RefDef::NoWorldModel))
     map->render();
 
   // map->render may change matrix mode
   GL::matrixMode(GL::MODELVIEW);
 
-  for(std::list<RefEntity>::iterator i = scene.entities.begin();
-      i != scene.entities.end(); ++i)
+  for(uint index = 0; index < entityCount; ++index)
   {
+    RefEntity* i = sceneEntity(index, prependedCount);
+
     Shader::st_entityColor = i->color;
 
     switch(i->type)
     {
     case RefEntity::Model:
 
-      if(i->modelHandle)
+      if(entityVisible[index])
       {
-        if(i->renderfx & RefEntity::ThirdPerson)
-          break;
-
-        GL::pushMatrix();
+        Model* model = Model::modelForHandle(i->modelHandle);
 
         Matrix4x4 modelMatrix;
 
@@ -1296,16 +2105,25 @@ void Renderer::renderScene(const RefDef& refDef, Map* map)
         modelMatrix.translate(i->origin(0), i->origin(1), i->origin(2));
         modelMatrix *= i->axis;
 
+        ++entitiesDrawn;
+
+        GL::pushMatrix();
+
         GL::multMatrixf(modelMatrix.data());
 
-        Model* model = Model::modelForHandle(i->modelHandle);
+        modelViewStack.push_back(modelView);
+        modelView *= modelMatrix;
 
         int skin = i->customSkin ? i->customSkin : i->skinNum;
 
-        model->render(i->frame, i->backlerp, i->customShader, skin);
+        model->render(i->frame, i->backlerp, i->customShader, skin,
+                      entityProjectedRadius[index]);
 
         GL::matrixMode(GL::MODELVIEW);
         GL::popMatrix();
+
+        modelView = modelViewStack.back();
+        modelViewStack.pop_back();
       }
 
       break;
@@ -1505,6 +2323,25 @@ void Renderer::renderScene(const RefDef& refDef, Map* map)
   GL::popMatrix();
   GL::matrixMode(GL::PROJECTION);
   GL::popMatrix();
+
+  modelView = modelViewStack.back();
+  modelViewStack.pop_back();
+}
+
+void Renderer::entityStatistics(uint& drawn, uint& culled)
+{
+  drawn = entitiesDrawn;
+  culled = entitiesCulled;
+}
+
+uint Renderer::textureBinds()
+{
+  return lastFrameTextureBinds;
+}
+
+uint Renderer::passesSaved()
+{
+  return passesSavedAfter - passesSavedBefore;
 }
 
 void Renderer::pushScene()
@@ -1514,8 +2351,6 @@ void Renderer::pushScene()
 
 void Renderer::popScene()
 {
-  scene = scenes.back();
-
   if(scenes.empty())
   {
     esWarning << "Attempt to pop from an empty scene stack." << std::endl;
@@ -1523,7 +2358,15 @@ void Renderer::popScene()
     return;
   }
 
+  scene = scenes.back();
+
   scenes.pop_back();
+
+  // Objects added after the push are no longer referenced
+  entities.size = scene.entities.end;
+  prependedEntities.size = scene.prependedEntities.end;
+  lights.size = scene.lights.end;
+  coronas.size = scene.coronas.end;
 }
 
 void Renderer::initialize()
@@ -1537,6 +2380,8 @@ void Renderer::initialize()
 
   GL::initialize();
 
+  modelView.identity();
+
   GL::genTextures(1, &lightmap);
 
   setTexture(lightmap);
@@ -1573,6 +2418,8 @@ void Renderer::initialize()
   {
     activeTexture[i] = 0;
     texCoordSource[i] = Source_Constant;
+    texEnvModes[i] = EnvMode_Modulate;
+    textureMatrices[i] = false;
   }
 
   // From Shader::setDefaults()
@@ -22,22 +22,46 @@
 #include <espace/opengl.h>
 #include <espace/output.h>
 #include <espace/plugins.h>
+#include <espace/registry.h>
 #include <espace/renderer.h>
 #include <espace/shader.h>
 #include <espace/string.h>
 
 namespace
 {
-  std::map<int, Shader*>   handles;
-  std::map<String, int>    reverseHandles;
+  // Names for which no shader was found are registered with a null shader,
+  // so that they are not searched for again
+  Registry<Shader*>        handles("Shaders");
   std::map<String, String> remapping;
-  int                      nextHandle = 1;
+
+  const uint waveTableSize = Shader::waveTableSize;
+
+  // One period of each waveform, indexed by Shader::WaveForm
+  float waveTables[5][waveTableSize];
+  bool  waveTablesBuilt = false;
+
+  void buildWaveTables()
+  {
+    for(uint i = 0; i < waveTableSize; ++i)
+    {
+      float subpos = float(i) / waveTableSize;
+
+      waveTables[Shader::Sawtooth][i] = subpos;
+      waveTables[Shader::InverseSawtooth][i] = 1 - subpos;
+      waveTables[Shader::Sin][i] = sin(subpos * 2 * M_PI);
+      waveTables[Shader::Square][i] = (subpos < 0.5) ? 1 : -1;
+      waveTables[Shader::Triangle][i] = (subpos < 0.5) ? (2 * subpos)
+                                                       : (2 - 2 * subpos);
+    }
+
+    waveTablesBuilt = true;
+  }
 }
 
-bool              Shader::st_tcMod = false;
 Color             Shader::st_entityColor(255, 255, 255);
 
 float             Shader::time = 0;
+uint              Shader::passesSaved = 0;
 
 Shader* Shader::acquire(const char* _name, bool mipmaps)
 {
@@ -50,14 +74,14 @@ Shader* Shader::acquire(const char* _name, bool mipmaps)
   if(j != remapping.end())
     name = j->second;
 
-  std::map<String, int>::iterator i = reverseHandles.find(name);
+  uint handle = handles.find(name);
 
-  if(i != reverseHandles.end())
+  if(handle)
   {
-    if(i->second == 0)
-      return 0;
+    Shader* shader = *handles.get(handle);
 
-    Shader* shader = handles[i->second];
+    if(!shader)
+      return 0;
 
     ++shader->refCount;
 
@@ -71,14 +95,13 @@ Shader* Shader::acquire(const char* _name, bool mipmaps)
 
     if(shader)
     {
-      handles[nextHandle++] = shader;
-      reverseHandles[name] = nextHandle - 1;
+      shader->handle = handles.add(name, shader);
 
       return shader;
     }
   }
 
-  reverseHandles[name] = 0;
+  handles.add(name, 0);
 
   return 0;
 }
@@ -94,18 +117,18 @@ int Shader::acquireHandle(const char* _name, bool mipmaps)
   if(j != remapping.end())
     name = j->second;
 
-  std::map<String, int>::iterator i = reverseHandles.find(name);
+  uint handle = handles.find(name);
 
-  if(i != reverseHandles.end())
+  if(handle)
   {
-    if(i->second == 0)
-      return 0;
+    Shader* shader = *handles.get(handle);
 
-    Shader* shader = handles[i->second];
+    if(!shader)
+      return 0;
 
     ++shader->refCount;
 
-    return i->second;
+    return handle;
   }
 
   for(std::map<uint, ShaderPlugin*>::iterator i = Plugin::shader.begin();
@@ -115,14 +138,13 @@ int Shader::acquireHandle(const char* _name, bool mipmaps)
 
     if(shader)
     {
-      handles[nextHandle++] = shader;
-      reverseHandles[name] = nextHandle - 1;
+      shader->handle = handles.add(name, shader);
 
-      return nextHandle - 1;
+      return shader->handle;
     }
   }
 
-  reverseHandles[name] = 0;
+  handles.add(name, 0);
 
   return 0;
 }
@@ -132,23 +154,7 @@ void Shader::unacquire(Shader* shader)
   if(--shader->refCount)
     return;
 
-  for(std::map<int, Shader*>::iterator i = handles.begin();
-      i != handles.end(); ++i)
-  {
-    if(i->second == shader)
-    {
-      handles.erase(i);
-
-      for(std::map<String, int>::iterator j = reverseHandles.begin();
-         j != reverseHandles.end(); ++j)
-      {
-        if(j->second == i->first)
-          reverseHandles.erase(j);
-      }
-
-      break;
-    }
-  }
+  handles.remove(shader->handle);
 
   shader->unacquire();
 }
@@ -162,12 +168,12 @@ void Shader::unacquire(int handle)
 
 Shader* Shader::shaderForHandle(int handle)
 {
-  std::map<int, Shader*>::iterator i = handles.find(handle);
+  Shader** shader = handles.get(handle);
 
-  if(i == handles.end())
+  if(!shader)
     return 0;
 
-  return i->second;
+  return *shader;
 }
 
 void Shader::remap(const char* oldShader, const char* newShader)
@@ -181,50 +187,40 @@ void Shader::remap(const char* oldShader, const char* newShader)
 float Shader::wave(WaveForm wave, float base, float amp, float phase,
                    float freq, float time)
 {
-  float value = base;
-  float pos = phase + freq * time;
-  float subpos = fmod(pos, 1);
-
-  switch(wave)
-  {
-  case Sawtooth:
-
-    value += amp * subpos;
-
-    break;
-
-  case InverseSawtooth:
+  if(!waveTablesBuilt)
+    buildWaveTables();
 
-    value += amp * (1 - subpos);
+  // The table size is a power of two, so masking wraps negative positions
+  // into the period as well
+  int index = static_cast<int>((phase + freq * time) * waveTableSize);
 
-    break;
-
-  case Sin:
-
-    value += amp * sin(pos * 2 * M_PI);
-
-    break;
-
-  case Square:
-
-    value += (subpos < 0.5) ? amp : -amp;
-
-    break;
-
-  case Triangle:
-
-    value += amp * ((subpos < 0.5) ? (2 * subpos) : (2 - 2 * subpos));
-
-    break;
-  }
+  float value = base + amp * waveTables[wave][index & (waveTableSize - 1)];
 
   return (value > 1) ? 1
        : (value < 0) ? 0
        :               value;
 }
 
+const float* Shader::waveTable(WaveForm wave)
+{
+  if(!waveTablesBuilt)
+    buildWaveTables();
+
+  return waveTables[wave];
+}
+
 Shader::~Shader()
 {
 }
 
+uint Shader::deformCount() const
+{
+  return 0;
+}
+
+const Shader::Deform* Shader::deforms() const
+{
+  return 0;
+}
+
 // vim: ts=2 sw=2 et
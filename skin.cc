@@ -14,12 +14,15 @@
  *                                                                         *
  ***************************************************************************/
 
+#include <algorithm>
 #include <map>
+#include <vector>
 
 #include <espace/skin.h>
 #include <espace/file.h>
 #include <espace/opengl.h>
 #include <espace/output.h>
+#include <espace/registry.h>
 #include <espace/renderer.h>
 #include <espace/shader.h>
 #include <espace/texture.h>
@@ -27,12 +30,15 @@
 struct Skin::Internal
 {
   std::map<String, Handle> textures;
+  std::vector<uint>        surfaceTextures; // By surfaceIndex()
+
+  // Shaders named by the skin that deform vertices, by surfaceIndex()
+  std::vector<Shader*>     surfaceDeforms;
 };
 
 namespace
 {
-  std::map<uint, Skin*> handles;
-  uint                  nextHandle = 1;
+  Registry<Skin*> handles("Skins");
 }
 
 Skin::Skin()
@@ -49,13 +55,14 @@ uint Skin::acquire(const char* _name)
 {
   String name = String(_name).replace('\\', '/');
 
-  for(std::map<uint, Skin*>::iterator i = handles.begin(); i != handles.end(); ++i)
-    if(i->second->name == name)
-    {
-      ++i->second->refCount;
+  uint existing = handles.find(name);
 
-      return i->first;
-    }
+  if(existing)
+  {
+    ++(*handles.get(existing))->refCount;
+
+    return existing;
+  }
 
   File file(name);
 
@@ -102,42 +109,72 @@ uint Skin::acquire(const char* _name)
     }
   }
 
-  handles[nextHandle++] = skin;
+  for(std::map<String, Handle>::iterator i = skin->m->textures.begin();
+      i != skin->m->textures.end(); ++i)
+  {
+    skin->m->surfaceTextures.push_back(i->second.handle);
+
+    // The texture is drawn as before, but deforms of a shader of the same
+    // name are applied to it
+    Shader* shader = 0;
 
-  return nextHandle - 1;
+    if(!i->second.name.isEmpty() && !i->second.name.beginsWith("md3_"))
+    {
+      shader = Shader::acquire(i->second.name);
+
+      if(shader && !shader->deformCount())
+      {
+        Shader::unacquire(shader);
+
+        shader = 0;
+      }
+    }
+
+    skin->m->surfaceDeforms.push_back(shader);
+  }
+
+  return handles.add(name, skin);
 }
 
 void Skin::unacquire(uint handle)
 {
-  std::map<uint, Skin*>::iterator i = handles.find(handle);
+  Skin** i = handles.get(handle);
 
-  if(i == handles.end())
+  if(!i)
     return;
 
-  if(--i->second->refCount)
+  Skin* skin = *i;
+
+  if(--skin->refCount)
     return;
 
   std::map<String, Handle>::iterator j;
 
-  for(j = i->second->m->textures.begin(); j != i->second->m->textures.end(); ++j)
+  for(j = skin->m->textures.begin(); j != skin->m->textures.end(); ++j)
   {
     if(j->second.handle)
       Texture::unacquire(j->second.handle);
   }
 
-  delete i->second;
+  for(uint k = 0; k < skin->m->surfaceDeforms.size(); ++k)
+  {
+    if(skin->m->surfaceDeforms[k])
+      Shader::unacquire(skin->m->surfaceDeforms[k]);
+  }
 
-  handles.erase(i);
+  delete skin;
+
+  handles.remove(handle);
 }
 
 Skin* Skin::skinForHandle(uint handle)
 {
-  std::map<uint, Skin*>::iterator i = handles.find(handle);
+  Skin** skin = handles.get(handle);
 
-  if(i == handles.end())
+  if(!skin)
     return 0;
 
-  return i->second;
+  return *skin;
 }
 
 void Skin::pushState(const char* surfaceName)
@@ -160,6 +197,39 @@ void Skin::pushState(const char* surfaceName)
   Renderer::setDepthMask(true);
 }
 
+void Skin::pushState(int surface)
+{
+  if(surface < 0)
+    return;
+
+  Renderer::setCullFace(Renderer::Face_Back);
+  Renderer::setPolygonOffset(false);
+  Renderer::setTexture(m->surfaceTextures[surface]);
+  Renderer::setColors(Renderer::Source_Array0);
+
+  Renderer::setDepthMask(true);
+}
+
+int Skin::surfaceIndex(const char* surfaceName) const
+{
+  const std::map<String, Handle>& textures = m->textures;
+
+  std::map<String, Handle>::const_iterator i = textures.find(surfaceName);
+
+  if(i == textures.end())
+    return -1;
+
+  return std::distance(textures.begin(), i);
+}
+
+Shader* Skin::deformShader(int surface) const
+{
+  if(surface < 0)
+    return 0;
+
+  return m->surfaceDeforms[surface];
+}
+
 const uint Skin::texture(const String& name) const
 {
   std::map<String, Handle>::const_iterator i = m->textures.find(name);
@@ -170,4 +240,49 @@ const uint Skin::texture(const String& name) const
   return i->second.handle;
 }
 
+void SkinBindings::addSurface(const char* name)
+{
+  names.push_back(String(name));
+}
+
+const int* SkinBindings::resolve(uint handle, Skin* skin)
+{
+  for(std::vector<Binding>::iterator i = bindings.begin();
+      i != bindings.end(); ++i)
+  {
+    if(i->handle == handle && i->skin == skin)
+      return i->surfaces.empty() ? 0 : &i->surfaces[0];
+  }
+
+  // Forget skins that have been unacquired.  Skin handles are not reused,
+  // so a reloaded skin gets a binding of its own.
+  for(uint i = 0; i < bindings.size(); )
+  {
+    if(Skin::skinForHandle(bindings[i].handle) != bindings[i].skin)
+      bindings.erase(bindings.begin() + i);
+    else
+      ++i;
+  }
+
+  Binding& binding = *bindings.insert(bindings.end(), Binding());
+
+  binding.handle = handle;
+  binding.skin = skin;
+
+  for(std::vector<String>::iterator i = names.begin(); i != names.end(); ++i)
+  {
+    int surface = skin->surfaceIndex(*i);
+
+    if(surface < 0)
+    {
+      esWarning << "Can't find texture for surface \"" << *i << "\"."
+                << std::endl;
+    }
+
+    binding.surfaces.push_back(surface);
+  }
+
+  return binding.surfaces.empty() ? 0 : &binding.surfaces[0];
+}
+
 // vim: ts=2 sw=2 et
@@ -14,51 +14,411 @@
  *                                                                         *
  ***************************************************************************/
 
-#include <list>
+#include <algorithm>
 #include <map>
+#include <vector>
+
+#include <string.h>
 
 #include <espace/cvar.h>
 #include <espace/media.h>
 #include <espace/output.h>
+#include <espace/registry.h>
 #include <espace/sound.h>
 #include <espace/string.h>
+#include <espace/system.h>
 #include <espace/vector.h>
 
 #include "openal.h"
 
-class Event
+namespace
 {
-public:
+  // Samples in the OpenAL buffer, and in memory if kept
+  uint soundBytes(Sound* const& sound)
+  {
+    uint bytes = sound->size * sound->bytesPerSample();
+
+    return sound->data ? 2 * bytes : bytes;
+  }
+
+  // By registry handle, see Sound::acquireHandle()
+  Registry<Sound*> sounds("Sounds", soundBytes);
+
+  // The last decode of each sound, in the order first decoded
+  std::vector<Sound::DecodeStatistics> statistics;
+  std::map<String, uint> statisticsIndex;
+
+  uint bytesPerSample(uint format)
+  {
+    switch(format)
+    {
+    case AL_FORMAT_MONO8: return 1;
+    case AL_FORMAT_MONO16: return 2;
+    case AL_FORMAT_STEREO8: return 2;
+    case AL_FORMAT_STEREO16: return 4;
+    default: return 0;
+    }
+  }
 
-  enum Type
+  // Samples decoded before growing the buffer, when the length of a stream
+  // is not known
+  const uint initialCapacity = 64 * 1024;
+
+  /**
+   * A media stream played through a ring of OpenAL buffers.
+   *
+   * Streams are created by SoundSource::play(), and only touched by the
+   * streaming thread once handed over to it.
+   */
+  struct Stream
   {
-    Stream,
-    Inactive
+    ALuint              source;
+    Media*              media;
+    bool                loop;
+    bool                finished;    // No more audio to decode
+    bool                started;     // Played at least once
+    uint                format;
+    uint                frequency;
+    uint                bytesPerSample;
+    uint                bufferSize;  // Samples per buffer
+    char*               data;        // Decoding buffer
+    std::vector<ALuint> buffers;
+    std::vector<ALuint> freeBuffers; // Not queued on the source
+    volatile bool*      played;      // Set when the whole stream is played
   };
 
-  Type   type;
-  ALuint handle;
-  Media* media;
-  Sound* buffers[2];
-  bool   loop;
-};
+  struct Command
+  {
+    enum Type
+    {
+      Play,
+      Stop,
+      Quit  // Stop all streams and end the streaming thread
+    };
+
+    Type    type;
+    ALuint  source;
+    Stream* stream; // Stream to play
+    bool    wait;   // Whether the sender waits for the command to be done
+  };
 
-namespace
-{
-  std::map<String, Sound*> sounds;
-  std::list<Event>         events;
-}
+  // Commands from the main thread, in a single producer, single consumer
+  // ring.  The entries from commandRead up to commandWrite belong to the
+  // streaming thread, the rest to the main thread, so no locking is needed.
+  enum { commandCount = 64 };
 
-struct Chunk
-{
-  uint   size;
-  char*  data;
-  Chunk* next;
-};
+  Command       commands[commandCount];
+  volatile uint commandRead = 0;
+  volatile uint commandWrite = 0;
+
+  void* streamThread = 0;
+  bool  streamingFailed = false;
+  bool  quitting = false; // Set by the streaming thread on Command::Quit
+  void* wakeSemaphore; // Posted for every command
+  void* doneSemaphore; // Posted when a command waited for is done
+
+  // How often the streaming thread refills buffers, in milliseconds
+  const uint streamInterval = 10;
+
+  // Only used by the streaming thread, or by Sound::idle() without one
+  std::vector<Stream*> streams;
+
+  // Written by the streaming thread, read by any
+  volatile uint streamCount = 0;
+  volatile uint underrunCount = 0;
+
+  void destroy(Stream* stream)
+  {
+    AL::sourceStop(stream->source);
+    AL::sourcei(stream->source, AL_BUFFER, 0); // Unqueues all buffers
+
+    AL::deleteBuffers(stream->buffers.size(), &stream->buffers[0]);
+
+    delete [] stream->data;
+    delete stream;
+  }
+
+  void execute(const Command& command)
+  {
+    if(command.type == Command::Quit)
+    {
+      for(std::vector<Stream*>::iterator i = streams.begin();
+          i != streams.end(); ++i)
+        destroy(*i);
+
+      streams.clear();
+      streamCount = 0;
+      quitting = true;
+
+      return;
+    }
+
+    // A source plays one stream at a time
+    for(std::vector<Stream*>::iterator i = streams.begin();
+        i != streams.end(); ++i)
+    {
+      if((*i)->source == command.source)
+      {
+        destroy(*i);
+
+        streams.erase(i);
+
+        break;
+      }
+    }
+
+    if(command.type == Command::Play)
+    {
+      Stream* stream = command.stream;
+
+      AL::genBuffers(stream->buffers.size(), &stream->buffers[0]);
+
+      stream->freeBuffers = stream->buffers;
+
+      streams.push_back(stream);
+    }
+
+    streamCount = streams.size();
+
+    if(command.wait && streamThread)
+      System::postSemaphore(doneSemaphore);
+  }
+
+  /**
+   * Decodes the next buffer of a stream into its decoding buffer, and
+   * returns the number of samples decoded.
+   */
+  uint decode(Stream* stream)
+  {
+    uint size = stream->media->audioRead(stream->data, stream->bufferSize);
+
+    while(size < stream->bufferSize && stream->loop)
+    {
+      stream->media->audioReset();
+
+      uint ret = stream->media->audioRead(stream->data
+                                          + size * stream->bytesPerSample,
+                                          stream->bufferSize - size);
+
+      if(!ret)
+        break;
+
+      size += ret;
+    }
+
+    if(size < stream->bufferSize)
+      stream->finished = true;
+
+    return size;
+  }
+
+  /**
+   * Decodes audio into the buffers the source has finished playing, and
+   * restarts the source if it ran dry.  Returns false when the whole
+   * stream has been played.
+   */
+  bool refill(Stream* stream)
+  {
+    // Check the state before decoding, so that a source running dry while
+    // we decode is noticed on the next call, with its queue intact
+    ALint state;
+
+    AL::getSourcei(stream->source, AL_SOURCE_STATE, &state);
+
+    // The source stops when it has played all buffers queued
+    bool stopped = (state == AL_STOPPED || state == AL_INITIAL);
+
+    if(stopped)
+    {
+      // Take back the whole queue, so that restarting the source does not
+      // replay it
+      AL::sourcei(stream->source, AL_BUFFER, 0);
+
+      stream->freeBuffers = stream->buffers;
+
+      if(stream->finished)
+        return false;
+
+      if(stream->started)
+        ++underrunCount;
+    }
+    else
+    {
+      ALint processed = 0;
+
+      AL::getSourcei(stream->source, AL_BUFFERS_PROCESSED, &processed);
+
+      for(; processed > 0; --processed)
+      {
+        ALuint buffer;
+
+        AL::sourceUnqueueBuffers(stream->source, 1, &buffer);
+
+        stream->freeBuffers.push_back(buffer);
+      }
+    }
+
+    while(!stream->finished && !stream->freeBuffers.empty())
+    {
+      uint size = decode(stream);
+
+      if(!size)
+        break;
+
+      ALuint& buffer = stream->freeBuffers.back();
+
+#ifdef WIN32
+      ALuint oldBuffer = buffer;
+
+      AL::deleteBuffers(1, &oldBuffer);
+      AL::genBuffers(1, &buffer);
+
+      std::replace(stream->buffers.begin(), stream->buffers.end(),
+                   oldBuffer, buffer);
+#endif
+
+      AL::bufferData(buffer, stream->format, stream->data,
+                     size * stream->bytesPerSample, stream->frequency);
+
+      AL::sourceQueueBuffers(stream->source, 1, &buffer);
+
+      stream->freeBuffers.pop_back();
+    }
+
+    if(stream->freeBuffers.size() == stream->buffers.size())
+      return !stream->finished;
+
+    if(stopped)
+    {
+      stream->started = true;
+
+      AL::sourcePlay(stream->source);
+    }
+
+    return true;
+  }
+
+  void updateStreams()
+  {
+    while(commandRead != commandWrite)
+    {
+      // Read the command only after seeing it published, and hand the
+      // entry back only after reading it
+      System::memoryBarrier();
+
+      Command command = commands[commandRead % commandCount];
+
+      System::memoryBarrier();
+
+      commandRead = commandRead + 1;
+
+      execute(command);
+    }
+
+    for(uint i = 0; i < streams.size(); )
+    {
+      if(refill(streams[i]))
+      {
+        ++i;
+
+        continue;
+      }
+
+      *streams[i]->played = true;
+
+      destroy(streams[i]);
+
+      streams.erase(streams.begin() + i);
+    }
+
+    streamCount = streams.size();
+  }
+
+  void streamLoop(void*)
+  {
+    for(;;)
+    {
+      if(streams.empty())
+        System::waitSemaphore(wakeSemaphore);
+      else
+        System::sleep(streamInterval);
+
+      updateStreams();
+
+      if(quitting)
+        return;
+    }
+  }
+
+  /**
+   * Starts the streaming thread, unless it is already running.
+   *
+   * Returns false if threads are not supported.
+   */
+  bool startStreaming()
+  {
+    if(streamThread)
+      return true;
+
+    if(streamingFailed)
+      return false;
+
+    wakeSemaphore = System::createSemaphore();
+    doneSemaphore = System::createSemaphore();
+
+    streamThread = System::createThread(streamLoop, 0);
+
+    if(!streamThread)
+    {
+      esWarning << "Sound: Failed to start streaming thread.  Media will be "
+                   "streamed by the main loop." << std::endl;
+
+      System::destroySemaphore(doneSemaphore);
+      System::destroySemaphore(wakeSemaphore);
+
+      streamingFailed = true;
+
+      return false;
+    }
+
+    return true;
+  }
+
+  /**
+   * Hands a command to the streaming thread, or executes it right away if
+   * there is none.
+   */
+  void sendCommand(const Command& command)
+  {
+    if(!startStreaming())
+    {
+      execute(command);
+
+      return;
+    }
+
+    // The ring is full; give the streaming thread time to catch up
+    while(commandWrite - commandRead == commandCount)
+      System::sleep(1);
+
+    commands[commandWrite % commandCount] = command;
+
+    // Write the command before publishing it
+    System::memoryBarrier();
+
+    commandWrite = commandWrite + 1;
+
+    System::postSemaphore(wakeSemaphore);
+
+    if(command.wait)
+      System::waitSemaphore(doneSemaphore);
+  }
+}
 
 Sound::Sound()
   : data(0),
     handle(0),
+    registryHandle(0),
     refCount(1)
 {
 }
@@ -87,13 +447,15 @@ Sound* Sound::acquire(const char* _name, bool keep)
 
   String name = String(_name).replace('\\', '/');
 
-  std::map<String, Sound*>::iterator i = sounds.find(name);
+  uint handle = sounds.find(name);
 
-  if(i != sounds.end())
+  if(handle)
   {
-    ++i->second->refCount;
+    Sound* sound = *sounds.get(handle);
 
-    return i->second;
+    ++sound->refCount;
+
+    return sound;
   }
 
   Media* media = Media::acquire(name);
@@ -118,49 +480,61 @@ Sound* Sound::acquire(const char* _name, bool keep)
   Sound* sound = new Sound;
 
   sound->freq = media->audioFrequency();
-  sound->size = media->audioLength();
   sound->format = media->audioFormat();
 
-  if(sound->size)
-  {
-    sound->data = new char[sound->size * sound->bytesPerSample()];
+  uint bytesPerSample = sound->bytesPerSample();
 
-    media->audioRead(sound->data, sound->size);
-  }
-  else
-  {
-    std::list<Chunk> chunks;
+  Sound::DecodeStatistics decode;
 
-    for(;;)
-    {
-      Chunk& chunk = *chunks.insert(chunks.end(), Chunk());
+  decode.name = name;
+  decode.growCount = 0;
 
-      chunk.size = 1024 * 1024;
-      chunk.data = new char[chunk.size * sound->bytesPerSample()];
+  double start = System::time();
 
-      uint ret = media->audioRead(chunk.data, chunk.size);
+  // Decode straight into one buffer, sized by the length reported by the
+  // stream.  If it is not known, the buffer doubles whenever it fills up,
+  // so each sample is copied less than once on average.
+  uint bound = media->audioLength();
 
-      sound->size += ret;
+  uint capacity = bound ? bound : initialCapacity;
 
-      if(ret < chunk.size)
-      {
-        chunk.size = ret;
+  sound->data = new char[capacity * bytesPerSample];
+  sound->size = 0;
 
-        break;
-      }
-    }
+  for(;;)
+  {
+    sound->size += media->audioRead(sound->data + sound->size * bytesPerSample,
+                                    capacity - sound->size);
 
-    sound->data = new char[sound->size * sound->bytesPerSample()];
-    uint offset = 0;
+    if(bound || sound->size < capacity)
+      break;
 
-    for(std::list<Chunk>::iterator i = chunks.begin(); i != chunks.end(); ++i)
-    {
-      memcpy(sound->data + offset, i->data, i->size * sound->bytesPerSample());
+    char* data = new char[capacity * 2 * bytesPerSample];
 
-      delete [] i->data;
+    memcpy(data, sound->data, capacity * bytesPerSample);
 
-      offset += i->size * sound->bytesPerSample();
-    }
+    delete [] sound->data;
+
+    sound->data = data;
+    capacity *= 2;
+
+    ++decode.growCount;
+  }
+
+  decode.seconds = System::time() - start;
+  decode.samples = sound->size;
+  decode.bufferBytes = capacity * bytesPerSample;
+
+  std::map<String, uint>::iterator index = statisticsIndex.find(name);
+
+  if(index != statisticsIndex.end())
+  {
+    statistics[index->second] = decode;
+  }
+  else
+  {
+    statisticsIndex[name] = statistics.size();
+    statistics.push_back(decode);
   }
 
   Media::unacquire(media);
@@ -168,13 +542,28 @@ Sound* Sound::acquire(const char* _name, bool keep)
   AL::genBuffers(1, &sound->handle);
 
   AL::bufferData(sound->handle, sound->format, sound->data,
-                 sound->size * sound->bytesPerSample(), sound->freq);
+                 sound->size * bytesPerSample, sound->freq);
 
-  sounds[name] = sound;
+  sound->registryHandle = sounds.add(name, sound);
 
   if(!keep)
+  {
+    delete [] sound->data;
+
+    sound->data = 0;
+  }
+  else if(sound->size < capacity)
+  {
+    // Kept sounds live as long as they are acquired, so drop the slack
+    char* data = new char[sound->size * bytesPerSample];
+
+    memcpy(data, sound->data, sound->size * bytesPerSample);
+
     delete [] sound->data;
 
+    sound->data = data;
+  }
+
   return sound;
 }
 
@@ -185,19 +574,17 @@ uint Sound::acquireHandle(const char* name, bool keep)
   if(!sound)
     return 0;
 
-  return sound->handle;
+  return sound->registryHandle;
 }
 
 Sound* Sound::soundForHandle(uint handle)
 {
-  for(std::map<String, Sound*>::iterator i = sounds.begin();
-      i != sounds.end(); ++i)
-  {
-    if(i->second->handle == handle)
-      return i->second;
-  }
+  Sound** sound = sounds.get(handle);
+
+  if(!sound)
+    return 0;
 
-  return 0;
+  return *sound;
 }
 
 void Sound::unacquire(Sound* sound)
@@ -205,85 +592,63 @@ void Sound::unacquire(Sound* sound)
   if(--sound->refCount)
     return;
 
-  for(std::map<String, Sound*>::iterator i = sounds.begin();
-      i != sounds.end(); ++i)
-  {
-    if(i->second == sound)
-    {
-      sounds.erase(i);
-
-      delete sound;
+  sounds.remove(sound->registryHandle);
 
-      return;
-    }
-  }
+  delete sound;
 }
 
-void Sound::idle()
+void Sound::shutdown()
 {
   if(!AL::initialized())
     return;
 
-  for(std::list<Event>::iterator i = events.begin(); i != events.end(); ++i)
+  Command command;
+
+  command.type = Command::Quit;
+  command.source = 0;
+  command.stream = 0;
+  command.wait = false;
+
+  if(!streamThread)
   {
-    switch(i->type)
-    {
-    case Event::Stream:
+    execute(command);
 
-      {
-        ALint queued;
-        ALint processed;
-
-        AL::getSourcei(i->handle, AL_BUFFERS_QUEUED, &queued);
-        AL::getSourcei(i->handle, AL_BUFFERS_PROCESSED, &processed);
-
-        if(processed + 1 >= queued)
-        {
-          Sound& buffer = *i->buffers[queued % 2];
-
-          uint ret = i->media->audioRead(buffer.data, buffer.size);
-
-          if(ret < buffer.size)
-          {
-            if(i->loop)
-            {
-              while(ret < buffer.size)
-              {
-                i->media->audioReset();
-
-                ret += i->media->audioRead(buffer.data + ret
-                                           * buffer.bytesPerSample(),
-                                           buffer.size - ret);
-              }
-            }
-            else // !i->loop
-            {
-              memset(buffer.data + ret * buffer.bytesPerSample(), 0,
-                     (buffer.size - ret) * buffer.bytesPerSample());
-
-              i->type = Event::Inactive;
-            }
-          }
+    return;
+  }
 
-#ifdef WIN32
-          AL::deleteBuffers(1, &buffer.handle);
-          AL::genBuffers(1, &buffer.handle);
-#endif
+  sendCommand(command);
 
-          AL::bufferData(buffer.handle, buffer.format, buffer.data,
-                         buffer.size * buffer.bytesPerSample(), buffer.freq);
+  System::joinThread(streamThread);
 
-          AL::sourceQueueBuffers(i->handle, 1, &buffer.handle);
-        }
-      }
+  streamThread = 0;
 
-      break;
+  System::destroySemaphore(doneSemaphore);
+  System::destroySemaphore(wakeSemaphore);
 
-    case Event::Inactive:
+  // Streams played from now on are refilled by the main loop
+  streamingFailed = true;
+  quitting = false;
+}
 
-      break;
-    }
-  }
+void Sound::idle()
+{
+  if(!AL::initialized())
+    return;
+
+  // Without a streaming thread, the main loop has to refill the buffers
+  if(!streamThread)
+    updateStreams();
+}
+
+const std::vector<Sound::DecodeStatistics>& Sound::decodeStatistics()
+{
+  return statistics;
+}
+
+void Sound::streamStatistics(uint& streams, uint& underruns)
+{
+  streams = streamCount;
+  underruns = underrunCount;
 }
 
 void Sound::setPosition(const Vector3& position)
@@ -316,6 +681,8 @@ SoundSource::SoundSource()
 {
   data = new DataProxy;
   data->refCount = 1;
+  data->streaming = false;
+  data->streamPlayed = false;
 
   if(AL::initialized())
     AL::genSources(1, &data->handle);
@@ -369,6 +736,9 @@ void SoundSource::play(const Sound* sound, bool loop)
   if(!AL::initialized())
     return;
 
+  if(data->streaming)
+    stop();
+
   AL::sourcei(data->handle, AL_LOOPING, loop);
   AL::sourcei(data->handle, AL_BUFFER, sound->handle);
   AL::sourcePlay(data->handle);
@@ -382,37 +752,45 @@ void SoundSource::play(Media* media, bool loop)
   if(!media->audioFrequency())
     return;
 
-  Sound* buffers[2];
+  stop();
 
-  for(uint i = 0; i < 2; ++i)
-  {
-    buffers[i] = new Sound;
+  // The streaming thread can't read archives
+  media->readIntoMemory();
 
-    Sound& buffer = *buffers[i];
+  CVar bufferCount = CVar::acquire("s_streambuffers", "4", CVar::Archive);
+  CVar bufferSize = CVar::acquire("s_streambuffersize", "16384",
+                                  CVar::Archive);
 
-    buffer.freq = media->audioFrequency();
-    buffer.size = 65536;
-    buffer.format = media->audioFormat();
+  Stream* stream = new Stream;
 
-    buffer.data = new char[buffer.size * buffer.bytesPerSample()];
+  stream->source = data->handle;
+  stream->played = &data->streamPlayed;
+  stream->media = media;
+  stream->loop = loop;
+  stream->finished = false;
+  stream->started = false;
+  stream->format = media->audioFormat();
+  stream->frequency = media->audioFrequency();
+  stream->bufferSize = std::max(bufferSize.integer, 1024);
+  stream->buffers.resize(std::max(bufferCount.integer, 2));
 
-    AL::genBuffers(1, &buffer.handle);
-  }
+  stream->bytesPerSample = bytesPerSample(stream->format);
 
-  Event event;
-  event.type = Event::Stream;
-  event.handle = data->handle;
-  event.media = media;
-  event.buffers[0] = buffers[0];
-  event.buffers[1] = buffers[1];
-  event.loop = loop;
+  stream->data = new char[stream->bufferSize * stream->bytesPerSample];
 
-  events.push_back(event);
+  AL::sourcei(data->handle, AL_LOOPING, AL_FALSE);
 
-  Sound::idle();
+  data->streaming = true;
+  data->streamPlayed = false;
 
-  AL::sourcei(data->handle, AL_LOOPING, AL_FALSE);
-  AL::sourcePlay(data->handle);
+  Command command;
+
+  command.type = Command::Play;
+  command.source = data->handle;
+  command.stream = stream;
+  command.wait = false;
+
+  sendCommand(command);
 }
 
 void SoundSource::enqueue(const Sound* sound, bool loop)
@@ -420,6 +798,10 @@ void SoundSource::enqueue(const Sound* sound, bool loop)
   if(!AL::initialized())
     return;
 
+  // The streaming thread owns the queue of a streaming source
+  if(data->streaming)
+    stop();
+
   AL::sourceQueueBuffers(data->handle, 1, const_cast<ALuint*>(&sound->handle));
 
   if(loop)
@@ -433,23 +815,23 @@ void SoundSource::stop()
   if(!AL::initialized())
     return;
 
-  AL::sourceStop(data->handle);
-
-  for(std::list<Event>::iterator i = events.begin(); i != events.end(); ++i)
+  if(!data->streaming)
   {
-    if(i->handle == data->handle)
-    {
-      if(i->buffers[0])
-        delete i->buffers[0];
+    AL::sourceStop(data->handle);
 
-      if(i->buffers[1])
-        delete i->buffers[1];
+    return;
+  }
 
-      events.erase(i);
+  data->streaming = false;
 
-      break;
-    }
-  }
+  Command command;
+
+  command.type = Command::Stop;
+  command.source = data->handle;
+  command.stream = 0;
+  command.wait = true;
+
+  sendCommand(command);
 }
 
 bool SoundSource::isStopped()
@@ -457,6 +839,9 @@ bool SoundSource::isStopped()
   if(!AL::initialized())
     return true;
 
+  if(data->streaming)
+    return data->streamPlayed;
+
   ALint state;
 
   AL::getSourcei(data->handle, AL_SOURCE_STATE, &state);
@@ -466,14 +851,7 @@ bool SoundSource::isStopped()
 
 uint Sound::bytesPerSample() const
 {
-  switch(format)
-  {
-  case AL_FORMAT_MONO8: return 1;
-  case AL_FORMAT_MONO16: return 2;
-  case AL_FORMAT_STEREO8: return 2;
-  case AL_FORMAT_STEREO16: return 4;
-  default: return 0;
-  }
+  return ::bytesPerSample(format);
 }
 
 // vim: ts=2 sw=2 et
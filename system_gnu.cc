@@ -18,6 +18,8 @@
 
 #include <dlfcn.h>
 #include <execinfo.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <time.h>
 #include <unistd.h>
@@ -85,6 +87,116 @@ void System::dlclose(void* handle)
   ::dlclose(handle);
 }
 
+namespace
+{
+  struct ThreadStart
+  {
+    void (*function)(void*);
+    void* argument;
+  };
+
+  void* threadStart(void* _start)
+  {
+    ThreadStart start = *reinterpret_cast<ThreadStart*>(_start);
+
+    delete reinterpret_cast<ThreadStart*>(_start);
+
+    start.function(start.argument);
+
+    return 0;
+  }
+}
+
+void* System::createThread(void (*function)(void*), void* argument)
+{
+  ThreadStart* start = new ThreadStart;
+
+  start->function = function;
+  start->argument = argument;
+
+  pthread_t* thread = new pthread_t;
+
+  if(0 != pthread_create(thread, 0, threadStart, start))
+  {
+    delete start;
+    delete thread;
+
+    return 0;
+  }
+
+  return thread;
+}
+
+void System::joinThread(void* thread)
+{
+  pthread_join(*reinterpret_cast<pthread_t*>(thread), 0);
+
+  delete reinterpret_cast<pthread_t*>(thread);
+}
+
+void* System::createMutex()
+{
+  pthread_mutex_t* mutex = new pthread_mutex_t;
+
+  pthread_mutex_init(mutex, 0);
+
+  return mutex;
+}
+
+void System::destroyMutex(void* mutex)
+{
+  pthread_mutex_destroy(reinterpret_cast<pthread_mutex_t*>(mutex));
+
+  delete reinterpret_cast<pthread_mutex_t*>(mutex);
+}
+
+void System::lockMutex(void* mutex)
+{
+  pthread_mutex_lock(reinterpret_cast<pthread_mutex_t*>(mutex));
+}
+
+void System::unlockMutex(void* mutex)
+{
+  pthread_mutex_unlock(reinterpret_cast<pthread_mutex_t*>(mutex));
+}
+
+void* System::createSemaphore(uint value)
+{
+  sem_t* semaphore = new sem_t;
+
+  sem_init(semaphore, 0, value);
+
+  return semaphore;
+}
+
+void System::destroySemaphore(void* semaphore)
+{
+  sem_destroy(reinterpret_cast<sem_t*>(semaphore));
+
+  delete reinterpret_cast<sem_t*>(semaphore);
+}
+
+void System::waitSemaphore(void* semaphore)
+{
+  // Retry if interrupted by a signal
+  while(0 != sem_wait(reinterpret_cast<sem_t*>(semaphore)));
+}
+
+void System::postSemaphore(void* semaphore)
+{
+  sem_post(reinterpret_cast<sem_t*>(semaphore));
+}
+
+void System::sleep(uint milliseconds)
+{
+  usleep(milliseconds * 1000);
+}
+
+void System::memoryBarrier()
+{
+  __sync_synchronize();
+}
+
 void System::crashHandler(int signal)
 {
   ::signal(signal, SIG_DFL);
@@ -59,4 +59,55 @@ void System::dlclose(void* handle)
 {
 }
 
+void* System::createThread(void (*function)(void*), void* argument)
+{
+  return 0;
+}
+
+void System::joinThread(void* thread)
+{
+}
+
+void* System::createMutex()
+{
+  return 0;
+}
+
+void System::destroyMutex(void* mutex)
+{
+}
+
+void System::lockMutex(void* mutex)
+{
+}
+
+void System::unlockMutex(void* mutex)
+{
+}
+
+void* System::createSemaphore(uint value)
+{
+  return 0;
+}
+
+void System::destroySemaphore(void* semaphore)
+{
+}
+
+void System::waitSemaphore(void* semaphore)
+{
+}
+
+void System::postSemaphore(void* semaphore)
+{
+}
+
+void System::sleep(uint milliseconds)
+{
+}
+
+void System::memoryBarrier()
+{
+}
+
 // vim: ts=2 sw=2 et
@@ -19,8 +19,10 @@
 #include <espace/network.h>
 #include <espace/opengl.h>
 #include <espace/output.h>
+#include <espace/renderer.h>
 #include <espace/sound.h>
 #include <espace/system.h>
+#include <espace/texture.h>
 
 #include <windows.h>
 #include <iostream>
@@ -318,12 +320,123 @@ void System::dlclose(void* handle)
   FreeLibrary(reinterpret_cast<HMODULE>(handle));
 }
 
+namespace
+{
+  struct ThreadStart
+  {
+    void (*function)(void*);
+    void* argument;
+  };
+
+  DWORD WINAPI threadStart(LPVOID _start)
+  {
+    ThreadStart start = *reinterpret_cast<ThreadStart*>(_start);
+
+    delete reinterpret_cast<ThreadStart*>(_start);
+
+    start.function(start.argument);
+
+    return 0;
+  }
+}
+
+void* System::createThread(void (*function)(void*), void* argument)
+{
+  ThreadStart* start = new ThreadStart;
+
+  start->function = function;
+  start->argument = argument;
+
+  HANDLE thread = CreateThread(0, 0, threadStart, start, 0, 0);
+
+  if(!thread)
+  {
+    delete start;
+
+    return 0;
+  }
+
+  return reinterpret_cast<void*>(thread);
+}
+
+void System::joinThread(void* thread)
+{
+  WaitForSingleObject(reinterpret_cast<HANDLE>(thread), INFINITE);
+
+  CloseHandle(reinterpret_cast<HANDLE>(thread));
+}
+
+void* System::createMutex()
+{
+  CRITICAL_SECTION* mutex = new CRITICAL_SECTION;
+
+  InitializeCriticalSection(mutex);
+
+  return mutex;
+}
+
+void System::destroyMutex(void* mutex)
+{
+  DeleteCriticalSection(reinterpret_cast<CRITICAL_SECTION*>(mutex));
+
+  delete reinterpret_cast<CRITICAL_SECTION*>(mutex);
+}
+
+void System::lockMutex(void* mutex)
+{
+  EnterCriticalSection(reinterpret_cast<CRITICAL_SECTION*>(mutex));
+}
+
+void System::unlockMutex(void* mutex)
+{
+  LeaveCriticalSection(reinterpret_cast<CRITICAL_SECTION*>(mutex));
+}
+
+void* System::createSemaphore(uint value)
+{
+  return reinterpret_cast<void*>(CreateSemaphore(0, value, 0x7FFFFFFF, 0));
+}
+
+void System::destroySemaphore(void* semaphore)
+{
+  CloseHandle(reinterpret_cast<HANDLE>(semaphore));
+}
+
+void System::waitSemaphore(void* semaphore)
+{
+  WaitForSingleObject(reinterpret_cast<HANDLE>(semaphore), INFINITE);
+}
+
+void System::postSemaphore(void* semaphore)
+{
+  ReleaseSemaphore(reinterpret_cast<HANDLE>(semaphore), 1, 0);
+}
+
+void System::sleep(uint milliseconds)
+{
+  Sleep(milliseconds);
+}
+
+void System::memoryBarrier()
+{
+  // Interlocked operations are full barriers
+  static volatile LONG barrier;
+
+  InterlockedExchange(&barrier, 0);
+}
+
 void System::exit()
 {
   CVar::save();
 
   Network::shutdown();
 
+  Renderer::finishCapture();
+
+  Sound::shutdown();
+
+  Texture::shutdown();
+
   SystemParametersInfo(SPI_SETMOUSE, 0, oldMouseParams, 0);
 
   wglDeleteContext(renderContext);
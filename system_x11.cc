@@ -27,8 +27,10 @@
 #include <espace/network.h>
 #include <espace/opengl.h>
 #include <espace/output.h>
+#include <espace/renderer.h>
 #include <espace/sound.h>
 #include <espace/system.h>
+#include <espace/texture.h>
 
 namespace
 {
@@ -411,6 +413,12 @@ void System::exit()
 
   Network::shutdown();
 
+  Renderer::finishCapture();
+
+  Sound::shutdown();
+
+  Texture::shutdown();
+
   ::exit(EXIT_SUCCESS);
 }
 
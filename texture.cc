@@ -14,14 +14,25 @@
  *                                                                         *
  ***************************************************************************/
 
+#include <algorithm>
+#include <deque>
 #include <map>
+#include <vector>
 
+#include <string.h>
+
+#include <espace/cvar.h>
+#include <espace/dxt.h>
+#include <espace/file.h>
 #include <espace/image.h>
 #include <espace/opengl.h>
 #include <espace/output.h>
+#include <espace/plugins.h>
+#include <espace/registry.h>
 #include <espace/renderer.h>
 #include <espace/shader.h>
 #include <espace/string.h>
+#include <espace/system.h>
 #include <espace/texture.h>
 
 namespace
@@ -30,18 +41,73 @@ namespace
   {
     Handle(uint flags = 0)
       : flags(flags),
-        refCount(1)
+        refCount(1),
+        bytes(0),
+        glHandle(0),
+        stream(0)
     {
     }
 
-    uint   glHandle;
     uint   flags;
     uint   refCount;
+    uint   bytes;    // Texture memory uploaded, estimated
+    uint   glHandle;
+    uint   stream;   // Id of the stream filling the texture, or 0
   };
 
-  std::map<String, Handle> handles;
+  uint handleBytes(const Handle& handle)
+  {
+    return handle.bytes;
+  }
+
+  Registry<Handle> handles("Textures", handleBytes);
+
+  // Registry handles indexed by OpenGL texture name, or 0.  Texture handles
+  // given out are OpenGL names, which are opaque, so they are not used as
+  // registry handles.  Drivers hand out small names and reuse deleted ones,
+  // so the table stays about as large as the number of textures.
+  std::vector<uint> glHandles;
+
+  /**
+   * Registers a texture, and returns its OpenGL name.
+   */
+  uint addHandle(uint glHandle, const String& name, Handle handle)
+  {
+    handle.glHandle = glHandle;
+
+    if(glHandle >= glHandles.size())
+      glHandles.resize(glHandle + 1, 0);
+
+    glHandles[glHandle] = handles.add(name, handle);
+
+    return glHandle;
+  }
+
+  Handle* handleForGL(uint glHandle)
+  {
+    if(glHandle >= glHandles.size())
+      return 0;
+
+    return handles.get(glHandles[glHandle]);
+  }
 
   uint upload(Image* image, uint flags);
+  uint upload(const CompressedImage& image, uint flags);
+
+  /**
+   * Returns the memory used by an image uploaded by upload(), including
+   * its mipmaps.
+   */
+  uint uploadedBytes(const Image& image, uint flags)
+  {
+    if(flags & (Texture::NoMipMaps | Texture::NVRect))
+      return image.size();
+
+    return image.size() + image.size() / 3;
+  }
+
+  bool startStreaming();
+  uint beginStream(const String& name, uint flags, uint& streamId);
 }
 
 uint Texture::acquire(const char* _name, uint flags)
@@ -53,67 +119,121 @@ uint Texture::acquire(const char* _name, uint flags)
   if(name == "$lightmap")
     return lightmap;
 
-  std::map<String, Handle>::iterator i = handles.find(name);
+  uint existing = handles.find(name);
+
+  if(existing)
+  {
+    Handle* handle = handles.get(existing);
+
+    ++handle->refCount;
+
+    return handle->glHandle;
+  }
+
+  uint glHandle;
+
+  Handle handle(flags);
+  Image* image = 0;
+
+  CVar compress = CVar::acquire("r_compresstextures", "0", CVar::Archive);
+
+  if(compress.integer && !(flags & NVRect)
+  && GL::config.textureCompression != GLConfig::TC_NONE)
+  {
+    CVar cache = CVar::acquire("r_dxtcache", "", CVar::Archive);
+
+    DXT::setCacheDirectory(cache.string);
+
+    CompressedImage* compressed = DXT::readCache(name);
+
+    // Images precompressed for a larger maximum texture size
+    if(compressed)
+    {
+      std::vector<CompressedImage::Level>& levels = compressed->levels;
+
+      while(levels.size() > 1
+      && (levels[0].width > GL::config.maxTextureSize
+       || levels[0].height > GL::config.maxTextureSize))
+        levels.erase(levels.begin());
+    }
+
+    if(!compressed)
+    {
+      image = Image::acquire(name);
+
+      if(!image)
+        return 0;
+
+      compressed = DXT::compressMipmaps(image, GL::config.maxTextureSize);
+
+      if(compressed)
+        DXT::writeCache(name, *compressed);
+    }
+
+    if(compressed)
+    {
+      glHandle = upload(*compressed, flags);
+
+      uint levelCount = (flags & NoMipMaps) ? 1 : compressed->levels.size();
+
+      for(uint i = 0; i < levelCount; ++i)
+        handle.bytes += compressed->levels[i].data.size();
+
+      delete compressed;
 
-  if(i != handles.end())
+      if(image)
+        Image::unacquire(image);
+
+      return addHandle(glHandle, name, handle);
+    }
+  }
+
+  CVar stream = CVar::acquire("r_streamtextures", "0", CVar::Archive);
+
+  if(!image && stream.integer && !(flags & NVRect) && startStreaming())
   {
-    ++i->second.refCount;
+    // Levels are counted as they are uploaded
+    glHandle = beginStream(name, flags, handle.stream);
+
+    if(!glHandle)
+      return 0;
 
-    return i->second.glHandle;
+    return addHandle(glHandle, name, handle);
   }
 
-  Image* image = Image::acquire(name);
+  if(!image)
+    image = Image::acquire(name);
 
   if(!image)
     return 0;
 
-  Handle handle(flags);
+  glHandle = upload(image, flags);
 
-  handle.glHandle = upload(image, flags);
+  handle.bytes = uploadedBytes(*image, flags);
 
-  handles[name] = handle;
+  Image::unacquire(image);
 
-  return handle.glHandle;
+  return addHandle(glHandle, name, handle);
 }
 
 uint Texture::acquire(Image* image, uint flags)
 {
   Handle handle(flags);
 
-  handle.glHandle = upload(image, flags);
+  uint glHandle = upload(image, flags);
 
-  handles[String::format("%p", image)] = handle;
+  handle.bytes = uploadedBytes(*image, flags);
 
-  return handle.glHandle;
+  return addHandle(glHandle, String::format("%p", image), handle);
 }
 
 namespace
 {
-  uint upload(Image* image, uint flags)
+  /**
+   * Creates a texture handle with filtering and wrapping set up.
+   */
+  uint createHandle(uint flags)
   {
-    uint width;
-    uint height;
-
-    if(!(flags & Texture::NVRect))
-    {
-      width = 1;
-      height = 1;
-
-      while(width < image->width() && width < GL::config.maxTextureSize)
-        width <<= 1;
-
-      while(height < image->height() && height < GL::config.maxTextureSize)
-        height <<= 1;
-
-      if(image->width() != width || image->height() != height)
-        image->resize(width, height);
-    }
-    else
-    {
-      width = image->width();
-      height = image->height();
-    }
-
     uint glHandle;
 
     GL::genTextures(1, &glHandle);
@@ -158,145 +278,760 @@ namespace
     GL::texParameteri(GL::TEXTURE_2D, GL::TEXTURE_WRAP_T,
                       (flags & Texture::NoYRepeat) ? GL::CLAMP : GL::REPEAT);
 
+    return glHandle;
+  }
+
+  uint glFormat(uint pixelFormat)
+  {
+    return
+        (   pixelFormat == Image::RGB
+         || pixelFormat == Image::RGB16)  ? GL::RGB
+      : (   pixelFormat == Image::RGBA
+         || pixelFormat == Image::RGBA16) ? GL::RGBA
+      : (   pixelFormat == Image::Gray
+         || pixelFormat == Image::Gray16) ? GL::LUMINANCE
+      : GL::FALSE;
+  }
+
+  uint upload(Image* image, uint flags)
+  {
+    uint width;
+    uint height;
+
+    if(!(flags & Texture::NVRect))
+    {
+      width = 1;
+      height = 1;
+
+      while(width < image->width() && width < GL::config.maxTextureSize)
+        width <<= 1;
+
+      while(height < image->height() && height < GL::config.maxTextureSize)
+        height <<= 1;
+
+      if(image->width() != width || image->height() != height)
+        image->resize(width, height);
+    }
+    else
+    {
+      width = image->width();
+      height = image->height();
+    }
+
+    uint glHandle = createHandle(flags);
+
     uint componentCount = image->componentCount();
     uint pixelFormat = image->pixelFormat();
 
+    uint format = glFormat(pixelFormat);
+
+    bool mipmaps = !(flags & (Texture::NoMipMaps | Texture::NVRect))
+                && (width > 1 || height > 1);
+
+    CVar gammaMips = CVar::acquire("r_gammamips", "0", CVar::Archive);
+    CVar hardwareMips = CVar::acquire("r_hardwaremips", "1", CVar::Archive);
+
+    // Let the driver build the mipmaps if it can, unless they should be
+    // gamma correct
+    if(mipmaps && !gammaMips.integer && hardwareMips.integer
+    && GL::config.extensions.count("GL_SGIS_generate_mipmap"))
+    {
+      GL::texParameteri(GL::TEXTURE_2D, GL::GENERATE_MIPMAP_SGIS, GL::TRUE);
+
+      mipmaps = false;
+    }
+
     GL::texImage2D(
       (flags & Texture::NVRect) ? GL::TEXTURE_RECTANGLE_NV : GL::TEXTURE_2D,
       0,
       componentCount,
       width, height,
       0,
-        (   pixelFormat == Image::RGB
-         || pixelFormat == Image::RGB16)  ? GL::RGB
-      : (   pixelFormat == Image::RGBA
-         || pixelFormat == Image::RGBA16) ? GL::RGBA
-      : (   pixelFormat == Image::Gray
-         || pixelFormat == Image::Gray16) ? GL::LUMINANCE
-      : GL::FALSE,
+      format,
       image->dataType(),
       image->data());
 
-    if(width > 1 || height > 1 && !(flags & Texture::NoMipMaps))
+    if(mipmaps)
     {
-      uint mipLevel = 1;
+      Image mipmap(1, 1, pixelFormat);
+      const Image* source = image;
 
-      if(image->dataType() == GL::UNSIGNED_BYTE)
+      for(uint mipLevel = 1; width > 1 || height > 1; ++mipLevel)
       {
-        uint8_t* data = new uint8_t[width * height * componentCount / 4];
+        mipmap.halve(*source, gammaMips.integer);
+
+        source = &mipmap;
+        width = mipmap.width();
+        height = mipmap.height();
+
+        GL::texImage2D(
+          GL::TEXTURE_2D,
+          mipLevel,
+          componentCount,
+          width, height,
+          0,
+          format,
+          image->dataType(),
+          mipmap.data());
+      }
+    }
+
+    return glHandle;
+  }
+}
+
+namespace
+{
+  uint upload(const CompressedImage& image, uint flags)
+  {
+    uint glHandle = createHandle(flags);
+
+    uint format = (image.format == DXT::DXT5)
+                ? GL::COMPRESSED_RGBA_S3TC_DXT5_EXT
+                : GL::COMPRESSED_RGB_S3TC_DXT1_EXT;
+
+    uint levelCount = (flags & Texture::NoMipMaps) ? 1 : image.levels.size();
+
+    for(uint i = 0; i < levelCount; ++i)
+    {
+      const CompressedImage::Level& level = image.levels[i];
+
+      GL::compressedTexImage2DARB(GL::TEXTURE_2D, i, format,
+                                  level.width, level.height, 0,
+                                  level.data.size(), &level.data[0]);
+    }
+
+    return glHandle;
+  }
+}
+
+// Video
+
+namespace
+{
+  struct Rect
+  {
+    uint x;
+    uint y;
+    uint width;
+    uint height;
+  };
+
+  /**
+   * Merges horizontal runs of changed blocks into rectangles.
+   */
+  void changedRects(const Image& frame, const uint8_t* changedBlocks,
+                    uint blockSize, std::vector<Rect>& rects)
+  {
+    rects.clear();
 
-        while(width > 1 || height > 1)
+    if(!changedBlocks || !blockSize)
+    {
+      Rect rect = { 0, 0, frame.width(), frame.height() };
+
+      rects.push_back(rect);
+
+      return;
+    }
+
+    uint columns = (frame.width() + blockSize - 1) / blockSize;
+    uint rows = (frame.height() + blockSize - 1) / blockSize;
+
+    for(uint row = 0; row < rows; ++row, changedBlocks += columns)
+    {
+      for(uint column = 0; column < columns; )
+      {
+        if(!changedBlocks[column])
         {
-          uint oldWidth = width;
-
-          uint XScale = (width > 1) ? 2 : 1;
-          uint YScale = (height > 1) ? 2 : 1;
-
-          width /= XScale;
-          height /= YScale;
-
-          const uint8_t* refData = (mipLevel == 1) ? image->data() : data;
-
-          uint nextX = (XScale - 1);
-          uint nextY = (YScale - 1);
-
-          for(uint y = 0, n = 0; y < height; ++y)
-            for(uint x = 0; x < width; ++x)
-              for(uint c = 0; c < componentCount; ++c, ++n)
-                data[n] =
-                  (refData[( y * YScale          * oldWidth +   x * XScale          ) * componentCount + c]
-                 + refData[( y * YScale          * oldWidth + ((x * XScale) + nextX)) * componentCount + c]
-                 + refData[((y * YScale + nextY) * oldWidth +   x * XScale          ) * componentCount + c]
-                 + refData[((y * YScale + nextY) * oldWidth + ((x * XScale) + nextX)) * componentCount + c]) / 4;
-
-          GL::texImage2D(
-            GL::TEXTURE_2D,
-            mipLevel,
-            componentCount,
-            width, height,
-            0,
-              (pixelFormat == Image::RGB)  ? GL::RGB
-            : (pixelFormat == Image::RGBA) ? GL::RGBA
-            : (pixelFormat == Image::Gray) ? GL::LUMINANCE
-            : GL::FALSE,
-            GL::UNSIGNED_BYTE,
-            data);
-
-          ++mipLevel;
+          ++column;
+
+          continue;
         }
 
-        delete [] data;
+        uint end = column + 1;
+
+        while(end < columns && changedBlocks[end])
+          ++end;
+
+        Rect rect;
+
+        rect.x = column * blockSize;
+        rect.y = row * blockSize;
+        rect.width = std::min(end * blockSize, frame.width()) - rect.x;
+        rect.height = std::min(rect.y + blockSize, frame.height()) - rect.y;
+
+        rects.push_back(rect);
+
+        column = end;
       }
-      else if(image->dataType() == GL::UNSIGNED_SHORT)
+    }
+  }
+
+  uint createVideoTexture(uint width, uint height, uint components,
+                          uint format, uint dataType)
+  {
+    uint textureWidth = 1;
+    uint textureHeight = 1;
+
+    while(textureWidth < width)
+      textureWidth <<= 1;
+
+    while(textureHeight < height)
+      textureHeight <<= 1;
+
+    Handle handle(Texture::NoMipMaps | Texture::NoRepeat);
+
+    uint glHandle = createHandle(handle.flags);
+
+    GL::texImage2D(GL::TEXTURE_2D, 0, components, textureWidth,
+                   textureHeight, 0, format, dataType, 0);
+
+    handle.bytes = textureWidth * textureHeight * components;
+
+    return addHandle(glHandle, String::format("video %u", glHandle),
+                     handle);
+  }
+
+  /**
+   * Uploads rectangles of an image plane directly from its memory.
+   *
+   * `scale' is 2 for planes of half resolution.
+   */
+  void uploadPlane(const std::vector<Rect>& rects, const uint8_t* data,
+                   uint rowLength, uint scale, uint format)
+  {
+    GL::pixelStorei(GL::UNPACK_ROW_LENGTH, rowLength);
+
+    for(std::vector<Rect>::const_iterator i = rects.begin();
+        i != rects.end(); ++i)
+    {
+      uint x = i->x / scale;
+      uint y = i->y / scale;
+      uint width = (i->x + i->width + scale - 1) / scale - x;
+      uint height = (i->y + i->height + scale - 1) / scale - y;
+
+      GL::pixelStorei(GL::UNPACK_SKIP_PIXELS, x);
+      GL::pixelStorei(GL::UNPACK_SKIP_ROWS, y);
+
+      GL::texSubImage2D(GL::TEXTURE_2D, 0, x, y, width, height, format,
+                        GL::UNSIGNED_BYTE, data);
+    }
+
+    GL::pixelStorei(GL::UNPACK_ROW_LENGTH, 0);
+    GL::pixelStorei(GL::UNPACK_SKIP_PIXELS, 0);
+    GL::pixelStorei(GL::UNPACK_SKIP_ROWS, 0);
+  }
+
+  std::vector<Rect>    videoRects;
+  std::vector<uint8_t> videoBuffer; // RGB pixels converted from NV12
+}
+
+uint Texture::uploadVideo(uint handle, const Image& frame,
+                          const uint8_t* changedBlocks, uint blockSize)
+{
+  bool nv12 = (frame.pixelFormat() == Image::NV12);
+  uint format = nv12 ? GL::RGB : glFormat(frame.pixelFormat());
+
+  if(!handle)
+  {
+    handle = createVideoTexture(frame.width(), frame.height(),
+                                nv12 ? 3 : frame.componentCount(), format,
+                                frame.dataType());
+
+    changedBlocks = 0;
+  }
+  else
+  {
+    Renderer::setTexture(handle);
+  }
+
+  changedRects(frame, changedBlocks, blockSize, videoRects);
+
+  GL::pixelStorei(GL::UNPACK_ALIGNMENT, 1);
+
+  if(nv12)
+  {
+    // Only the changed parts are converted
+    for(std::vector<Rect>::const_iterator i = videoRects.begin();
+        i != videoRects.end(); ++i)
+    {
+      uint size = i->width * i->height * 3;
+
+      if(videoBuffer.size() < size)
+        videoBuffer.resize(size);
+
+      frame.convertNV12(i->x, i->y, i->width, i->height, &videoBuffer[0]);
+
+      GL::texSubImage2D(GL::TEXTURE_2D, 0, i->x, i->y, i->width, i->height,
+                        GL::RGB, GL::UNSIGNED_BYTE, &videoBuffer[0]);
+    }
+  }
+  else
+  {
+    GL::texSubImage2D(GL::TEXTURE_2D, 0, 0, 0, frame.width(),
+                      frame.height(), format, frame.dataType(), frame.data());
+  }
+
+  GL::pixelStorei(GL::UNPACK_ALIGNMENT, 4);
+
+  return handle;
+}
+
+void Texture::uploadVideoPlanes(uint& luma, uint& chroma, const Image& frame,
+                                const uint8_t* changedBlocks,
+                                uint blockSize)
+{
+  if(frame.pixelFormat() != Image::NV12)
+  {
+    esWarning << "Texture: Video planes can only be uploaded from NV12 "
+                 "images." << std::endl;
+
+    return;
+  }
+
+  uint width = frame.width();
+  uint height = frame.height();
+
+  if(!luma || !chroma)
+  {
+    luma = createVideoTexture(width, height, 1, GL::LUMINANCE,
+                              GL::UNSIGNED_BYTE);
+    chroma = createVideoTexture(width / 2, height / 2, 2,
+                                GL::LUMINANCE_ALPHA, GL::UNSIGNED_BYTE);
+
+    changedBlocks = 0;
+  }
+
+  changedRects(frame, changedBlocks, blockSize, videoRects);
+
+  GL::pixelStorei(GL::UNPACK_ALIGNMENT, 1);
+
+  Renderer::setTexture(luma);
+
+  uploadPlane(videoRects, frame.data(), width, 1, GL::LUMINANCE);
+
+  Renderer::setTexture(chroma);
+
+  uploadPlane(videoRects, frame.data() + width * height, width / 2, 2,
+              GL::LUMINANCE_ALPHA);
+
+  GL::pixelStorei(GL::UNPACK_ALIGNMENT, 4);
+}
+
+// Streaming
+
+namespace
+{
+  /**
+   * A texture being decoded in the background.
+   *
+   * The file is opened and read into memory by the main thread, since
+   * archives can't be accessed from several threads.  The decoding thread
+   * parses the memory, scales the image and builds the mipmaps.
+   */
+  struct Stream
+  {
+    String       name;
+    uint         id;
+    uint         flags;
+    uint         glHandle;
+    bool         gammaCorrect;
+    File*        file;
+
+    // Written by the decoding thread.  Empty if decoding failed.
+    std::vector<Image*> levels;
+
+    uint         nextLevel; // One more than the next level to upload
+    bool         cancelled;
+  };
+
+  void* decodeThread = 0;
+  bool  streamingFailed = false;
+
+  // Guards decodeQueue and decodedQueue.  decodeSemaphore counts the
+  // entries of decodeQueue.
+  void* queueMutex;
+  void* decodeSemaphore;
+
+  std::deque<Stream*> decodeQueue;
+  std::deque<Stream*> decodedQueue;
+
+  // Only used by the main thread
+  std::deque<Stream*> uploadQueue;
+  std::map<uint, Stream*> streams; // By Stream::id
+  uint nextStreamId = 1;
+  uint decodingCount = 0;
+  uint frameUploadBytes = 0;
+  uint uploadBuffer = 0; // Pixel buffer object
+
+  void decode(Stream* stream)
+  {
+    // Image plugins keep their decoder state on the stack, so they can run
+    // here as long as the file is in memory
+    Image* image = 0;
+
+    for(PluginMap(Image)::iterator i = Plugin::image.begin();
+        i != Plugin::image.end() && !image; ++i)
+    {
+      stream->file->seek(0);
+
+      if(!i->second->canHandle(*stream->file))
+        continue;
+
+      stream->file->seek(0);
+
+      image = i->second->read(*stream->file);
+    }
+
+    if(!image)
+      return;
+
+    uint width = 1;
+    uint height = 1;
+
+    while(width < image->width() && width < GL::config.maxTextureSize)
+      width <<= 1;
+
+    while(height < image->height() && height < GL::config.maxTextureSize)
+      height <<= 1;
+
+    if(image->width() != width || image->height() != height)
+      image->resize(width, height);
+
+    stream->levels.push_back(image);
+
+    if(stream->flags & Texture::NoMipMaps)
+      return;
+
+    while(width > 1 || height > 1)
+    {
+      Image* mipmap = new Image(1, 1, image->pixelFormat());
+
+      mipmap->halve(*stream->levels.back(), stream->gammaCorrect);
+
+      width = mipmap->width();
+      height = mipmap->height();
+
+      stream->levels.push_back(mipmap);
+    }
+  }
+
+  void decodeLoop(void*)
+  {
+    for(;;)
+    {
+      System::waitSemaphore(decodeSemaphore);
+
+      System::lockMutex(queueMutex);
+
+      Stream* stream = decodeQueue.front();
+
+      decodeQueue.pop_front();
+
+      System::unlockMutex(queueMutex);
+
+      // Queued by Texture::shutdown()
+      if(!stream)
+        return;
+
+      decode(stream);
+
+      System::lockMutex(queueMutex);
+
+      decodedQueue.push_back(stream);
+
+      System::unlockMutex(queueMutex);
+    }
+  }
+
+  /**
+   * Starts the decoding thread, unless it is already running.
+   *
+   * Returns false if threads are not supported.
+   */
+  bool startStreaming()
+  {
+    if(decodeThread)
+      return true;
+
+    if(streamingFailed)
+      return false;
+
+    queueMutex = System::createMutex();
+    decodeSemaphore = System::createSemaphore();
+
+    decodeThread = System::createThread(decodeLoop, 0);
+
+    if(!decodeThread)
+    {
+      esWarning << "Texture: Failed to start decoding thread.  Textures will "
+                   "not be streamed." << std::endl;
+
+      System::destroySemaphore(decodeSemaphore);
+      System::destroyMutex(queueMutex);
+
+      streamingFailed = true;
+
+      return false;
+    }
+
+    return true;
+  }
+
+  /**
+   * Creates a texture handle holding a placeholder, and queues the image
+   * for decoding.  The id of the stream is stored in `streamId'.
+   */
+  uint beginStream(const String& name, uint flags, uint& streamId)
+  {
+    String fileName = Image::locate(name);
+
+    if(fileName.isNull())
+    {
+      esWarning << "Image: Failed to open \"" << name << "\"." << std::endl;
+
+      return 0;
+    }
+
+    File* file = new File(fileName);
+
+    if(!file->isOpen())
+    {
+      delete file;
+
+      return 0;
+    }
+
+    // Archives can only be read by the main thread
+    file->data();
+    file->seek(0);
+
+    CVar gammaMips = CVar::acquire("r_gammamips", "0", CVar::Archive);
+
+    Stream* stream = new Stream;
+
+    stream->name = name;
+    stream->id = nextStreamId++;
+    stream->flags = flags;
+    stream->glHandle = createHandle(flags);
+    stream->gammaCorrect = gammaMips.integer;
+    stream->file = file;
+    stream->nextLevel = 0;
+    stream->cancelled = false;
+
+    // A 1x1 texture has a complete set of mipmaps
+    static const uint8_t placeholder[4] = { 128, 128, 128, 255 };
+
+    GL::texImage2D(GL::TEXTURE_2D, 0, 4, 1, 1, 0, GL::RGBA,
+                   GL::UNSIGNED_BYTE, placeholder);
+
+    streams[stream->id] = stream;
+    streamId = stream->id;
+    ++decodingCount;
+
+    System::lockMutex(queueMutex);
+
+    decodeQueue.push_back(stream);
+
+    System::unlockMutex(queueMutex);
+
+    System::postSemaphore(decodeSemaphore);
+
+    return stream->glHandle;
+  }
+
+  void uploadLevel(Stream* stream, uint level)
+  {
+    Image* image = stream->levels[level];
+
+    Renderer::setTexture(stream->glHandle);
+
+    const void* data = image->data();
+
+    if(GL::config.pixelBufferObjectSupport)
+    {
+      // Copying into a buffer object lets the driver transfer the data
+      // while we go on with the frame
+      if(!uploadBuffer)
+        GL::genBuffersARB(1, &uploadBuffer);
+
+      GL::bindBufferARB(GL::PIXEL_UNPACK_BUFFER_ARB, uploadBuffer);
+      GL::bufferDataARB(GL::PIXEL_UNPACK_BUFFER_ARB, image->size(), 0,
+                        GL::STREAM_DRAW_ARB);
+
+      void* buffer = GL::mapBufferARB(GL::PIXEL_UNPACK_BUFFER_ARB,
+                                      GL::WRITE_ONLY_ARB);
+
+      if(buffer)
       {
-        uint16_t* data = new uint16_t[width * height * componentCount / 4];
+        memcpy(buffer, image->data(), image->size());
 
-        while(width > 1 || height > 1)
-        {
-          uint oldWidth = width;
-
-          uint XScale = (width > 1) ? 2 : 1;
-          uint YScale = (height > 1) ? 2 : 1;
-
-          width /= XScale;
-          height /= YScale;
-
-          const uint16_t* refData = (mipLevel == 1) ? image->data16() : data;
-
-          uint nextX = (XScale - 1);
-          uint nextY = (YScale - 1);
-
-          for(uint y = 0, n = 0; y < height; ++y)
-            for(uint x = 0; x < width; ++x)
-              for(uint c = 0; c < componentCount; ++c, ++n)
-                data[n] =
-                   (refData[( y * YScale          * oldWidth +   x * XScale          ) * componentCount + c]
-                 +  refData[( y * YScale          * oldWidth + ((x * XScale) + nextX)) * componentCount + c]) / 2
-                 + (refData[((y * YScale + nextY) * oldWidth +   x * XScale          ) * componentCount + c]
-                 +  refData[((y * YScale + nextY) * oldWidth + ((x * XScale) + nextX)) * componentCount + c]) / 2;
-
-          GL::texImage2D(
-            GL::TEXTURE_2D,
-            mipLevel,
-            componentCount,
-            width, height,
-            0,
-              (pixelFormat == Image::RGB16)  ? GL::RGB
-            : (pixelFormat == Image::RGBA16) ? GL::RGBA
-            : (pixelFormat == Image::Gray16) ? GL::LUMINANCE
-            : GL::FALSE,
-            GL::UNSIGNED_SHORT,
-            data);
-
-          ++mipLevel;
-        }
+        GL::unmapBufferARB(GL::PIXEL_UNPACK_BUFFER_ARB);
 
-        delete [] data;
+        data = 0; // Offset into the buffer object
+      }
+      else
+      {
+        GL::bindBufferARB(GL::PIXEL_UNPACK_BUFFER_ARB, 0);
       }
     }
 
-    return glHandle;
+    GL::texImage2D(GL::TEXTURE_2D, level, image->componentCount(),
+                   image->width(), image->height(), 0,
+                   glFormat(image->pixelFormat()), image->dataType(), data);
+
+    if(!data)
+      GL::bindBufferARB(GL::PIXEL_UNPACK_BUFFER_ARB, 0);
+
+    Handle* handle = handleForGL(stream->glHandle);
+
+    if(handle)
+      handle->bytes += image->size();
+
+    // Only use the levels uploaded so far, so the texture stays complete
+    // while it is being streamed
+    if(stream->levels.size() > 1)
+      GL::texParameteri(GL::TEXTURE_2D, GL::TEXTURE_BASE_LEVEL, level);
+  }
+
+  void finishStream(Stream* stream)
+  {
+    delete stream->file;
+
+    for(std::vector<Image*>::iterator i = stream->levels.begin();
+        i != stream->levels.end(); ++i)
+      delete *i;
+
+    streams.erase(stream->id);
+
+    delete stream;
   }
 }
 
-void Texture::unacquire(uint handle)
+void Texture::update()
 {
-  if(handle == lightmap)
+  frameUploadBytes = 0;
+
+  if(!decodeThread)
     return;
 
-  for(std::map<String, Handle>::iterator i = handles.begin();
-      i != handles.end(); ++i)
+  System::lockMutex(queueMutex);
+
+  while(!decodedQueue.empty())
   {
-    if(i->second.glHandle == handle)
+    Stream* stream = decodedQueue.front();
+
+    decodedQueue.pop_front();
+
+    stream->nextLevel = stream->levels.size();
+    uploadQueue.push_back(stream);
+    --decodingCount;
+  }
+
+  System::unlockMutex(queueMutex);
+
+  CVar budget = CVar::acquire("r_texturebudget", "256", CVar::Archive);
+
+  uint budgetBytes = (budget.integer > 0) ? budget.integer * 1024 : 0;
+
+  while(!uploadQueue.empty())
+  {
+    Stream* stream = uploadQueue.front();
+
+    if(stream->cancelled || !stream->nextLevel)
     {
-      if(--i->second.refCount)
-        break;
+      if(!stream->cancelled && stream->levels.empty())
+      {
+        esWarning << "Texture: Failed to decode \"" << stream->name << "\"."
+                  << std::endl;
+      }
 
-      handles.erase(i);
+      uploadQueue.pop_front();
 
-      break;
+      finishStream(stream);
+
+      continue;
     }
+
+    uint level = stream->nextLevel - 1;
+    uint size = stream->levels[level]->size();
+
+    // Upload at least one level per frame, so that levels larger than the
+    // budget are not held back forever
+    if(budgetBytes && frameUploadBytes
+    && frameUploadBytes + size > budgetBytes)
+      break;
+
+    uploadLevel(stream, level);
+
+    frameUploadBytes += size;
+    --stream->nextLevel;
   }
 }
 
+void Texture::streamStatistics(uint& decoding, uint& uploading,
+                               uint& uploadedBytes)
+{
+  decoding = decodingCount;
+  uploading = uploadQueue.size();
+  uploadedBytes = frameUploadBytes;
+}
+
+void Texture::unacquire(uint handle)
+{
+  if(handle == lightmap)
+    return;
+
+  Handle* entry = handleForGL(handle);
+
+  if(!entry)
+    return;
+
+  if(--entry->refCount)
+    return;
+
+  std::map<uint, Stream*>::iterator j = streams.find(entry->stream);
+
+  if(j != streams.end())
+    j->second->cancelled = true;
+
+  handles.remove(glHandles[handle]);
+  glHandles[handle] = 0;
+}
+
+void Texture::shutdown()
+{
+  if(!decodeThread)
+    return;
+
+  // A null stream tells the decoding thread to return
+  System::lockMutex(queueMutex);
+
+  decodeQueue.push_back(0);
+
+  System::unlockMutex(queueMutex);
+
+  System::postSemaphore(decodeSemaphore);
+  System::joinThread(decodeThread);
+
+  decodeThread = 0;
+
+  System::destroySemaphore(decodeSemaphore);
+  System::destroyMutex(queueMutex);
+
+  // The decoding thread is gone, so every stream is owned by this thread
+  std::map<uint, Stream*> remaining;
+
+  remaining.swap(streams);
+
+  for(std::map<uint, Stream*>::iterator i = remaining.begin();
+      i != remaining.end(); ++i)
+    finishStream(i->second);
+
+  decodeQueue.clear();
+  decodedQueue.clear();
+  uploadQueue.clear();
+  decodingCount = 0;
+}
+
 // vim: ts=2 sw=2 et